@@ -10,6 +10,8 @@
  *    (n_blocks + 1).
  * n_blocks consisting of:
  *   [compressed block]
+ * zlib, or for version 3 images the codec in the last preamble byte.
+ * Version 3 blocks of exactly block_size bytes are stored uncompressed.
  *
  * Every version greatly inspired by code seen in loop.c
  * by Theodore Ts'o, 3/29/93.
@@ -20,7 +22,7 @@
  */
 
 #define CLOOP_NAME "cloop"
-#define CLOOP_VERSION "3.12"
+#define CLOOP_VERSION "3.16"
 #define CLOOP_MAX 8
 
 #ifndef KBUILD_MODNAME
@@ -53,6 +55,9 @@
 #include <linux/kthread.h>
 #include <linux/compat.h>
 #include "cloop.h"
+#include "cloop_cache.h"
+#include "cloop_lzma.h"
+#include "cloop_lz4.h"
 
 /* New License scheme */
 #ifdef MODULE_LICENSE
@@ -92,42 +97,83 @@ MODULE_DESCRIPTION("Transparently decompressing loopback block device");
 #define DEBUGP(format, x...)
 #endif
 
+/* Default number of buffered decompressed blocks */
+#define BUFFERED_BLOCKS 8
+
+/* Default number of blocks decompressed ahead of sequential readers */
+#define READAHEAD_BLOCKS 8
+
+/* Default size of the buffer for coalesced reads of compressed blocks */
+#define STAGING_KB 512
+
 /* One file can be opened at module insertion time */
 /* insmod cloop file=/path/to/file */
 static char *file=NULL;
 static unsigned int preload=0;
 static unsigned int cloop_max=CLOOP_MAX;
+static unsigned int buffers=BUFFERED_BLOCKS;
+static unsigned int threads=0;
+static unsigned int readahead=READAHEAD_BLOCKS;
+static unsigned int staging_kb=STAGING_KB;
 module_param(file, charp, 0);
 module_param(preload, uint, 0);
 module_param(cloop_max, uint, 0);
+module_param(buffers, uint, 0);
+module_param(threads, uint, 0);
+module_param(readahead, uint, 0644);
+module_param(staging_kb, uint, 0);
 MODULE_PARM_DESC(file, "Initial cloop image file (full path) for /dev/cloop");
 MODULE_PARM_DESC(preload, "Preload n blocks of cloop data into memory");
 MODULE_PARM_DESC(cloop_max, "Maximum number of cloop devices (default 8)");
+MODULE_PARM_DESC(buffers, "Number of decompressed blocks cached per device (LRU, default 8, at least threads + readahead)");
+MODULE_PARM_DESC(threads, "Number of decompression threads per device (default: one per CPU)");
+MODULE_PARM_DESC(readahead, "Blocks to decompress ahead of sequential reads, 0 disables (default 8)");
+MODULE_PARM_DESC(staging_kb, "KiB per device for reading neighbouring compressed blocks at once, 0 disables (default 512)");
 
 static struct file *initial_file=NULL;
 static int cloop_major=MAJOR_NR;
 
-/* Number of buffered decompressed blocks */
-#define BUFFERED_BLOCKS 8
+struct cloop_device;
+
+/* Each worker thread reads and decompresses with its own buffers, */
+/* zstream or lzma_probs depending on the codec of the image        */
+struct cloop_worker
+{
+ struct cloop_device *clo;
+ struct task_struct *thread;
+ z_stream zstream;
+ unsigned short *lzma_probs;
+ void *compressed_buffer;
+};
+
 struct cloop_device
 {
  /* Copied straight from the file */
  struct cloop_head head;
+ int codec; /* CLOOP_CODEC_* */
+ int raw_blocks; /* CLOOP_RAW_BLOCKS, version 3 */
 
  /* An array of offsets of compressed blocks within the file */
  loff_t *offsets;
 
- /* We buffer some uncompressed blocks for performance */
- int buffered_blocknum[BUFFERED_BLOCKS];
- int current_bufnum;
- void *buffer[BUFFERED_BLOCKS];
- void *compressed_buffer;
+ /* We buffer some uncompressed blocks for performance, */
+ /* cache tells which block is in which buffer.         */
+ unsigned int num_buffers;
+ void **buffer;
+ struct cloop_cache cache;
+ void *cache_mem;
+ /* cache_mutex protects cache and buffer_loading[], a  */
+ /* buffer that is still being inflated by one worker   */
+ /* is waited for on buffer_wait by the others.         */
+ struct mutex cache_mutex;
+ char *buffer_loading;
+ wait_queue_head_t buffer_wait;
+ unsigned int num_workers;
+ struct cloop_worker *workers;
  size_t preload_array_size; /* Size of pointer array in blocks */
  size_t preload_size;       /* Number of successfully allocated blocks */
  char **preload_cache;      /* Pointers to preloaded blocks */
 
- z_stream zstream;
-
  struct file   *backing_file;  /* associated file */
  struct inode  *backing_inode; /* for bmap */
 
@@ -142,8 +188,20 @@ struct cloop_device
  /* mutex for ioctl() */
  struct mutex clo_ctl_mutex;
  struct list_head clo_list;
- struct task_struct *clo_thread;
  wait_queue_head_t clo_event;
+ /* Read-ahead state, protected by queue_lock. Blocks ra_next up */
+ /* to ra_end-1 are waiting to be prefetched by an idle worker.   */
+ int ra_last;
+ int ra_next, ra_end;
+ unsigned long ra_blocks;
+ /* Compressed data of blocks staging_first..staging_last-1, read */
+ /* in one go during sequential access. Protected by its mutex.   */
+ struct mutex staging_mutex;
+ char *staging;
+ size_t staging_size;
+ int staging_first, staging_last;
+ atomic_long_t file_reads;
+ atomic_long_t coalesced_blocks; /* Blocks fetched by multi-block reads */
  struct request_queue *clo_queue;
  struct gendisk *clo_disk;
  int suspended;
@@ -154,6 +212,7 @@ struct cloop_device
    so we can specify how many devices we need via parameters. */
 static struct cloop_device **cloop_dev;
 static const char *cloop_name=CLOOP_NAME;
+static const char *cloop_codec_names[] = CLOOP_CODEC_NAMES;
 static int cloop_count = 0;
 
 #if (!(defined(CONFIG_ZLIB_INFLATE) || defined(CONFIG_ZLIB_INFLATE_MODULE))) /* Must be compiled into kernel. */
@@ -186,28 +245,49 @@ static void cloop_free(void *mem, size_t size)
  vfree(mem);
 }
 
-static int uncompress(struct cloop_device *clo,
+static int uncompress(z_stream *zstream,
                       unsigned char *dest, unsigned long *destLen,
                       unsigned char *source, unsigned long sourceLen)
 {
  /* Most of this code can be found in fs/cramfs/uncompress.c */
  int err;
- clo->zstream.next_in = source;
- clo->zstream.avail_in = sourceLen;
- clo->zstream.next_out = dest;
- clo->zstream.avail_out = *destLen;
- err = zlib_inflateReset(&clo->zstream);
+ zstream->next_in = source;
+ zstream->avail_in = sourceLen;
+ zstream->next_out = dest;
+ zstream->avail_out = *destLen;
+ err = zlib_inflateReset(zstream);
  if (err != Z_OK)
   {
    printk(KERN_ERR "%s: zlib_inflateReset error %d\n", cloop_name, err);
-   zlib_inflateEnd(&clo->zstream); zlib_inflateInit(&clo->zstream);
+   zlib_inflateEnd(zstream); zlib_inflateInit(zstream);
   }
- err = zlib_inflate(&clo->zstream, Z_FINISH);
- *destLen = clo->zstream.total_out;
+ err = zlib_inflate(zstream, Z_FINISH);
+ *destLen = zstream->total_out;
  if (err != Z_STREAM_END) return err;
  return Z_OK;
 }
 
+static int cloop_decompress(struct cloop_device *clo, struct cloop_worker *w,
+                            unsigned char *dest, unsigned long *destLen,
+                            unsigned char *source, unsigned long sourceLen)
+{
+ if(clo->raw_blocks && CLOOP_BLOCK_IS_RAW(sourceLen, ntohl(clo->head.block_size)))
+  { /* Did not compress, stored as it is */
+   memcpy(dest, source, sourceLen);
+   *destLen = sourceLen;
+   return 0;
+  }
+ switch(clo->codec)
+  {
+   case CLOOP_CODEC_LZMA:
+    return cloop_lzma_decompress(w->lzma_probs, dest, destLen, source, sourceLen);
+   case CLOOP_CODEC_LZ4:
+    return cloop_lz4_decompress(dest, destLen, source, sourceLen);
+   default:
+    return uncompress(&w->zstream, dest, destLen, source, sourceLen);
+  }
+}
+
 static ssize_t cloop_read_from_file(struct cloop_device *clo, struct file *f, char *buf,
   loff_t pos, size_t buf_len)
 {
@@ -235,63 +315,165 @@ static ssize_t cloop_read_from_file(struct cloop_device *clo, struct file *f, ch
  return buf_done;
 }
 
+/* Read the compressed data of blocknum into w->compressed_buffer.  */
+/* Inside a read-ahead window, the neighbouring blocks up to ra_end */
+/* are fetched with the same read into the staging buffer, so the   */
+/* workers prefetching them only need to copy.                      */
+static void cloop_read_compressed(struct cloop_device *clo, struct cloop_worker *w,
+                                  int blocknum)
+{
+ loff_t start = be64_to_cpu(clo->offsets[blocknum]);
+ size_t len = be64_to_cpu(clo->offsets[blocknum+1]) - start;
+ int last = blocknum + 1, ra_end = clo->ra_end;
+ if(clo->staging)
+  {
+   mutex_lock(&clo->staging_mutex);
+   if(blocknum < clo->staging_first || blocknum >= clo->staging_last)
+    {
+     /* Extend the read over following blocks while they fit */
+     while(last < ra_end &&
+           be64_to_cpu(clo->offsets[last+1]) - start <= clo->staging_size)
+      ++last;
+     if(last == blocknum + 1) goto unstaged; /* Random access */
+     cloop_read_from_file(clo, clo->backing_file, clo->staging, start,
+                          be64_to_cpu(clo->offsets[last]) - start);
+     atomic_long_inc(&clo->file_reads);
+     atomic_long_add(last - blocknum, &clo->coalesced_blocks);
+     clo->staging_first = blocknum;
+     clo->staging_last = last;
+    }
+   memcpy(w->compressed_buffer, clo->staging +
+          (start - be64_to_cpu(clo->offsets[clo->staging_first])), len);
+   mutex_unlock(&clo->staging_mutex);
+   return;
+unstaged:
+   mutex_unlock(&clo->staging_mutex);
+  }
+ cloop_read_from_file(clo, clo->backing_file, (char *)w->compressed_buffer,
+                      start, len);
+ atomic_long_inc(&clo->file_reads);
+}
+
 /* This looks more complicated than it is */
-/* Returns number of block buffer to use for this request */
-static int cloop_load_buffer(struct cloop_device *clo, int blocknum)
+/* Returns number of block buffer to use for this request. The buffer */
+/* stays pinned until cloop_release_buffer(), so other workers cannot */
+/* recycle it while we copy from it.                                  */
+static int cloop_load_buffer(struct cloop_device *clo, struct cloop_worker *w,
+                             int blocknum)
 {
  unsigned int buf_done = 0;
  unsigned long buflen;
  unsigned int buf_length;
- int ret;
+ int ret = 0;
  int i;
- if(blocknum > ntohl(clo->head.num_blocks) || blocknum < 0)
+ if(blocknum >= ntohl(clo->head.num_blocks) || blocknum < 0)
   {
    printk(KERN_WARNING "%s: Invalid block number %d requested.\n",
                        cloop_name, blocknum);
    return -1;
   }
 
+ mutex_lock(&clo->cache_mutex);
  /* Quick return if the block we seek is already in one of the buffers. */
- /* Return number of buffer */
- for(i=0; i<BUFFERED_BLOCKS; i++)
-  if (blocknum == clo->buffered_blocknum[i])
-   {
-    DEBUGP(KERN_INFO "cloop_load_buffer: Found buffered block %d\n", i);
-    return i;
-   }
+ /* If another worker is still inflating it, wait for it to finish.     */
+ while((i = cloop_cache_lookup(&clo->cache, blocknum)) >= 0 && clo->buffer_loading[i])
+  {
+   mutex_unlock(&clo->cache_mutex);
+   wait_event(clo->buffer_wait, !clo->buffer_loading[i]);
+   mutex_lock(&clo->cache_mutex);
+  }
+ if(i >= 0)
+  {
+   cloop_cache_pin(&clo->cache, i);
+   mutex_unlock(&clo->cache_mutex);
+   DEBUGP(KERN_INFO "cloop_load_buffer: Found buffered block %d\n", i);
+   return i;
+  }
+
+ /* Recycle the least recently used buffer. There are at least as */
+ /* many buffers as workers, and each worker pins only one.       */
+ i = cloop_cache_evict(&clo->cache);
+ if(i < 0)
+  {
+   mutex_unlock(&clo->cache_mutex);
+   printk(KERN_ERR "%s: no free buffer for block %d\n", cloop_name, blocknum);
+   return -1;
+  }
+ cloop_cache_insert(&clo->cache, i, blocknum);
+ cloop_cache_pin(&clo->cache, i);
+ clo->buffer_loading[i] = 1;
+ mutex_unlock(&clo->cache_mutex);
 
  buf_length = be64_to_cpu(clo->offsets[blocknum+1]) - be64_to_cpu(clo->offsets[blocknum]);
 
-/* Load one compressed block from the file. */
- cloop_read_from_file(clo, clo->backing_file, (char *)clo->compressed_buffer,
-                    be64_to_cpu(clo->offsets[blocknum]), buf_length);
+ /* All-zero block, nothing to read or inflate (advfs -z) */
+ if(CLOOP_BLOCK_IS_ZERO(buf_length))
+   memset(clo->buffer[i], 0, ntohl(clo->head.block_size));
+ else
+  {
+   /* Load one compressed block from the file or the staging buffer. */
+   cloop_read_compressed(clo, w, blocknum);
 
- buflen = ntohl(clo->head.block_size);
+   buflen = ntohl(clo->head.block_size);
 
- /* Go to next position in the block ring buffer */
- clo->current_bufnum++;
- if(clo->current_bufnum >= BUFFERED_BLOCKS) clo->current_bufnum = 0;
+   /* Do the uncompression */
+   ret = cloop_decompress(clo, w, clo->buffer[i], &buflen, w->compressed_buffer,
+                          buf_length);
+   /* DEBUGP("cloop: buflen after uncompress: %ld\n",buflen); */
+   if (ret != 0)
+    {
+     printk(KERN_ERR "%s: %s decompression error %i uncompressing block %u %u/%lu/%u/%u "
+            "%Lu-%Lu\n", cloop_name, cloop_codec_names[clo->codec], ret, blocknum,
+	    ntohl(clo->head.block_size), buflen, buf_length, buf_done,
+	    be64_to_cpu(clo->offsets[blocknum]), be64_to_cpu(clo->offsets[blocknum+1]));
+    }
+  }
 
- /* Do the uncompression */
- ret = uncompress(clo, clo->buffer[clo->current_bufnum], &buflen, clo->compressed_buffer,
-                  buf_length);
- /* DEBUGP("cloop: buflen after uncompress: %ld\n",buflen); */
- if (ret != 0)
+ mutex_lock(&clo->cache_mutex);
+ clo->buffer_loading[i] = 0;
+ if(ret != 0)
   {
-   printk(KERN_ERR "%s: zlib decompression error %i uncompressing block %u %u/%lu/%u/%u "
-          "%Lu-%Lu\n", cloop_name, ret, blocknum,
-	  ntohl(clo->head.block_size), buflen, buf_length, buf_done,
-	  be64_to_cpu(clo->offsets[blocknum]), be64_to_cpu(clo->offsets[blocknum+1]));
-   clo->buffered_blocknum[clo->current_bufnum] = -1;
-   return -1;
+   cloop_cache_drop(&clo->cache, i);
+   cloop_cache_unpin(&clo->cache, i);
+   i = -1;
+  }
+ mutex_unlock(&clo->cache_mutex);
+ wake_up_all(&clo->buffer_wait);
+ return i;
+}
+
+static void cloop_release_buffer(struct cloop_device *clo, int i)
+{
+ mutex_lock(&clo->cache_mutex);
+ cloop_cache_unpin(&clo->cache, i);
+ mutex_unlock(&clo->cache_mutex);
+}
+
+/* Decompress a block into the cache before anyone asks for it */
+static void cloop_prefetch_block(struct cloop_device *clo, struct cloop_worker *w,
+                                 int blocknum)
+{
+ int i;
+ if(blocknum < clo->preload_size && clo->preload_cache != NULL &&
+    clo->preload_cache[blocknum] != NULL) return;
+ mutex_lock(&clo->cache_mutex);
+ i = cloop_cache_find(&clo->cache, blocknum);
+ mutex_unlock(&clo->cache_mutex);
+ if(i >= 0) return;
+ i = cloop_load_buffer(clo, w, blocknum);
+ if(i >= 0)
+  {
+   mutex_lock(&clo->cache_mutex);
+   cloop_cache_unpin(&clo->cache, i);
+   ++clo->ra_blocks;
+   mutex_unlock(&clo->cache_mutex);
   }
- clo->buffered_blocknum[clo->current_bufnum] = blocknum;
- return clo->current_bufnum;
 }
 
 /* This function does all the real work. */
 /* returns "uptodate" */
-static int cloop_handle_request(struct cloop_device *clo, struct request *req)
+static int cloop_handle_request(struct cloop_device *clo, struct cloop_worker *w,
+                                struct request *req)
 {
  int buffered_blocknum = -1;
  int preloaded = 0;
@@ -323,7 +505,7 @@ static int cloop_handle_request(struct cloop_device *clo, struct request *req)
      else
       {
        preloaded = 0;
-       buffered_blocknum = cloop_load_buffer(clo,block_offset);
+       buffered_blocknum = cloop_load_buffer(clo,w,block_offset);
        if(buffered_blocknum == -1) break; /* invalid data, leave inner loop */
        /* Copy from buffer */
        from_ptr = clo->buffer[buffered_blocknum];
@@ -337,6 +519,7 @@ static int cloop_handle_request(struct cloop_device *clo, struct request *req)
        length_in_buffer = len;
       }
      memcpy(to_ptr, from_ptr + offset_in_buffer, length_in_buffer);
+     if(!preloaded) cloop_release_buffer(clo, buffered_blocknum);
      to_ptr      += length_in_buffer;
      len         -= length_in_buffer;
      offset      += length_in_buffer;
@@ -347,17 +530,20 @@ static int cloop_handle_request(struct cloop_device *clo, struct request *req)
 }
 
 /* Adopted from loop.c, a kernel thread to handle physical reads and
- * decompression. */
+ * decompression. Each device runs num_workers of them, every request
+ * is picked up by the first idle one. */
 static int cloop_thread(void *data)
 {
- struct cloop_device *clo = data;
+ struct cloop_worker *w = data;
+ struct cloop_device *clo = w->clo;
  current->flags |= PF_NOFREEZE;
  set_user_nice(current, -15);
  while (!kthread_should_stop()||!list_empty(&clo->clo_list))
   {
    int err;
-   err = wait_event_interruptible(clo->clo_event, !list_empty(&clo->clo_list) || 
-                                  kthread_should_stop());
+   err = wait_event_interruptible_exclusive(clo->clo_event, !list_empty(&clo->clo_list) || 
+                                            clo->ra_next < clo->ra_end ||
+                                            kthread_should_stop());
    if(unlikely(err))
     {
      DEBUGP(KERN_ERR "cloop thread activated on error!? Continuing.\n");
@@ -369,19 +555,62 @@ static int cloop_thread(void *data)
      unsigned long flags;
      int uptodate;
      spin_lock_irq(&clo->queue_lock);
+     if(list_empty(&clo->clo_list)) /* Another worker was faster */
+      {
+       spin_unlock_irq(&clo->queue_lock);
+       continue;
+      }
      req = list_entry(clo->clo_list.next, struct request, queuelist);
      list_del_init(&req->queuelist);
      spin_unlock_irq(&clo->queue_lock);
-     uptodate = cloop_handle_request(clo, req);
+     uptodate = cloop_handle_request(clo, w, req);
      spin_lock_irqsave(&clo->queue_lock, flags);
      __blk_end_request_all(req, uptodate ? 0 : -EIO);
      spin_unlock_irqrestore(&clo->queue_lock, flags);
     }
+   else if(!kthread_should_stop())
+    { /* Nothing queued, work on the read-ahead window */
+     int blocknum = -1;
+     spin_lock_irq(&clo->queue_lock);
+     if(clo->ra_next < clo->ra_end) blocknum = clo->ra_next++;
+     spin_unlock_irq(&clo->queue_lock);
+     if(blocknum >= 0) cloop_prefetch_block(clo, w, blocknum);
+    }
   }
  DEBUGP(KERN_ERR "cloop_thread exited.\n");
  return 0;
 }
 
+/* Called with queue_lock held for every new request. If it continues */
+/* where the last one ended, move the read-ahead window behind it.   */
+/* Returns nonzero if there is something to prefetch.                */
+static int cloop_readahead(struct cloop_device *clo, struct request *req)
+{
+ u64 start = (u64) blk_rq_pos(req) << 9;
+ u64 stop  = start + blk_rq_bytes(req) - 1;
+ unsigned int window = readahead;
+ int num_blocks = ntohl(clo->head.num_blocks);
+ int first, last, end;
+ do_div(start, ntohl(clo->head.block_size));
+ do_div(stop, ntohl(clo->head.block_size));
+ first = start; last = stop;
+ if(first != clo->ra_last && first != clo->ra_last + 1)
+  { /* Random access, drop what has not been prefetched yet */
+   clo->ra_last = last;
+   clo->ra_next = clo->ra_end = 0;
+   return 0;
+  }
+ clo->ra_last = last;
+ /* Keep one buffer per worker for requests, readahead may have */
+ /* been raised after the buffers were allocated                */
+ if(clo->num_buffers <= clo->num_workers) return 0;
+ window = MIN(window, clo->num_buffers - clo->num_workers);
+ end = MIN(last + 1 + (int)window, num_blocks);
+ if(clo->ra_next <= last) clo->ra_next = last + 1;
+ if(clo->ra_end < end) clo->ra_end = end;
+ return clo->ra_next < clo->ra_end;
+}
+
 /* This is called by the kernel block queue management every now and then,
  * with successive read requests qeued and sorted in a (hopefully)
  * "most efficient way". spin_lock_irq() is being held by the kernel. */
@@ -409,7 +638,10 @@ static void cloop_do_request(struct request_queue *q)
      goto error_continue;
     }
    list_add_tail(&req->queuelist, &clo->clo_list); /* Add to working list for thread */
-   wake_up(&clo->clo_event);    /* Wake up cloop_thread */
+   if(cloop_readahead(clo, req))
+    wake_up_all(&clo->clo_event);  /* Idle threads can prefetch */
+   else
+    wake_up(&clo->clo_event);    /* Wake up cloop_thread */
    continue; /* next request */
   error_continue:
    DEBUGP(KERN_ERR "cloop_do_request: Discarding request %p.\n", req);
@@ -418,6 +650,52 @@ static void cloop_do_request(struct request_queue *q)
   }
 }
 
+static void cloop_stop_workers(struct cloop_device *clo)
+{
+ int i;
+ if(!clo->workers) return;
+ for(i=0; i<clo->num_workers; i++)
+  if(clo->workers[i].thread)
+   {
+    kthread_stop(clo->workers[i].thread);
+    clo->workers[i].thread = NULL;
+   }
+}
+
+static void cloop_free_workers(struct cloop_device *clo)
+{
+ int i;
+ if(!clo->workers) return;
+ for(i=0; i<clo->num_workers; i++)
+  {
+   struct cloop_worker *w = &clo->workers[i];
+   if(w->compressed_buffer) { cloop_free(w->compressed_buffer, MAX(clo->largest_block, 1)); w->compressed_buffer = NULL; }
+   if(w->zstream.workspace)
+    {
+     zlib_inflateEnd(&w->zstream);
+     cloop_free(w->zstream.workspace, zlib_inflate_workspacesize()); w->zstream.workspace = NULL;
+    }
+   if(w->lzma_probs) { cloop_free(w->lzma_probs, CLOOP_LZMA_WORKSPACE); w->lzma_probs = NULL; }
+  }
+ cloop_free(clo->workers, clo->num_workers * sizeof(struct cloop_worker));
+ clo->workers = NULL;
+}
+
+static void cloop_free_buffers(struct cloop_device *clo)
+{
+ int i;
+ if(clo->buffer)
+  {
+   for(i=0; i<clo->num_buffers; i++)
+    if(clo->buffer[i]) { cloop_free(clo->buffer[i], ntohl(clo->head.block_size)); clo->buffer[i]=NULL; }
+   cloop_free(clo->buffer, clo->num_buffers * sizeof(void *)); clo->buffer=NULL;
+  }
+ if(clo->buffer_loading) { cloop_free(clo->buffer_loading, clo->num_buffers); clo->buffer_loading=NULL; }
+ if(clo->cache_mem) { cloop_free(clo->cache_mem, cloop_cache_memsize(clo->num_buffers)); clo->cache_mem=NULL; }
+ if(clo->staging) { cloop_free(clo->staging, clo->staging_size); clo->staging=NULL; }
+ clo->staging_first = clo->staging_last = 0;
+}
+
 /* Read header and offsets from already opened file */
 static int cloop_set_file(int cloop_num, struct file *file, char *filename)
 {
@@ -508,6 +786,15 @@ static int cloop_set_file(int cloop_num, struct file *file, char *filename)
 		       cloop_name, cloop_name);
        error=-EBADF; goto error_release;
       }
+     clo->codec = CLOOP_CODEC(&clo->head);
+     clo->raw_blocks = CLOOP_RAW_BLOCKS(&clo->head);
+     if (clo->codec > CLOOP_CODEC_MAX)
+      {
+       printk(KERN_ERR "%s: Unknown codec %d (format %c), please use a newer "
+		       "version of %s for this file.\n",
+		       cloop_name, clo->codec, clo->head.preamble[0x0C], cloop_name);
+       error=-EBADF; goto error_release;
+      }
      total_offsets=ntohl(clo->head.num_blocks)+1;
      if (!isblkdev && (sizeof(struct cloop_head)+sizeof(loff_t)*
                        total_offsets > inode->i_size))
@@ -536,63 +823,130 @@ static int cloop_set_file(int cloop_num, struct file *file, char *filename)
      loff_t d=be64_to_cpu(clo->offsets[i+1]) - be64_to_cpu(clo->offsets[i]);
      clo->largest_block=MAX(clo->largest_block,d);
     }
-   printk(KERN_INFO "%s: %s: %u blocks, %u bytes/block, largest block is %lu bytes.\n",
+   printk(KERN_INFO "%s: %s: %u blocks, %u bytes/block, largest block is %lu bytes, %s.\n",
           cloop_name, filename, ntohl(clo->head.num_blocks),
-          ntohl(clo->head.block_size), clo->largest_block);
+          ntohl(clo->head.block_size), clo->largest_block,
+          cloop_codec_names[clo->codec]);
   }
 /* Combo kmalloc used too large chunks (>130000). */
+ clo->num_workers = threads ? threads : num_online_cpus();
+ /* Every worker may pin one buffer, and the read-ahead window */
+ /* needs room on top of that, also with many CPUs             */
+ clo->num_buffers = MAX(buffers, clo->num_workers + readahead);
+ clo->buffer = cloop_malloc(clo->num_buffers * sizeof(void *));
+ if(clo->buffer) memset(clo->buffer, 0, clo->num_buffers * sizeof(void *));
+ clo->buffer_loading = cloop_malloc(clo->num_buffers);
+ clo->cache_mem = cloop_malloc(cloop_cache_memsize(clo->num_buffers));
+ if(!clo->buffer || !clo->buffer_loading || !clo->cache_mem)
+  {
+   printk(KERN_ERR "%s: out of memory for %u buffer pointers\n",
+          cloop_name, clo->num_buffers);
+   error=-ENOMEM; goto error_release_free_buffer;
+  }
+ memset(clo->buffer_loading, 0, clo->num_buffers);
+ cloop_cache_init(&clo->cache, clo->cache_mem, clo->num_buffers);
  {
   int i;
-  for(i=0;i<BUFFERED_BLOCKS;i++)
+  for(i=0;i<clo->num_buffers;i++)
    {
     clo->buffer[i] = cloop_malloc(ntohl(clo->head.block_size));
     if(!clo->buffer[i])
      {
       printk(KERN_ERR "%s: out of memory for buffer %lu\n",
              cloop_name, (unsigned long) ntohl(clo->head.block_size));
-      error=-ENOMEM; goto error_release_free;
+      error=-ENOMEM; goto error_release_free_buffer;
      }
    }
  }
- clo->compressed_buffer = cloop_malloc(clo->largest_block);
- if(!clo->compressed_buffer)
-  {
-   printk(KERN_ERR "%s: out of memory for compressed buffer %lu\n",
-          cloop_name, clo->largest_block);
-   error=-ENOMEM; goto error_release_free_buffer;
+ clo->staging_size = (size_t)staging_kb << 10;
+ clo->staging_first = clo->staging_last = 0;
+ if(clo->staging_size && !(clo->staging = cloop_malloc(clo->staging_size)))
+  { /* Not fatal, every block is read by itself then */
+   printk(KERN_WARNING "%s: cloop_malloc(%lu) failed for staging buffer (ignored).\n",
+          cloop_name, (unsigned long)clo->staging_size);
   }
- clo->zstream.workspace = cloop_malloc(zlib_inflate_workspacesize());
- if(!clo->zstream.workspace)
+ atomic_long_set(&clo->file_reads, 0);
+ atomic_long_set(&clo->coalesced_blocks, 0);
+ clo->workers = cloop_malloc(clo->num_workers * sizeof(struct cloop_worker));
+ if(!clo->workers)
   {
-   printk(KERN_ERR "%s: out of mem for zlib working area %u\n",
-          cloop_name, zlib_inflate_workspacesize());
-   error=-ENOMEM; goto error_release_free_all;
+   printk(KERN_ERR "%s: out of memory for %u workers\n",
+          cloop_name, clo->num_workers);
+   error=-ENOMEM; goto error_release_free_buffer;
   }
- zlib_inflateInit(&clo->zstream);
+ memset(clo->workers, 0, clo->num_workers * sizeof(struct cloop_worker));
+ {
+  int i;
+  for(i=0;i<clo->num_workers;i++)
+   {
+    struct cloop_worker *w = &clo->workers[i];
+    w->clo = clo;
+    /* At least one byte, an image of only zero blocks has none larger */
+    w->compressed_buffer = cloop_malloc(MAX(clo->largest_block, 1));
+    if(!w->compressed_buffer)
+     {
+      printk(KERN_ERR "%s: out of memory for compressed buffer %lu\n",
+             cloop_name, clo->largest_block);
+      error=-ENOMEM; goto error_release_free_all;
+     }
+    if(clo->codec == CLOOP_CODEC_LZMA)
+     {
+      w->lzma_probs = cloop_malloc(CLOOP_LZMA_WORKSPACE);
+      if(!w->lzma_probs)
+       {
+        printk(KERN_ERR "%s: out of mem for lzma working area %lu\n",
+               cloop_name, (unsigned long)CLOOP_LZMA_WORKSPACE);
+        error=-ENOMEM; goto error_release_free_all;
+       }
+     }
+    else if(clo->codec == CLOOP_CODEC_ZLIB)
+     {
+      w->zstream.workspace = cloop_malloc(zlib_inflate_workspacesize());
+      if(!w->zstream.workspace)
+       {
+        printk(KERN_ERR "%s: out of mem for zlib working area %u\n",
+               cloop_name, zlib_inflate_workspacesize());
+        error=-ENOMEM; goto error_release_free_all;
+       }
+      zlib_inflateInit(&w->zstream);
+     }
+   }
+ }
  if(!isblkdev &&
     be64_to_cpu(clo->offsets[ntohl(clo->head.num_blocks)]) != inode->i_size)
   {
-   printk(KERN_ERR "%s: final offset wrong (%Lu not %Lu)\n",
-          cloop_name,
-          be64_to_cpu(clo->offsets[ntohl(clo->head.num_blocks)]),
-          inode->i_size);
-   cloop_free(clo->zstream.workspace, zlib_inflate_workspacesize()); clo->zstream.workspace=NULL;
-   goto error_release_free_all;
+   /* Not verified here, only the block hash trailer may follow the data */
+   loff_t end = be64_to_cpu(clo->offsets[ntohl(clo->head.num_blocks)]);
+   struct cloop_tail tail;
+   if(end > inode->i_size ||
+      cloop_read_from_file(clo, file, (char *)&tail, end, sizeof(tail)) != sizeof(tail) ||
+      memcmp(tail.magic, CLOOP_TAIL_MAGIC, sizeof(tail.magic)) ||
+      end + CLOOP_TAIL_SIZE(&tail) != inode->i_size)
+    {
+     printk(KERN_ERR "%s: final offset wrong (%Lu not %Lu)\n",
+            cloop_name, end, inode->i_size);
+     error=-EBADF; goto error_release_free_all;
+    }
+   printk(KERN_INFO "%s: %s: block hash trailer present (type %u).\n",
+          cloop_name, filename, ntohl(tail.hash_type));
   }
+ set_capacity(clo->clo_disk, (sector_t)(ntohl(clo->head.num_blocks)*
+              (ntohl(clo->head.block_size)>>9)));
  {
   int i;
-  for(i=0; i<BUFFERED_BLOCKS; i++) clo->buffered_blocknum[i] = -1;
-  clo->current_bufnum=0;
+  for(i=0;i<clo->num_workers;i++)
+   {
+    struct task_struct *t = kthread_create(cloop_thread, &clo->workers[i],
+                                           "cloop%d.%d", cloop_num, i);
+    if(IS_ERR(t))
+     {
+      error = PTR_ERR(t);
+      cloop_stop_workers(clo);
+      goto error_release_free_all;
+     }
+    clo->workers[i].thread = t;
+   }
  }
- set_capacity(clo->clo_disk, (sector_t)(ntohl(clo->head.num_blocks)*
-              (ntohl(clo->head.block_size)>>9)));
- clo->clo_thread = kthread_create(cloop_thread, clo, "cloop%d", cloop_num);
- if(IS_ERR(clo->clo_thread))
-  {
-   error = PTR_ERR(clo->clo_thread);
-   clo->clo_thread=NULL;
-   goto error_release_free_all;
-  }
  if(preload > 0)
   {
    clo->preload_array_size = ((preload<=ntohl(clo->head.num_blocks))?preload:ntohl(clo->head.num_blocks));
@@ -612,11 +966,13 @@ static int cloop_set_file(int cloop_num, struct file *file, char *filename)
      clo->preload_size = i;
      for(i=0; i<clo->preload_size; i++)
       {
-       int buffered_blocknum = cloop_load_buffer(clo,i);
+       /* Workers are not running yet, borrow the first one's buffers */
+       int buffered_blocknum = cloop_load_buffer(clo,&clo->workers[0],i);
        if(buffered_blocknum >= 0)
         {
 	 memcpy(clo->preload_cache[i], clo->buffer[buffered_blocknum],
 	        ntohl(clo->head.block_size));
+	 cloop_release_buffer(clo, buffered_blocknum);
 	}
        else
         {
@@ -638,24 +994,21 @@ static int cloop_set_file(int cloop_num, struct file *file, char *filename)
      clo->preload_array_size = clo->preload_size = 0;
     }
   }
- wake_up_process(clo->clo_thread);
+ clo->ra_last = -2;
+ clo->ra_next = clo->ra_end = 0;
+ clo->ra_blocks = 0;
+ {
+  int i;
+  for(i=0;i<clo->num_workers;i++) wake_up_process(clo->workers[i].thread);
+ }
+ printk(KERN_INFO "%s: %u decompression threads, %u buffered blocks.\n",
+        cloop_name, clo->num_workers, clo->num_buffers);
  /* Uncheck */
  return error;
 error_release_free_all:
- cloop_free(clo->compressed_buffer, clo->largest_block);
- clo->compressed_buffer=NULL;
+ cloop_free_workers(clo);
 error_release_free_buffer:
- {
-  int i;
-  for(i=0; i<BUFFERED_BLOCKS; i++)
-   { 
-    if(clo->buffer[i])
-     {
-      cloop_free(clo->buffer[i], ntohl(clo->head.block_size));
-      clo->buffer[i]=NULL;
-     }
-   }
- }
+ cloop_free_buffers(clo);
 error_release_free:
  cloop_free(clo->offsets, sizeof(loff_t) * total_offsets);
  clo->offsets=NULL;
@@ -692,7 +1045,8 @@ static int cloop_clr_fd(int cloop_num, struct block_device *bdev)
  if(clo->refcnt > 1)	/* we needed one fd for the ioctl */
    return -EBUSY;
  if(filp==NULL) return -EINVAL;
- if(clo->clo_thread) { kthread_stop(clo->clo_thread); clo->clo_thread=NULL; }
+ cloop_stop_workers(clo);
+ clo->ra_next = clo->ra_end = 0;
  if(filp!=initial_file) fput(filp);
  else { filp_close(initial_file,0); initial_file=NULL; }
  clo->backing_file  = NULL;
@@ -706,11 +1060,8 @@ static int cloop_clr_fd(int cloop_num, struct block_device *bdev)
    clo->preload_cache = NULL;
    clo->preload_size = clo->preload_array_size = 0;
   }
- for(i=0; i<BUFFERED_BLOCKS; i++)
-      if(clo->buffer[i]) { cloop_free(clo->buffer[i], ntohl(clo->head.block_size)); clo->buffer[i]=NULL; }
- if(clo->compressed_buffer) { cloop_free(clo->compressed_buffer, clo->largest_block); clo->compressed_buffer = NULL; }
- zlib_inflateEnd(&clo->zstream);
- if(clo->zstream.workspace) { cloop_free(clo->zstream.workspace, zlib_inflate_workspacesize()); clo->zstream.workspace = NULL; }
+ cloop_free_buffers(clo);
+ cloop_free_workers(clo);
  if(bdev) invalidate_bdev(bdev);
  if(clo->clo_disk) set_capacity(clo->clo_disk, 0);
  return 0;
@@ -947,6 +1298,91 @@ static struct block_device_operations clo_fops =
 	/* locked_ioctl ceased to exist in 2.6.36 */
 };
 
+/* Cache statistics in /sys/block/cloopN/cloop/, same scheme as loop.c */
+static ssize_t cloop_attr_show(struct device *dev, char *page,
+                               ssize_t (*callback)(struct cloop_device *, char *))
+{
+ struct gendisk *disk = dev_to_disk(dev);
+ struct cloop_device *clo = disk->private_data;
+ return callback(clo, page);
+}
+
+#define CLOOP_ATTR_RO(_name)						\
+static ssize_t cloop_attr_##_name##_show(struct cloop_device *, char *);	\
+static ssize_t cloop_attr_do_show_##_name(struct device *d,		\
+				struct device_attribute *attr, char *b)	\
+{									\
+ return cloop_attr_show(d, b, cloop_attr_##_name##_show);		\
+}									\
+static struct device_attribute cloop_attr_##_name =			\
+ __ATTR(_name, S_IRUGO, cloop_attr_do_show_##_name, NULL);
+
+static ssize_t cloop_attr_cache_size_show(struct cloop_device *clo, char *buf)
+{
+ return sprintf(buf, "%u\n", clo->cache_mem ? clo->cache.size : 0);
+}
+
+static ssize_t cloop_attr_cache_hits_show(struct cloop_device *clo, char *buf)
+{
+ return sprintf(buf, "%lu\n", clo->cache_mem ? clo->cache.hits : 0);
+}
+
+static ssize_t cloop_attr_cache_misses_show(struct cloop_device *clo, char *buf)
+{
+ return sprintf(buf, "%lu\n", clo->cache_mem ? clo->cache.misses : 0);
+}
+
+static ssize_t cloop_attr_threads_show(struct cloop_device *clo, char *buf)
+{
+ return sprintf(buf, "%u\n", clo->workers ? clo->num_workers : 0);
+}
+
+static ssize_t cloop_attr_readahead_blocks_show(struct cloop_device *clo, char *buf)
+{
+ return sprintf(buf, "%lu\n", clo->ra_blocks);
+}
+
+static ssize_t cloop_attr_file_reads_show(struct cloop_device *clo, char *buf)
+{
+ return sprintf(buf, "%ld\n", atomic_long_read(&clo->file_reads));
+}
+
+static ssize_t cloop_attr_coalesced_blocks_show(struct cloop_device *clo, char *buf)
+{
+ return sprintf(buf, "%ld\n", atomic_long_read(&clo->coalesced_blocks));
+}
+
+static ssize_t cloop_attr_codec_show(struct cloop_device *clo, char *buf)
+{
+ return sprintf(buf, "%s\n", clo->offsets ? cloop_codec_names[clo->codec] : "");
+}
+
+CLOOP_ATTR_RO(cache_size);
+CLOOP_ATTR_RO(cache_hits);
+CLOOP_ATTR_RO(cache_misses);
+CLOOP_ATTR_RO(threads);
+CLOOP_ATTR_RO(readahead_blocks);
+CLOOP_ATTR_RO(file_reads);
+CLOOP_ATTR_RO(coalesced_blocks);
+CLOOP_ATTR_RO(codec);
+
+static struct attribute *cloop_attrs[] = {
+ &cloop_attr_cache_size.attr,
+ &cloop_attr_cache_hits.attr,
+ &cloop_attr_cache_misses.attr,
+ &cloop_attr_threads.attr,
+ &cloop_attr_readahead_blocks.attr,
+ &cloop_attr_file_reads.attr,
+ &cloop_attr_coalesced_blocks.attr,
+ &cloop_attr_codec.attr,
+ NULL,
+};
+
+static struct attribute_group cloop_attribute_group = {
+ .name = "cloop",
+ .attrs = cloop_attrs,
+};
+
 static int cloop_register_blkdev(int major_nr)
 {
  return register_blkdev(major_nr, cloop_name);
@@ -965,8 +1401,10 @@ static int cloop_alloc(int cloop_num)
  cloop_dev[cloop_num] = clo;
  memset(clo, 0, sizeof(struct cloop_device));
  clo->clo_number = cloop_num;
- clo->clo_thread = NULL;
  init_waitqueue_head(&clo->clo_event);
+ init_waitqueue_head(&clo->buffer_wait);
+ mutex_init(&clo->cache_mutex);
+ mutex_init(&clo->staging_mutex);
  spin_lock_init(&clo->queue_lock);
  mutex_init(&clo->clo_ctl_mutex);
  INIT_LIST_HEAD(&clo->clo_list);
@@ -990,6 +1428,9 @@ static int cloop_alloc(int cloop_num)
  clo->clo_disk->private_data = clo;
  sprintf(clo->clo_disk->disk_name, "%s%d", cloop_name, cloop_num);
  add_disk(clo->clo_disk);
+ if(sysfs_create_group(&disk_to_dev(clo->clo_disk)->kobj, &cloop_attribute_group))
+  printk(KERN_WARNING "%s: Unable to create sysfs statistics for %s\n",
+         cloop_name, clo->clo_disk->disk_name);
  return 0;
 error_disk:
  blk_cleanup_queue(clo->clo_queue);
@@ -1001,6 +1442,7 @@ static void cloop_dealloc(int cloop_num)
 {
  struct cloop_device *clo = cloop_dev[cloop_num];
  if(clo == NULL) return;
+ sysfs_remove_group(&disk_to_dev(clo->clo_disk)->kobj, &cloop_attribute_group);
  del_gendisk(clo->clo_disk);
  blk_cleanup_queue(clo->clo_queue);
  put_disk(clo->clo_disk);
@@ -20,6 +20,62 @@ struct cloop_head
 /* data_index (num_blocks 64bit pointers, network order)...      */
 /* compressed data (gzip block compressed format)...             */
 
+/* A block with offsets[n+1] == offsets[n] (zero compressed size) */
+/* contains only zeroes and has no data (advfs -z, cloop >= 3.13) */
+#define CLOOP_BLOCK_IS_ZERO(size) ((size) == 0)
+
+/* Version 3 images (advfs -C, cloop >= 3.16) have "#V3.0 Format" in */
+/* the preamble and the codec of all blocks in its last byte. Older    */
+/* images are zlib, advfs writes zlib images as version 2 so that      */
+/* older drivers can still read them.                                  */
+#define CLOOP_CODEC_ZLIB 0 /* zlib stream                              */
+#define CLOOP_CODEC_LZMA 1 /* 7-Zip LZMA, see cloop_lzma.h            */
+#define CLOOP_CODEC_LZ4  2 /* LZ4 block, see cloop_lz4.h              */
+#define CLOOP_CODEC_MAX  CLOOP_CODEC_LZ4
+#define CLOOP_CODEC_NAMES { "zlib", "lzma", "lz4" }
+
+/* LZMA and LZ4 blocks are never larger than this, even if the data */
+/* does not compress                                                 */
+#define CLOOP_CODEC_MAXLEN(block_size) ((block_size) + (block_size) / 8 + 64)
+
+#define CLOOP_CODEC(head) ((head)->preamble[0x0C] < '3' ? CLOOP_CODEC_ZLIB : \
+	(unsigned char)(head)->preamble[CLOOP_HEADROOM - 1])
+
+/* Version 3 images keep a block that does not get smaller as it is: */
+/* a block of exactly block_size bytes is stored uncompressed (advfs  */
+/* -C and -A). advfs never writes a compressed block of that          */
+/* size or larger into them.                                          */
+#define CLOOP_RAW_BLOCKS(head) ((head)->preamble[0x0C] >= '3')
+#define CLOOP_BLOCK_IS_RAW(size, block_size) ((size) == (block_size))
+
+/* Optional trailer at offsets[num_blocks], where the file otherwise ends */
+/* (advfs -T, cloop >= 3.14): struct cloop_tail, then num_blocks hashes  */
+/* of hash_size bytes of the uncompressed blocks. A hash of all zero     */
+/* bytes marks a block unused by the filesystem (advfs -U), its content  */
+/* does not matter. All numbers in network order.                        */
+/* Readers that don't verify blocks only need to accept a file that is   */
+/* longer than offsets[num_blocks] by the size of the trailer.           */
+
+#define CLOOP_TAIL_MAGIC   "CLOOPTL\n"
+#define CLOOP_TAIL_VERSION 1
+#define CLOOP_TAIL_XXH64   1 /* 8 bytes, fast, block-delta restores */
+#define CLOOP_TAIL_BLAKE2B 2 /* 16 bytes (BLAKE2b-128), integrity    */
+
+struct cloop_tail
+{
+	char magic[8];
+	u_int32_t version;
+	u_int32_t hash_type;
+	u_int32_t hash_size;
+	u_int32_t num_blocks;
+	u_int64_t table_sum; /* XXH64 of the hash table                      */
+	u_int64_t head_sum;  /* XXH64 of cloop_head, offsets and this struct */
+	                     /* up to head_sum                              */
+};
+
+#define CLOOP_TAIL_SIZE(tail) (sizeof(struct cloop_tail) + \
+	(u_int64_t)ntohl((tail)->num_blocks) * ntohl((tail)->hash_size))
+
 /* Cloop suspend IOCTL */
 #define CLOOP_SUSPEND 0x4C07
 
@@ -0,0 +1,131 @@
+/* cloop_cache_replay: feed a recorded block access trace through the
+ * block cache of the cloop driver (cloop_cache.h) and print hit ratios
+ * for several cache sizes, compared to the old 8-slot round-robin ring.
+ *
+ * Trace format, one request per line:
+ *   <block>              cloop block number
+ *   <sector> <sectors>   512-byte request as printed by
+ *                        blktrace -d /dev/cloop0 -o - | blkparse -i - -a issue -f "%S %n\n"
+ *
+ * License: GPL V2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cloop_cache.h"
+
+#define RING_SIZE 8
+
+struct result
+{
+ unsigned int size;
+ struct cloop_cache cache;
+ void *mem;
+};
+
+static unsigned long ring_hits, ring_misses;
+static int ring[RING_SIZE], ring_pos;
+
+/* The buffer ring of cloop <= 3.13 */
+static void ring_access(int block)
+{
+ int i;
+ for(i=0; i<RING_SIZE; i++)
+  if(ring[i] == block) { ++ring_hits; return; }
+ ++ring_misses;
+ if(++ring_pos >= RING_SIZE) ring_pos = 0;
+ ring[ring_pos] = block;
+}
+
+static void cache_access(struct cloop_cache *c, int block)
+{
+ if(cloop_cache_lookup(c, block) < 0)
+  cloop_cache_insert(c, cloop_cache_evict(c), block);
+}
+
+static void usage(const char *progname)
+{
+ fprintf(stderr, "Usage: %s [-B blocksize] [-c size,size,...] [tracefile]\n"
+                 "  -B N  cloop block size for sector traces (default 131072)\n"
+                 "  -c L  comma separated cache sizes (default 8,16,32,64,128,256)\n",
+                 progname);
+ exit(1);
+}
+
+int main(int argc, char **argv)
+{
+ unsigned long blocksize = 131072, requests = 0;
+ char *sizes = strdup("8,16,32,64,128,256"), *s, line[256];
+ struct result *results = NULL;
+ int nresults = 0, i, c;
+ FILE *trace = stdin;
+
+ while((c = getopt(argc, argv, "B:c:")) != -1)
+  {
+   switch(c)
+    {
+     case 'B': blocksize = strtoul(optarg, NULL, 0); break;
+     case 'c': sizes = optarg; break;
+     default: usage(argv[0]);
+    }
+  }
+ if(blocksize < 512 || blocksize % 512) usage(argv[0]);
+ if(optind < argc && !(trace = fopen(argv[optind], "r")))
+  {
+   perror(argv[optind]);
+   return 1;
+  }
+
+ for(s = strtok(sizes, ","); s; s = strtok(NULL, ","))
+  {
+   struct result *r;
+   unsigned int size = atoi(s);
+   if(size < 1) usage(argv[0]);
+   results = realloc(results, (nresults + 1) * sizeof(struct result));
+   if(!results) { perror("realloc"); return 1; }
+   r = &results[nresults++];
+   r->size = size;
+   r->mem = malloc(cloop_cache_memsize(size));
+   if(!r->mem) { perror("malloc"); return 1; }
+   cloop_cache_init(&r->cache, r->mem, size);
+  }
+ for(i=0; i<RING_SIZE; i++) ring[i] = -1;
+
+ while(fgets(line, sizeof(line), trace))
+  {
+   unsigned long long a, b;
+   int first, last, block;
+   switch(sscanf(line, "%llu %llu", &a, &b))
+    {
+     case 1:  first = last = a; break;
+     case 2:  if(b == 0) continue;
+              first = a * 512 / blocksize;
+              last = (a + b) * 512 / blocksize - (((a + b) * 512) % blocksize == 0);
+              break;
+     default: continue;
+    }
+   ++requests;
+   /* Like cloop_handle_request(), one lookup per block touched */
+   for(block = first; block <= last; block++)
+    {
+     ring_access(block);
+     for(i=0; i<nresults; i++) cache_access(&results[i].cache, block);
+    }
+  }
+
+ printf("%lu requests\n", requests);
+ printf("%-12s %10s %10s %7s\n", "cache", "hits", "misses", "ratio");
+ printf("%-12s %10lu %10lu %6.2f%%\n", "ring(8)", ring_hits, ring_misses,
+        ring_hits + ring_misses ? 100.0 * ring_hits / (ring_hits + ring_misses) : 0.0);
+ for(i=0; i<nresults; i++)
+  {
+   struct cloop_cache *c = &results[i].cache;
+   char name[32];
+   snprintf(name, sizeof(name), "lru(%u)", results[i].size);
+   printf("%-12s %10lu %10lu %6.2f%%\n", name, c->hits, c->misses,
+          c->hits + c->misses ? 100.0 * c->hits / (c->hits + c->misses) : 0.0);
+  }
+ return 0;
+}
@@ -0,0 +1,225 @@
+#ifndef _CLOOP_LZMA_H
+#define _CLOOP_LZMA_H
+
+/* Decoder for the blocks of CLOOP_CODEC_LZMA images, as written by the  */
+/* LZMA encoder of 7-Zip bundled with advfs: 5 bytes of properties (the */
+/* lc/lp/pb byte and the dictionary size, which is not needed here),    */
+/* then the range coded data, decoded until the block is full. The      */
+/* whole block is in memory, so the output buffer is the dictionary.    */
+/* The caller owns the probability array, CLOOP_LZMA_WORKSPACE bytes,   */
+/* so decoding needs no allocation. Plain C without kernel dependencies */
+/* like cloop_cache.h, the driver and the userspace tools share it.     */
+
+#define CLOOP_LZMA_PROPS 5
+#define CLOOP_LZMA_LCLP_MAX 4 /* lc + lp, 7-Zip uses 3 + 0 */
+
+/* Offsets into the probability array, the layout of the LZMA SDK */
+#define CLOOP_LZMA_IS_MATCH      0
+#define CLOOP_LZMA_IS_REP        192
+#define CLOOP_LZMA_IS_REP_G0     204
+#define CLOOP_LZMA_IS_REP_G1     216
+#define CLOOP_LZMA_IS_REP_G2     228
+#define CLOOP_LZMA_IS_REP0_LONG  240
+#define CLOOP_LZMA_POS_SLOT      432
+#define CLOOP_LZMA_SPEC_POS      688
+#define CLOOP_LZMA_ALIGN         802
+#define CLOOP_LZMA_LEN           818
+#define CLOOP_LZMA_REP_LEN       1332
+#define CLOOP_LZMA_LITERAL       1846
+
+#define CLOOP_LZMA_NUM_PROBS (CLOOP_LZMA_LITERAL + (0x300 << CLOOP_LZMA_LCLP_MAX))
+#define CLOOP_LZMA_WORKSPACE (CLOOP_LZMA_NUM_PROBS * sizeof(unsigned short))
+
+struct cloop_lzma_rc
+{
+ const unsigned char *in, *end;
+ unsigned int range, code;
+ int error; /* Input ended early */
+};
+
+static inline void cloop_lzma_normalize(struct cloop_lzma_rc *rc)
+{
+ if(rc->range < (1U << 24))
+  {
+   rc->range <<= 8;
+   if(rc->in < rc->end) rc->code = (rc->code << 8) | *rc->in++;
+   else rc->error = 1;
+  }
+}
+
+static inline unsigned int cloop_lzma_bit(struct cloop_lzma_rc *rc, unsigned short *p)
+{
+ unsigned int bound = (rc->range >> 11) * *p;
+ unsigned int bit;
+ if(rc->code < bound)
+  {
+   rc->range = bound;
+   *p += ((1 << 11) - *p) >> 5;
+   bit = 0;
+  }
+ else
+  {
+   rc->range -= bound;
+   rc->code -= bound;
+   *p -= *p >> 5;
+   bit = 1;
+  }
+ cloop_lzma_normalize(rc);
+ return bit;
+}
+
+static inline unsigned int cloop_lzma_direct(struct cloop_lzma_rc *rc, int bits)
+{
+ unsigned int res = 0;
+ while(bits--)
+  {
+   rc->range >>= 1;
+   if(rc->code >= rc->range) { rc->code -= rc->range; res = (res << 1) | 1; }
+   else res <<= 1;
+   cloop_lzma_normalize(rc);
+  }
+ return res;
+}
+
+static inline unsigned int cloop_lzma_tree(struct cloop_lzma_rc *rc, unsigned short *p, int bits)
+{
+ unsigned int m = 1;
+ int i;
+ for(i = 0; i < bits; i++) m = (m << 1) | cloop_lzma_bit(rc, &p[m]);
+ return m - (1U << bits);
+}
+
+static inline unsigned int cloop_lzma_reverse(struct cloop_lzma_rc *rc, unsigned short *p, int bits)
+{
+ unsigned int m = 1, sym = 0;
+ int i;
+ for(i = 0; i < bits; i++)
+  {
+   unsigned int bit = cloop_lzma_bit(rc, &p[m]);
+   m = (m << 1) | bit;
+   sym |= bit << i;
+  }
+ return sym;
+}
+
+/* Match length - 2 */
+static inline unsigned int cloop_lzma_len(struct cloop_lzma_rc *rc, unsigned short *p, unsigned int pos_state)
+{
+ if(!cloop_lzma_bit(rc, &p[0])) return cloop_lzma_tree(rc, &p[2 + (pos_state << 3)], 3);
+ if(!cloop_lzma_bit(rc, &p[1])) return 8 + cloop_lzma_tree(rc, &p[130 + (pos_state << 3)], 3);
+ return 16 + cloop_lzma_tree(rc, &p[258], 8);
+}
+
+/* Returns 0 and the number of bytes in *destLen, or -1 for bad data */
+static inline int cloop_lzma_decompress(unsigned short *probs,
+                                        unsigned char *dest, unsigned long *destLen,
+                                        const unsigned char *source, unsigned long sourceLen)
+{
+ struct cloop_lzma_rc rc;
+ unsigned int lc, lp, pb, state = 0, i;
+ unsigned int rep0 = 0, rep1 = 0, rep2 = 0, rep3 = 0;
+ unsigned long pos = 0, size = *destLen;
+
+ if(sourceLen < CLOOP_LZMA_PROPS + 5 || source[0] >= 9 * 5 * 5) return -1;
+ lc = source[0] % 9; lp = (source[0] / 9) % 5; pb = source[0] / 45;
+ if(lc + lp > CLOOP_LZMA_LCLP_MAX) return -1;
+ for(i = 0; i < CLOOP_LZMA_LITERAL + (0x300U << (lc + lp)); i++) probs[i] = 1 << 10;
+
+ rc.in = source + CLOOP_LZMA_PROPS; rc.end = source + sourceLen;
+ if(*rc.in++) return -1;
+ rc.range = 0xFFFFFFFF; rc.code = 0; rc.error = 0;
+ for(i = 0; i < 4; i++) rc.code = (rc.code << 8) | *rc.in++;
+
+ while(pos < size && !rc.error)
+  {
+   unsigned int pos_state = pos & ((1 << pb) - 1);
+   unsigned int len;
+   if(!cloop_lzma_bit(&rc, &probs[CLOOP_LZMA_IS_MATCH + (state << 4) + pos_state]))
+    {
+     unsigned int prev = pos ? dest[pos - 1] : 0;
+     unsigned short *p = &probs[CLOOP_LZMA_LITERAL + 0x300 *
+                         (((pos & ((1 << lp) - 1)) << lc) + (prev >> (8 - lc)))];
+     unsigned int sym = 1;
+     if(state >= 7)
+      { /* After a match, the byte at rep0 predicts the literal */
+       unsigned int match = dest[pos - rep0 - 1];
+       do
+        {
+         unsigned int mbit = (match >> 7) & 1, bit;
+         match <<= 1;
+         bit = cloop_lzma_bit(&rc, &p[0x100 + (mbit << 8) + sym]);
+         sym = (sym << 1) | bit;
+         if(bit != mbit) break;
+        } while(sym < 0x100);
+      }
+     while(sym < 0x100) sym = (sym << 1) | cloop_lzma_bit(&rc, &p[sym]);
+     dest[pos++] = sym;
+     state = state < 4 ? 0 : state < 10 ? state - 3 : state - 6;
+     continue;
+    }
+   if(cloop_lzma_bit(&rc, &probs[CLOOP_LZMA_IS_REP + state]))
+    {
+     if(!pos) return -1;
+     if(!cloop_lzma_bit(&rc, &probs[CLOOP_LZMA_IS_REP_G0 + state]))
+      {
+       if(!cloop_lzma_bit(&rc, &probs[CLOOP_LZMA_IS_REP0_LONG + (state << 4) + pos_state]))
+        { /* One byte at rep0 */
+         state = state < 7 ? 9 : 11;
+         dest[pos] = dest[pos - rep0 - 1];
+         pos++;
+         continue;
+        }
+      }
+     else
+      {
+       unsigned int dist;
+       if(!cloop_lzma_bit(&rc, &probs[CLOOP_LZMA_IS_REP_G1 + state])) dist = rep1;
+       else
+        {
+         if(!cloop_lzma_bit(&rc, &probs[CLOOP_LZMA_IS_REP_G2 + state])) dist = rep2;
+         else { dist = rep3; rep3 = rep2; }
+         rep2 = rep1;
+        }
+       rep1 = rep0; rep0 = dist;
+      }
+     len = cloop_lzma_len(&rc, &probs[CLOOP_LZMA_REP_LEN], pos_state);
+     state = state < 7 ? 8 : 11;
+    }
+   else
+    {
+     unsigned int slot;
+     rep3 = rep2; rep2 = rep1; rep1 = rep0;
+     len = cloop_lzma_len(&rc, &probs[CLOOP_LZMA_LEN], pos_state);
+     state = state < 7 ? 7 : 10;
+     slot = cloop_lzma_tree(&rc, &probs[CLOOP_LZMA_POS_SLOT + ((len < 3 ? len : 3) << 6)], 6);
+     if(slot < 4) rep0 = slot;
+     else
+      {
+       int direct = (slot >> 1) - 1;
+       rep0 = (2 | (slot & 1)) << direct;
+       if(slot < 14)
+        rep0 += cloop_lzma_reverse(&rc, &probs[CLOOP_LZMA_SPEC_POS + rep0 - slot - 1], direct);
+       else
+        {
+         rep0 += cloop_lzma_direct(&rc, direct - 4) << 4;
+         rep0 += cloop_lzma_reverse(&rc, &probs[CLOOP_LZMA_ALIGN], 4);
+         if(rep0 == 0xFFFFFFFF) break; /* End marker */
+        }
+      }
+    }
+   len += 2;
+   if(rep0 >= pos) return -1;
+   if(len > size - pos) len = size - pos;
+   {
+    unsigned char *d = dest + pos;
+    const unsigned char *s = d - rep0 - 1;
+    pos += len;
+    while(len--) *d++ = *s++;
+   }
+  }
+ if(rc.error) return -1;
+ *destLen = pos;
+ return 0;
+}
+
+#endif /* _CLOOP_LZMA_H */
@@ -42,11 +42,17 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <time.h>
+#include <math.h>
 #include <endian.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <zlib.h>
 #include "cloop.h"
+#include "cloop_hash.h"
+#include "cloop_lz4.h"
 #include "portable.h"
 #include "pngex.h"
 //#include "utility.h"
@@ -93,6 +99,8 @@ using namespace std;
 //#define MAX_KMALLOC_SIZE 2L<<17
 
 #define CLOOP_PREAMBLE "#!/bin/sh\n" "#V2.0 Format\n" "modprobe cloop file=$0 && mount -r -t iso9660 /dev/cloop $1\n" "exit $?\n"
+// -C lzma|lz4, the codec goes into the last byte, see cloop.h
+#define CLOOP_PREAMBLE_V3 "#!/bin/sh\n" "#V3.0 Format\n" "modprobe cloop file=$0 && mount -r -t iso9660 /dev/cloop $1\n" "exit $?\n"
 
 #define MAXLEN(bs) ((bs) + (bs)/1000 + 12)
 
@@ -104,6 +112,7 @@ typedef uint64_t loff_t;
 
 # if defined(linux) || defined(__linux__)
 #include <asm/byteorder.h>
+#include <linux/fs.h> // BLKGETSIZE64
 #define ENSURE64UINT(x) __cpu_to_be64(x)
 
 #else // not linux
@@ -146,9 +155,57 @@ unsigned long blocksize=0;
 unsigned long expected_blocks=0;
 //unsigned long numblocks=0;
 int method=Z_BEST_COMPRESSION;
-const int maxalg=11;
-unsigned int levelcount[maxalg];
+// -C: codec of the image. Other codecs than zlib travel to remote
+// compression nodes as method -3 (lzma) and -4 (lz4).
+int codec=CLOOP_CODEC_ZLIB;
+const char *codec_names[] = CLOOP_CODEC_NAMES;
+#define CODEC_METHOD(c) (-2-(c))
+// best: 0-9 gzip level, 10 7zip, then the blocks of the other codecs
+// and those stored uncompressed (version 3 images only, see cloop.h),
+// levelcount[maxalg] counts all-zero blocks stored without data (-z)
+const int maxalg=14;
+#define BEST_LZMA 11
+#define BEST_LZ4 12
+#define RAWBLOCK 13
+#define ZEROBLOCK maxalg
+unsigned int levelcount[maxalg+1];
+inline int best_codec(int best) {
+    return best==BEST_LZMA ? CLOOP_CODEC_LZMA : best==BEST_LZ4 ? CLOOP_CODEC_LZ4 : CLOOP_CODEC_ZLIB;
+}
 bool be_verbose(false), be_quiet(false);
+bool sparse_zero(false);
+
+// -A: every block is put into one of these classes by decide(), the
+// time spent on each class is in threadStats
+bool adaptive(false);
+#define DECIDE_ZERO 0   // all zero or unused (-z, -U), no data
+#define DECIDE_RAW 1    // looks random, stored without trying to compress
+#define DECIDE_NORMAL 2 // the method of -L
+#define DECIDE_BEST 3   // gzip -9 gains on a sample, 7zip for zlib
+#define DECIDE_MAX 4
+const char *decide_names[] = { "zero", "raw", "normal", "best" };
+// order-0 entropy of the block in bits per byte
+#define ENTROPY_RAW 7.9  // and LZ4 saves less than 2% on the whole block
+#define ENTROPY_LOW 1.0  // below, nearly nothing left to save
+#define SAMPLE_SIZE 8192
+// DECIDE_BEST if gzip -9 output of the sample is this many per mille of
+// the sample smaller than gzip -1. 7zip costs ~40 times gzip -1, this
+// picks the few percent of blocks where it gains twice the average.
+#define GAIN_BEST 42
+// method for DECIDE_BEST blocks
+inline int best_method() {
+    return codec!=CLOOP_CODEC_ZLIB || method<0 ? method : -1;
+}
+// version 3 images, in which blocks that don't get smaller are kept raw
+inline bool image_v3() {
+    return codec!=CLOOP_CODEC_ZLIB || adaptive;
+}
+// -U: one bit per block, clear = unused by the filesystem (cloop_usedmap),
+// such blocks are stored as zero blocks without reading them
+vector<unsigned char> usedmap;
+inline bool block_used(uint64_t n) {
+    return n/8 >= usedmap.size() || (usedmap[n/8] & (1 << (n%8)));
+}
 
 #define TOFILE 0
 #define TOTEMPFILE 1
@@ -162,14 +219,76 @@ int workThreads=3;
 vector<char *> hostpool;
 
 vector<uint64_t> lengths;
+// -H: per-block hashes of the uncompressed data, see cloop_hash.h
+char *hashfile(NULL);
+vector<uint64_t> hashes;
+// -T: hash trailer embedded in the image, CLOOP_TAIL_* type, see cloop.h
+unsigned int tailtype(0);
+vector<unsigned char> digests;
 vector<char *> blocks;
 
-pthread_mutex_t mainlock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t maincond = PTHREAD_COND_INITIALIZER;
-#define lock pthread_mutex_lock( &mainlock )
-#define unlock pthread_mutex_unlock( &mainlock )
-#define doSleep pthread_cond_wait(&maincond, &mainlock)
-#define doAwake pthread_cond_broadcast(&maincond)
+/* Bounded multi-producer/multi-consumer queue of pool indices, after
+ * Dmitry Vyukov: every cell carries a sequence number telling whether it
+ * is ready to be written (seq==pos) or read (seq==pos+1) at position pos,
+ * so producers and consumers only contend on one CAS each. The counting
+ * semaphore lets idle consumers sleep, and each push wakes exactly one. */
+class jobQueue {
+    private:
+        struct cell {
+            volatile unsigned long seq;
+            int item;
+        };
+        cell *cells;
+        unsigned long mask;
+        volatile unsigned long head, tail;
+        sem_t avail;
+
+    public:
+        void init(int capacity) {
+            unsigned long size=1;
+            while(size < (unsigned long) capacity) size <<= 1;
+            cells = new cell[size];
+            for(unsigned long i=0; i<size; i++) cells[i].seq=i;
+            mask=size-1;
+            head=tail=0;
+            sem_init(&avail, 0, 0);
+        }
+
+        // never fails, capacity is the pool size
+        void push(int item) {
+            unsigned long pos=tail;
+            cell *c;
+            for(;;) {
+                c=&cells[pos & mask];
+                long diff=(long) c->seq - (long) pos;
+                if(diff==0 && __sync_bool_compare_and_swap(&tail, pos, pos+1))
+                    break;
+                pos = diff<0 ? pos : tail; // full (cannot happen) or lost the race
+            }
+            c->item=item;
+            __sync_synchronize();
+            c->seq=pos+1;
+            sem_post(&avail);
+        }
+
+        // blocks until an item is available
+        int pop() {
+            while(sem_wait(&avail)!=0) ; // EINTR
+            unsigned long pos=head;
+            cell *c;
+            for(;;) {
+                c=&cells[pos & mask];
+                long diff=(long) c->seq - (long) (pos+1);
+                if(diff==0 && __sync_bool_compare_and_swap(&head, pos, pos+1))
+                    break;
+                pos=head; // lost the race, or the producer is still storing
+            }
+            int item=c->item;
+            __sync_synchronize();
+            c->seq=pos+mask+1;
+            return item;
+        }
+};
 
 class compressItem;
 compressItem *pool;
@@ -177,6 +296,14 @@ int poolsize(0);
 int posAdd(0);
 int posFetch(0);
 
+// inputFeed -> compressingLoop: filled items; outputFetch -> inputFeed: free items
+jobQueue freshQueue, freeQueue;
+// reorder buffer for the writer: block n is handed over in slot n%poolsize
+struct reorderSlot {
+    int item;
+    sem_t ready;
+} *reorder;
+
 bool terminateAll=false;
 
 // job size
@@ -184,6 +311,30 @@ unsigned long jobsize = 32;
 
 int in(-1);
 
+// -I: how the input is read. INPUT_READ is the classic read() loop in
+// inputFeed. With INPUT_MMAP and INPUT_DIRECT inputFeed only hands out
+// block numbers, and each compressor fetches its own block, so there
+// are as many readers as compressing threads.
+#define INPUT_READ 0
+#define INPUT_MMAP 1   // views into the mapped input, no copy
+#define INPUT_DIRECT 2 // pread() with O_DIRECT, bypassing the page cache
+int inputmode(INPUT_READ);
+char *inmap(NULL);
+uint64_t insize(0);
+
+// Time spent reading and compressing, slot workThreads is inputFeed.
+// Each thread only updates its own slot.
+struct threadStats {
+    uint64_t read_ns, read_bytes, comp_ns, comp_bytes;
+    uint64_t decide_ns[DECIDE_MAX], decide_blocks[DECIDE_MAX]; // -A
+} *tstats;
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 int start_server(int port);
 int setup_connection(char *peer);
 
@@ -199,6 +350,10 @@ class compressItem {
         // those are the only interesting unique attributes
         int best;
         unsigned long compLen;
+        int blocknum;
+        bool unused; // -U says there is nothing in it, not read
+        uint64_t hash; // -H
+        unsigned char digest[16]; // -T
 #define STOPMARK -2
 #define SDIRTY -1
 #define SFRESH 0
@@ -206,14 +361,50 @@ class compressItem {
 #define SCOMPRESSED 2
         int state;
 
-        char *inBuf, *outBuf;
+        // inBuf is readBuf, or a view into the mapped input (-I mmap)
+        char *inBuf, *outBuf, *readBuf;
 
         compressItem() : state(SDIRTY) {
-            maxlen=MAXLEN(blocksize); // is global, though
-            inBuf  =(char *) malloc(blocksize);
+            // is global, though
+            maxlen=method<-2 ? CLOOP_CODEC_MAXLEN(blocksize) : MAXLEN(blocksize);
+            // aligned for O_DIRECT
+            if(posix_memalign((void **) &readBuf, 4096, blocksize))
+                readBuf=NULL;
+            inBuf=readBuf;
             outBuf=(char *) malloc(maxlen);
         };
 
+        // -I mmap/direct: get block blocknum from the input, zero padded
+        // at the end. Returns the number of bytes read.
+        size_t fetch() {
+            uint64_t off=(uint64_t) blocknum * blocksize;
+            size_t len = insize-off < blocksize ? insize-off : blocksize;
+            if(inputmode==INPUT_MMAP && len==blocksize) {
+                inBuf=inmap+off;
+                // fault the pages in now, so this counts as reading time
+                volatile char sum=0;
+                for(size_t i=0; i<len; i+=4096) sum+=inBuf[i];
+                return len;
+            }
+            inBuf=readBuf;
+            if(inputmode==INPUT_MMAP)
+                memcpy(readBuf, inmap+off, len);
+            else {
+                size_t done=0;
+                while(done<len) {
+                    // O_DIRECT wants whole sectors, the short read at the end is fine
+                    ssize_t r=pread(in, readBuf+done, blocksize-done, off+done);
+                    if(r<0 && errno==EINTR) continue;
+                    if(r<0) die("Input stream error at block " << blocknum);
+                    if(!r) break;
+                    done+=r;
+                }
+                if(done<len) die("Input ended early at block " << blocknum);
+            }
+            memset(readBuf+len, 0, blocksize-len);
+            return len;
+        }
+
         void set_size (int id, int size)
         {
             //uncompLen=size;
@@ -226,6 +417,56 @@ class compressItem {
             //if(compBuf) delete[] compBuf;
         }
 
+        // all-zero blocks get an empty index entry with -z, see cloop.h
+        bool isZero() {
+            return !inBuf[0] && !memcmp(inBuf, inBuf+1, blocksize-1);
+        }
+
+        // -A: DECIDE_RAW, _NORMAL or _BEST from a byte histogram of the
+        // block, for blocks that look random a trial LZ4 compression of
+        // the block, which catches repeated random data, and for the
+        // others trial deflates of its start at gzip -1 and -9
+        int decide() {
+            unsigned int hist[4][256]; // four, to keep the increments apart
+            memset(hist, 0, sizeof(hist));
+            const unsigned char *p=(const unsigned char *) inBuf;
+            for(unsigned long i=0; i<blocksize; i+=4) { // multiple of 512
+                hist[0][p[i]]++; hist[1][p[i+1]]++;
+                hist[2][p[i+2]]++; hist[3][p[i+3]]++;
+            }
+            double bits=0;
+            for(int c=0; c<256; c++) {
+                unsigned int n=hist[0][c]+hist[1][c]+hist[2][c]+hist[3][c];
+                if(n) bits-=n*log2((double) n/blocksize);
+            }
+            double entropy=bits/blocksize;
+            if(entropy >= ENTROPY_RAW) {
+                // an LZ4 image keeps blocks raw that LZ4 does not shrink
+                if(codec==CLOOP_CODEC_LZ4)
+                    return DECIDE_NORMAL;
+                // fails if the result does not fit into 98%, LZ4 skips
+                // quickly over data without matches
+                if(!cloop_lz4_compress((unsigned char *) outBuf, blocksize*98/100, (unsigned char *) inBuf, blocksize))
+                    return DECIDE_RAW;
+                return DECIDE_NORMAL;
+            }
+            if(entropy < ENTROPY_LOW || best_method()==method)
+                return DECIDE_NORMAL;
+            // outBuf holds more than compressBound(SAMPLE_SIZE)
+            unsigned long n = blocksize<SAMPLE_SIZE ? blocksize : SAMPLE_SIZE;
+            uLongf fast=maxlen, good=maxlen;
+            if(compress2((Bytef*) outBuf, &fast, (Bytef*) inBuf, n, 1) != Z_OK ||
+               compress2((Bytef*) outBuf, &good, (Bytef*) inBuf, n, 9) != Z_OK)
+                return DECIDE_NORMAL;
+            return good<fast && (fast-good)*1000 >= GAIN_BEST*n ? DECIDE_BEST : DECIDE_NORMAL;
+        }
+
+        void storeRaw() {
+            memcpy(outBuf, inBuf, blocksize);
+            compLen=blocksize;
+            best=RAWBLOCK;
+        }
+
         bool doRemoteCompression(int method, int con) {
             DEBUG("sending data");
             if(send(con, inBuf, blocksize, MSG_NOSIGNAL) == -1) {
@@ -250,6 +491,11 @@ class compressItem {
                 rest-=l;
             }
             DEBUG("### Received\n");
+            // a node without -C support sends zlib data instead
+            if(best_codec(best) != codec) {
+                cerr << "Remote node does not support the " << codec_names[codec] << " codec\n";
+                return false;
+            }
             return true;
         }
 
@@ -279,6 +525,26 @@ class compressItem {
                 }
                 compLen=tmp;
             }
+            else if(method==CODEC_METHOD(CLOOP_CODEC_LZMA)) {
+                // best mode, the whole block as dictionary
+                unsigned int tmp=maxlen;
+                best=BEST_LZMA;
+                if(!compress_lzma_7z((unsigned char *)inBuf, blocksize, (unsigned char *)outBuf, tmp, 2, blocksize, 32))
+                {
+                    fprintf(stderr, "*** Error compressing block with LZMA!\n");
+                    return false;
+                }
+                compLen=tmp;
+            }
+            else if(method==CODEC_METHOD(CLOOP_CODEC_LZ4)) {
+                best=BEST_LZ4;
+                compLen=cloop_lz4_compress((unsigned char *)outBuf, maxlen, (unsigned char *)inBuf, blocksize);
+                if(!compLen)
+                {
+                    fprintf(stderr, "*** Error compressing block with LZ4!\n");
+                    return false;
+                }
+            }
             else if(method<-1)
             {
              
@@ -349,64 +615,77 @@ void *compressingLoop(void *ptr)
         // otherwise compress locally
     }
 
-    int pos(0);
+    threadStats *st=&tstats[id];
     while(!terminateAll)
     {
-#if 1
-        DEBUG("c1");
-        lock;
-get_fresh_stuff:
-        DEBUG("c2");
-        int i=1;
-        for(;i<=poolsize;i++) {
-            int j=(pos+i)%poolsize;
-            if(pool[j].state==SFRESH) { // MINE!
-                pool[j].state=SRESERVED;
-                pos=j;
-                break;
-            }
+        int pos=freshQueue.pop();
+        pool[pos].state=SRESERVED;
+
+        uint64_t t0=now_ns();
+        int decision=DECIDE_NORMAL;
+        if(pool[pos].unused) {
+            pool[pos].compLen=0;
+            pool[pos].best=ZEROBLOCK;
+            pool[pos].hash=CLOOP_HASH_UNUSED;
+            memset(pool[pos].digest, 0, sizeof(pool[pos].digest));
+            st->decide_blocks[DECIDE_ZERO]++;
+            goto done;
         }
-        DEBUG("c3, i: "<<i);
-        if(i>poolsize) { doSleep; goto get_fresh_stuff; }
-        DEBUG("c4");
-        unlock;
-
-#else
-        // simplier/stupid version, just pickup the first one
-        lock;
-get_fresh_stuff:
-        for(pos=0;pos<poolsize;pos++) {
-            if(pool[pos].state==SFRESH) { // MINE!
-                pool[pos].state=SRESERVED;
-                break;
-            }
+        if(inputmode!=INPUT_READ) {
+            st->read_bytes+=pool[pos].fetch();
+            uint64_t t1=now_ns();
+            st->read_ns+=t1-t0;
+            t0=t1;
         }
-        if(pos==poolsize) { doSleep; goto get_fresh_stuff; }
-        unlock;
-#endif
+
+        if(hashfile)
+            pool[pos].hash=cloop_block_hash(pool[pos].inBuf, blocksize);
+        if(tailtype)
+            cloop_digest(tailtype, pool[pos].digest, pool[pos].inBuf, blocksize);
 
 do_local:
-        if(con<0) {
-            DEBUG("c5");
-            if (! pool[pos].doLocalCompression(method) )
-                die("Compression failed on block " <<pos);
+        if(sparse_zero && pool[pos].isZero()) {
+            pool[pos].compLen=0;
+            pool[pos].best=ZEROBLOCK;
+            decision=DECIDE_ZERO;
         }
         else {
-            DEBUG("c6");
-            if(! pool[pos].doRemoteCompression(method, con) ) 
-            {
-                con=-1;
-                cerr << "Remote compression failed, doing local now...\n";
-                goto do_local;
+            if(adaptive)
+                decision=pool[pos].decide();
+            if(decision==DECIDE_RAW)
+                pool[pos].storeRaw();
+            else if(con<0) {
+                DEBUG("c5");
+                if (! pool[pos].doLocalCompression(decision==DECIDE_BEST ? best_method() : method) )
+                    die("Compression failed on block " <<pos);
             }
+            else {
+                DEBUG("c6");
+                // the method is fixed per connection, DECIDE_BEST is not
+                // compressed harder by remote nodes
+                if(! pool[pos].doRemoteCompression(method, con) ) 
+                {
+                    con=-1;
+                    cerr << "Remote compression failed, doing local now...\n";
+                    goto do_local;
+                }
+            }
+            if(image_v3() && pool[pos].compLen>=blocksize)
+                pool[pos].storeRaw();
+        }
+        {
+            uint64_t dt=now_ns()-t0;
+            st->comp_ns+=dt;
+            st->decide_ns[decision]+=dt;
         }
+        st->comp_bytes+=blocksize;
+        st->decide_blocks[decision]++;
+done:
         DEBUG("Calc: submitting results of pos: " << pos);
-        DEBUG("c7");
-        lock;
         pool[pos].state=SCOMPRESSED;
-        doAwake;
-        unlock;
-        DEBUG("c8");
+        int slot=pool[pos].blocknum%poolsize;
+        reorder[slot].item=pos;
+        sem_post(&reorder[slot].ready);
     }
     return(NULL); // g++ shut up
 }
@@ -417,33 +696,29 @@ void *outputFetch(void *ptr) {
 
     DEBUG("Fetcher thread created");
     uint64_t total_compressed(0);
-    for(int i=0; i<maxalg; i++) levelcount[i]=0; // or better with memset?
+    for(int i=0; i<=maxalg; i++) levelcount[i]=0; // or better with memset?
     time_t starttime=time(NULL);
     DEBUG("f1");
 
     while(true) {
 
-        int pos=posFetch%poolsize;
-        DEBUG("f2");
-
-        lock;
-        DEBUG("f3");
-        while(/*posFetch<=posAdd || */pool[pos].state!=SCOMPRESSED) {
-            DEBUG("f4, pos: "<<pos);
-            if(pool[pos].state==STOPMARK) // ugly, exiting program with hot locks... don't care
-                return(NULL);
-            DEBUG("f4.1");
-            doSleep;
-            DEBUG("f4.2");
-        }
-        unlock;
-        DEBUG("f5");
+        // blocks arrive in any order, wait for the next one in sequence
+        reorderSlot *slot=&reorder[posFetch%poolsize];
+        while(sem_wait(&slot->ready)!=0) ; // EINTR
+        int pos=slot->item;
+        DEBUG("f5, pos: "<<pos);
+        if(pool[pos].state==STOPMARK) // ugly, exiting program with busy workers... don't care
+            return(NULL);
 
         total_compressed += pool[pos].compLen;
 
         ++levelcount[pool[pos].best];
 
         lengths.push_back(pool[pos].compLen); // could seek, but that may be faster after all
+        if(hashfile) hashes.push_back(pool[pos].hash);
+        if(tailtype)
+            digests.insert(digests.end(), pool[pos].digest,
+                    pool[pos].digest+cloop_digest_size(tailtype));
         DEBUG("f6, target: " << targetkind);
         if(targetkind<TOMEM) 
         {
@@ -453,7 +728,7 @@ void *outputFetch(void *ptr) {
         }
         else { //TOMEM
             char *t=(char *) malloc(pool[pos].compLen);
-            if(!t) {
+            if(!t && pool[pos].compLen) {
                 cerr << "Virtual memory exhausted. Use temp. file mode or add more swap." <<endl;
                 exit(1);
             }
@@ -466,7 +741,7 @@ void *outputFetch(void *ptr) {
         if(be_verbose || 0==posFetch%100 || posFetch==(int)expected_blocks-1) {
             unsigned int per=1+time(NULL)-starttime;
             fprintf(stderr,
-                    "[%2d] Blk# %5d, [ratio/avg. %3d%%/%3d%%], avg.speed: %d b/s, ETA: %ds",
+                    "[%2d] Blk# %5d, [ratio/avg. %3d%%/%3d%%], avg.speed: %lu b/s, ETA: %lus",
                     pool[pos].best,
                     posFetch,
                     (int)(((float)pool[pos].compLen*(float)100) / (float)blocksize ),
@@ -475,7 +750,7 @@ void *outputFetch(void *ptr) {
                     ( per*(expected_blocks-posFetch-1) ) / (posFetch+1)
                    );
 	    if(expected_blocks>0)
-	     fprintf(stderr, ", Complete: %d%%\n",
+	     fprintf(stderr, ", Complete: %lu%%\n",
 		    (posFetch+1) * 100 / expected_blocks);
 	    else
 	     fprintf(stderr, "\n");
@@ -492,22 +767,20 @@ void *outputFetch(void *ptr) {
 #endif
         }
 
-        lock;
         pool[pos].state=SDIRTY;
         posFetch++;
-        doAwake;
-        unlock;
+        freeQueue.push(pos);
     }
     return(NULL);
 }
 
 void *inputFeed(void *ptr) {
     
-    //int id = * ( (int*) ptr);
+    int id = * ( (int*) ptr);
     
     DEBUG("Input thread created");
 
-    compressItem *item;
+    threadStats *st=&tstats[id];
     int newstate(SFRESH);
     bool finishing(false);
 
@@ -515,21 +788,29 @@ void *inputFeed(void *ptr) {
 
         DEBUG("s1");
 
-        int pos=posAdd%poolsize ;
-
-        DEBUG("s3");
-        lock;
-        DEBUG("s4");
-        while(pool[pos].state!=SDIRTY) // overrun? wait for outputFetch to mark it dirty again
-            doSleep;
-        DEBUG("s5");
-        // not changing posAdd yet, keep it dirty
-        unlock;
+        // overrun? wait for outputFetch to hand back a written item
+        int pos=freeQueue.pop();
+        DEBUG("s5, pos: " << pos);
 
         DEBUG("Next block...");
+        pool[pos].unused=false;
         if(finishing)
             newstate=STOPMARK;
+        else if(inputmode!=INPUT_READ) { // the compressor fetches the data
+            if((uint64_t) posAdd * blocksize >= insize)
+                newstate=STOPMARK;
+            else
+                pool[pos].unused=!block_used(posAdd);
+        }
+        else if(!block_used(posAdd) && (uint64_t) posAdd * blocksize < insize) {
+            // skip it, a short read at the end of the input stops as usual
+            if(lseek(in, blocksize, SEEK_CUR) < 0)
+                die("Seeking input");
+            pool[pos].unused=true;
+        }
         else {
+            uint64_t t0=now_ns();
+            pool[pos].inBuf=pool[pos].readBuf;
             char *ptr=pool[pos].inBuf;
             size_t rest=blocksize;
             while(rest>0) {
@@ -542,12 +823,14 @@ void *inputFeed(void *ptr) {
                     break;
             }
             DEBUG("Block rest: " << rest);
+            st->read_ns+=now_ns()-t0;
+            st->read_bytes+=blocksize-rest;
 
             if(rest==blocksize) { // zero read, previous block was the last one
                 DEBUG("s2.3");
                 newstate=STOPMARK;
             }
-            else if(posAdd==expected_blocks) { // got data but this block is already one too much, ignore it and bail out
+            else if((unsigned long) posAdd==expected_blocks) { // got data but this block is already one too much, ignore it and bail out
                 DEBUG("s2.2");
                 ret=0; /* This is not an error */
                 cerr << "WARNING: got more data than expected. Trailing data is ignored." <<endl;
@@ -561,12 +844,15 @@ void *inputFeed(void *ptr) {
             }
         }
 
-        lock;
         DEBUG("Set new state on " << posAdd << ", " << newstate);
         pool[pos].state=newstate;
-        posAdd++;
-        doAwake; // go compressors, go
-        unlock;
+        pool[pos].blocknum=posAdd++;
+        if(newstate==STOPMARK) { // nothing to compress, straight to the writer
+            reorder[pool[pos].blocknum%poolsize].item=pos;
+            sem_post(&reorder[pool[pos].blocknum%poolsize].ready);
+        }
+        else
+            freshQueue.push(pos); // go compressors, go
         if(newstate==STOPMARK) {
             DEBUG("Set stop mark on " << posAdd-1);
             return(NULL);
@@ -598,7 +884,16 @@ try_another_connection:
     }
 #endif
 
-    pool = new compressItem[workThreads+3];
+    tstats = new threadStats[workThreads+1];
+    memset(tstats, 0, sizeof(threadStats)*(workThreads+1));
+    pool = new compressItem[poolsize];
+    reorder = new reorderSlot[poolsize];
+    freshQueue.init(poolsize);
+    freeQueue.init(poolsize);
+    for(int i=0; i<poolsize; i++) {
+        sem_init(&reorder[i].ready, 0, 0);
+        freeQueue.push(i);
+    }
 
     for(; threadId < workThreads ; threadId++)
         pthread_create(new pthread_t, NULL, compressingLoop, (void *) new int(threadId));
@@ -615,20 +910,102 @@ try_another_connection:
     
     if(!be_quiet) {
         fprintf(stderr,"\nStatistics:\n");
-        for(int j=0; j<maxalg-1; j++) 
-            fprintf(stderr,"gzip(%d): %5d (%5.2g%%)\n", 
-                    j,
+        if(codec==CLOOP_CODEC_ZLIB) {
+            for(int j=0; j<10; j++)
+                fprintf(stderr,"gzip(%d): %5d (%5.2g%%)\n", 
+                        j,
+                        levelcount[j],
+                        100.0F*(float)levelcount[j]/(float)lengths.size());
+            fprintf(stderr,"7zip: %5d (%5.2g%%)\n", 
+                    levelcount[10],
+                    100.0F*(float)levelcount[10]/(float)lengths.size());
+        }
+        else {
+            int j=codec==CLOOP_CODEC_LZMA ? BEST_LZMA : BEST_LZ4;
+            fprintf(stderr,"%s: %5d (%5.2g%%)\n",
+                    codec_names[codec],
                     levelcount[j],
                     100.0F*(float)levelcount[j]/(float)lengths.size());
-        fprintf(stderr,"7zip: %5d (%5.2g%%)\n", 
-                levelcount[10],
-                100.0F*(float)levelcount[10]/(float)lengths.size());
+        }
+        if(image_v3())
+            fprintf(stderr,"raw: %5d (%5.2g%%)\n",
+                    levelcount[RAWBLOCK],
+                    100.0F*(float)levelcount[RAWBLOCK]/(float)lengths.size());
+        if(sparse_zero)
+            fprintf(stderr,"zero: %5d (%5.2g%%)\n",
+                    levelcount[ZEROBLOCK],
+                    100.0F*(float)levelcount[ZEROBLOCK]/(float)lengths.size());
+
+        // MB/s while busy, per thread and times the number of threads,
+        // if input is lower than compression, the input is the bottleneck
+        threadStats sum;
+        memset(&sum, 0, sizeof(sum));
+        for(int j=0; j<=workThreads; j++) {
+            sum.read_ns+=tstats[j].read_ns; sum.read_bytes+=tstats[j].read_bytes;
+            sum.comp_ns+=tstats[j].comp_ns; sum.comp_bytes+=tstats[j].comp_bytes;
+        }
+        if(adaptive) {
+            // time in all threads together, estimate included
+            for(int d=0; d<DECIDE_MAX; d++) {
+                uint64_t ns=0, n=0;
+                for(int j=0; j<workThreads; j++) {
+                    ns+=tstats[j].decide_ns[d];
+                    n+=tstats[j].decide_blocks[d];
+                }
+                fprintf(stderr,"adaptive %-6s: %5d blocks, %7.2fs (%5.1f%%), %.1f MB/s\n",
+                        decide_names[d], (int) n, ns/1e9,
+                        sum.comp_ns ? 100.0*ns/sum.comp_ns : 0.0,
+                        ns ? (double) n*blocksize*1000.0/ns : 0.0);
+            }
+        }
+        int readers = inputmode==INPUT_READ ? 1 : workThreads;
+        double rd = sum.read_ns ? (double) sum.read_bytes*1000.0/sum.read_ns : 0;
+        double cp = sum.comp_ns ? (double) sum.comp_bytes*1000.0/sum.comp_ns : 0;
+        fprintf(stderr,"input (%s): %.1f MB/s per reader, %.1f MB/s with %d\n",
+                inputmode==INPUT_MMAP ? "mmap" : inputmode==INPUT_DIRECT ? "direct" : "read",
+                rd, rd*readers, readers);
+        fprintf(stderr,"compression: %.1f MB/s per thread, %.1f MB/s with %d\n",
+                cp, cp*workThreads, workThreads);
     }
 
     return ret;
 };
 
-#define OPTIONS "bB:mrp:lt:hs:f:j:a:vqS:L:"
+// -T: struct cloop_tail followed by the block hashes, for an image whose
+// data starts at offset
+// cloop_head and the offsets as they are stored in the image, the first
+// block at offset
+void headerBytes(struct cloop_head &head, uint64_t offset, vector<char> &buf)
+{
+    buf.assign((char *) &head, (char *) &head + sizeof(head));
+    for(size_t i=0;i<=lengths.size();i++) {
+        uint64_t tmp=ENSURE64UINT(offset);
+        buf.insert(buf.end(), (char *) &tmp, (char *) &tmp + sizeof(tmp));
+        if(i<lengths.size()) offset+=lengths[i];
+    }
+}
+
+void buildTail(struct cloop_head &head, uint64_t offset, vector<char> &out)
+{
+    struct cloop_tail t;
+    memcpy(t.magic, CLOOP_TAIL_MAGIC, sizeof(t.magic));
+    t.version=htonl(CLOOP_TAIL_VERSION);
+    t.hash_type=htonl(tailtype);
+    t.hash_size=htonl(cloop_digest_size(tailtype));
+    t.num_blocks=htonl(lengths.size());
+    t.table_sum=ENSURE64UINT(cloop_xxh64(digests.size() ? &digests[0] : NULL, digests.size()));
+
+    // head_sum covers everything needed to find the blocks
+    vector<char> buf;
+    headerBytes(head, offset, buf);
+    buf.insert(buf.end(), (char *) &t, (char *) &t.head_sum);
+    t.head_sum=ENSURE64UINT(cloop_xxh64(&buf[0], buf.size()));
+
+    out.assign((char *) &t, (char *) &t + sizeof(t));
+    out.insert(out.end(), digests.begin(), digests.end());
+}
+
+#define OPTIONS "bB:mrp:lt:hs:f:j:a:vqS:L:zI:U:H:T:C:A"
         
 int usage(char *progname)
 {
@@ -647,9 +1024,23 @@ int usage(char *progname)
     cout << "  -v     Verbose mode, print extra statistics" <<endl;
     cout << "  -h     Help of the program" << endl;
     cout << "  -S X   Experimental option: store volume header in file X, see manpage" <<endl;
+    cout << "  -z     Store all-zero blocks without data (sparse, needs cloop >= 3.13)" <<endl;
+    cout << "  -U F   Bitmap of used blocks (see cloop_usedmap), unused blocks are not\n"
+            "         read and stored as zero blocks; implies -z" <<endl;
+    cout << "  -H F   Write a table of block hashes to F, for extract_compressed_fs -d" <<endl;
+    cout << "  -T H   Append a trailer with a hash of every block to the image, H is\n"
+            "         blake2b (for extract_compressed_fs -c) or xxh64 (also for -D)" <<endl;
+    cout << "  -C C   Codec: zlib (default), lzma (smaller, slow to create) or lz4\n"
+            "         (fast to decompress); lzma and lz4 need cloop >= 3.16, -L and -b\n"
+            "         only apply to zlib" <<endl;
+    cout << "  -A     Adaptive: blocks that look incompressible are stored raw, blocks where\n"
+            "         a trial gzip -9 of the start gains over -1 get 7zip (zlib), the rest\n"
+            "         the method of -L; needs cloop >= 3.16" <<endl;
     cout << "Performance tuning options:"<<endl;
     //cout << "  -j W   Jobsize, number W of blocks passed to each working thread per call"<<endl;
     cout << "  -a U   Job pool size (default: threadcount+3)" <<endl;
+    cout << "  -I M   Input method: read (default), mmap (no copy) or direct (O_DIRECT);\n"
+            "         with mmap and direct every compressing thread reads its own blocks" <<endl;
     cout << "  -L V   Compression level (-2..9); 9: zlib's best (default setting), 0: none,\n"
             "         -1: 7zip, -2: do all and keep the best one" <<endl;
     /*
@@ -773,6 +1164,49 @@ int main(int argc, char **argv)
                 reuse_as_tempfile=true;
                 break;
 
+            case 'z':
+                sparse_zero=true;
+                break;
+
+            case 'A':
+                adaptive=true;
+                break;
+
+            case 'H':
+                hashfile=optarg;
+                break;
+
+            case 'T':
+                if(!strcmp(optarg, "blake2b")) tailtype=CLOOP_TAIL_BLAKE2B;
+                else if(!strcmp(optarg, "xxh64")) tailtype=CLOOP_TAIL_XXH64;
+                else die("Unknown hash type " << optarg);
+                break;
+
+            case 'C':
+                if(!strcmp(optarg, "zlib")) codec=CLOOP_CODEC_ZLIB;
+                else if(!strcmp(optarg, "lzma")) codec=CLOOP_CODEC_LZMA;
+                else if(!strcmp(optarg, "lz4")) codec=CLOOP_CODEC_LZ4;
+                else die("Unknown codec " << optarg);
+                break;
+
+            case 'U':
+                {
+                    FILE *f=fopen(optarg, "r");
+                    if(!f) die("Opening used block bitmap " << optarg);
+                    int ch;
+                    while((ch=fgetc(f))!=EOF) usedmap.push_back(ch);
+                    fclose(f);
+                    sparse_zero=true;
+                }
+                break;
+
+            case 'I':
+                if(!strcmp(optarg, "read")) inputmode=INPUT_READ;
+                else if(!strcmp(optarg, "mmap")) inputmode=INPUT_MMAP;
+                else if(!strcmp(optarg, "direct")) inputmode=INPUT_DIRECT;
+                else die("Unknown input method " << optarg);
+                break;
+
             case 'S':
                 sepheader=optarg;
                 break;
@@ -817,7 +1251,9 @@ int main(int argc, char **argv)
     }
 
     const char *fromfile=NULL, *tofile=NULL;
-    int test;
+
+    if(codec!=CLOOP_CODEC_ZLIB)
+        method=CODEC_METHOD(codec);
 
     if(optind > argc-2) {
         usage(argv[0]);
@@ -867,17 +1303,42 @@ int main(int argc, char **argv)
 
     if(strcmp(fromfile, "-")) {
         struct stat buf;
-        if(!datasize) {
-            stat(fromfile, &buf);
-            datasize=buf.st_size;
+        in=open(fromfile, O_RDONLY | O_LARGEFILE | (inputmode==INPUT_DIRECT ? O_DIRECT : 0));
+        if(in<0) die("Opening input");
+        uint64_t realsize=0;
+        if(fstat(in, &buf)==0) {
+            realsize=buf.st_size;
+#ifdef BLKGETSIZE64
+            if(S_ISBLK(buf.st_mode) && ioctl(in, BLKGETSIZE64, &realsize))
+                realsize=0;
+#endif
         }
+        if(!datasize)
+            datasize=realsize;
         if(datasize < 8000)
             die("Unknown or suspicious input data size. Use -s to specify a real value");
 
-        in=open(fromfile, O_RDONLY | O_LARGEFILE);
+        // with -s beyond the end of the input, -I mmap and direct stop at
+        // the end and pad the last block like the read() loop does
+        insize=datasize;
+        if(realsize && insize>realsize)
+            insize=realsize;
+        if(inputmode==INPUT_MMAP) {
+            inmap=(char *) mmap(NULL, insize, PROT_READ, MAP_SHARED, in, 0);
+            if(inmap==MAP_FAILED) {
+                // e.g. larger than the address space on 32bit
+                cerr << "Cannot map input, reading it instead" <<endl;
+                inmap=NULL;
+                inputmode=INPUT_READ;
+            }
+            else
+                madvise(inmap, insize, MADV_SEQUENTIAL);
+        }
     }
     else
     {
+        if(inputmode!=INPUT_READ) die("-I mmap and -I direct need an input file");
+        if(usedmap.size()) die("-U needs an input file");
         in=fileno(stdin);
         if(!datasize) {
             if(sepheader) 
@@ -929,9 +1390,31 @@ int main(int argc, char **argv)
         numblocks=lengths.size();
         bytes_so_far = sizeof(head) + sizeof(uint64_t) * (1+lengths.size());
     }
-    else if(numblocks != lengths.size())
+    else if((size_t) numblocks != lengths.size())
         die("Incorrect number of blocks detected, "<<numblocks << " vs. " << lengths.size());
 
+    /* Update the head... */
+
+    memset(head.preamble, 0, sizeof(head.preamble));
+    if(!image_v3())
+        memcpy(head.preamble, CLOOP_PREAMBLE, sizeof(CLOOP_PREAMBLE));
+    else {
+        memcpy(head.preamble, CLOOP_PREAMBLE_V3, sizeof(CLOOP_PREAMBLE_V3));
+        head.preamble[CLOOP_HEADROOM-1]=codec;
+    }
+    head.block_size = htonl(blocksize);
+    head.num_blocks = htonl(numblocks);
+
+    // goes after the data, or at the end of the data file with -S
+    vector<char> tail;
+    if(tailtype) buildTail(head, bytes_so_far, tail);
+    uint64_t image_sum(0);
+    if(hashfile) {
+        vector<char> buf;
+        headerBytes(head, bytes_so_far, buf);
+        image_sum=cloop_xxh64(&buf[0], buf.size());
+    }
+
     // stretch the temp/target file, shifting data to make space for the header
     if(reuse_as_tempfile) {
         cerr << "Shifting data..."<<endl;
@@ -947,9 +1430,9 @@ int main(int argc, char **argv)
                     ipos=0;
                 }
                 if(fseeko(targetfh, ipos, SEEK_SET) < 0) throw 42;
-                if(fread( buf, sizeof(char), clen, targetfh) != clen) throw 42;
+                if(fread( buf, sizeof(char), clen, targetfh) != (size_t) clen) throw 42;
                 fseeko(targetfh, ipos+bytes_so_far, SEEK_SET);
-                if(fwrite(buf, sizeof(char), clen, targetfh) != clen) throw 42;
+                if(fwrite(buf, sizeof(char), clen, targetfh) != (size_t) clen) throw 42;
                 ipos-=clen;
             }
         }
@@ -957,6 +1440,8 @@ int main(int argc, char **argv)
     }
 
     if(sepheader) {
+        if(tail.size() && 1!=fwrite(&tail[0], tail.size(), 1, targetfh))
+            die("Writing hash trailer");
         fclose(targetfh);
         targetfh=fopen(sepheader, "w");
         if(!targetfh)
@@ -966,13 +1451,6 @@ int main(int argc, char **argv)
     // seek back
     fseeko(targetfh, 0, SEEK_SET);
 
-    /* Update the head... */
-
-    memset(head.preamble, 0, sizeof(head.preamble));
-    memcpy(head.preamble, CLOOP_PREAMBLE, sizeof(CLOOP_PREAMBLE));
-    head.block_size = htonl(blocksize);
-    head.num_blocks = htonl(numblocks);
-
     /* Write out head... */
 
     fwrite(&head, sizeof(head), 1, targetfh);
@@ -987,7 +1465,7 @@ int main(int argc, char **argv)
     tmp = ENSURE64UINT(bytes_so_far);
     fwrite(&tmp, sizeof(tmp), 1, targetfh);
 
-    for(int i=0;i<lengths.size();i++) {
+    for(size_t i=0;i<lengths.size();i++) {
         bytes_so_far += lengths[i];
         tmp = ENSURE64UINT(bytes_so_far);
         if(1!=fwrite(&tmp, sizeof(tmp), 1, targetfh))
@@ -998,7 +1476,7 @@ int main(int argc, char **argv)
 
     if(!be_quiet) cerr << "Writing compressed data...\n";
     if(targetkind==TOMEM) {
-        for(int i=0;i<blocks.size();i++) {
+        for(size_t i=0;i<blocks.size();i++) {
             DEBUG("Dumping contents of " << i);
             fwrite(blocks[i],lengths[i], 1, targetfh);
         }
@@ -1015,7 +1493,30 @@ int main(int argc, char **argv)
         }
         unlink(tempfile);
     }
+    if(tail.size() && !sepheader) {
+        // bytes_so_far is the end of the data now
+        if(targetfh!=stdout) fseeko(targetfh, bytes_so_far, SEEK_SET);
+        if(1!=fwrite(&tail[0], tail.size(), 1, targetfh))
+            die("Writing hash trailer");
+    }
     if(targetfh) fclose(targetfh);
+
+    if(hashfile) {
+        FILE *hf=fopen(hashfile, "w");
+        struct cloop_hash_head hh;
+        memcpy(hh.magic, CLOOP_HASH_MAGIC, sizeof(hh.magic));
+        hh.block_size=htonl(blocksize);
+        hh.num_blocks=htonl(hashes.size());
+        hh.image_sum=ENSURE64UINT(image_sum);
+        if(!hf || 1!=fwrite(&hh, sizeof(hh), 1, hf))
+            die("Writing hash table " << hashfile);
+        for(size_t i=0;i<hashes.size();i++) {
+            uint64_t tmp=ENSURE64UINT(hashes[i]);
+            if(1!=fwrite(&tmp, sizeof(tmp), 1, hf))
+                die("Writing hash table " << hashfile);
+        }
+        if(fclose(hf)) die("Writing hash table " << hashfile);
+    }
     return ret;
 }
 
@@ -1104,12 +1605,12 @@ int start_server(int port)
             unsigned int limit=1048576;
             uint32_t head[2];
             int l=recv(new_fd, head, sizeof(head), MSG_WAITALL);
-            if(l<sizeof(head)) { // not OK
+            if(l<(int) sizeof(head)) { // not OK
                 close(new_fd);
                 exit(1);
             }
             blocksize=ntohl(head[0]);
-            uint32_t method=ntohl(head[1]);
+            method=(int32_t) ntohl(head[1]);
             if( !head[0] || head[0]>limit) {
                 cerr << "Bad blocksize\n";
                 close(new_fd);
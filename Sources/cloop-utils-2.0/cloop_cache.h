@@ -0,0 +1,184 @@
+#ifndef _CLOOP_CACHE_H
+#define _CLOOP_CACHE_H
+
+/* Bookkeeping for the cache of decompressed blocks in cloop.c.          */
+/* Slots are found by block number through a hash table and recycled in */
+/* least-recently-used order. Only indices are managed here, the caller  */
+/* owns the block buffers and the table memory (cloop_cache_memsize()). */
+/* Slots can be pinned while a reader copies from them or a worker      */
+/* fills them, pinned slots are never evicted. Locking is up to the     */
+/* caller, too.                                                          */
+/* Plain C without kernel dependencies, so cloop_cache_replay.c can run  */
+/* recorded access traces through exactly the same code in userspace.    */
+
+struct cloop_cache
+{
+ unsigned int size;        /* Number of slots                        */
+ unsigned int hash_mask;   /* Number of hash buckets - 1             */
+ int *blocknum;            /* Block held by slot, -1 if empty        */
+ int *hash_head;           /* First slot per bucket, -1 if empty     */
+ int *hash_next;           /* Next slot in same bucket               */
+ int *lru_prev, *lru_next; /* LRU list, most recently used first     */
+ int *users;               /* Pin count per slot                     */
+ int lru_first, lru_last;
+ unsigned long hits, misses;
+};
+
+/* Power of two >= size, at least 1 */
+static inline unsigned int cloop_cache_buckets(unsigned int size)
+{
+ unsigned int n = 1;
+ while(n < size) n <<= 1;
+ return n;
+}
+
+static inline unsigned long cloop_cache_memsize(unsigned int size)
+{
+ return sizeof(int) * (5 * size + cloop_cache_buckets(size));
+}
+
+static inline unsigned int cloop_cache_hash(struct cloop_cache *c, int block)
+{
+ return (unsigned int)block & c->hash_mask;
+}
+
+static inline void cloop_cache_lru_unlink(struct cloop_cache *c, int slot)
+{
+ if(c->lru_prev[slot] >= 0) c->lru_next[c->lru_prev[slot]] = c->lru_next[slot];
+ else c->lru_first = c->lru_next[slot];
+ if(c->lru_next[slot] >= 0) c->lru_prev[c->lru_next[slot]] = c->lru_prev[slot];
+ else c->lru_last = c->lru_prev[slot];
+}
+
+static inline void cloop_cache_lru_front(struct cloop_cache *c, int slot)
+{
+ c->lru_prev[slot] = -1;
+ c->lru_next[slot] = c->lru_first;
+ if(c->lru_first >= 0) c->lru_prev[c->lru_first] = slot;
+ c->lru_first = slot;
+ if(c->lru_last < 0) c->lru_last = slot;
+}
+
+static inline void cloop_cache_lru_back(struct cloop_cache *c, int slot)
+{
+ c->lru_next[slot] = -1;
+ c->lru_prev[slot] = c->lru_last;
+ if(c->lru_last >= 0) c->lru_next[c->lru_last] = slot;
+ c->lru_last = slot;
+ if(c->lru_first < 0) c->lru_first = slot;
+}
+
+static inline void cloop_cache_hash_remove(struct cloop_cache *c, int slot)
+{
+ int *p = &c->hash_head[cloop_cache_hash(c, c->blocknum[slot])];
+ while(*p >= 0)
+  {
+   if(*p == slot) { *p = c->hash_next[slot]; break; }
+   p = &c->hash_next[*p];
+  }
+ c->hash_next[slot] = -1;
+}
+
+/* mem must hold cloop_cache_memsize(size) bytes */
+static inline void cloop_cache_init(struct cloop_cache *c, void *mem, unsigned int size)
+{
+ unsigned int i, buckets = cloop_cache_buckets(size);
+ int *p = (int *)mem;
+ c->size      = size;
+ c->hash_mask = buckets - 1;
+ c->blocknum  = p; p += size;
+ c->hash_next = p; p += size;
+ c->lru_prev  = p; p += size;
+ c->lru_next  = p; p += size;
+ c->users     = p; p += size;
+ c->hash_head = p;
+ c->lru_first = c->lru_last = -1;
+ c->hits = c->misses = 0;
+ for(i = 0; i < buckets; i++) c->hash_head[i] = -1;
+ for(i = 0; i < size; i++)
+  {
+   c->blocknum[i] = -1;
+   c->hash_next[i] = -1;
+   c->users[i] = 0;
+   cloop_cache_lru_back(c, i);
+  }
+}
+
+/* Returns the slot holding block or -1, without touching LRU order */
+/* or statistics.                                                   */
+static inline int cloop_cache_find(struct cloop_cache *c, int block)
+{
+ int slot;
+ for(slot = c->hash_head[cloop_cache_hash(c, block)]; slot >= 0; slot = c->hash_next[slot])
+  if(c->blocknum[slot] == block) return slot;
+ return -1;
+}
+
+/* Returns the slot holding block and marks it most recently used, */
+/* or -1 if the block is not cached.                               */
+static inline int cloop_cache_lookup(struct cloop_cache *c, int block)
+{
+ int slot = cloop_cache_find(c, block);
+ if(slot < 0)
+  {
+   ++c->misses;
+   return -1;
+  }
+ ++c->hits;
+ if(c->lru_first != slot)
+  {
+   cloop_cache_lru_unlink(c, slot);
+   cloop_cache_lru_front(c, slot);
+  }
+ return slot;
+}
+
+/* Returns the least recently used unpinned slot, emptied, for a new */
+/* block, or -1 if all slots are pinned. It stays least recently     */
+/* used until cloop_cache_insert().                                  */
+static inline int cloop_cache_evict(struct cloop_cache *c)
+{
+ int slot = c->lru_last;
+ while(slot >= 0 && c->users[slot] > 0) slot = c->lru_prev[slot];
+ if(slot < 0) return -1;
+ if(c->blocknum[slot] >= 0)
+  {
+   cloop_cache_hash_remove(c, slot);
+   c->blocknum[slot] = -1;
+  }
+ return slot;
+}
+
+/* Slot now holds block, make it most recently used. */
+static inline void cloop_cache_insert(struct cloop_cache *c, int slot, int block)
+{
+ c->blocknum[slot] = block;
+ c->hash_next[slot] = c->hash_head[cloop_cache_hash(c, block)];
+ c->hash_head[cloop_cache_hash(c, block)] = slot;
+ cloop_cache_lru_unlink(c, slot);
+ cloop_cache_lru_front(c, slot);
+}
+
+/* Forget the block in slot (e.g. after a read error), reuse it first. */
+static inline void cloop_cache_drop(struct cloop_cache *c, int slot)
+{
+ if(c->blocknum[slot] >= 0)
+  {
+   cloop_cache_hash_remove(c, slot);
+   c->blocknum[slot] = -1;
+  }
+ cloop_cache_lru_unlink(c, slot);
+ cloop_cache_lru_back(c, slot);
+}
+
+static inline void cloop_cache_pin(struct cloop_cache *c, int slot)
+{
+ ++c->users[slot];
+}
+
+static inline void cloop_cache_unpin(struct cloop_cache *c, int slot)
+{
+ --c->users[slot];
+}
+
+#endif /*_CLOOP_CACHE_H*/
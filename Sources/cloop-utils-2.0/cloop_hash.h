@@ -0,0 +1,228 @@
+#ifndef _CLOOP_HASH_H
+#define _CLOOP_HASH_H
+
+/* Per-block hash table of a cloop image, "image.cloop.hash", written by */
+/* create_compressed_fs -H and used by extract_compressed_fs -d to only  */
+/* rewrite blocks of a partition that differ from the image.              */
+/*                                                                        */
+/* struct cloop_hash_head, then num_blocks big endian 64bit hashes of the */
+/* uncompressed blocks. CLOOP_HASH_UNUSED marks blocks that the          */
+/* filesystem does not use (create_compressed_fs -U), their content does  */
+/* not matter and they are never rewritten.                               */
+/* The hash is XXH64 (Yann Collet), seed 0.                               */
+/* image_sum ties the table to its image: XXH64 of the cloop_head and the */
+/* offsets as stored in the image, like cloop_tail.head_sum without the   */
+/* trailer. A table left over from another image is refused.              */
+/* The same hashes, or BLAKE2b-128, can be embedded in the image itself   */
+/* as struct cloop_tail (create_compressed_fs -T), see cloop.h.           */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "cloop.h"
+
+#define CLOOP_HASH_MAGIC "CLHASH02"
+#define CLOOP_HASH_UNUSED 0
+
+struct cloop_hash_head
+{
+	char magic[8];
+	uint32_t block_size; /* big endian */
+	uint32_t num_blocks; /* big endian */
+	uint64_t image_sum;  /* big endian */
+};
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t xxh_read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint32_t xxh_read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_P2;
+	acc = xxh_rotl(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static inline uint64_t cloop_xxh64(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data, *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		const unsigned char *limit = end - 32;
+		uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = 0 - XXH_P1;
+		do {
+			v1 = xxh_round(v1, xxh_read64(p)); p += 8;
+			v2 = xxh_round(v2, xxh_read64(p)); p += 8;
+			v3 = xxh_round(v3, xxh_read64(p)); p += 8;
+			v4 = xxh_round(v4, xxh_read64(p)); p += 8;
+		} while (p <= limit);
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	}
+	else
+		h = XXH_P5;
+
+	h += len;
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+		h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_P5;
+		h = xxh_rotl(h, 11) * XXH_P1;
+	}
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* Hash of a block as stored in the table, never CLOOP_HASH_UNUSED */
+static inline uint64_t cloop_block_hash(const void *data, size_t len)
+{
+	uint64_t h = cloop_xxh64(data, len);
+	return h == CLOOP_HASH_UNUSED ? 1 : h;
+}
+
+/* BLAKE2b (RFC 7693), unkeyed, outlen <= 64 */
+static const uint64_t blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const unsigned char blake2b_sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define BLAKE2B_G(a, b, c, d, x, y) do { \
+	a += b + (x); d = xxh_rotl(d ^ a, 32); \
+	c += d;       b = xxh_rotl(b ^ c, 40); \
+	a += b + (y); d = xxh_rotl(d ^ a, 48); \
+	c += d;       b = xxh_rotl(b ^ c, 1);  \
+} while (0)
+
+static inline void blake2b_compress(uint64_t h[8], const unsigned char *block,
+                                    uint64_t t, int last)
+{
+	uint64_t v[16], m[16];
+	int i;
+	for (i = 0; i < 16; i++) m[i] = xxh_read64(block + 8 * i);
+	for (i = 0; i < 8; i++) { v[i] = h[i]; v[i + 8] = blake2b_iv[i]; }
+	v[12] ^= t;
+	if (last) v[14] = ~v[14];
+	for (i = 0; i < 12; i++) {
+		const unsigned char *s = blake2b_sigma[i];
+		BLAKE2B_G(v[0], v[4], v[ 8], v[12], m[s[ 0]], m[s[ 1]]);
+		BLAKE2B_G(v[1], v[5], v[ 9], v[13], m[s[ 2]], m[s[ 3]]);
+		BLAKE2B_G(v[2], v[6], v[10], v[14], m[s[ 4]], m[s[ 5]]);
+		BLAKE2B_G(v[3], v[7], v[11], v[15], m[s[ 6]], m[s[ 7]]);
+		BLAKE2B_G(v[0], v[5], v[10], v[15], m[s[ 8]], m[s[ 9]]);
+		BLAKE2B_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+		BLAKE2B_G(v[2], v[7], v[ 8], v[13], m[s[12]], m[s[13]]);
+		BLAKE2B_G(v[3], v[4], v[ 9], v[14], m[s[14]], m[s[15]]);
+	}
+	for (i = 0; i < 8; i++) h[i] ^= v[i] ^ v[i + 8];
+}
+
+static inline void cloop_blake2b(unsigned char *out, size_t outlen,
+                                 const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned char last[128];
+	uint64_t h[8], t = 0;
+	size_t i;
+
+	for (i = 0; i < 8; i++) h[i] = blake2b_iv[i];
+	h[0] ^= 0x01010000 ^ outlen;
+	for (; len > 128; len -= 128, p += 128) {
+		t += 128;
+		blake2b_compress(h, p, t, 0);
+	}
+	memset(last, 0, sizeof(last));
+	memcpy(last, p, len);
+	t += len;
+	blake2b_compress(h, last, t, 1);
+	for (i = 0; i < outlen; i++) out[i] = h[i / 8] >> (8 * (i % 8));
+}
+
+/* Size of a block hash of type CLOOP_TAIL_*, 0 if unknown */
+static inline unsigned int cloop_digest_size(unsigned int type)
+{
+	switch (type) {
+		case CLOOP_TAIL_XXH64:   return 8;
+		case CLOOP_TAIL_BLAKE2B: return 16;
+	}
+	return 0;
+}
+
+/* Block hash as stored in struct cloop_tail or the hash table, never */
+/* all zero bytes (= unused). XXH64 is stored big endian.             */
+static inline void cloop_digest(unsigned int type, unsigned char *out,
+                                const void *data, size_t len)
+{
+	if (type == CLOOP_TAIL_XXH64) {
+		uint64_t h = cloop_block_hash(data, len);
+		int i;
+		for (i = 0; i < 8; i++) out[i] = h >> (56 - 8 * i);
+	}
+	else {
+		unsigned int i, n = cloop_digest_size(type);
+		cloop_blake2b(out, n, data, len);
+		for (i = 0; i < n && !out[i]; i++);
+		if (i == n) out[n - 1] = 1;
+	}
+}
+
+#endif /*_CLOOP_HASH_H*/
@@ -0,0 +1,227 @@
+#ifndef _CLOOP_LZ4_H
+#define _CLOOP_LZ4_H
+
+/* The blocks of CLOOP_CODEC_LZ4 images are in the LZ4 block format: a  */
+/* token with the literal and match length, the literals, a 16-bit     */
+/* little endian offset back into the block and more length bytes for  */
+/* long runs. The last sequence has only literals. Decoding is a few   */
+/* copies per sequence, several times faster than inflate, at about    */
+/* the ratio of gzip -1.                                               */
+/* The decoder is plain C without kernel dependencies like             */
+/* cloop_cache.h, the driver and the userspace tools share it. The     */
+/* compressor is for advfs -C lz4 only.                                */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+
+#define CLOOP_LZ4_MINMATCH  4
+#define CLOOP_LZ4_LASTLIT   5  /* The block ends with at least 5 literals */
+#define CLOOP_LZ4_MFLIMIT   12 /* No match starts in the last 12 bytes    */
+#define CLOOP_LZ4_MAXOFFSET 65535
+
+/* Worst case size of the compressed data, all literals */
+#define CLOOP_LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+/* Length continued in bytes up to one below 255, stops at the end of */
+/* the input, which the bounds checks of the caller then catch         */
+static inline unsigned long cloop_lz4_runlen(const unsigned char **ip, const unsigned char *end)
+{
+ unsigned long len = 0;
+ unsigned int b;
+ do
+  {
+   if(*ip >= end) break;
+   b = *(*ip)++;
+   len += b;
+  } while(b == 255);
+ return len;
+}
+
+/* Returns 0 and the number of bytes in *destLen, or -1 for bad data */
+static inline int cloop_lz4_decompress(unsigned char *dest, unsigned long *destLen,
+                                       const unsigned char *source, unsigned long sourceLen)
+{
+ const unsigned char *ip = source, *iend = source + sourceLen;
+ unsigned char *op = dest, *oend = dest + *destLen;
+
+ for(;;)
+  {
+   unsigned int token;
+   unsigned long len, offset;
+   const unsigned char *match;
+
+   if(ip >= iend) return -1;
+   token = *ip++;
+   len = token >> 4;
+
+   /* Most sequences have short runs and are far from both ends: */
+   /* fixed size copies of 16 literals and 18 bytes of the match */
+   if(len < 15 && (token & 15) < 15 && iend - ip >= 18 && oend - op >= 32)
+    {
+     memcpy(op, ip, 16);
+     op += len; ip += len;
+     offset = ip[0] | (ip[1] << 8);
+     ip += 2;
+     len = (token & 15) + CLOOP_LZ4_MINMATCH;
+     if(offset >= 8 && offset <= (unsigned long)(op - dest))
+      {
+       match = op - offset;
+       memcpy(op, match, 8);
+       memcpy(op + 8, match + 8, 8);
+       memcpy(op + 16, match + 16, 2);
+       op += len;
+       continue;
+      }
+     goto copy_match;
+    }
+
+   /* Literals */
+   if(len == 15) len += cloop_lz4_runlen(&ip, iend);
+   if(len > (unsigned long)(iend - ip) || len > (unsigned long)(oend - op)) return -1;
+   memcpy(op, ip, len);
+   op += len; ip += len;
+   if(ip == iend) break; /* Last sequence */
+
+   if(iend - ip < 2) return -1;
+   offset = ip[0] | (ip[1] << 8);
+   ip += 2;
+   len = token & 15;
+   if(len == 15) len += cloop_lz4_runlen(&ip, iend);
+   len += CLOOP_LZ4_MINMATCH;
+
+copy_match:
+   if(!offset || offset > (unsigned long)(op - dest)) return -1;
+   if(len > (unsigned long)(oend - op)) return -1;
+   match = op - offset;
+   if(offset >= 8 && (unsigned long)(oend - op) >= len + 8)
+    { /* 8 bytes at a time, may write up to 7 bytes past the match */
+     unsigned char *end = op + len;
+     do
+      {
+       memcpy(op, match, 8);
+       op += 8; match += 8;
+      } while(op < end);
+     op = end;
+    }
+   else
+    { /* Overlapping or at the end of the block */
+     while(len--) *op++ = *match++;
+    }
+  }
+ *destLen = op - dest;
+ return 0;
+}
+
+#ifndef __KERNEL__
+
+#define CLOOP_LZ4_HASHLOG 12
+#define CLOOP_LZ4_SKIP    6 /* Step up after 2^6 misses, incompressible data is fast */
+
+static inline unsigned int cloop_lz4_read32(const unsigned char *p)
+{
+ unsigned int v;
+ memcpy(&v, p, sizeof(v));
+ return v;
+}
+
+static inline int cloop_lz4_equal8(const unsigned char *a, const unsigned char *b)
+{
+ unsigned long long x, y;
+ memcpy(&x, a, sizeof(x));
+ memcpy(&y, b, sizeof(y));
+ return x == y;
+}
+
+static inline unsigned int cloop_lz4_hash(const unsigned char *p)
+{
+ return (cloop_lz4_read32(p) * 2654435761U) >> (32 - CLOOP_LZ4_HASHLOG);
+}
+
+static inline unsigned char *cloop_lz4_putlen(unsigned char *op, unsigned long len)
+{
+ while(len >= 255) { *op++ = 255; len -= 255; }
+ *op++ = len;
+ return op;
+}
+
+/* Greedy compression with a hash table of the last position of every  */
+/* 4 byte sequence, like LZ4's default mode. Returns the compressed     */
+/* size, 0 if it does not fit into destLen (CLOOP_LZ4_BOUND always does) */
+static inline unsigned long cloop_lz4_compress(unsigned char *dest, unsigned long destLen,
+                                               const unsigned char *source, unsigned long sourceLen)
+{
+ unsigned int table[1 << CLOOP_LZ4_HASHLOG];
+ const unsigned char *ip = source, *anchor = source;
+ const unsigned char *iend = source + sourceLen;
+ const unsigned char *mflimit = iend - CLOOP_LZ4_MFLIMIT;
+ const unsigned char *matchlimit = iend - CLOOP_LZ4_LASTLIT;
+ unsigned char *op = dest, *oend = dest + destLen;
+ unsigned long litlen;
+
+ if(sourceLen < CLOOP_LZ4_MFLIMIT + 1) goto last;
+ memset(table, 0, sizeof(table));
+ ip++;
+
+ for(;;)
+  {
+   const unsigned char *match;
+   unsigned long len;
+   unsigned int step = 1, misses = 1 << CLOOP_LZ4_SKIP;
+   unsigned char *token;
+
+   /* Find 4 matching bytes within reach */
+   for(;;)
+    {
+     unsigned int h;
+     if(ip > mflimit) goto last;
+     h = cloop_lz4_hash(ip);
+     match = source + table[h];
+     table[h] = ip - source;
+     if(match < ip && ip - match <= CLOOP_LZ4_MAXOFFSET &&
+        cloop_lz4_read32(match) == cloop_lz4_read32(ip))
+      break;
+     ip += step;
+     step = misses++ >> CLOOP_LZ4_SKIP;
+    }
+   while(ip > anchor && match > source && ip[-1] == match[-1]) { ip--; match--; }
+
+   /* Extend it, 8 bytes at a time */
+   len = CLOOP_LZ4_MINMATCH;
+   while(ip + len + 8 <= matchlimit && cloop_lz4_equal8(ip + len, match + len)) len += 8;
+   while(ip + len < matchlimit && ip[len] == match[len]) len++;
+
+   litlen = ip - anchor;
+   if(op + 1 + litlen + litlen / 255 + 1 + 2 + (len - CLOOP_LZ4_MINMATCH) / 255 + 1 > oend)
+    return 0;
+   token = op++;
+   if(litlen >= 15) { *token = 15 << 4; op = cloop_lz4_putlen(op, litlen - 15); }
+   else *token = litlen << 4;
+   memcpy(op, anchor, litlen);
+   op += litlen;
+   *op++ = (ip - match) & 0xff;
+   *op++ = (ip - match) >> 8;
+   if(len - CLOOP_LZ4_MINMATCH >= 15) { *token |= 15; op = cloop_lz4_putlen(op, len - CLOOP_LZ4_MINMATCH - 15); }
+   else *token |= len - CLOOP_LZ4_MINMATCH;
+
+   ip += len;
+   anchor = ip;
+   if(ip > mflimit) break;
+   table[cloop_lz4_hash(ip - 2)] = ip - 2 - source;
+  }
+
+last:
+ litlen = iend - anchor;
+ if(op + 1 + litlen + litlen / 255 + 1 > oend) return 0;
+ if(litlen >= 15) { *op++ = 15 << 4; op = cloop_lz4_putlen(op, litlen - 15); }
+ else *op++ = litlen << 4;
+ memcpy(op, anchor, litlen);
+ op += litlen;
+ return op - dest;
+}
+
+#endif /* !__KERNEL__ */
+
+#endif /* _CLOOP_LZ4_H */
@@ -0,0 +1,767 @@
+/* cloop_nbd: serves a compressed cloop file read-only over the NBD     */
+/* protocol, so images can be inspected without the cloop kernel module */
+/*                                                                     */
+/*   cloop_nbd -s /tmp/cloop.sock image.cloop &                        */
+/*   nbd-client -unix /tmp/cloop.sock /dev/nbd0 && mount -r /dev/nbd0 /mnt */
+/*                                                                     */
+/* or over TCP (localhost only unless -b is given):                    */
+/*   cloop_nbd -p 10809 image.cloop &                                  */
+/*   nbd-client localhost 10809 /dev/nbd0 -N cloop                     */
+/*                                                                     */
+/* Requests of a connection are handled by a pool of threads, each     */
+/* with its own compressed buffer. Decompressed blocks are kept in a   */
+/* cache that is split into shards with their own lock and LRU list    */
+/* (cloop_cache.h, the same code as in the kernel module).             */
+/* zlib, LZMA and LZ4 images are served (cloop.h CLOOP_CODEC_*).       */
+/* License: GPL V2                                                     */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+
+#define __be64_to_cpu be64toh
+#include "cloop.h"
+#include "cloop_cache.h"
+#include "cloop_lzma.h"
+#include "cloop_lz4.h"
+
+#ifndef MAX
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+#endif
+#ifndef MIN
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#endif
+
+/* NBD protocol, fixed newstyle handshake only */
+#define NBD_MAGIC             0x4e42444d41474943ULL /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC        0x49484156454F5054ULL /* "IHAVEOPT" */
+#define NBD_REP_MAGIC         0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC     0x25609513
+#define NBD_REPLY_MAGIC       0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+#define NBD_FLAG_HAS_FLAGS      (1 << 0)
+#define NBD_FLAG_READ_ONLY      (1 << 1)
+#define NBD_FLAG_SEND_FLUSH     (1 << 2)
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT       2
+#define NBD_OPT_LIST        3
+#define NBD_OPT_INFO        6
+#define NBD_OPT_GO          7
+
+#define NBD_REP_ACK         1
+#define NBD_REP_SERVER      2
+#define NBD_REP_INFO        3
+#define NBD_REP_ERR_UNSUP   0x80000001
+#define NBD_INFO_EXPORT     0
+
+#define NBD_CMD_READ  0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC  2
+#define NBD_CMD_FLUSH 3
+
+/* Largest request we accept, the kernel sends at most max_sectors */
+#define NBD_MAX_REQUEST (32 << 20)
+
+struct nbd_request
+{
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t length;
+} __attribute__((packed));
+
+struct nbd_reply
+{
+	uint32_t magic;
+	uint32_t error;
+	uint64_t handle;
+} __attribute__((packed));
+
+/* One part of the decompressed block cache, see get_block() */
+struct shard
+{
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;
+	struct cloop_cache cache;
+	void *cache_mem;
+	unsigned char **buffer;
+	char *loading;
+};
+
+/* One connection, served by all worker threads together */
+struct connection
+{
+	int fd;
+	int closed;
+	pthread_mutex_t rx_lock, tx_lock;
+	unsigned long requests;
+};
+
+struct worker
+{
+	struct connection *conn;
+	pthread_t thread;
+	unsigned char *compressed;
+	unsigned short *lzma_probs;
+	unsigned char *data;
+	size_t data_size;
+};
+
+static const char *progname;
+static int handle;
+static int be_quiet = 0;
+static unsigned int total_blocks, block_size, compressed_buffer_size;
+static uint64_t image_size;
+static loff_t *offsets;
+static int codec, raw_blocks;
+static const char *codec_names[] = CLOOP_CODEC_NAMES;
+
+static struct shard *shards;
+static unsigned int num_shards;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-t threads] [-c blocks] [-S shards] [-q]\n"
+	                "          (-s socket | -p port [-b address]) file.cloop\n"
+	                "  -t N  decompression threads (default: number of CPUs)\n"
+	                "  -c N  decompressed blocks to cache (default 256)\n"
+	                "  -S N  cache shards (default: 4 per thread)\n"
+	                "  -s P  listen on unix socket P\n"
+	                "  -p N  listen on TCP port N\n"
+	                "  -b A  bind TCP to address A (default 127.0.0.1)\n"
+	                "  -q    do not report connections\n", progname);
+	exit(1);
+}
+
+/* read() may return less than requested on pipes and sockets */
+static ssize_t read_all(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = read(fd, (char *)buf + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return r;
+		}
+		if (r == 0) break;
+		done += r;
+	}
+	return done;
+}
+
+static ssize_t write_all(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = write(fd, (const char *)buf + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return r;
+		}
+		done += r;
+	}
+	return done;
+}
+
+static ssize_t pread_all(int fd, void *buf, size_t len, off_t pos)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = pread(fd, (char *)buf + done, len - done, pos + done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return r;
+		}
+		if (r == 0) break;
+		done += r;
+	}
+	return done;
+}
+
+static void init_cache(unsigned int blocks, unsigned int threads)
+{
+	unsigned int i, j, per_shard;
+	/* Every thread pins at most one block, so each shard needs at least
+	 * one slot per thread to always find one to recycle. */
+	per_shard = MAX((blocks + num_shards - 1) / num_shards, threads);
+	shards = calloc(num_shards, sizeof(struct shard));
+	if (shards == NULL) {
+		perror("Out of memory for cache");
+		exit(1);
+	}
+	for (i = 0; i < num_shards; i++) {
+		struct shard *s = &shards[i];
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->loaded, NULL);
+		s->cache_mem = malloc(cloop_cache_memsize(per_shard));
+		s->buffer = malloc(per_shard * sizeof(unsigned char *));
+		s->loading = calloc(per_shard, 1);
+		if (!s->cache_mem || !s->buffer || !s->loading) {
+			perror("Out of memory for cache");
+			exit(1);
+		}
+		cloop_cache_init(&s->cache, s->cache_mem, per_shard);
+		for (j = 0; j < per_shard; j++) {
+			s->buffer[j] = malloc(block_size);
+			if (s->buffer[j] == NULL) {
+				perror("Out of memory for cache");
+				fprintf(stderr, " (%u blocks of %u bytes).\n",
+				        per_shard * num_shards, block_size);
+				exit(1);
+			}
+		}
+	}
+	if (!be_quiet)
+		fprintf(stderr, "%s: caching %u blocks in %u shards.\n",
+		        progname, per_shard * num_shards, num_shards);
+}
+
+/* Returns 0 if the block was decompressed */
+static int decompress_block(struct worker *w, unsigned char *dest, uLongf *destlen,
+                            const unsigned char *source, int size)
+{
+	if (raw_blocks && CLOOP_BLOCK_IS_RAW(size, block_size)) {
+		memcpy(dest, source, size);
+		return 0;
+	}
+	switch (codec) {
+		case CLOOP_CODEC_LZMA:
+			return cloop_lzma_decompress(w->lzma_probs, dest, destlen, source, size);
+		case CLOOP_CODEC_LZ4:
+			return cloop_lz4_decompress(dest, destlen, source, size);
+		default:
+			return uncompress(dest, destlen, source, size) != Z_OK;
+	}
+}
+
+/* Returns the cache buffer holding block i, pinned in its shard until
+ * put_block(). Other threads asking for the same block while it is
+ * being inflated wait for it, NULL on read or inflate errors. */
+static unsigned char *get_block(struct worker *w, unsigned int i, int *slot)
+{
+	struct shard *s = &shards[i % num_shards];
+	loff_t start = __be64_to_cpu(offsets[i]);
+	int size = __be64_to_cpu(offsets[i+1]) - start;
+	uLongf destlen = block_size;
+	int n, err = 0;
+
+	pthread_mutex_lock(&s->lock);
+	while ((n = cloop_cache_lookup(&s->cache, i)) >= 0 && s->loading[n])
+		pthread_cond_wait(&s->loaded, &s->lock);
+	if (n >= 0) {
+		cloop_cache_pin(&s->cache, n);
+		pthread_mutex_unlock(&s->lock);
+		*slot = n;
+		return s->buffer[n];
+	}
+	n = cloop_cache_evict(&s->cache);
+	if (n < 0) { /* Cannot happen with one pin per thread */
+		pthread_mutex_unlock(&s->lock);
+		fprintf(stderr, "%s: no free cache slot for block %u.\n", progname, i);
+		return NULL;
+	}
+	cloop_cache_insert(&s->cache, n, i);
+	cloop_cache_pin(&s->cache, n);
+	s->loading[n] = 1;
+	pthread_mutex_unlock(&s->lock);
+
+	if (CLOOP_BLOCK_IS_ZERO(size))
+		memset(s->buffer[n], 0, block_size);
+	else if (size < 0 || size > compressed_buffer_size) {
+		fprintf(stderr, "%s: Size %d for block %u (offset %" PRIu64 ") wrong, corrupt data!\n",
+		        progname, size, i, (uint64_t) start);
+		err = 1;
+	}
+	else if (pread_all(handle, w->compressed, size, start) != size) {
+		perror("Reading block");
+		fprintf(stderr, " %u (offset %" PRIu64 ") of size %d.\n", i,
+		        (uint64_t) start, size);
+		err = 1;
+	}
+	else if (decompress_block(w, s->buffer[n], &destlen, w->compressed, size)) {
+		fprintf(stderr, "%s: Uncomp: %s input corrupt %u\n", progname,
+		        codec_names[codec], i);
+		err = 1;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->loading[n] = 0;
+	if (err) {
+		cloop_cache_drop(&s->cache, n);
+		cloop_cache_unpin(&s->cache, n);
+	}
+	pthread_cond_broadcast(&s->loaded);
+	pthread_mutex_unlock(&s->lock);
+	*slot = n;
+	return err ? NULL : s->buffer[n];
+}
+
+static void put_block(unsigned int i, int slot)
+{
+	struct shard *s = &shards[i % num_shards];
+	pthread_mutex_lock(&s->lock);
+	cloop_cache_unpin(&s->cache, slot);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Copy len bytes from image position pos to w->data, 0 or EIO */
+static int read_image(struct worker *w, uint64_t pos, uint32_t len)
+{
+	uint32_t done = 0;
+	while (done < len) {
+		unsigned int i = (pos + done) / block_size;
+		uint32_t in_block = (pos + done) % block_size;
+		uint32_t n = MIN(len - done, block_size - in_block);
+		int slot;
+		unsigned char *buf = get_block(w, i, &slot);
+		if (buf == NULL) return EIO;
+		memcpy(w->data + done, buf + in_block, n);
+		put_block(i, slot);
+		done += n;
+	}
+	return 0;
+}
+
+static void close_connection(struct connection *conn)
+{
+	conn->closed = 1;
+	/* Wakes up the thread waiting for the next request */
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+static int send_reply(struct connection *conn, uint64_t handle_, uint32_t error,
+                      const void *data, uint32_t len)
+{
+	struct nbd_reply reply;
+	int ok;
+	reply.magic = htonl(NBD_REPLY_MAGIC);
+	reply.error = htonl(error);
+	reply.handle = handle_;
+	pthread_mutex_lock(&conn->tx_lock);
+	ok = write_all(conn->fd, &reply, sizeof(reply)) == sizeof(reply) &&
+	     (len == 0 || write_all(conn->fd, data, len) == len);
+	pthread_mutex_unlock(&conn->tx_lock);
+	return ok ? 0 : -1;
+}
+
+/* Takes the next request from the socket, serves it and repeats. Only
+ * reading the request is serialized, the reply is sent as soon as the
+ * data is ready, which the protocol allows (replies carry the handle). */
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct connection *conn = w->conn;
+	for (;;) {
+		struct nbd_request req;
+		uint32_t len, error = 0;
+		uint64_t pos;
+
+		pthread_mutex_lock(&conn->rx_lock);
+		if (conn->closed ||
+		    read_all(conn->fd, &req, sizeof(req)) != sizeof(req) ||
+		    ntohl(req.magic) != NBD_REQUEST_MAGIC) {
+			close_connection(conn);
+			pthread_mutex_unlock(&conn->rx_lock);
+			break;
+		}
+		++conn->requests;
+		len = ntohl(req.length);
+		pos = be64toh(req.offset);
+		if (ntohs(req.type) == NBD_CMD_WRITE) {
+			/* Read-only export, skip the payload */
+			uint32_t skipped = 0;
+			while (skipped < len) {
+				uint32_t n = MIN(len - skipped, (uint32_t)block_size);
+				if (read_all(conn->fd, w->compressed, n) != n) {
+					close_connection(conn);
+					break;
+				}
+				skipped += n;
+			}
+		}
+		pthread_mutex_unlock(&conn->rx_lock);
+
+		switch (ntohs(req.type)) {
+			case NBD_CMD_READ:
+				if (len > NBD_MAX_REQUEST || pos > image_size || len > image_size - pos) {
+					error = EINVAL;
+					len = 0;
+					break;
+				}
+				if (len > w->data_size) {
+					unsigned char *data = realloc(w->data, len);
+					if (data == NULL) { error = ENOMEM; len = 0; break; }
+					w->data = data;
+					w->data_size = len;
+				}
+				error = read_image(w, pos, len);
+				if (error) len = 0;
+				break;
+			case NBD_CMD_DISC:
+				close_connection(conn);
+				continue;
+			case NBD_CMD_FLUSH:
+				len = 0;
+				break;
+			case NBD_CMD_WRITE:
+				error = EPERM;
+				len = 0;
+				break;
+			default:
+				error = EINVAL;
+				len = 0;
+		}
+		if (send_reply(conn, req.handle, error, w->data, len) != 0)
+			close_connection(conn);
+	}
+	return NULL;
+}
+
+static int send_option_reply(int fd, uint32_t option, uint32_t type,
+                             const void *data, uint32_t len)
+{
+	struct {
+		uint64_t magic;
+		uint32_t option, type, length;
+	} __attribute__((packed)) rep;
+	rep.magic = htobe64(NBD_REP_MAGIC);
+	rep.option = htonl(option);
+	rep.type = htonl(type);
+	rep.length = htonl(len);
+	if (write_all(fd, &rep, sizeof(rep)) != sizeof(rep)) return -1;
+	if (len && write_all(fd, data, len) != len) return -1;
+	return 0;
+}
+
+/* Fixed newstyle handshake, returns 0 when the client is ready for
+ * the transmission phase. Any export name is accepted. */
+static int negotiate(int fd)
+{
+	static const char zeroes[124];
+	/* No NBD_FLAG_CAN_MULTI_CONN, connections are served one at a time */
+	uint16_t transmission_flags = htons(NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY |
+	                                    NBD_FLAG_SEND_FLUSH);
+	uint64_t size_be = htobe64(image_size);
+	struct {
+		uint64_t magic, opts_magic;
+		uint16_t flags;
+	} __attribute__((packed)) hello;
+	uint32_t client_flags;
+
+	hello.magic = htobe64(NBD_MAGIC);
+	hello.opts_magic = htobe64(NBD_OPTS_MAGIC);
+	hello.flags = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (write_all(fd, &hello, sizeof(hello)) != sizeof(hello) ||
+	    read_all(fd, &client_flags, sizeof(client_flags)) != sizeof(client_flags))
+		return -1;
+	client_flags = ntohl(client_flags);
+
+	for (;;) {
+		struct {
+			uint64_t magic;
+			uint32_t option, length;
+		} __attribute__((packed)) opt;
+		unsigned char *data = NULL;
+		uint32_t option, len;
+
+		if (read_all(fd, &opt, sizeof(opt)) != sizeof(opt) ||
+		    be64toh(opt.magic) != NBD_OPTS_MAGIC)
+			return -1;
+		option = ntohl(opt.option);
+		len = ntohl(opt.length);
+		if (len > 65536 || (len && (data = malloc(len)) == NULL) ||
+		    read_all(fd, data, len) != len) {
+			free(data);
+			return -1;
+		}
+		free(data);
+
+		switch (option) {
+			case NBD_OPT_EXPORT_NAME:
+				if (write_all(fd, &size_be, sizeof(size_be)) != sizeof(size_be) ||
+				    write_all(fd, &transmission_flags, sizeof(transmission_flags)) != sizeof(transmission_flags))
+					return -1;
+				if (!(client_flags & NBD_FLAG_NO_ZEROES) &&
+				    write_all(fd, zeroes, sizeof(zeroes)) != sizeof(zeroes))
+					return -1;
+				return 0;
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO: {
+				struct {
+					uint16_t type;
+					uint64_t size;
+					uint16_t flags;
+				} __attribute__((packed)) info;
+				info.type = htons(NBD_INFO_EXPORT);
+				info.size = size_be;
+				info.flags = transmission_flags;
+				if (send_option_reply(fd, option, NBD_REP_INFO, &info, sizeof(info)) ||
+				    send_option_reply(fd, option, NBD_REP_ACK, NULL, 0))
+					return -1;
+				if (option == NBD_OPT_GO) return 0;
+				break;
+			}
+			case NBD_OPT_LIST: {
+				static const char name[] = "\0\0\0\5cloop";
+				if (send_option_reply(fd, option, NBD_REP_SERVER, name, sizeof(name) - 1) ||
+				    send_option_reply(fd, option, NBD_REP_ACK, NULL, 0))
+					return -1;
+				break;
+			}
+			case NBD_OPT_ABORT:
+				send_option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+				return -1;
+			default:
+				if (send_option_reply(fd, option, NBD_REP_ERR_UNSUP, NULL, 0))
+					return -1;
+		}
+	}
+}
+
+static void serve(int fd, struct worker *workers, unsigned int threads)
+{
+	struct connection conn;
+	unsigned long hits = 0, misses = 0;
+	unsigned int i;
+
+	if (negotiate(fd) != 0) {
+		if (!be_quiet) fprintf(stderr, "%s: handshake failed.\n", progname);
+		return;
+	}
+	conn.fd = fd;
+	conn.closed = 0;
+	conn.requests = 0;
+	pthread_mutex_init(&conn.rx_lock, NULL);
+	pthread_mutex_init(&conn.tx_lock, NULL);
+	for (i = 0; i < num_shards; i++) {
+		hits -= shards[i].cache.hits;
+		misses -= shards[i].cache.misses;
+	}
+	for (i = 0; i < threads; i++) {
+		workers[i].conn = &conn;
+		if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	for (i = 0; i < num_shards; i++) {
+		hits += shards[i].cache.hits;
+		misses += shards[i].cache.misses;
+	}
+	pthread_mutex_destroy(&conn.rx_lock);
+	pthread_mutex_destroy(&conn.tx_lock);
+	if (!be_quiet)
+		fprintf(stderr, "%s: connection closed after %lu requests, "
+		        "cache hits %lu, misses %lu.\n",
+		        progname, conn.requests, hits, misses);
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) { perror("socket"); exit(1); }
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long.\n", progname);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+		perror(path);
+		exit(1);
+	}
+	return fd;
+}
+
+static int listen_tcp(const char *address, int port)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) { perror("socket"); exit(1); }
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+		fprintf(stderr, "%s: bad address %s.\n", progname, address);
+		exit(1);
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, port = 0, listen_fd, threads = 1;
+	unsigned int i, cache_blocks = 256, total_offsets, offsets_size;
+	const char *socket_path = NULL, *address = "127.0.0.1";
+	struct cloop_head head;
+	struct worker *workers;
+
+	progname = argv[0];
+#ifdef _SC_NPROCESSORS_ONLN
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) threads = 1;
+#endif
+
+	while ((c = getopt(argc, argv, "t:c:S:s:p:b:q")) != -1) {
+		switch (c) {
+			case 't':
+				threads = atoi(optarg);
+				if (threads < 1) usage();
+				break;
+			case 'c':
+				cache_blocks = atoi(optarg);
+				if (cache_blocks < 1) usage();
+				break;
+			case 'S':
+				num_shards = atoi(optarg);
+				if (num_shards < 1) usage();
+				break;
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				if (port < 1 || port > 65535) usage();
+				break;
+			case 'b':
+				address = optarg;
+				break;
+			case 'q':
+				be_quiet = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind != 1 || (socket_path == NULL) == (port == 0)) usage();
+	if (num_shards == 0) num_shards = 4 * threads;
+
+	handle = open(argv[optind], O_RDONLY|O_LARGEFILE);
+	if (handle < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	if (read_all(handle, &head, sizeof(head)) != sizeof(head)) {
+		perror("Reading compressed file header\n");
+		exit(1);
+	}
+	total_blocks = ntohl(head.num_blocks);
+	block_size = ntohl(head.block_size);
+	image_size = (uint64_t) total_blocks * block_size;
+	if (block_size == 0 || block_size % 512) {
+		fprintf(stderr, "%s: block size %u not a multiple of 512.\n", progname, block_size);
+		exit(1);
+	}
+	codec = CLOOP_CODEC(&head);
+	raw_blocks = CLOOP_RAW_BLOCKS(&head);
+	if (codec > CLOOP_CODEC_MAX) {
+		fprintf(stderr, "%s: unknown codec %d in a version %c image.\n",
+		        progname, codec, head.preamble[0x0C]);
+		exit(1);
+	}
+	/* The maximum size of a compressed block, due to the
+	 * specification of uncompress() */
+	if (codec == CLOOP_CODEC_ZLIB)
+		compressed_buffer_size = block_size + block_size/1000 + 12 + 4;
+	else
+		compressed_buffer_size = CLOOP_CODEC_MAXLEN(block_size);
+
+	total_offsets = total_blocks + 1;
+	offsets_size = total_offsets * sizeof(loff_t);
+	offsets = (loff_t *)malloc(offsets_size);
+	if (offsets == NULL) {
+		perror("Out of memory");
+		fprintf(stderr, " for %d offsets.\n", total_offsets);
+		exit(1);
+	}
+	if (read_all(handle, offsets, offsets_size) != offsets_size) {
+		perror("Reading offsets");
+		fprintf(stderr, " (%d bytes).\n", offsets_size);
+		exit(1);
+	}
+	fprintf(stderr, "%s: %s has %u blocks of size %u, %" PRIu64 " bytes (%s).\n",
+	        progname, argv[optind], total_blocks, block_size, image_size,
+	        codec_names[codec]);
+
+	init_cache(cache_blocks, threads);
+	workers = calloc(threads, sizeof(struct worker));
+	if (workers == NULL) {
+		perror("Out of memory for threads");
+		exit(1);
+	}
+	for (i = 0; i < threads; i++) {
+		workers[i].compressed = malloc(MAX(compressed_buffer_size, block_size));
+		if (workers[i].compressed == NULL) {
+			perror("Out of memory for compressed buffers");
+			exit(1);
+		}
+		if (codec == CLOOP_CODEC_LZMA &&
+		    (workers[i].lzma_probs = malloc(CLOOP_LZMA_WORKSPACE)) == NULL) {
+			perror("Out of memory for LZMA decoders");
+			exit(1);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	listen_fd = socket_path ? listen_unix(socket_path) : listen_tcp(address, port);
+	if (!be_quiet) {
+		if (socket_path)
+			fprintf(stderr, "%s: serving with %d threads on %s.\n",
+			        progname, threads, socket_path);
+		else
+			fprintf(stderr, "%s: serving with %d threads on %s:%d.\n",
+			        progname, threads, address, port);
+	}
+
+	/* One client at a time, all threads work for it */
+	for (;;) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			perror("accept");
+			exit(1);
+		}
+		if (!socket_path) {
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		serve(fd, workers, threads);
+		close(fd);
+	}
+	return 0;
+}
@@ -0,0 +1,374 @@
+/* cloop_usedmap: writes a bitmap of the cloop blocks of a partition that */
+/* contain allocated filesystem data, for create_compressed_fs -U. Blocks */
+/* with a clear bit are stored as empty (all-zero) entries without being  */
+/* read. Bit i is (byte i/8 >> (i%8)) & 1, like the NTFS $Bitmap.         */
+/* Understands ext2/3/4, FAT12/16/32 and NTFS. Anything it cannot prove   */
+/* unused (boot sectors, FATs, metadata, tail of the device) is marked    */
+/* used, so a restored partition is always consistent.                    */
+/* License: GPL V2                                                        */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifndef MIN
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#endif
+
+static const char *progname;
+static int handle;
+static uint64_t device_size, block_size = 131072;
+static unsigned char *usedmap;
+static uint64_t total_blocks;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-B blocksize] device bitmapfile\n"
+	                "  -B N  cloop block size (default 131072)\n"
+	                "Exits with 2 if the filesystem is not supported.\n", progname);
+	exit(1);
+}
+
+static void read_at(uint64_t pos, void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = pread(handle, (char *)buf + done, len - done, pos + done);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) {
+			fprintf(stderr, "%s: read error at %" PRIu64 ": %s\n", progname,
+			        pos + done, r ? strerror(errno) : "end of device");
+			exit(1);
+		}
+		done += r;
+	}
+}
+
+static uint16_t le16(const unsigned char *p) { return p[0] | p[1] << 8; }
+static uint32_t le32(const unsigned char *p) { return le16(p) | (uint32_t)le16(p + 2) << 16; }
+static uint64_t le64(const unsigned char *p) { return le32(p) | (uint64_t)le32(p + 4) << 32; }
+
+/* Mark the bytes pos..pos+len-1 of the device as used */
+static void mark_used(uint64_t pos, uint64_t len)
+{
+	uint64_t i, last;
+	if (len == 0 || pos >= device_size) return;
+	if (len > device_size - pos) len = device_size - pos;
+	last = (pos + len - 1) / block_size;
+	for (i = pos / block_size; i <= last; i++)
+		usedmap[i / 8] |= 1 << (i % 8);
+}
+
+/* Walk a bitmap of allocation units of unit bytes starting at base,
+ * bit set = used, and mark the used ones. */
+static void mark_bitmap(const unsigned char *bits, uint64_t units, uint64_t base, uint64_t unit)
+{
+	uint64_t i = 0;
+	while (i < units) {
+		uint64_t start;
+		if (!(bits[i / 8] & (1 << (i % 8)))) { i++; continue; }
+		/* Coalesce runs, mark_used() is per cloop block */
+		for (start = i; i < units && (bits[i / 8] & (1 << (i % 8))); i++) ;
+		mark_used(base + start * unit, (i - start) * unit);
+	}
+}
+
+/* ext2/3/4: per-group block bitmaps. Groups flagged BLOCK_UNINIT have no
+ * bitmap on disk, only the group metadata is in use there. */
+static int scan_ext(void)
+{
+	unsigned char sb[1024], *gdt, *bitmap;
+	uint64_t blocks, bs, groups, g, gdt_blocks, desc_size;
+	uint32_t per_group, first_data, incompat, ro_compat, inodes_per_group, inode_size;
+	int is64;
+
+	read_at(1024, sb, sizeof(sb));
+	if (le16(sb + 0x38) != 0xEF53) return -1;
+	bs = 1024 << le32(sb + 0x18);
+	first_data = le32(sb + 0x14);
+	per_group = le32(sb + 0x20);
+	incompat = le32(sb + 0x60);
+	ro_compat = le32(sb + 0x64);
+	is64 = (incompat & 0x80) != 0;
+	blocks = le32(sb + 0x04) | (is64 ? (uint64_t)le32(sb + 0x150) << 32 : 0);
+	desc_size = is64 ? le16(sb + 0xFE) : 32;
+	inodes_per_group = le32(sb + 0x28);
+	inode_size = le32(sb + 0x4C) >= 1 ? le16(sb + 0x58) : 128;
+	if (per_group == 0 || desc_size < 32 || bs > 65536) return -1;
+	groups = (blocks - first_data + per_group - 1) / per_group;
+	gdt_blocks = (groups * desc_size + bs - 1) / bs;
+
+	gdt = malloc(gdt_blocks * bs);
+	bitmap = malloc(bs);
+	if (!gdt || !bitmap) { perror("malloc"); exit(1); }
+	read_at((first_data + 1) * bs, gdt, gdt_blocks * bs);
+
+	/* Boot block, superblock and descriptors of group 0 */
+	mark_used(0, (first_data + 1 + gdt_blocks + le16(sb + 0xCE)) * bs);
+
+	for (g = 0; g < groups; g++) {
+		const unsigned char *d = gdt + g * desc_size;
+		uint64_t start = first_data + g * per_group;
+		uint64_t count = MIN(blocks - start, per_group);
+		uint64_t block_bitmap = le32(d) | (is64 && desc_size >= 64 ? (uint64_t)le32(d + 0x20) << 32 : 0);
+		uint64_t inode_bitmap = le32(d + 4) | (is64 && desc_size >= 64 ? (uint64_t)le32(d + 0x24) << 32 : 0);
+		uint64_t inode_table = le32(d + 8) | (is64 && desc_size >= 64 ? (uint64_t)le32(d + 0x28) << 32 : 0);
+		uint16_t flags = le16(d + 0x12);
+
+		/* Metadata of this group, wherever it lives (flex_bg) */
+		mark_used(block_bitmap * bs, bs);
+		mark_used(inode_bitmap * bs, bs);
+		mark_used(inode_table * bs, (uint64_t)inodes_per_group * inode_size);
+
+		if (flags & 0x2) { /* EXT4_BG_BLOCK_UNINIT */
+			int backup = 1;
+			if (incompat & 0x10) { /* META_BG, do not guess */
+				mark_used(start * bs, count * bs);
+				continue;
+			}
+			if ((ro_compat & 0x1) && g > 1) { /* SPARSE_SUPER: 0, 1, 3^n, 5^n, 7^n */
+				uint64_t p;
+				backup = 0;
+				for (p = 3; p <= g; p *= 3) if (p == g) backup = 1;
+				for (p = 5; p <= g; p *= 5) if (p == g) backup = 1;
+				for (p = 7; p <= g; p *= 7) if (p == g) backup = 1;
+			}
+			if (backup)
+				mark_used(start * bs, (1 + gdt_blocks + le16(sb + 0xCE)) * bs);
+			continue;
+		}
+		read_at(block_bitmap * bs, bitmap, bs);
+		mark_bitmap(bitmap, count, start * bs, bs);
+	}
+	free(gdt);
+	free(bitmap);
+	fprintf(stderr, "%s: ext2/3/4, %" PRIu64 " blocks of %" PRIu64 " bytes in %" PRIu64 " groups.\n",
+	        progname, blocks, bs, groups);
+	return 0;
+}
+
+/* FAT12/16/32: everything up to the data area is used, clusters with a
+ * non-zero FAT entry too. */
+static int scan_fat(void)
+{
+	unsigned char bs[512], *fat;
+	uint32_t bytes_per_sector, spc, reserved, nfats, root_entries, fat_size;
+	uint64_t sectors, data_start, clusters, fat_bytes, c;
+	int bits;
+
+	read_at(0, bs, sizeof(bs));
+	if (le16(bs + 510) != 0xAA55) return -1;
+	bytes_per_sector = le16(bs + 11);
+	spc = bs[13];
+	reserved = le16(bs + 14);
+	nfats = bs[16];
+	root_entries = le16(bs + 17);
+	sectors = le16(bs + 19) ? le16(bs + 19) : le32(bs + 32);
+	fat_size = le16(bs + 22) ? le16(bs + 22) : le32(bs + 36);
+	if (bytes_per_sector < 512 || bytes_per_sector > 4096 ||
+	    (bytes_per_sector & (bytes_per_sector - 1)) || spc == 0 || (spc & (spc - 1)) ||
+	    reserved == 0 || nfats == 0 || fat_size == 0 || sectors == 0)
+		return -1;
+	/* NTFS and exFAT have zeroes here, but check the OEM names anyway */
+	if (!memcmp(bs + 3, "NTFS    ", 8) || !memcmp(bs + 3, "EXFAT   ", 8)) return -1;
+	data_start = reserved + (uint64_t)nfats * fat_size +
+	             ((uint64_t)root_entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+	if (data_start >= sectors) return -1;
+	clusters = (sectors - data_start) / spc;
+	bits = clusters < 4085 ? 12 : clusters < 65525 ? 16 : 32;
+
+	fat_bytes = (uint64_t)fat_size * bytes_per_sector;
+	fat = malloc(fat_bytes);
+	if (!fat) { perror("malloc"); exit(1); }
+	read_at((uint64_t)reserved * bytes_per_sector, fat, fat_bytes);
+
+	mark_used(0, data_start * bytes_per_sector);
+	for (c = 2; c < clusters + 2; c++) {
+		uint32_t entry;
+		if (bits == 12) {
+			if (c * 3 / 2 + 1 >= fat_bytes) break;
+			entry = le16(fat + c * 3 / 2);
+			entry = (c & 1) ? entry >> 4 : entry & 0xFFF;
+		}
+		else if (bits == 16) {
+			if (c * 2 + 1 >= fat_bytes) break;
+			entry = le16(fat + c * 2);
+		}
+		else {
+			if (c * 4 + 3 >= fat_bytes) break;
+			entry = le32(fat + c * 4) & 0x0FFFFFFF;
+		}
+		if (entry)
+			mark_used((data_start + (c - 2) * spc) * bytes_per_sector,
+			          (uint64_t)spc * bytes_per_sector);
+	}
+	/* Clusters beyond what the FAT can describe are treated as used */
+	if (c < clusters + 2)
+		mark_used((data_start + (c - 2) * spc) * bytes_per_sector, device_size);
+	free(fat);
+	fprintf(stderr, "%s: FAT%d, %" PRIu64 " clusters of %u bytes.\n",
+	        progname, bits, clusters, spc * bytes_per_sector);
+	return 0;
+}
+
+/* NTFS: $Bitmap is the unnamed $DATA of MFT record 6. The first MFT
+ * records are always in the first extent of the MFT. */
+static int scan_ntfs(void)
+{
+	unsigned char bs[512], *rec, *attr, *bitmap;
+	uint32_t bytes_per_sector, record_size, usa_ofs, usa_count, i;
+	uint64_t cluster, total_clusters, mft_lcn, bitmap_size, done;
+	int8_t cpr;
+
+	read_at(0, bs, sizeof(bs));
+	if (memcmp(bs + 3, "NTFS    ", 8)) return -1;
+	bytes_per_sector = le16(bs + 0x0B);
+	cluster = bs[0x0D] <= 0x80 ? bs[0x0D] : 1 << (256 - bs[0x0D]);
+	cluster *= bytes_per_sector;
+	total_clusters = le64(bs + 0x28) * bytes_per_sector / cluster;
+	mft_lcn = le64(bs + 0x30);
+	cpr = (int8_t)bs[0x40];
+	record_size = cpr > 0 ? cpr * cluster : 1U << -cpr;
+	if (bytes_per_sector < 512 || cluster == 0 || record_size < 512 || record_size > 65536)
+		return -1;
+
+	rec = malloc(record_size);
+	if (!rec) { perror("malloc"); exit(1); }
+	read_at(mft_lcn * cluster + 6 * (uint64_t)record_size, rec, record_size);
+	if (memcmp(rec, "FILE", 4)) {
+		fprintf(stderr, "%s: NTFS MFT record 6 is corrupt.\n", progname);
+		return -1;
+	}
+	/* Undo the update sequence fixups, one per 512 bytes */
+	usa_ofs = le16(rec + 0x04);
+	usa_count = le16(rec + 0x06);
+	for (i = 1; i < usa_count && i * 512 <= record_size; i++) {
+		rec[i * 512 - 2] = rec[usa_ofs + i * 2];
+		rec[i * 512 - 1] = rec[usa_ofs + i * 2 + 1];
+	}
+
+	for (attr = rec + le16(rec + 0x14); attr + 8 <= rec + record_size; attr += le32(attr + 4)) {
+		if (le32(attr) == 0xFFFFFFFF || le32(attr + 4) == 0) break;
+		if (le32(attr) == 0x80 && attr[9] == 0 && attr[8] == 1) break; /* unnamed non-resident $DATA */
+	}
+	if (attr + 8 > rec + record_size || le32(attr) != 0x80) {
+		fprintf(stderr, "%s: no $DATA in NTFS $Bitmap.\n", progname);
+		return -1;
+	}
+
+	bitmap_size = le64(attr + 0x30);
+	if (bitmap_size * 8 < total_clusters) {
+		fprintf(stderr, "%s: NTFS $Bitmap too small.\n", progname);
+		return -1;
+	}
+	bitmap = calloc(1, bitmap_size + cluster);
+	if (!bitmap) { perror("malloc"); exit(1); }
+
+	/* Decode the runlist and read the bitmap */
+	{
+		unsigned char *run = attr + le16(attr + 0x20);
+		int64_t lcn = 0;
+		done = 0;
+		while (run < attr + le32(attr + 4) && *run && done < bitmap_size) {
+			int len_bytes = *run & 0x0F, ofs_bytes = *run >> 4, k;
+			uint64_t length = 0;
+			int64_t delta = 0;
+			for (k = 0; k < len_bytes; k++) length |= (uint64_t)run[1 + k] << (8 * k);
+			for (k = 0; k < ofs_bytes; k++) delta |= (int64_t)run[1 + len_bytes + k] << (8 * k);
+			if (ofs_bytes && (run[len_bytes + ofs_bytes] & 0x80))
+				delta -= (int64_t)1 << (8 * ofs_bytes); /* sign extend */
+			run += 1 + len_bytes + ofs_bytes;
+			length *= cluster;
+			if (length > bitmap_size - done) length = bitmap_size - done;
+			if (ofs_bytes == 0) /* sparse run, cannot happen for $Bitmap */
+				memset(bitmap + done, 0xFF, length);
+			else {
+				lcn += delta;
+				read_at(lcn * cluster, bitmap + done, length);
+			}
+			done += length;
+		}
+		if (done < bitmap_size) {
+			fprintf(stderr, "%s: NTFS $Bitmap runlist is short.\n", progname);
+			return -1;
+		}
+	}
+
+	mark_used(0, cluster); /* boot sector */
+	mark_bitmap(bitmap, total_clusters, 0, cluster);
+	/* The backup boot sector is behind the last cluster */
+	mark_used(total_clusters * cluster, device_size);
+	free(bitmap);
+	free(rec);
+	fprintf(stderr, "%s: NTFS, %" PRIu64 " clusters of %" PRIu64 " bytes.\n",
+	        progname, total_clusters, cluster);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat st;
+	uint64_t i, used = 0;
+	FILE *out;
+	int c;
+
+	progname = argv[0];
+	while ((c = getopt(argc, argv, "B:")) != -1) {
+		switch (c) {
+			case 'B':
+				block_size = strtoull(optarg, NULL, 0);
+				if (block_size < 512 || block_size % 512) usage();
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind != 2) usage();
+
+	handle = open(argv[optind], O_RDONLY|O_LARGEFILE);
+	if (handle < 0 || fstat(handle, &st) < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	device_size = st.st_size;
+#ifdef BLKGETSIZE64
+	if (S_ISBLK(st.st_mode) && ioctl(handle, BLKGETSIZE64, &device_size) < 0) {
+		perror("BLKGETSIZE64");
+		exit(1);
+	}
+#endif
+	total_blocks = (device_size + block_size - 1) / block_size;
+	usedmap = calloc(1, (total_blocks + 7) / 8 + 1);
+	if (!usedmap) { perror("malloc"); exit(1); }
+
+	if (device_size < 4096 ||
+	    (scan_ntfs() != 0 && scan_ext() != 0 && scan_fat() != 0)) {
+		fprintf(stderr, "%s: %s: unknown filesystem.\n", progname, argv[optind]);
+		exit(2);
+	}
+
+	for (i = 0; i < total_blocks; i++)
+		if (usedmap[i / 8] & (1 << (i % 8))) used++;
+	fprintf(stderr, "%s: %" PRIu64 " of %" PRIu64 " blocks in use (%d%%).\n",
+	        progname, used, total_blocks, total_blocks ? (int)(used * 100 / total_blocks) : 0);
+
+	out = strcmp(argv[optind + 1], "-") ? fopen(argv[optind + 1], "w") : stdout;
+	if (!out || fwrite(usedmap, 1, (total_blocks + 7) / 8, out) != (total_blocks + 7) / 8 ||
+	    fclose(out) != 0) {
+		perror(argv[optind + 1]);
+		exit(1);
+	}
+	return 0;
+}
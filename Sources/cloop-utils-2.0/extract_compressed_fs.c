@@ -1,18 +1,31 @@
 /* Extracts a filesystem back from a compressed cloop file */
 /* Extended to support stdin 31.5.2008 Klaus Knopper       */
+/* Multithreaded inflate with in-order pwrite() output      */
+/* All-zero blocks are discarded/punched instead of written */
+/* -d/-D: delta restore, only rewrite blocks that differ   */
+/* -c: verify blocks against the hash trailer of the image  */
+/* -w: streaming restore, keep a copy of the input stream   */
+/* zlib, LZMA and LZ4 images (cloop.h CLOOP_CODEC_*)        */
 /* License: GPL V2                                         */
 
+#define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
-#define _XOPEN_SOURCE 600
+#define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <endian.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <zlib.h>
 #include <netinet/in.h>
 #include <inttypes.h>
@@ -38,32 +51,792 @@ __bswap64(__uint64_t _x)
 #endif /* !be64toh */
 #define __be64_to_cpu be64toh
 #include "cloop.h"
+#include "cloop_hash.h"
+#include "cloop_lzma.h"
+#include "cloop_lz4.h"
 
-struct compressed_block
+#ifndef MIN
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#endif
+#ifndef MAX
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+#endif
+
+/* Slot states of the decompression ring, see extract_parallel() */
+#define SLOT_FREE     0 /* may be filled by the reader             */
+#define SLOT_READ     1 /* compressed data present, to be inflated */
+#define SLOT_INFLATED 2 /* uncompressed data present, to be written */
+
+struct slot
 {
-	size_t size;
-	void *data;
+	unsigned int block;      /* block number currently held   */
+	int size;                /* compressed size               */
+	uLongf destlen;          /* uncompressed size             */
+	int state;
+	unsigned char *compressed, *uncompressed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
 };
 
+static const char *progname;
+static int handle, output;
+static int be_quiet = 0;
+static int output_seekable = 0, output_isblk = 0, output_discard_zeroes = 0;
+static unsigned int total_blocks, compressed_buffer_size, uncompressed_buffer_size;
+static loff_t *offsets;
+static int codec, raw_blocks;
+static const char *codec_names[] = CLOOP_CODEC_NAMES;
+/* Probabilities of the LZMA decoder, one set per thread */
+static __thread unsigned short *lzma_probs;
+
+static struct slot *ring;
+static unsigned int ring_size;
+static unsigned int next_inflate = 0;
+static pthread_mutex_t inflate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* For statistics */
+static loff_t compressed_bytes = 0, uncompressed_bytes = 0;
+static unsigned int zero_blocks = 0;
+
+/* -d/-D/-c: block hashes of the image (CLOOP_TAIL_* hash_type, hash_size
+ * bytes each), size of the target */
+static unsigned char *hashes;
+static unsigned int hash_type, hash_size;
+static int verify = 0;
+static loff_t target_size;
+static unsigned int next_delta = 0;
+static unsigned int delta_blocks = 0, unused_blocks = 0, bad_blocks = 0;
+static pthread_mutex_t delta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* -w: copy of the compressed input, e.g. into the cache while
+ * restoring from a network stream */
+static int tee_fd = -1;
+static const char *tee_name;
+
+/* Pending run of all-zero blocks, written out by flush_zeros() */
+static loff_t zero_start = 0, zero_len = 0;
+static unsigned char *zero_buffer;
+
+/* read() may return less than requested on pipes and sockets */
+static ssize_t read_all(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = read(fd, (char *)buf + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return r;
+		}
+		if (r == 0) break;
+		done += r;
+	}
+	return done;
+}
+
+static ssize_t write_all(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = write(fd, (const char *)buf + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return r;
+		}
+		done += r;
+	}
+	return done;
+}
+
+static ssize_t pwrite_all(int fd, const void *buf, size_t len, off_t pos)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = pwrite(fd, (const char *)buf + done, len - done, pos + done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return r;
+		}
+		done += r;
+	}
+	return done;
+}
+
+/* Sequential read from the image, also copied to the -w file. If that
+ * fails (cache full), the restore goes on without the copy. */
+static ssize_t read_input(void *buf, size_t len)
+{
+	ssize_t r = read_all(handle, buf, len);
+	if (r > 0 && tee_fd >= 0 && write_all(tee_fd, buf, r) != r) {
+		perror("Writing copy of input");
+		fprintf(stderr, "%s: continuing without %s.\n", progname, tee_name);
+		close(tee_fd);
+		unlink(tee_name);
+		tee_fd = -1;
+	}
+	return r;
+}
+
+/* -w: the rest of the input after the last block (hash trailer) */
+static void finish_tee(void)
+{
+	unsigned char buf[65536];
+	ssize_t r;
+	if (tee_fd < 0) return;
+	while ((r = read_input(buf, sizeof(buf))) > 0);
+	if (tee_fd < 0) return;
+	if (r < 0 || fsync(tee_fd) != 0 || close(tee_fd) != 0) {
+		perror("Writing copy of input");
+		unlink(tee_name);
+	}
+	tee_fd = -1;
+}
+
+static int block_size(unsigned int i)
+{
+	int size = __be64_to_cpu(offsets[i+1]) - __be64_to_cpu(offsets[i]);
+	if (size < 0 || size > compressed_buffer_size) {
+		fprintf(stderr,
+			"%s: Size %d for block %u (offset %" PRIu64 ") wrong, corrupt data!\n",
+			progname, size, i, (uint64_t) __be64_to_cpu(offsets[i]));
+		exit(1);
+	}
+	return size;
+}
+
+static void read_block(unsigned int i, unsigned char *buffer, int size)
+{
+	if (CLOOP_BLOCK_IS_ZERO(size)) return;
+	if (read_input(buffer, size) != size) {
+		perror("Reading block");
+		fprintf(stderr, " %u (offset %" PRIu64 ") of size %d.\n", i,
+		     (uint64_t) __be64_to_cpu(offsets[i]), size);
+		exit(1);
+	}
+}
+
+static void inflate_block(unsigned int i, unsigned char *dest, uLongf *destlen,
+                          unsigned char *source, int size)
+{
+	*destlen = uncompressed_buffer_size;
+	if (CLOOP_BLOCK_IS_ZERO(size)) return;
+	if (raw_blocks && CLOOP_BLOCK_IS_RAW(size, uncompressed_buffer_size)) {
+		memcpy(dest, source, size);
+		return;
+	}
+	if (codec != CLOOP_CODEC_ZLIB) {
+		int err;
+		if (codec == CLOOP_CODEC_LZMA) {
+			if (lzma_probs == NULL &&
+			    (lzma_probs = malloc(CLOOP_LZMA_WORKSPACE)) == NULL) {
+				fprintf(stderr, "Uncomp: oom block %u\n", i);
+				exit(1);
+			}
+			err = cloop_lzma_decompress(lzma_probs, dest, destlen, source, size);
+		}
+		else
+			err = cloop_lz4_decompress(dest, destlen, source, size);
+		if (err) {
+			fprintf(stderr, "Uncomp: %s input corrupt %u\n", codec_names[codec], i);
+			exit(1);
+		}
+		return;
+	}
+	switch (uncompress(dest, destlen, source, size)) {
+		case Z_OK: break;
+
+		case Z_MEM_ERROR:
+			fprintf(stderr, "Uncomp: oom block %u\n", i);
+			exit(1);
+			break;
+
+		case Z_BUF_ERROR:
+			fprintf(stderr, "Uncomp: not enough out room %u\n", i);
+			exit(1);
+			break;
+
+		case Z_DATA_ERROR:
+			fprintf(stderr, "Uncomp: input corrupt %u\n", i);
+			exit(1);
+			break;
+
+		default:
+			fprintf(stderr, "Uncomp: unknown error %u\n", i);
+			exit(1);
+	}
+}
+
+/* Zero out len bytes at pos in the output without writing data, if the
+ * target supports it: discard (if it reads back as zeroes) or zeroout on
+ * block devices, punching a hole in regular files. */
+static int discard_range(loff_t pos, loff_t len)
+{
+#ifdef BLKZEROOUT
+	if (output_isblk) {
+		uint64_t range[2];
+		range[0] = pos; range[1] = len;
+		if (output_discard_zeroes && ioctl(output, BLKDISCARD, &range) == 0)
+			return 0;
+		return ioctl(output, BLKZEROOUT, &range);
+	}
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+	return fallocate(output, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, pos, len);
+#else
+	return -1;
+#endif
+}
+
+static void flush_zeros(void)
+{
+	if (zero_len == 0) return;
+	if (!output_seekable || discard_range(zero_start, zero_len) != 0) {
+		/* Fallback: write real zeroes */
+		loff_t done;
+		if (output_seekable) lseek(output, zero_start, SEEK_SET);
+		for (done = 0; done < zero_len; done += uncompressed_buffer_size) {
+			size_t n = MIN(zero_len - done, (loff_t)uncompressed_buffer_size);
+			if (write_all(output, zero_buffer, n) != n) {
+				perror("Writing output");
+				fprintf(stderr, " (zero block at %" PRIu64 ").\n",
+				        (uint64_t)(zero_start + done));
+				exit(1);
+			}
+		}
+	}
+	else
+		lseek(output, zero_start + zero_len, SEEK_SET);
+	zero_len = 0;
+}
+
+/* Collect consecutive zero blocks, so they can be discarded in one go */
+static void queue_zeros(loff_t pos, loff_t len)
+{
+	if (zero_len && zero_start + zero_len != pos) flush_zeros();
+	if (zero_len == 0) zero_start = pos;
+	zero_len += len;
+	++zero_blocks;
+}
+
+static void progress(unsigned int i)
+{
+	loff_t block_modulo = total_blocks / 10;
+	if (be_quiet) return;
+	if (block_modulo == 0) block_modulo = 1;
+	if(((i % block_modulo) == 0) || (i == (total_blocks - 1))) {
+		fprintf(stderr, "[Current block: %6u, In: %" PRIu64 "kB, Out: %" PRIu64 "kB, ratio %d%%, complete %3d%%]\n",
+		        i,
+		        (uint64_t) compressed_bytes / 1024L,
+		        (uint64_t) uncompressed_bytes / 1024L,
+		        compressed_bytes ? (int)((uncompressed_bytes * 100L) / compressed_bytes) : 0,
+		        total_blocks > 1 ? (int)(i * 100 / (total_blocks - 1)) : 100);
+	}
+}
+
+/* The original one-block-at-a-time loop, used for -t 1 */
+static void extract_serial(void)
+{
+	unsigned int i;
+	unsigned char *compressed_buffer, *uncompressed_buffer;
+
+	compressed_buffer = malloc(compressed_buffer_size);
+	if (compressed_buffer == NULL) {
+		perror("Out of memory for compressed buffer");
+		fprintf(stderr," (%d bytes).\n", compressed_buffer_size);
+		exit(1);
+	}
+
+	uncompressed_buffer = malloc(uncompressed_buffer_size);
+	if (uncompressed_buffer == NULL) {
+		perror("Out of memory for uncompressed buffer");
+		fprintf(stderr," (%d bytes).\n", uncompressed_buffer_size);
+		exit(1);
+	}
+
+	for (i = 0; i < total_blocks; i++) {
+		int size = block_size(i);
+		uLongf destlen;
+		read_block(i, compressed_buffer, size);
+		inflate_block(i, uncompressed_buffer, &destlen, compressed_buffer, size);
+		compressed_bytes += size; uncompressed_bytes += destlen;
+		progress(i);
+		if (CLOOP_BLOCK_IS_ZERO(size)) {
+			queue_zeros((loff_t)i * uncompressed_buffer_size, destlen);
+			continue;
+		}
+		flush_zeros();
+		if (write_all(output, uncompressed_buffer, destlen) != destlen) {
+			perror("Writing output");
+			exit(1);
+		}
+	}
+	flush_zeros();
+	/* Once at the end, like the writer thread */
+	if (output_seekable) fdatasync(output);
+	free(compressed_buffer);
+	free(uncompressed_buffer);
+}
+
+/* Wait until slot s has reached state, slot must be locked */
+static void slot_wait(struct slot *s, unsigned int block, int state)
+{
+	while (s->block != block || s->state != state)
+		pthread_cond_wait(&s->cond, &s->lock);
+}
+
+static void slot_set(struct slot *s, unsigned int block, int state)
+{
+	s->block = block;
+	s->state = state;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Workers pick up blocks strictly in ascending order, so a slot is
+ * always claimed by exactly one worker and the writer never waits
+ * for a block that nobody is working on. */
+static void *inflate_worker(void *arg)
+{
+	while (1) {
+		struct slot *s;
+		unsigned int i;
+		pthread_mutex_lock(&inflate_lock);
+		i = next_inflate++;
+		pthread_mutex_unlock(&inflate_lock);
+		if (i >= total_blocks) break;
+		s = &ring[i % ring_size];
+		pthread_mutex_lock(&s->lock);
+		slot_wait(s, i, SLOT_READ);
+		pthread_mutex_unlock(&s->lock);
+		inflate_block(i, s->uncompressed, &s->destlen, s->compressed, s->size);
+		pthread_mutex_lock(&s->lock);
+		slot_set(s, i, SLOT_INFLATED);
+	}
+	return NULL;
+}
+
+/* Output is written strictly in block order. Seekable targets get a
+ * pwrite() to the known block position, pipes a plain write(). */
+static void *output_writer(void *arg)
+{
+	unsigned int i;
+	for (i = 0; i < total_blocks; i++) {
+		struct slot *s = &ring[i % ring_size];
+		ssize_t written;
+		pthread_mutex_lock(&s->lock);
+		slot_wait(s, i, SLOT_INFLATED);
+		pthread_mutex_unlock(&s->lock);
+		if (CLOOP_BLOCK_IS_ZERO(s->size)) {
+			queue_zeros((loff_t)i * uncompressed_buffer_size, s->destlen);
+			written = s->destlen;
+		}
+		else if (output_seekable) {
+			flush_zeros();
+			written = pwrite_all(output, s->uncompressed, s->destlen,
+			                     (off_t)i * uncompressed_buffer_size);
+		}
+		else {
+			flush_zeros();
+			written = write_all(output, s->uncompressed, s->destlen);
+		}
+		if (written != s->destlen) {
+			perror("Writing output");
+			fprintf(stderr, " block %u.\n", i);
+			exit(1);
+		}
+		compressed_bytes += s->size; uncompressed_bytes += s->destlen;
+		progress(i);
+		pthread_mutex_lock(&s->lock);
+		/* Hand the slot over to block i + ring_size */
+		slot_set(s, i + ring_size, SLOT_FREE);
+	}
+	flush_zeros();
+	if (output_seekable) fdatasync(output);
+	return NULL;
+}
+
+/* One reader (the main thread), n inflate workers, one writer */
+static void extract_parallel(int threads)
+{
+	unsigned int i;
+	pthread_t writer, *workers;
+
+	ring_size = 2 * threads + 2;
+	ring = calloc(ring_size, sizeof(struct slot));
+	workers = calloc(threads, sizeof(pthread_t));
+	if (ring == NULL || workers == NULL) {
+		perror("Out of memory for decompression ring");
+		exit(1);
+	}
+	for (i = 0; i < ring_size; i++) {
+		struct slot *s = &ring[i];
+		s->block = i;
+		s->state = SLOT_FREE;
+		s->compressed = malloc(compressed_buffer_size);
+		s->uncompressed = malloc(uncompressed_buffer_size);
+		if (s->compressed == NULL || s->uncompressed == NULL) {
+			perror("Out of memory for block buffers");
+			fprintf(stderr, " (%u slots of %d bytes).\n", ring_size,
+			        compressed_buffer_size + uncompressed_buffer_size);
+			exit(1);
+		}
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+	}
+
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&workers[i], NULL, inflate_worker, NULL)) {
+			perror("Creating inflate thread");
+			exit(1);
+		}
+	if (pthread_create(&writer, NULL, output_writer, NULL)) {
+		perror("Creating output thread");
+		exit(1);
+	}
+
+	for (i = 0; i < total_blocks; i++) {
+		struct slot *s = &ring[i % ring_size];
+		int size = block_size(i);
+		pthread_mutex_lock(&s->lock);
+		slot_wait(s, i, SLOT_FREE);
+		pthread_mutex_unlock(&s->lock);
+		read_block(i, s->compressed, size);
+		s->size = size;
+		pthread_mutex_lock(&s->lock);
+		slot_set(s, i, SLOT_READ);
+	}
+
+	for (i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+	pthread_join(writer, NULL);
+	free(workers);
+}
+
+static int hash_unused(const unsigned char *hash)
+{
+	unsigned int i;
+	for (i = 0; i < hash_size; i++)
+		if (hash[i]) return 0;
+	return 1;
+}
+
+static ssize_t pread_all(int fd, void *buf, size_t len, off_t pos)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = pread(fd, (char *)buf + done, len - done, pos + done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return r;
+		}
+		if (r == 0) break;
+		done += r;
+	}
+	return done;
+}
+
+/* -d/-D: each thread claims the next block, reads it from the target and
+ * only if its hash differs from the table, reads the compressed block
+ * from the image and rewrites it. -c: inflates every block and compares
+ * its hash. Blocks unused in the image (all zero hash) are left alone. */
+static void *delta_worker(void *arg)
+{
+	unsigned char *compressed, *uncompressed, *current;
+	unsigned char digest[16];
+	loff_t in = 0, out = 0;
+	unsigned int rewritten = 0, unused = 0, bad = 0;
+
+	compressed = malloc(compressed_buffer_size);
+	uncompressed = malloc(uncompressed_buffer_size);
+	current = malloc(uncompressed_buffer_size);
+	if (compressed == NULL || uncompressed == NULL || current == NULL) {
+		perror("Out of memory for delta buffers");
+		exit(1);
+	}
+
+	for (;;) {
+		unsigned int i;
+		loff_t pos;
+		ssize_t got;
+		size_t len;
+		int size;
+		uLongf destlen;
+		const unsigned char *data, *hash;
+
+		pthread_mutex_lock(&delta_lock);
+		i = next_delta++;
+		pthread_mutex_unlock(&delta_lock);
+		if (i >= total_blocks) break;
+
+		hash = hashes + (size_t)i * hash_size;
+		if (hash_unused(hash)) {
+			++unused;
+			continue;
+		}
+		pos = (loff_t)i * uncompressed_buffer_size;
+		len = uncompressed_buffer_size;
+		if (!verify) {
+			/* The image pads the last block with zeroes, the target may end there */
+			if (target_size > pos && target_size - pos < (loff_t)len)
+				len = target_size - pos;
+			got = pos < target_size ? pread_all(output, current, len, pos) : 0;
+			if (got < 0) {
+				perror("Reading output");
+				fprintf(stderr, " (block %u).\n", i);
+				exit(1);
+			}
+			if (got == len) {
+				memset(current + got, 0, uncompressed_buffer_size - got);
+				cloop_digest(hash_type, digest, current, uncompressed_buffer_size);
+				if (!memcmp(digest, hash, hash_size))
+					continue;
+			}
+		}
+
+		size = block_size(i);
+		if (CLOOP_BLOCK_IS_ZERO(size)) {
+			data = zero_buffer;
+			if (!verify && discard_range(pos, len) == 0)
+				goto rewritten;
+		}
+		else {
+			if (pread_all(handle, compressed, size, __be64_to_cpu(offsets[i])) != size) {
+				perror("Reading block");
+				fprintf(stderr, " %u (offset %" PRIu64 ") of size %d.\n", i,
+				        (uint64_t) __be64_to_cpu(offsets[i]), size);
+				exit(1);
+			}
+			inflate_block(i, uncompressed, &destlen, compressed, size);
+			data = uncompressed;
+			in += size;
+		}
+		if (verify) {
+			cloop_digest(hash_type, digest, data, uncompressed_buffer_size);
+			if (memcmp(digest, hash, hash_size)) {
+				fprintf(stderr, "%s: block %u (offset %" PRIu64 ") does not match its hash.\n",
+				        progname, i, (uint64_t) __be64_to_cpu(offsets[i]));
+				++bad;
+			}
+			out += len;
+			continue;
+		}
+		if (pwrite_all(output, data, len, pos) != len) {
+			perror("Writing output");
+			fprintf(stderr, " (block %u).\n", i);
+			exit(1);
+		}
+rewritten:
+		out += len;
+		++rewritten;
+	}
+
+	pthread_mutex_lock(&delta_lock);
+	compressed_bytes += in;
+	uncompressed_bytes += out;
+	delta_blocks += rewritten;
+	unused_blocks += unused;
+	bad_blocks += bad;
+	pthread_mutex_unlock(&delta_lock);
+	free(compressed);
+	free(uncompressed);
+	free(current);
+	return NULL;
+}
+
+static void extract_delta(int threads)
+{
+	int i;
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	if (workers == NULL) {
+		perror("Out of memory for threads");
+		exit(1);
+	}
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&workers[i], NULL, delta_worker, NULL) != 0) {
+			perror("Creating thread");
+			exit(1);
+		}
+	for (i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+	free(workers);
+}
+
+/* Reads the table written by create_compressed_fs -H, exits with 2 if it
+ * was made for another image */
+static void load_hashes(const char *name, const struct cloop_head *head)
+{
+	struct cloop_hash_head hh;
+	size_t n = (size_t)total_blocks * sizeof(uint64_t);
+	size_t headlen = sizeof(*head) + (total_blocks + 1) * sizeof(loff_t);
+	unsigned char *buf;
+	int fd = open(name, O_RDONLY);
+	if (fd < 0 || read_all(fd, &hh, sizeof(hh)) != sizeof(hh)) {
+		perror("Reading hash table");
+		exit(1);
+	}
+	if (memcmp(hh.magic, CLOOP_HASH_MAGIC, sizeof(hh.magic)) ||
+	    ntohl(hh.block_size) != uncompressed_buffer_size ||
+	    ntohl(hh.num_blocks) != total_blocks) {
+		fprintf(stderr, "%s: %s does not belong to this image.\n", progname, name);
+		exit(2);
+	}
+	buf = malloc(headlen);
+	if (buf == NULL) {
+		perror("Out of memory for hash table");
+		exit(1);
+	}
+	memcpy(buf, head, sizeof(*head));
+	memcpy(buf + sizeof(*head), offsets, headlen - sizeof(*head));
+	if (cloop_xxh64(buf, headlen) != be64toh(hh.image_sum)) {
+		fprintf(stderr, "%s: %s was made for another image.\n", progname, name);
+		exit(2);
+	}
+	free(buf);
+	/* Same encoding as CLOOP_TAIL_XXH64 */
+	hash_type = CLOOP_TAIL_XXH64;
+	hash_size = sizeof(uint64_t);
+	hashes = malloc(n);
+	if (hashes == NULL) {
+		perror("Out of memory for hash table");
+		exit(1);
+	}
+	if (read_all(fd, hashes, n) != n) {
+		perror("Reading hash table");
+		exit(1);
+	}
+	close(fd);
+}
+
+/* Reads and checks the trailer of the image (create_compressed_fs -T),
+ * exits with 2 if there is none, 1 if it is damaged. */
+static void load_tail(const struct cloop_head *head)
+{
+	struct cloop_tail tail;
+	struct stat st;
+	loff_t end = __be64_to_cpu(offsets[total_blocks]);
+	size_t n, headlen;
+	unsigned char *buf;
+
+	if (fstat(handle, &st) != 0 || st.st_size == end) {
+		fprintf(stderr, "%s: image has no hash trailer (create_compressed_fs -T).\n", progname);
+		exit(2);
+	}
+	if (pread_all(handle, &tail, sizeof(tail), end) != sizeof(tail) ||
+	    memcmp(tail.magic, CLOOP_TAIL_MAGIC, sizeof(tail.magic)) ||
+	    ntohl(tail.version) != CLOOP_TAIL_VERSION ||
+	    ntohl(tail.num_blocks) != total_blocks ||
+	    st.st_size != end + CLOOP_TAIL_SIZE(&tail)) {
+		fprintf(stderr, "%s: hash trailer missing or damaged.\n", progname);
+		exit(1);
+	}
+	hash_type = ntohl(tail.hash_type);
+	hash_size = ntohl(tail.hash_size);
+	if (hash_size == 0 || hash_size != cloop_digest_size(hash_type)) {
+		fprintf(stderr, "%s: unknown hash type %u in trailer.\n", progname, hash_type);
+		exit(1);
+	}
+
+	/* head_sum: header, offsets and the trailer up to head_sum */
+	headlen = sizeof(*head) + (total_blocks + 1) * sizeof(loff_t);
+	n = (size_t)total_blocks * hash_size;
+	buf = malloc(MAX(headlen + offsetof(struct cloop_tail, head_sum), n));
+	hashes = malloc(n);
+	if (buf == NULL || hashes == NULL) {
+		perror("Out of memory for hash table");
+		exit(1);
+	}
+	memcpy(buf, head, sizeof(*head));
+	memcpy(buf + sizeof(*head), offsets, headlen - sizeof(*head));
+	memcpy(buf + headlen, &tail, offsetof(struct cloop_tail, head_sum));
+	if (cloop_xxh64(buf, headlen + offsetof(struct cloop_tail, head_sum)) !=
+	    be64toh(tail.head_sum)) {
+		fprintf(stderr, "%s: header checksum mismatch, image is damaged.\n", progname);
+		exit(1);
+	}
+	if (pread_all(handle, hashes, n, end + sizeof(tail)) != n ||
+	    cloop_xxh64(hashes, n) != be64toh(tail.table_sum)) {
+		fprintf(stderr, "%s: hash table checksum mismatch, image is damaged.\n", progname);
+		exit(1);
+	}
+	free(buf);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Syntax: %s [-t threads] [-q] [-w copyfile|-d hashfile|-D] infile outfile,\n"
+	                "        use \"-\" for stdin/stdout.\n"
+	                "        %s [-t threads] -c infile\n"
+	                "  -t N  Number of inflate threads (default: number of CPUs, 1: serial loop)\n"
+	                "  -q    Don't print progress, only the final summary\n"
+	                "  -w F  Also write the compressed input to F, e.g. to keep a copy of an\n"
+	                "        image that is restored while it is received on stdin\n"
+	                "  -d F  Delta restore: outfile already holds an older version, only rewrite\n"
+	                "        blocks whose hash differs from table F (create_compressed_fs -H)\n"
+	                "  -D    Delta restore with the hashes in the image (create_compressed_fs -T)\n"
+	                "  -c    Check the image against the hashes in its trailer\n",
+	                progname, progname);
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-	int handle, output;
-	unsigned int i, total_blocks, total_offsets, offsets_size,
-	    compressed_buffer_size, uncompressed_buffer_size;
+	int c, threads = 1, delta = 0;
+	const char *hashfile = NULL;
+	unsigned int total_offsets, offsets_size;
 	struct cloop_head head;
-	unsigned char *compressed_buffer, *uncompressed_buffer;
-	loff_t *offsets;
-	/* For statistics */
-	loff_t compressed_bytes, uncompressed_bytes, block_modulo;
+	struct stat st;
+	struct timeval start, end;
+	double elapsed;
 
-	if (argc != 3) {
-		fprintf(stderr, "Syntax: %s infile outfile, use \"-\" for stdin/stdout.\n", argv[0]);
+	progname = argv[0];
+#ifdef _SC_NPROCESSORS_ONLN
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) threads = 1;
+#endif
+
+	while ((c = getopt(argc, argv, "t:qd:Dcw:")) != -1) {
+		switch (c) {
+			case 't':
+				threads = atoi(optarg);
+				if (threads < 1) usage();
+				break;
+			case 'q':
+				be_quiet = 1;
+				break;
+			case 'd':
+				hashfile = optarg;
+				delta = 1;
+				break;
+			case 'D':
+				delta = 1;
+				break;
+			case 'c':
+				verify = 1;
+				break;
+			case 'w':
+				tee_name = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (argc - optind != (verify ? 1 : 2) || (verify && delta) ||
+	    (tee_name && (verify || delta))) usage();
+	if ((delta || verify) && (!strcmp(argv[optind],"-") ||
+	                          (delta && !strcmp(argv[optind+1],"-")))) {
+		fprintf(stderr, "%s: -d, -D and -c need seekable files, not stdin/stdout.\n", progname);
 		exit(1);
 	}
 
-	if(!strcmp(argv[1],"-")) handle = STDIN_FILENO;
+	if(!strcmp(argv[optind],"-")) {
+		handle = STDIN_FILENO;
+#ifdef F_SETPIPE_SZ
+		/* Absorb bursts of a network stream (udp-receiver, nc) while
+		 * the inflate threads are busy */
+		if (fstat(handle, &st) == 0 && S_ISFIFO(st.st_mode))
+			fcntl(handle, F_SETPIPE_SZ, 1024 * 1024);
+#endif
+	}
 	else {
-		handle = open(argv[1], O_RDONLY|O_LARGEFILE);
+		handle = open(argv[optind], O_RDONLY|O_LARGEFILE);
 		if (handle < 0) {
 			perror("Opening compressed input file\n");
 			exit(1);
@@ -71,12 +844,24 @@ int main(int argc, char *argv[])
 		/* Never ever attempt to cache file content in
 		 * filesystem cache, since we really need it just ONCE. */
 		fdatasync(handle);
-		posix_fadvise(handle, 0, 0, POSIX_FADV_DONTNEED|POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(handle, 0, 0, delta ? POSIX_FADV_RANDOM :
+		              POSIX_FADV_DONTNEED|POSIX_FADV_SEQUENTIAL);
+	}
+
+	if (tee_name) {
+		tee_fd = open(tee_name, O_CREAT|O_TRUNC|O_WRONLY|O_LARGEFILE,
+		              S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+		if (tee_fd < 0) {
+			perror("Opening copy of input");
+			exit(1);
+		}
 	}
 
-	if(!strcmp(argv[2],"-")) output = STDOUT_FILENO;
+	if (verify) output = -1;
+	else if(!strcmp(argv[optind+1],"-")) output = STDOUT_FILENO;
 	else {
-		output = open(argv[2], O_CREAT|O_WRONLY|O_LARGEFILE,
+		output = open(argv[optind+1], delta ? O_RDWR|O_LARGEFILE :
+		                       O_CREAT|O_WRONLY|O_LARGEFILE,
 		                       S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
 		if (output < 0) {
 			perror("Opening uncompressed output file\n");
@@ -88,37 +873,53 @@ int main(int argc, char *argv[])
 		posix_fadvise(output, 0, 0, POSIX_FADV_DONTNEED|POSIX_FADV_SEQUENTIAL);
 	}
 
+	/* pwrite() only works on regular files and block devices,
+	 * and only if we start writing at position 0. */
+	if (fstat(output, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) &&
+	    lseek(output, 0, SEEK_CUR) == 0) {
+		output_seekable = 1;
+		output_isblk = S_ISBLK(st.st_mode);
+#ifdef BLKDISCARDZEROES
+		if (output_isblk) {
+			unsigned int zeroes = 0;
+			if (ioctl(output, BLKDISCARDZEROES, &zeroes) == 0)
+				output_discard_zeroes = zeroes;
+		}
+#endif
+	}
 
-	if (read(handle, &head, sizeof(head)) != sizeof(head)) {
+	if (read_input(&head, sizeof(head)) != sizeof(head)) {
 		perror("Reading compressed file header\n");
 		exit(1);
 	}
 
 	total_blocks = ntohl(head.num_blocks);
 	uncompressed_buffer_size = ntohl(head.block_size);
+	codec = CLOOP_CODEC(&head);
+	raw_blocks = CLOOP_RAW_BLOCKS(&head);
+	if (codec > CLOOP_CODEC_MAX) {
+		fprintf(stderr, "%s: unknown codec %d in a version %c image.\n",
+		        progname, codec, head.preamble[0x0C]);
+		exit(1);
+	}
 
-	fprintf(stderr, "%s: compressed input has %u blocks of size %u.\n",
-		argv[0], total_blocks, uncompressed_buffer_size);
+	fprintf(stderr, "%s: compressed input has %u blocks of size %u (%s).\n",
+		progname, total_blocks, uncompressed_buffer_size, codec_names[codec]);
 
 
 	/* The maximum size of a compressed block, due to the
 	 * specification of uncompress() */
-	compressed_buffer_size = uncompressed_buffer_size + uncompressed_buffer_size/1000 + 12 + 4;
-	compressed_buffer = malloc(compressed_buffer_size);
-	if (compressed_buffer == NULL) {
-		perror("Out of memory for compressed buffer");
-		fprintf(stderr," (%d bytes).\n", compressed_buffer_size);
-		exit(1);
-	}
+	if (codec == CLOOP_CODEC_ZLIB)
+		compressed_buffer_size = uncompressed_buffer_size + uncompressed_buffer_size/1000 + 12 + 4;
+	else
+		compressed_buffer_size = CLOOP_CODEC_MAXLEN(uncompressed_buffer_size);
 
-	uncompressed_buffer = malloc(uncompressed_buffer_size);
-	if (uncompressed_buffer == NULL) {
-		perror("Out of memory for uncompressed buffer");
-		fprintf(stderr," (%d bytes).\n", uncompressed_buffer_size);
+	zero_buffer = calloc(1, uncompressed_buffer_size);
+	if (zero_buffer == NULL) {
+		perror("Out of memory for zero buffer");
 		exit(1);
 	}
 
-
 	/* Store block index in memory to avoid seek()ing a lot */
 	total_offsets  = total_blocks + 1;
 	offsets_size = total_offsets * sizeof(loff_t);
@@ -129,88 +930,67 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (read(handle, offsets, offsets_size) != offsets_size) {
+	if (read_input(offsets, offsets_size) != offsets_size) {
 		perror("Reading offsets");
 		fprintf(stderr, " (%d bytes).\n", offsets_size);
 		exit(1);
 	}
-	
-	for (i = 0, compressed_bytes=0, uncompressed_bytes=0, block_modulo = total_blocks / 10;
-	     i < total_blocks;
-	     i++) {
-                int size = __be64_to_cpu(offsets[i+1]) - __be64_to_cpu(offsets[i]);
-		uLongf destlen = uncompressed_buffer_size;
-		if (size < 0 || size > compressed_buffer_size) {
-			fprintf(stderr, 
-				"%s: Size %d for block %u (offset %" PRIu64 ") wrong, corrupt data!\n",
-				argv[0], size, i, (uint64_t) __be64_to_cpu(offsets[i]));
-			exit(1);
-		}
-		if(read(handle, compressed_buffer, size) != size) {
-			perror("Reading block");
-			fprintf(stderr, " %u (offset %" PRIu64 ") of size %d.\n", i,
-			     (uint64_t) __be64_to_cpu(offsets[i]), size);
+
+	if (verify)
+		load_tail(&head);
+	if (delta) {
+		if (!output_seekable) {
+			fprintf(stderr, "%s: -d needs a regular file or block device as outfile.\n", progname);
 			exit(1);
 		}
-
-#if 0 /* DEBUG */
-		if (i == 3) {
-			fprintf(stderr,
-				"Block head:%02X%02X%02X%02X%02X%02X%02X%02X\n",
-				buffer[0],
-				buffer[1],
-				buffer[2],
-				buffer[3],
-				buffer[4],
-				buffer[5],
-				buffer[6],
-				buffer[7]);
-			fprintf(stderr,
-				"Block tail:%02X%02X%02X%02X%02X%02X%02X%02X\n",
-				buffer[3063],
-				buffer[3064],
-				buffer[3065],
-				buffer[3066],
-				buffer[3067],
-				buffer[3068],
-				buffer[3069],
-				buffer[3070]);
+		if (hashfile) load_hashes(hashfile, &head);
+		else load_tail(&head);
+		target_size = output_isblk ? 0 : st.st_size;
+#ifdef BLKGETSIZE64
+		if (output_isblk) {
+			uint64_t bytes = 0;
+			ioctl(output, BLKGETSIZE64, &bytes);
+			target_size = bytes;
 		}
 #endif
-		switch (uncompress(uncompressed_buffer, &destlen,
-				   compressed_buffer, size)) {
-			case Z_OK: break;
-
-			case Z_MEM_ERROR:
-				fprintf(stderr, "Uncomp: oom block %u\n", i);
-				exit(1);
-				break;
+	}
 
-			case Z_BUF_ERROR:
-				fprintf(stderr, "Uncomp: not enough out room %u\n", i);
-				exit(1);
-				break;
+	gettimeofday(&start, NULL);
+	if (delta || verify)
+		extract_delta(threads);
+	else if (threads > 1 && total_blocks > 1)
+		extract_parallel(threads);
+	else
+		extract_serial();
+	gettimeofday(&end, NULL);
+	finish_tee();
 
-			case Z_DATA_ERROR:
-				fprintf(stderr, "Uncomp: input corrupt %u\n", i);
-				exit(1);
-				break;
+	/* Trailing zero blocks were punched, not written, extend the file. */
+	if (output_seekable && !output_isblk && !delta &&
+	    fstat(output, &st) == 0 && st.st_size < uncompressed_bytes)
+		ftruncate(output, uncompressed_bytes);
 
-			default:
-				fprintf(stderr, "Uncomp: unknown error %u\n", i);
-				exit(1);
-		}
-		compressed_bytes += size; uncompressed_bytes += destlen;
-		if(((i % block_modulo) == 0) || (i == (total_blocks - 1))) {
-			fprintf(stderr, "[Current block: %6u, In: %" PRIu64 "kB, Out: %" PRIu64 "kB, ratio %d%%, complete %3d%%]\n",
-			        i, 
-              (uint64_t) compressed_bytes / 1024L,
-              (uint64_t) uncompressed_bytes / 1024L,
-				(int)((uncompressed_bytes * 100L) / compressed_bytes),
-				(int)(i * 100 / (total_blocks - 1)));
-		}
-		write(output, uncompressed_buffer, destlen);
-		fdatasync(output);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	if (elapsed <= 0) elapsed = 0.000001;
+	fprintf(stderr, "%s: %u blocks, In: %" PRIu64 "kB, Out: %" PRIu64 "kB in %.2fs "
+	        "(%.1f MB/s out, %d thread%s).\n",
+	        progname, total_blocks,
+	        (uint64_t) compressed_bytes / 1024L,
+	        (uint64_t) uncompressed_bytes / 1024L,
+	        elapsed, uncompressed_bytes / elapsed / 1048576.0,
+	        threads, threads == 1 ? "" : "s");
+	if (verify) {
+		fprintf(stderr, "%s: %u blocks verified, %u bad, %u unused in the image.\n",
+		        progname, total_blocks - unused_blocks, bad_blocks, unused_blocks);
+		return bad_blocks ? 1 : 0;
 	}
+	if (delta)
+		fprintf(stderr, "%s: %u blocks rewritten, %u unchanged, %u unused in the image.\n",
+		        progname, delta_blocks, total_blocks - delta_blocks - unused_blocks,
+		        unused_blocks);
+	if (zero_blocks)
+		fprintf(stderr, "%s: %u zero blocks (%" PRIu64 "kB) discarded instead of written.\n",
+		        progname, zero_blocks,
+		        (uint64_t) zero_blocks * uncompressed_buffer_size / 1024L);
 	return 0;
 }
@@ -497,6 +497,18 @@ void fuse_destroy(struct fuse *f);
  */
 int fuse_loop(struct fuse *f);
 
+/**
+ * FUSE event loop with multiple threads
+ *
+ * Requests from the kernel are processed in parallel by @threads
+ * worker threads.  The filesystem operations must be thread safe.
+ *
+ * @param f the FUSE handle
+ * @param threads the number of worker threads
+ * @return 0 if no error occurred, -1 otherwise
+ */
+int fuse_loop_mt(struct fuse *f, int threads);
+
 /**
  * Exit from event loop
  *
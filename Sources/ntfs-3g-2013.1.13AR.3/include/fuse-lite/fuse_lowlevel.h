@@ -1241,9 +1241,11 @@ int fuse_session_loop(struct fuse_session *se);
  * Enter a multi-threaded event loop
  *
  * @param se the session
+ * @param threads the number of worker threads, 1 or less runs
+ *        fuse_session_loop()
  * @return 0 on success, -1 on error
  */
-int fuse_session_loop_mt(struct fuse_session *se);
+int fuse_session_loop_mt(struct fuse_session *se, int threads);
 
 /* ----------------------------------------------------------- *
  * Channel interface					       *
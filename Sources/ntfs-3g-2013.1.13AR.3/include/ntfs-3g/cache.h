@@ -72,6 +72,7 @@ enum {
 typedef int (*cache_compare)(const struct CACHED_GENERIC *cached,
 				const struct CACHED_GENERIC *item);
 typedef void (*cache_free)(const struct CACHED_GENERIC *cached);
+	/* any non-negative value, reduced to the table size by the cache */
 typedef int (*cache_hash)(const struct CACHED_GENERIC *cached);
 
 struct HASH_ENTRY {
@@ -92,6 +93,7 @@ struct CACHE_HEADER {
 	unsigned long writes;
 	unsigned long hits;
 	int fixed_size;
+	int item_count;
 	int max_hash;
 	struct CACHED_GENERIC entry[0];
 } ;
@@ -112,6 +114,8 @@ int ntfs_remove_cache(struct CACHE_HEADER *cache,
 			struct CACHED_GENERIC *item, int flags);
 
 void ntfs_create_lru_caches(ntfs_volume *vol);
+int ntfs_resize_lru_caches(ntfs_volume *vol, int inode_size,
+			int nidata_size, int lookup_size);
 void ntfs_free_lru_caches(ntfs_volume *vol);
 
 #endif /* _NTFS_CACHE_H_ */
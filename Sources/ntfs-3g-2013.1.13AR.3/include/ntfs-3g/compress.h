@@ -37,5 +37,13 @@ extern s64 ntfs_compressed_pwrite(ntfs_attr *na, runlist_element *brl, s64 wpos,
 extern int ntfs_compressed_close(ntfs_attr *na, runlist_element *brl,
 				s64 offs, VCN *update_from);
 
+/* The LZNT1 coding of a 4096-byte block and of a compression block */
+
+extern unsigned int ntfs_compress_block(const char *inbuf, int bufsize,
+				char *outbuf);
+
+extern int ntfs_decompress(u8 *dest, const u32 dest_size,
+				u8 *const cb_start, const u32 cb_size);
+
 #endif /* defined _NTFS_COMPRESS_H */
 
@@ -27,6 +27,7 @@
 #define CACHE_LOOKUP_SIZE 64	/* lookup cache, zero or >= 3 and not too big */
 #define CACHE_SECURID_SIZE 16    /* securid cache, zero or >= 3 and not too big */
 #define CACHE_LEGACY_SIZE 8    /* legacy cache size, zero or >= 3 and not too big */
+#define CACHE_MAX_SIZE 1048576 /* upper limit for the cache size options */
 
 #define FORCE_FORMAT_v1x 0	/* Insert security data as in NTFS v1.x */
 #define OWNERFROMACL 1		/* Get the owner from ACL (not Windows owner) */
@@ -55,6 +56,10 @@ enum {
  */
 
 #define DEFAULT_DMTIME 60 /* default 1mn for delay_mtime */
+#define MAX_FUSE_THREADS 32 /* upper limit for the threads option */
+#define DEFAULT_DELAY_ALLOC 16 /* default MB per file for delay_alloc */
+#define MAX_DELAY_ALLOC 256 /* upper limit for delay_alloc, in MB */
+#define DELAY_ALLOC_FILES 16 /* files with delayed writes at once */
 
 /*
  *		Use of big write buffers
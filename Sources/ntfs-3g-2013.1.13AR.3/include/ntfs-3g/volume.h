@@ -42,6 +42,7 @@
 #ifdef HAVE_MNTENT_H
 #include <mntent.h>
 #endif
+#include <pthread.h>
 
 /* Forward declaration */
 typedef struct _ntfs_volume ntfs_volume;
@@ -275,7 +276,12 @@ struct _ntfs_volume {
 #if CACHE_LEGACY_SIZE
 	struct CACHE_HEADER *legacy_cache;
 #endif
-
+	BOOL locking;		/* vol_lock and cache_lock are in use, see
+				   ntfs_volume_set_locking() */
+	pthread_rwlock_t vol_lock; /* Shared for lookups and reads, exclusive
+				   for anything else. */
+	pthread_mutex_t cache_lock; /* Protects the inode and lookup caches,
+				   which shared holders of vol_lock update. */
 };
 
 extern const char *ntfs_home;
@@ -309,5 +315,12 @@ extern int ntfs_set_shown_files(ntfs_volume *vol,
 extern int ntfs_set_locale(void);
 extern int ntfs_set_ignore_case(ntfs_volume *vol);
 
+extern int ntfs_volume_set_locking(ntfs_volume *vol);
+extern void ntfs_volume_lock_shared(ntfs_volume *vol);
+extern void ntfs_volume_lock_exclusive(ntfs_volume *vol);
+extern void ntfs_volume_unlock(ntfs_volume *vol);
+extern void ntfs_volume_cache_lock(ntfs_volume *vol);
+extern void ntfs_volume_cache_unlock(ntfs_volume *vol);
+
 #endif /* defined _NTFS_VOLUME_H */
 
@@ -11,7 +11,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 int fuse_session_loop(struct fuse_session *se)
 {
@@ -38,3 +42,114 @@ int fuse_session_loop(struct fuse_session *se)
     fuse_session_reset(se);
     return res < 0 ? -1 : 0;
 }
+
+struct fuse_mt {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    sem_t finish;
+    int error;
+};
+
+struct fuse_worker {
+    struct fuse_mt *mt;
+    pthread_t thread;
+    char *buf;
+    size_t bufsize;
+};
+
+static void *fuse_do_work(void *data)
+{
+    struct fuse_worker *w = (struct fuse_worker *) data;
+    struct fuse_mt *mt = w->mt;
+
+    while (!fuse_session_exited(mt->se)) {
+        struct fuse_chan *ch = mt->ch;
+        int res;
+
+        /* Only cancel a worker while it waits for a request */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_chan_recv(&ch, w->buf, w->bufsize);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            if (res < 0)
+                mt->error = -1;
+            fuse_session_exit(mt->se);
+            break;
+        }
+        fuse_session_process(mt->se, w->buf, res, ch);
+    }
+
+    sem_post(&mt->finish);
+    return NULL;
+}
+
+/*
+ * Each worker reads a request from the channel into its own buffer and
+ * processes it, so up to @threads requests run at once.  The filesystem
+ * has to do its own locking.  Signals are handled by the calling thread,
+ * which stops the workers when the session exits.
+ */
+int fuse_session_loop_mt(struct fuse_session *se, int threads)
+{
+    struct fuse_mt mt;
+    struct fuse_worker *workers;
+    sigset_t newset, oldset;
+    int started = 0;
+    int i, err;
+
+    if (threads <= 1)
+        return fuse_session_loop(se);
+
+    mt.se = se;
+    mt.ch = fuse_session_next_chan(se, NULL);
+    mt.error = 0;
+    workers = (struct fuse_worker *) calloc(threads, sizeof(*workers));
+    if (!workers || sem_init(&mt.finish, 0, 0)) {
+        fprintf(stderr, "fuse: failed to set up worker threads\n");
+        free(workers);
+        return -1;
+    }
+
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    for (i = 0; i < threads; i++) {
+        struct fuse_worker *w = &workers[i];
+
+        w->mt = &mt;
+        w->bufsize = fuse_chan_bufsize(mt.ch);
+        w->buf = (char *) malloc(w->bufsize);
+        if (!w->buf) {
+            fprintf(stderr, "fuse: failed to allocate read buffer\n");
+            break;
+        }
+        err = pthread_create(&w->thread, NULL, fuse_do_work, w);
+        if (err) {
+            fprintf(stderr, "fuse: error creating thread: %s\n",
+                    strerror(err));
+            free(w->buf);
+            break;
+        }
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (started == threads) {
+        /* sem_wait() is interrupted by the exit signals */
+        while (!fuse_session_exited(se))
+            sem_wait(&mt.finish);
+    } else
+        mt.error = -1;
+
+    for (i = 0; i < started; i++)
+        pthread_cancel(workers[i].thread);
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].buf);
+    }
+    sem_destroy(&mt.finish);
+    free(workers);
+    fuse_session_reset(se);
+    return mt.error;
+}
@@ -29,6 +29,9 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
 
 #include "types.h"
 #include "security.h"
@@ -54,6 +57,24 @@
  *	searches are used.
  */
 
+/*
+ *		Get the hash table index of a record
+ *
+ *	The hash functions return any non-negative value, so that the
+ *	table can be sized at run time, or -1 for a bad record.
+ */
+
+static int hashindex(const struct CACHE_HEADER *cache,
+			const struct CACHED_GENERIC *item)
+{
+	int h;
+
+	h = cache->dohash(item);
+	if (h >= 0)
+		h %= cache->max_hash;
+	return (h);
+}
+
 /*
  *		Enter a new hash index, after a new record has been inserted
  *
@@ -68,7 +89,7 @@ static void inserthashindex(struct CACHE_HEADER *cache,
 	struct HASH_ENTRY *first;
 
 	if (cache->dohash) {
-		h = cache->dohash(current);
+		h = hashindex(cache,current);
 		if ((h >= 0) && (h < cache->max_hash)) {
 			/* get a free link and insert at top of hash list */
 			link = cache->free_hash;
@@ -159,7 +180,7 @@ struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
 			 * When possible, use the hash table to
 			 * locate the entry if present
 			 */
-			h = cache->dohash(wanted);
+			h = hashindex(cache,wanted);
 		        link = cache->first_hash[h];
 			while (link && compare(link->entry, wanted))
 				link = link->next;
@@ -225,7 +246,7 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 			 * When possible, use the hash table to
 			 * find out whether the entry if present
 			 */
-			h = cache->dohash(item);
+			h = hashindex(cache,item);
 		        link = cache->first_hash[h];
 			while (link && compare(link->entry, item))
 				link = link->next;
@@ -274,7 +295,7 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 				before->next = (struct CACHED_GENERIC*)NULL;
 				if (cache->dohash)
 					drophashindex(cache,current,
-						cache->dohash(current));
+						hashindex(cache,current));
 				if (cache->dofree)
 					cache->dofree(current);
 				cache->oldest_entry = current->previous;
@@ -389,7 +410,7 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 			 * When possible, use the hash table to
 			 * find out whether the entry if present
 			 */
-			h = cache->dohash(item);
+			h = hashindex(cache,item);
 		        link = cache->first_hash[h];
 			while (link) {
 				if (compare(link->entry, item))
@@ -416,7 +437,7 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 					next = current->next;
 					if (cache->dohash)
 						drophashindex(cache,current,
-						    cache->dohash(current));
+						    hashindex(cache,current));
 					do_invalidate(cache,current,flags);
 					current = next;
 					count++;
@@ -437,7 +458,7 @@ int ntfs_remove_cache(struct CACHE_HEADER *cache,
 	count = 0;
 	if (cache) {
 		if (cache->dohash)
-			drophashindex(cache,item,cache->dohash(item));
+			drophashindex(cache,item,hashindex(cache,item));
 		do_invalidate(cache,item,flags);
 		count++;
 	}
@@ -500,6 +521,7 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 			cache->max_hash = 0;
 		}
 		cache->fixed_size = full_item_size - sizeof(struct CACHED_GENERIC);
+		cache->item_count = item_count;
 		cache->reads = 0;
 		cache->writes = 0;
 		cache->hits = 0;
@@ -584,6 +606,81 @@ void ntfs_create_lru_caches(ntfs_volume *vol)
 #endif
 }
 
+/*
+ *		Replace a cache by a new one of another size
+ *
+ *	Returns 0, or -1 if the new cache could not be created (the
+ *	cache is then not available)
+ */
+
+static int resize_cache(struct CACHE_HEADER **pcache, const char *name,
+			cache_free dofree, cache_hash dohash,
+			int full_item_size, int item_count)
+{
+	int res;
+
+	res = 0;
+	if (!*pcache || ((*pcache)->item_count != item_count)) {
+		ntfs_free_cache(*pcache);
+		*pcache = (struct CACHE_HEADER*)NULL;
+		if (item_count) {
+			*pcache = ntfs_create_cache(name, dofree, dohash,
+				full_item_size, item_count, 2*item_count);
+			if (!*pcache)
+				res = -1;
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Resize the inode, nidata and lookup caches
+ *
+ *	The sizes replace the compiled-in defaults, zero disables a
+ *	cache. The hash tables are sized accordingly.
+ *	The current entries are dropped, so this is meant to be called
+ *	just after mounting, before the caches are shared.
+ *
+ *	Returns 0, or -1 if a size is not acceptable or a cache could
+ *	not be allocated (caching is then just not available)
+ */
+
+int ntfs_resize_lru_caches(ntfs_volume *vol, int inode_size,
+			int nidata_size, int lookup_size)
+{
+	int res;
+
+	if ((inode_size < 0) || (inode_size > CACHE_MAX_SIZE)
+	    || ((inode_size > 0) && (inode_size < 3))
+	    || (nidata_size < 0) || (nidata_size > CACHE_MAX_SIZE)
+	    || ((nidata_size > 0) && (nidata_size < 3))
+	    || (lookup_size < 0) || (lookup_size > CACHE_MAX_SIZE)
+	    || ((lookup_size > 0) && (lookup_size < 3))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	res = 0;
+#if CACHE_INODE_SIZE
+	if (resize_cache(&vol->xinode_cache, "inode", (cache_free)NULL,
+			ntfs_dir_inode_hash, sizeof(struct CACHED_INODE),
+			inode_size))
+		res = -1;
+#endif
+#if CACHE_NIDATA_SIZE
+	if (resize_cache(&vol->nidata_cache, "nidata",
+			ntfs_inode_nidata_free, ntfs_inode_nidata_hash,
+			sizeof(struct CACHED_NIDATA), nidata_size))
+		res = -1;
+#endif
+#if CACHE_LOOKUP_SIZE
+	if (resize_cache(&vol->lookup_cache, "lookup", (cache_free)NULL,
+			ntfs_dir_lookup_hash, sizeof(struct CACHED_LOOKUP),
+			lookup_size))
+		res = -1;
+#endif
+	return (res);
+}
+
 /*
  *		Free all LRU caches
  */
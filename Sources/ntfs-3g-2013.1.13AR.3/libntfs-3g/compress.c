@@ -92,6 +92,32 @@ struct COMPRESS_CONTEXT {
 	s16 rson[NTFS_SB_SIZE];
 } ;
 
+/*
+ *		Extend a match between p1[j] and p2[j], j < 0, up to index 0
+ *
+ *	Eight bytes are compared at a time while possible, the byte loop
+ *	then locates the first mismatch (within the last word compared).
+ *
+ *	Returns the index of the first mismatch, zero if there is none.
+ */
+
+static inline long ntfs_match_end(const unsigned char *p1,
+			const unsigned char *p2, long j)
+{
+	u64 w1, w2;
+
+	while (j <= -8) {
+		memcpy(&w1, &p1[j], 8);
+		memcpy(&w2, &p2[j], 8);
+		if (w1 != w2)
+			break;
+		j += 8;
+	}
+	while ((j < 0) && (p1[j] == p2[j]))
+		j++;
+	return (j);
+}
+
 /*
  *		Search for the longest sequence matching current position
  *
@@ -138,12 +164,7 @@ static int ntfs_best_match(struct COMPRESS_CONTEXT *pctx, int i)
 				j = startj;
 			/* the second byte cannot lead to useful compression */
 				if (p1[j] == p2[j]) {
-					j++;
-					if (j < 0) {
-						do {
-						} while ((p1[j] == p2[j])
-								&& (++j < 0));
-					}
+					j = ntfs_match_end(p1, p2, j + 1);
 					/* remember the match, if better */
 					if (j > bestj) {
 						bestj = j;
@@ -188,7 +209,7 @@ static int ntfs_best_match(struct COMPRESS_CONTEXT *pctx, int i)
  *		0 if an error has been met. 
  */
 
-static unsigned int ntfs_compress_block(const char *inbuf, int bufsize,
+unsigned int ntfs_compress_block(const char *inbuf, int bufsize,
 				char *outbuf)
 {
 	struct COMPRESS_CONTEXT *pctx;
@@ -196,7 +217,6 @@ static unsigned int ntfs_compress_block(const char *inbuf, int bufsize,
 	int j; /* end of best match from current position */
 	int k; /* end of best match from next position */
 	int offs; /* offset to best match */
-	int n;
 	int bp; /* bits to store offset */
 	int mxoff; /* max match offset : 1 << bp */
 	int mxsz2;
@@ -209,14 +229,13 @@ static unsigned int ntfs_compress_block(const char *inbuf, int bufsize,
 
 	pctx = (struct COMPRESS_CONTEXT*)ntfs_malloc(sizeof(struct COMPRESS_CONTEXT));
 	if (pctx) {
-		for (n=0; n<NTFS_SB_SIZE; n++)
-			pctx->lson[n] = pctx->rson[n] = -1;
-		for (n=0; n<256; n++)
-			pctx->head[n] = -1;
+			/* all bytes 0xff : all nodes -1 */
+		memset(pctx->lson, 0xff, sizeof(pctx->lson));
+		memset(pctx->rson, 0xff, sizeof(pctx->rson));
+		memset(pctx->head, 0xff, sizeof(pctx->head));
 		pctx->inbuf = (const unsigned char*)inbuf;
 		pctx->bufsize = bufsize;
 		xout = 2;
-		n = 0;
 		i = 0;
 		bp = 4;
 		mxoff = 1 << bp;
@@ -317,7 +336,7 @@ static unsigned int ntfs_compress_block(const char *inbuf, int bufsize,
  *
  * Return 0 if success or -EOVERFLOW on error in the compressed stream.
  */
-static int ntfs_decompress(u8 *dest, const u32 dest_size,
+int ntfs_decompress(u8 *dest, const u32 dest_size,
 		u8 *const cb_start, const u32 cb_size)
 {
 	/*
@@ -335,6 +354,7 @@ static int ntfs_decompress(u8 *dest, const u32 dest_size,
 	/* Variables for tag and token parsing. */
 	u8 tag;			/* Current tag. */
 	int token;		/* Loop counter for the eight tokens in tag. */
+	u16 lg;			/* log2(position in sb) - 4, see below. */
 
 	ntfs_log_trace("Entering, cb_size = 0x%x.\n", (unsigned)cb_size);
 do_next_sb:
@@ -385,6 +405,7 @@ do_next_sb:
 	/* This sb is compressed, decompress it into destination. */
 	/* Forward to the first tag in the sub-block. */
 	cb += 2;
+	lg = 0;
 do_next_tag:
 	if (cb == cb_sb_end) {
 		/* Check if the decompressed sub-block was not full-length. */
@@ -404,11 +425,20 @@ do_next_tag:
 		goto return_overflow;
 	/* Get the next tag and advance to first token. */
 	tag = *cb++;
+	/*
+	 * Eight symbol tokens, if all of them are within range, are just
+	 * eight bytes to copy across.
+	 */
+	if (!tag && cb + 8 <= cb_sb_end && dest + 8 <= dest_sb_end) {
+		memcpy(dest, cb, 8);
+		cb += 8;
+		dest += 8;
+		goto do_next_tag;
+	}
 	/* Parse the eight tokens described by the tag. */
 	for (token = 0; token < 8; token++, tag >>= 1) {
-		u16 lg, pt, length, max_non_overlap;
-		register u16 i;
-		u8 *dest_back_addr;
+		u16 pt, length, max_non_overlap;
+		u8 *dest_back_addr, *dest_seq_end;
 
 		/* Check if we are done / still in range. */
 		if (cb >= cb_sb_end || dest > dest_sb_end)
@@ -434,10 +464,10 @@ do_next_tag:
 		 * of bytes to copy (l). We use an optimized algorithm in which
 		 * we first calculate log2(current destination position in sb),
 		 * which allows determination of l and p in O(1) rather than
-		 * O(n). We just need an arch-optimized log2() function now.
+		 * O(n). The position only grows within the sb, so lg is just
+		 * increased as needed.
 		 */
-		lg = 0;
-		for (i = dest - dest_sb_start - 1; i >= 0x10; i >>= 1)
+		while (dest - dest_sb_start - 1 >= (0x10 << lg))
 			lg++;
 		/* Get the phrase token into i. */
 		pt = le16_to_cpup((le16*)cb);
@@ -456,7 +486,26 @@ do_next_tag:
 			goto return_overflow;
 		/* The number of non-overlapping bytes. */
 		max_non_overlap = dest - dest_back_addr;
-		if (length <= max_non_overlap) {
+		if (max_non_overlap >= 8 && dest + length + 7 <= dest_sb_end) {
+			/*
+			 * Copy eight bytes at a time, each of them read at
+			 * least eight bytes back so already in place. Up to
+			 * seven bytes are written beyond the sequence, they
+			 * are in the sb and will be overwritten by the next
+			 * tokens or the final zeroes.
+			 */
+			dest_seq_end = dest + length;
+			do {
+				memcpy(dest, dest_back_addr, 8);
+				dest += 8;
+				dest_back_addr += 8;
+			} while (dest < dest_seq_end);
+			dest = dest_seq_end;
+		} else if (max_non_overlap == 1) {
+			/* A run of the previous byte. */
+			memset(dest, *dest_back_addr, length);
+			dest += length;
+		} else if (length <= max_non_overlap) {
 			/* The byte sequence doesn't overlap, just copy it. */
 			memcpy(dest, dest_back_addr, length);
 			/* Advance destination pointer. */
@@ -91,24 +91,24 @@ ntfschar NTFS_INDEX_R[3] = { const_cpu_to_le16('$'), const_cpu_to_le16('R'),
 /*
  *		Pathname hashing
  *
- *	Based on first char and second char (which may be '\0')
+ *	Based on the full path, as in deep directories (such as WinSxS)
+ *	many names share a long prefix
  */
 
 int ntfs_dir_inode_hash(const struct CACHED_GENERIC *cached)
 {
-	const char *path;
-	const unsigned char *name;
+	const unsigned char *path;
+	unsigned int val;
 
-	path = (const char*)cached->variable;
+	path = (const unsigned char*)cached->variable;
 	if (!path) {
 		ntfs_log_error("Bad inode cache entry\n");
 		return (-1);
 	}
-	name = (const unsigned char*)strrchr(path,'/');
-	if (!name)
-		name = (const unsigned char*)path;
-	return (((name[0] << 1) + name[1] + strlen((const char*)name))
-				% (2*CACHE_INODE_SIZE));
+	val = 0;
+	while (*path)
+		val = val*31 + *path++;
+	return (val & 0x7fffffff);
 }
 
 /*
@@ -196,7 +196,7 @@ static int lookup_cache_inv_compare(const struct CACHED_GENERIC *cached,
 /*
  *		Lookup hashing
  *
- *	Based on first, second and and last char
+ *	Based on the parent directory and the full name
  */
 
 int ntfs_dir_lookup_hash(const struct CACHED_GENERIC *cached)
@@ -211,8 +211,10 @@ int ntfs_dir_lookup_hash(const struct CACHED_GENERIC *cached)
 		ntfs_log_error("Bad lookup cache entry\n");
 		return (-1);
 	}
-	val = (name[0] << 2) + (name[1] << 1) + name[count - 1] + count;
-	return (val % (2*CACHE_LOOKUP_SIZE));
+	val = ((const struct CACHED_LOOKUP*)cached)->parent;
+	while (count--)
+		val = val*31 + *name++;
+	return (val & 0x7fffffff);
 }
 
 #endif
@@ -570,11 +572,14 @@ u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
 			item.name = const_name;
 			item.namesize = strlen(const_name) + 1;
 			item.parent = dir_ni->mft_no;
+			ntfs_volume_cache_lock(dir_ni->vol);
 			cached = (struct CACHED_LOOKUP*)ntfs_fetch_cache(
 					dir_ni->vol->lookup_cache,
 					GENERIC(&item), lookup_cache_compare);
-			if (cached) {
+			if (cached)
 				inum = cached->inum;
+			ntfs_volume_cache_unlock(dir_ni->vol);
+			if (cached) {
 				if (inum == (u64)-1)
 					errno = ENOENT;
 			} else {
@@ -585,9 +590,11 @@ u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
 							uname, uname_len);
 					item.inum = inum;
 				/* enter into cache, even if not found */
+					ntfs_volume_cache_lock(dir_ni->vol);
 					ntfs_enter_cache(dir_ni->vol->lookup_cache,
 							GENERIC(&item),
 							lookup_cache_compare);
+					ntfs_volume_cache_unlock(dir_ni->vol);
 					free(uname);
 				} else
 					inum = (s64)-1;
@@ -636,11 +643,13 @@ void ntfs_inode_update_mbsname(ntfs_inode *dir_ni, const char *name, u64 inum)
 			item.namesize = strlen(item.name) + 1;
 			item.parent = dir_ni->mft_no;
 			item.inum = inum;
+			ntfs_volume_cache_lock(dir_ni->vol);
 			cached = (struct CACHED_LOOKUP*)ntfs_enter_cache(
 					dir_ni->vol->lookup_cache,
 					GENERIC(&item), lookup_cache_compare);
 			if (cached)
 				cached->inum = inum;
+			ntfs_volume_cache_unlock(dir_ni->vol);
 			if (cached_name)
 				free(cached_name);
 		}
@@ -710,16 +719,19 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		if (*fullname) {
 			item.pathname = fullname;
 			item.varsize = strlen(fullname) + 1;
+			ntfs_volume_cache_lock(vol);
 			cached = (struct CACHED_INODE*)ntfs_fetch_cache(
 				vol->xinode_cache, GENERIC(&item),
 				inode_cache_compare);
+			if (cached)
+				inum = MREF(cached->inum);
+			ntfs_volume_cache_unlock(vol);
 		} else
 			cached = (struct CACHED_INODE*)NULL;
 		if (cached) {
 			/*
 			 * return opened inode if found in cache
 			 */
-			inum = MREF(cached->inum);
 			ni = ntfs_inode_open(vol, inum);
 			if (!ni) {
 				ntfs_log_debug("Cannot open inode %llu: %s.\n",
@@ -754,12 +766,14 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		if (!parent) {
 			item.pathname = fullname;
 			item.varsize = strlen(fullname) + 1;
+			ntfs_volume_cache_lock(vol);
 			cached = (struct CACHED_INODE*)ntfs_fetch_cache(
 					vol->xinode_cache, GENERIC(&item),
 					inode_cache_compare);
 			if (cached) {
 				inum = cached->inum;
 			}
+			ntfs_volume_cache_unlock(vol);
 		}
 			/*
 			 * if not in cache, translate, search, then
@@ -779,9 +793,11 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 			inum = ntfs_inode_lookup_by_name(ni, unicode, len);
 			if (!parent && (inum != (u64) -1)) {
 				item.inum = inum;
+				ntfs_volume_cache_lock(vol);
 				ntfs_enter_cache(vol->xinode_cache,
 						GENERIC(&item),
 						inode_cache_compare);
+				ntfs_volume_cache_unlock(vol);
 			}
 		}
 #else
@@ -2000,8 +2016,10 @@ search:
 	lkitem.namesize = 0;
 	lkitem.inum = ni->mft_no;
 	lkitem.parent = dir_ni->mft_no;
+	ntfs_volume_cache_lock(vol);
 	ntfs_invalidate_cache(vol->lookup_cache, GENERIC(&lkitem),
 			lookup_cache_inv_compare, CACHE_NOHASH);
+	ntfs_volume_cache_unlock(vol);
 #endif
 #if CACHE_INODE_SIZE
 	inum = ni->mft_no;
@@ -2020,8 +2038,10 @@ search:
 		item.varsize = 0;
 	}
 	item.inum = inum;
+	ntfs_volume_cache_lock(vol);
 	count = ntfs_invalidate_cache(vol->xinode_cache, GENERIC(&item),
 				inode_cache_inv_compare, CACHE_NOHASH);
+	ntfs_volume_cache_unlock(vol);
 	if (pathname && !count)
 		ntfs_log_error("Could not delete inode cache entry for %s\n",
 			pathname);
@@ -413,8 +413,7 @@ void ntfs_inode_nidata_free(const struct CACHED_GENERIC *cached)
 
 int ntfs_inode_nidata_hash(const struct CACHED_GENERIC *item)
 {
-	return (((const struct CACHED_NIDATA*)item)->inum
-			% (2*CACHE_NIDATA_SIZE));
+	return (((const struct CACHED_NIDATA*)item)->inum & 0x7fffffff);
 }
 
 /*
@@ -442,8 +441,10 @@ void ntfs_inode_invalidate(ntfs_volume *vol, const MFT_REF mref)
 	item.ni = (ntfs_inode*)NULL;
 	item.pathname = (const char*)NULL;
 	item.varsize = 0;
+	ntfs_volume_cache_lock(vol);
 	ntfs_invalidate_cache(vol->nidata_cache,
 				GENERIC(&item),idata_cache_compare,CACHE_FREE);
+	ntfs_volume_cache_unlock(vol);
 }
 
 #endif
@@ -470,6 +471,7 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
 	debug_double_inode(item.inum,1);
 	item.pathname = (const char*)NULL;
 	item.varsize = 0;
+	ntfs_volume_cache_lock(vol);
 	cached = (struct CACHED_NIDATA*)ntfs_fetch_cache(vol->nidata_cache,
 				GENERIC(&item),idata_cache_compare);
 	if (cached) {
@@ -477,7 +479,9 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
 		/* do not keep open entries in cache */
 		ntfs_remove_cache(vol->nidata_cache,
 				(struct CACHED_GENERIC*)cached,0);
-	} else {
+	}
+	ntfs_volume_cache_unlock(vol);
+	if (!cached) {
 		ni = ntfs_inode_real_open(vol, mref);
 	}
 	if (!ni) {
@@ -504,7 +508,9 @@ int ntfs_inode_close(ntfs_inode *ni)
 	int res;
 #if CACHE_NIDATA_SIZE
 	BOOL dirty;
+	BOOL duplicate;
 	struct CACHED_NIDATA item;
+	struct CACHED_NIDATA *cached;
 
 	if (ni) {
 		debug_double_inode(ni->mft_no,0);
@@ -530,8 +536,19 @@ int ntfs_inode_close(ntfs_inode *ni)
 				item.pathname = (const char*)NULL;
 				item.varsize = 0;
 				debug_cached_inode(ni);
-				ntfs_enter_cache(ni->vol->nidata_cache,
+				ntfs_volume_cache_lock(ni->vol);
+				cached = (struct CACHED_NIDATA*)ntfs_enter_cache(
+					ni->vol->nidata_cache,
 					GENERIC(&item), idata_cache_compare);
+				/*
+				 * Another copy may have been cached meanwhile
+				 * when the inode was opened by concurrent
+				 * readers, drop this one.
+				 */
+				duplicate = cached && (cached->ni != ni);
+				ntfs_volume_cache_unlock(ni->vol);
+				if (duplicate)
+					ntfs_inode_real_close(ni);
 			}
 		} else {
 			/* cache not ready or system file, really close */
@@ -202,6 +202,10 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	}
 
 	ntfs_free_lru_caches(v);
+	if (v->locking) {
+		pthread_rwlock_destroy(&v->vol_lock);
+		pthread_mutex_destroy(&v->cache_lock);
+	}
 	free(v->vol_name);
 	free(v->upcase);
 	if (v->locase) free(v->locase);
@@ -1311,6 +1315,89 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
 	return (res);
 }
 
+/*
+ *		Locking for multi-threaded callers
+ *
+ *	The library is single-threaded : until locking is set on a
+ *	volume, the functions below do nothing. A caller which then runs
+ *	several requests at once holds the volume lock for each of them :
+ *	- shared, for requests which only look up and read : path and
+ *	  index lookups, opening and closing clean inodes, reading
+ *	  attributes and listing directories. Such a request must not
+ *	  modify an inode (not even its times, see ntfs-3g's deferred
+ *	  atime) and must not call the security functions, whose
+ *	  $Secure index contexts and caches are shared.
+ *	- exclusive, for anything else.
+ *	Shared holders update the inode cache and the lookup caches, so
+ *	the library takes the cache lock around each use of them. Two
+ *	shared holders may open the same inode at the same time, each of
+ *	them then gets its own copy.
+ *	The runlist of $MFT is fully mapped on mount and the device is
+ *	read with pread(), so reading mft records needs no lock.
+ *
+ *	Returns 0 if successful
+ *		-1 if the locks could not be created (errno tells why)
+ */
+
+int ntfs_volume_set_locking(ntfs_volume *vol)
+{
+	pthread_rwlockattr_t attr;
+	int err;
+
+	if (vol->locking)
+		return (0);
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+		/* do not let a stream of reads starve the writers */
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	err = pthread_rwlock_init(&vol->vol_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	if (!err) {
+		err = pthread_mutex_init(&vol->cache_lock, NULL);
+		if (err)
+			pthread_rwlock_destroy(&vol->vol_lock);
+	}
+	if (err) {
+		errno = err;
+		ntfs_log_perror("Failed to set up volume locking");
+		return (-1);
+	}
+	vol->locking = TRUE;
+	return (0);
+}
+
+void ntfs_volume_lock_shared(ntfs_volume *vol)
+{
+	if (vol->locking)
+		pthread_rwlock_rdlock(&vol->vol_lock);
+}
+
+void ntfs_volume_lock_exclusive(ntfs_volume *vol)
+{
+	if (vol->locking)
+		pthread_rwlock_wrlock(&vol->vol_lock);
+}
+
+void ntfs_volume_unlock(ntfs_volume *vol)
+{
+	if (vol->locking)
+		pthread_rwlock_unlock(&vol->vol_lock);
+}
+
+void ntfs_volume_cache_lock(ntfs_volume *vol)
+{
+	if (vol->locking)
+		pthread_mutex_lock(&vol->cache_lock);
+}
+
+void ntfs_volume_cache_unlock(ntfs_volume *vol)
+{
+	if (vol->locking)
+		pthread_mutex_unlock(&vol->cache_lock);
+}
+
 /**
  * ntfs_mount - open ntfs volume
  * @name:	name of device/file to open
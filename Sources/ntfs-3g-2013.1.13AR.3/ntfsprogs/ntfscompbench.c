@@ -0,0 +1,957 @@
+/**
+ * ntfscompbench - Part of the Linux-NTFS project.
+ *
+ * This utility checks and times the LZNT1 code of libntfs-3g on the
+ * compressed files of a volume. Each compression block is decompressed,
+ * and the data compressed again by 4096-byte blocks, both with the
+ * library and with a reference copy of the code it had before the word
+ * compares of the match finder and the 8-byte copies of the decompressor.
+ * The outputs must be the same, byte for byte.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <sys/time.h>
+
+#include "types.h"
+#include "attrib.h"
+#include "inode.h"
+#include "compress.h"
+#include "utils.h"
+#include "volume.h"
+#include "misc.h"
+#include "logging.h"
+
+struct options {
+	char		*device;	/* Device/File to read */
+	int		 repeat;	/* Runs of each routine */
+	int		 max_mb;	/* Compressed data to load */
+	int		 force;		/* Override common sense */
+	int		 quiet;		/* Less output */
+	int		 verbose;	/* Extra output */
+};
+
+struct cblock {
+	u8		*comp;		/* the compressed clusters */
+	u32		 comp_size;
+	u32		 size;		/* of the data in the block */
+	u32		 dest_size;	/* size rounded to the sub-blocks */
+	u64		 inum;		/* where it comes from */
+	VCN		 vcn;
+};
+
+#define NTFS_SB_SIZE 0x1000
+#define NTFS_SB_SIZE_MASK 0x0fff
+#define NTFS_SB_IS_COMPRESSED 0x8000
+#define NTFS_SYMBOL_TOKEN 0
+#define NTFS_TOKEN_MASK 1
+
+#undef le16_to_cpup
+#define le16_to_cpup(p) (*(u8*)(p) + (((u8*)(p))[1] << 8))
+
+static const char *EXEC_NAME = "ntfscompbench";
+static struct options opts;
+static struct cblock *blocks;
+static int block_count;
+static s64 loaded;		/* compressed bytes */
+static s64 data_bytes;		/* uncompressed bytes */
+static long long files;
+
+/*
+ *		The reference code, as in libntfs-3g/compress.c before the
+ *	current version, only without the logging.
+ */
+
+struct REF_CONTEXT {
+	const unsigned char *inbuf;
+	int bufsize;
+	int size;
+	int rel;
+	int mxsz;
+	s16 head[256];
+	s16 lson[NTFS_SB_SIZE];
+	s16 rson[NTFS_SB_SIZE];
+} ;
+
+/* Search for the longest sequence matching the current position */
+
+static int ref_best_match(struct REF_CONTEXT *pctx, int i)
+{
+	s16 *prev;
+	int node;
+	register long j;
+	long maxpos;
+	long startj;
+	long bestj;
+	int bufsize;
+	int bestnode;
+	register const unsigned char *p1,*p2;
+
+	p1 = pctx->inbuf;
+	node = pctx->head[p1[i] & 255];
+	if (node >= 0) {
+		/* search the best match at current position */
+		bestnode = node;
+		bufsize = pctx->bufsize;
+		/* restrict matches to the longest allowed sequence */
+		maxpos = bufsize;
+		if ((i + pctx->mxsz) < maxpos)
+			maxpos = i + pctx->mxsz;
+		startj = i + 1 - maxpos;
+		bestj = startj;
+		/* make indexes relative to end of allowed position */
+		p1 = &p1[maxpos];
+		if (startj < 0) {
+			do {
+			/* indexes are negative */
+				p2 = &p1[node - i];
+			/* no need to compare the first byte */
+				j = startj;
+			/* the second byte cannot lead to useful compression */
+				if (p1[j] == p2[j]) {
+					j++;
+					if (j < 0) {
+						do {
+						} while ((p1[j] == p2[j])
+								&& (++j < 0));
+					}
+					/* remember the match, if better */
+					if (j > bestj) {
+						bestj = j;
+						bestnode = node;
+					}
+				}
+				/* walk in the tree in the right direction */
+				if ((j < 0) && (p1[j] < p2[j]))
+					prev = &pctx->lson[node];
+				else
+					prev = &pctx->rson[node];
+				node = *prev;
+				/* stop if reaching a leaf or maximum length */
+			} while ((node >= 0) && (j < 0));
+			/* put the node into the tree if we reached a leaf */
+			if (node < 0)
+				*prev = i;
+		}
+			/* done, return the best match */
+		pctx->size = bestj + maxpos - i;
+		pctx->rel = bestnode - i;
+	} else {
+		pctx->head[p1[i] & 255] = i;
+		pctx->size = 0;
+		pctx->rel = 0;
+	}
+	return (pctx->size);
+}
+
+/* Compress a 4096-byte block, returns the size of the output */
+
+static unsigned int ref_compress_block(const char *inbuf, int bufsize,
+				char *outbuf)
+{
+	struct REF_CONTEXT *pctx;
+	int i; /* current position */
+	int j; /* end of best match from current position */
+	int k; /* end of best match from next position */
+	int offs; /* offset to best match */
+	int n;
+	int bp; /* bits to store offset */
+	int mxoff; /* max match offset : 1 << bp */
+	int mxsz2;
+	unsigned int xout;
+	unsigned int q; /* aggregated offset and size */
+	int done;
+	char *ptag; /* location reserved for a tag */
+	int tag;    /* current value of tag */
+	int ntag;   /* count of bits still undefined in tag */
+
+	pctx = (struct REF_CONTEXT*)ntfs_malloc(sizeof(struct REF_CONTEXT));
+	if (pctx) {
+		for (n=0; n<NTFS_SB_SIZE; n++)
+			pctx->lson[n] = pctx->rson[n] = -1;
+		for (n=0; n<256; n++)
+			pctx->head[n] = -1;
+		pctx->inbuf = (const unsigned char*)inbuf;
+		pctx->bufsize = bufsize;
+		xout = 2;
+		n = 0;
+		i = 0;
+		bp = 4;
+		mxoff = 1 << bp;
+		pctx->mxsz = (1 << (16 - bp)) + 2;
+		tag = 0;
+		done = -1;
+		ntag = 8;
+		ptag = &outbuf[xout++];
+		while ((i < bufsize) && (xout < (NTFS_SB_SIZE + 2))) {
+		   /* adjust the longest match we can output */
+			while (mxoff < i) {
+				bp++;
+				mxoff <<= 1;
+				pctx->mxsz = (pctx->mxsz + 2) >> 1;
+			}
+		/* search the best match at current position */
+			if (done < i)
+				do {
+					ref_best_match(pctx,++done);
+				} while (done < i);
+			j = i + pctx->size;
+			if ((j - i) > pctx->mxsz)
+				j = i + pctx->mxsz;
+
+			if ((j - i) > 2) {
+				offs = pctx->rel;
+		  /* check whether there is a better run at i+1 */
+				ref_best_match(pctx,i+1);
+				done = i+1;
+				k = i + 1 + pctx->size;
+				mxsz2 = pctx->mxsz;
+				if (mxoff <= i)
+					mxsz2 = (pctx->mxsz + 2) >> 1;
+				if ((k - i) > mxsz2)
+					k = i + mxsz2;
+				if (k > (j + 1)) {
+					/* issue a single byte */
+					outbuf[xout++] = inbuf[i];
+					i++;
+				} else {
+					q = (~offs << (16 - bp))
+						+ (j - i - 3);
+					outbuf[xout++] = q & 255;
+					outbuf[xout++] = (q >> 8) & 255;
+					tag |= (1 << (8 - ntag));
+					i = j;
+				}
+			} else {
+				outbuf[xout++] = inbuf[i];
+				i++;
+			}
+				/* store the tag if fully used */
+			if (!--ntag) {
+				*ptag = tag;
+				ntag = 8;
+				ptag = &outbuf[xout++];
+				tag = 0;
+			}
+		}
+			/* store the last tag, if partially used */
+		if (ntag == 8)
+			xout--;
+		else
+			*ptag = tag;
+		/* uncompressed must be full size, accept if better */
+		if ((i >= bufsize) && (xout < (NTFS_SB_SIZE + 2))) {
+			outbuf[0] = (xout - 3) & 255;
+			outbuf[1] = 0xb0 + (((xout - 3) >> 8) & 15);
+		} else {
+			memcpy(&outbuf[2],inbuf,bufsize);
+			if (bufsize < NTFS_SB_SIZE)
+				memset(&outbuf[bufsize+2], 0,
+						NTFS_SB_SIZE - bufsize);
+			outbuf[0] = 0xff;
+			outbuf[1] = 0x3f;
+			xout = NTFS_SB_SIZE + 2;
+		}
+		free(pctx);
+	} else {
+		xout = 0;
+		errno = ENOMEM;
+	}
+	return (xout);
+}
+
+/* Decompress a compression block, returns 0 or -1 (EOVERFLOW) */
+
+static int ref_decompress(u8 *dest, const u32 dest_size,
+		u8 *const cb_start, const u32 cb_size)
+{
+	/*
+	 * Pointers into the compressed data, i.e. the compression block (cb),
+	 * and the therein contained sub-blocks (sb).
+	 */
+	u8 *cb_end = cb_start + cb_size; /* End of cb. */
+	u8 *cb = cb_start;	/* Current position in cb. */
+	u8 *cb_sb_start = cb;	/* Beginning of the current sb in the cb. */
+	u8 *cb_sb_end;		/* End of current sb / beginning of next sb. */
+	/* Variables for uncompressed data / destination. */
+	u8 *dest_end = dest + dest_size;	/* End of dest buffer. */
+	u8 *dest_sb_start;	/* Start of current sub-block in dest. */
+	u8 *dest_sb_end;	/* End of current sb in dest. */
+	/* Variables for tag and token parsing. */
+	u8 tag;			/* Current tag. */
+	int token;		/* Loop counter for the eight tokens in tag. */
+
+do_next_sb:
+	/*
+	 * Have we reached the end of the compression block or the end of the
+	 * decompressed data?  The latter can happen for example if the current
+	 * position in the compression block is one byte before its end so the
+	 * first two checks do not detect it.
+	 */
+	if (cb == cb_end || !le16_to_cpup((le16*)cb) || dest == dest_end) {
+		return 0;
+	}
+	/* Setup offset for the current sub-block destination. */
+	dest_sb_start = dest;
+	dest_sb_end = dest + NTFS_SB_SIZE;
+	/* Check that we are still within allowed boundaries. */
+	if (dest_sb_end > dest_end)
+		goto return_overflow;
+	/* Does the minimum size of a compressed sb overflow valid range? */
+	if (cb + 6 > cb_end)
+		goto return_overflow;
+	/* Setup the current sub-block source pointers and validate range. */
+	cb_sb_start = cb;
+	cb_sb_end = cb_sb_start + (le16_to_cpup((le16*)cb) & NTFS_SB_SIZE_MASK)
+			+ 3;
+	if (cb_sb_end > cb_end)
+		goto return_overflow;
+	/* Now, we are ready to process the current sub-block (sb). */
+	if (!(le16_to_cpup((le16*)cb) & NTFS_SB_IS_COMPRESSED)) {
+		/* This sb is not compressed, just copy it into destination. */
+		/* Advance source position to first data byte. */
+		cb += 2;
+		/* An uncompressed sb must be full size. */
+		if (cb_sb_end - cb != NTFS_SB_SIZE)
+			goto return_overflow;
+		/* Copy the block and advance the source position. */
+		memcpy(dest, cb, NTFS_SB_SIZE);
+		cb += NTFS_SB_SIZE;
+		/* Advance destination position to next sub-block. */
+		dest += NTFS_SB_SIZE;
+		goto do_next_sb;
+	}
+	/* This sb is compressed, decompress it into destination. */
+	/* Forward to the first tag in the sub-block. */
+	cb += 2;
+do_next_tag:
+	if (cb == cb_sb_end) {
+		/* Check if the decompressed sub-block was not full-length. */
+		if (dest < dest_sb_end) {
+			int nr_bytes = dest_sb_end - dest;
+
+			/* Zero remainder and update destination position. */
+			memset(dest, 0, nr_bytes);
+			dest += nr_bytes;
+		}
+		/* We have finished the current sub-block. */
+		goto do_next_sb;
+	}
+	/* Check we are still in range. */
+	if (cb > cb_sb_end || dest > dest_sb_end)
+		goto return_overflow;
+	/* Get the next tag and advance to first token. */
+	tag = *cb++;
+	/* Parse the eight tokens described by the tag. */
+	for (token = 0; token < 8; token++, tag >>= 1) {
+		u16 lg, pt, length, max_non_overlap;
+		register u16 i;
+		u8 *dest_back_addr;
+
+		/* Check if we are done / still in range. */
+		if (cb >= cb_sb_end || dest > dest_sb_end)
+			break;
+		/* Determine token type and parse appropriately.*/
+		if ((tag & NTFS_TOKEN_MASK) == NTFS_SYMBOL_TOKEN) {
+			/*
+			 * We have a symbol token, copy the symbol across, and
+			 * advance the source and destination positions.
+			 */
+			*dest++ = *cb++;
+			/* Continue with the next token. */
+			continue;
+		}
+		/*
+		 * We have a phrase token. Make sure it is not the first tag in
+		 * the sb as this is illegal and would confuse the code below.
+		 */
+		if (dest == dest_sb_start)
+			goto return_overflow;
+		/*
+		 * Determine the number of bytes to go back (p) and the number
+		 * of bytes to copy (l). We use an optimized algorithm in which
+		 * we first calculate log2(current destination position in sb),
+		 * which allows determination of l and p in O(1) rather than
+		 * O(n). We just need an arch-optimized log2() function now.
+		 */
+		lg = 0;
+		for (i = dest - dest_sb_start - 1; i >= 0x10; i >>= 1)
+			lg++;
+		/* Get the phrase token into i. */
+		pt = le16_to_cpup((le16*)cb);
+		/*
+		 * Calculate starting position of the byte sequence in
+		 * the destination using the fact that p = (pt >> (12 - lg)) + 1
+		 * and make sure we don't go too far back.
+		 */
+		dest_back_addr = dest - (pt >> (12 - lg)) - 1;
+		if (dest_back_addr < dest_sb_start)
+			goto return_overflow;
+		/* Now calculate the length of the byte sequence. */
+		length = (pt & (0xfff >> lg)) + 3;
+		/* Verify destination is in range. */
+		if (dest + length > dest_sb_end)
+			goto return_overflow;
+		/* The number of non-overlapping bytes. */
+		max_non_overlap = dest - dest_back_addr;
+		if (length <= max_non_overlap) {
+			/* The byte sequence doesn't overlap, just copy it. */
+			memcpy(dest, dest_back_addr, length);
+			/* Advance destination pointer. */
+			dest += length;
+		} else {
+			/*
+			 * The byte sequence does overlap, copy non-overlapping
+			 * part and then do a slow byte by byte copy for the
+			 * overlapping part. Also, advance the destination
+			 * pointer.
+			 */
+			memcpy(dest, dest_back_addr, max_non_overlap);
+			dest += max_non_overlap;
+			dest_back_addr += max_non_overlap;
+			length -= max_non_overlap;
+			while (length--)
+				*dest++ = *dest_back_addr++;
+		}
+		/* Advance source position and continue with the next token. */
+		cb += 2;
+	}
+	/* No tokens left in the current tag. Continue with the next tag. */
+	goto do_next_tag;
+return_overflow:
+	errno = EOVERFLOW;
+	return -1;
+}
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Check and time the NTFS "
+		"compression code.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] device\n\n"
+		"    -m, --max-mb MB         Load at most MB of compressed "
+						"data (default 256)\n"
+		"    -r, --repeat N          Run each routine N times "
+						"(default 3)\n"
+		"    -f, --force             Use less caution\n"
+		"    -h, --help              Print this help\n"
+		"    -q, --quiet             Less output\n"
+		"    -V, --version           Version information\n"
+		"    -v, --verbose           More output\n\n",
+		EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:  1 Success
+ *	    0 Error, one or more problems
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-fh?m:qr:Vv";
+	static const struct option lopt[] = {
+		{ "force",	     no_argument,	NULL, 'f' },
+		{ "help",	     no_argument,	NULL, 'h' },
+		{ "max-mb",	     required_argument,	NULL, 'm' },
+		{ "quiet",	     no_argument,	NULL, 'q' },
+		{ "repeat",	     required_argument,	NULL, 'r' },
+		{ "version",	     no_argument,	NULL, 'V' },
+		{ "verbose",	     no_argument,	NULL, 'v' },
+		{ NULL,		     0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+	int levels = 0;
+	char *end;
+
+	opts.device = NULL;
+	opts.repeat = 3;
+	opts.max_mb = 256;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.device) {
+				opts.device = argv[optind - 1];
+			} else {
+				ntfs_log_error("You must specify exactly one "
+						"device.\n");
+				err++;
+			}
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'h':
+		case '?':
+			if (strncmp(argv[optind - 1], "--log-", 6) == 0) {
+				if (!ntfs_log_parse_option(argv[optind - 1]))
+					err++;
+				break;
+			}
+			help++;
+			break;
+		case 'm':
+			opts.max_mb = strtol(optarg, &end, 10);
+			if (*end || (opts.max_mb <= 0) || (opts.max_mb > 4096)) {
+				ntfs_log_error("Bad size '%s'.\n", optarg);
+				err++;
+			}
+			break;
+		case 'q':
+			opts.quiet++;
+			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
+			break;
+		case 'r':
+			opts.repeat = strtol(optarg, &end, 10);
+			if (*end || (opts.repeat <= 0)) {
+				ntfs_log_error("Bad count '%s'.\n", optarg);
+				err++;
+			}
+			break;
+		case 'V':
+			ver++;
+			break;
+		case 'v':
+			opts.verbose++;
+			ntfs_log_set_levels(NTFS_LOG_LEVEL_VERBOSE);
+			break;
+		default:
+			ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind - 1]);
+			err++;
+			break;
+		}
+	}
+
+	/* Make sure we're in sync with the log levels */
+	levels = ntfs_log_get_levels();
+	if (levels & NTFS_LOG_LEVEL_VERBOSE)
+		opts.verbose++;
+	if (!(levels & NTFS_LOG_LEVEL_QUIET))
+		opts.quiet++;
+
+	if (help || ver) {
+		opts.quiet = 0;
+	} else {
+		if (!opts.device) {
+			ntfs_log_error("You must specify a device.\n");
+			err++;
+		}
+
+		if (opts.quiet && opts.verbose) {
+			ntfs_log_error("You may not use --quiet and --verbose "
+					"at the same time.\n");
+			err++;
+		}
+	}
+
+	if (ver)
+		version();
+	if (help || err)
+		usage();
+
+	return (!err && !help && !ver);
+}
+
+/**
+ * read_clusters - Read the allocated clusters of a compression block
+ *
+ * Return:  the number of bytes read, 0 if the block is not compressed
+ *		(sparse or fully allocated), -1 if there was an error
+ */
+static s64 read_clusters(ntfs_attr *na, VCN vcn, u8 *buf)
+{
+	ntfs_volume *vol = na->ni->vol;
+	int clusters = na->compression_block_clusters;
+	LCN lcn;
+	s64 got = 0;
+	int n = 0;
+	int i;
+
+	for (i=0; i<clusters; i++) {
+		lcn = ntfs_rl_vcn_to_lcn(na->rl, vcn + i);
+		if (lcn == LCN_HOLE)
+			continue;
+		if (lcn < 0) {
+			errno = EIO;
+			return (-1);
+		}
+		if (ntfs_pread(vol->dev, lcn << vol->cluster_size_bits,
+				vol->cluster_size, &buf[got])
+					!= vol->cluster_size)
+			return (-1);
+		got += vol->cluster_size;
+		n++;
+	}
+	return ((n && (n < clusters)) ? got : 0);
+}
+
+/**
+ * load_attr - Load the compressed blocks of an attribute
+ *
+ * Return:  0 Success, or the attribute is not compressed
+ *	   -1 The memory limit is reached, or an error
+ */
+static int load_attr(ntfs_attr *na, u64 inum)
+{
+	s64 limit = (s64)opts.max_mb << 20;
+	u32 cb_size = na->compression_block_size;
+	struct cblock *cb;
+	VCN vcn;
+	s64 got;
+	s64 pos;
+	u8 *buf;
+
+	if (!NAttrNonResident(na)
+	    || ((na->data_flags & ATTR_COMPRESSION_MASK)
+			!= ATTR_IS_COMPRESSED)
+	    || (na->data_flags & ATTR_IS_ENCRYPTED))
+		return (0);
+	if (ntfs_attr_map_whole_runlist(na)) {
+		ntfs_log_perror("Failed to map the runlist of inode %lld",
+				(long long)inum);
+		return (0);
+	}
+	files++;
+	for (vcn=0; (vcn << na->ni->vol->cluster_size_bits)
+					< na->data_size;
+			vcn+=na->compression_block_clusters) {
+		if (loaded + cb_size > limit)
+			return (-1);
+		buf = (u8*)ntfs_malloc(cb_size + 2);
+		if (!buf)
+			return (-1);
+		got = read_clusters(na, vcn, buf);
+		if (got <= 0) {
+			if (got < 0)
+				ntfs_log_perror("Failed to read inode %lld "
+					"at vcn %lld", (long long)inum,
+					(long long)vcn);
+			free(buf);
+			continue;
+		}
+		/* the end mark, as ntfs_compressed_attr_pread() does */
+		memset(&buf[got], 0, cb_size + 2 - got);
+		if (!(block_count & 1023)) {
+			cb = (struct cblock*)realloc(blocks,
+				(block_count + 1024)*sizeof(struct cblock));
+			if (!cb) {
+				free(buf);
+				return (-1);
+			}
+			blocks = cb;
+		}
+		cb = &blocks[block_count++];
+		cb->comp = buf;
+		cb->comp_size = got;
+		pos = vcn << na->ni->vol->cluster_size_bits;
+		cb->size = (na->data_size - pos < cb_size
+				? na->data_size - pos : cb_size);
+		cb->dest_size = ((cb->size - 1) | (NTFS_SB_SIZE - 1)) + 1;
+		cb->inum = inum;
+		cb->vcn = vcn;
+		loaded += got;
+		data_bytes += cb->size;
+	}
+	return (0);
+}
+
+/**
+ * load_volume - Load the compressed blocks of all the files
+ *
+ * All the data streams are examined, up to the memory limit.
+ */
+static void load_volume(ntfs_volume *vol)
+{
+	s64 nr_mft_records;
+	ntfs_attr_search_ctx *ctx;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	ntfschar *name;
+	s64 inum;
+	BOOL full;
+
+	nr_mft_records = vol->mft_na->initialized_size
+			>> vol->mft_record_size_bits;
+	full = FALSE;
+	for (inum=FILE_first_user; (inum<nr_mft_records) && !full; inum++) {
+		if (utils_mftrec_in_use(vol, inum) <= 0)
+			continue;
+		ni = ntfs_inode_open(vol, inum);
+		if (!ni)
+			continue;
+		if (ni->mrec->base_mft_record) {
+			ntfs_inode_close(ni);
+			continue;
+		}
+		ctx = ntfs_attr_get_search_ctx(ni, NULL);
+		while (ctx && !full && !ntfs_attr_lookup(AT_DATA, NULL, 0,
+				CASE_SENSITIVE, 0, NULL, 0, ctx)) {
+			if (ctx->attr->lowest_vcn)
+				continue;
+			name = AT_UNNAMED;
+			if (ctx->attr->name_length)
+				name = (ntfschar*)((u8*)ctx->attr
+				    + le16_to_cpu(ctx->attr->name_offset));
+			na = ntfs_attr_open(ni, AT_DATA, name,
+					ctx->attr->name_length);
+			if (na) {
+				full = load_attr(na, inum) < 0;
+				ntfs_attr_close(na);
+			}
+		}
+		if (ctx)
+			ntfs_attr_put_search_ctx(ctx);
+		ntfs_inode_close(ni);
+	}
+	if (full)
+		ntfs_log_info("Stopped loading at %d MB.\n", opts.max_mb);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec/1000000.0);
+}
+
+/**
+ * check_decompress - Decompress all blocks both ways, compare
+ *
+ * The reference output is kept in data[], for check_compress().
+ *
+ * Return:  the number of blocks which differ
+ */
+static int check_decompress(u8 **data, double *ref_time, double *cur_time)
+{
+	u8 *dest;
+	int differ;
+	int r, i;
+	double start;
+
+	dest = (u8*)ntfs_malloc(1 << 16);
+	if (!dest)
+		return (block_count);
+	differ = 0;
+	*ref_time = *cur_time = 0.0;
+	for (r=0; r<opts.repeat; r++) {
+		start = now();
+		for (i=0; i<block_count; i++)
+			if (ref_decompress(data[i], blocks[i].dest_size,
+					blocks[i].comp, blocks[i].comp_size)) {
+				ntfs_log_verbose("Bad compressed block, "
+					"inode %lld vcn %lld\n",
+					(long long)blocks[i].inum,
+					(long long)blocks[i].vcn);
+				memset(data[i], 0, blocks[i].dest_size);
+			}
+		*ref_time += now() - start;
+		start = now();
+		for (i=0; i<block_count; i++)
+			ntfs_decompress(dest, blocks[i].dest_size,
+					blocks[i].comp, blocks[i].comp_size);
+		*cur_time += now() - start;
+	}
+	/* compare out of the timed loops, block by block */
+	for (i=0; i<block_count; i++) {
+		memset(dest, 0, blocks[i].dest_size);
+		if (ntfs_decompress(dest, blocks[i].dest_size,
+				blocks[i].comp, blocks[i].comp_size))
+			memset(dest, 0, blocks[i].dest_size);
+		if (memcmp(dest, data[i], blocks[i].dest_size)) {
+			ntfs_log_error("Decompressed data differ, inode %lld "
+				"vcn %lld\n", (long long)blocks[i].inum,
+				(long long)blocks[i].vcn);
+			differ++;
+		}
+	}
+	free(dest);
+	return (differ);
+}
+
+/**
+ * check_compress - Compress the data of all blocks both ways, compare
+ *
+ * Return:  the number of blocks which differ
+ */
+static int check_compress(u8 **data, double *ref_time, double *cur_time)
+{
+	char ref_out[NTFS_SB_SIZE + 4];
+	char cur_out[NTFS_SB_SIZE + 4];
+	unsigned int ref_sz, cur_sz;
+	int differ;
+	u32 p, bsz;
+	int r, i;
+	double start;
+
+	differ = 0;
+	*ref_time = *cur_time = 0.0;
+	for (r=0; r<opts.repeat; r++) {
+		start = now();
+		for (i=0; i<block_count; i++)
+			for (p=0; p<blocks[i].size; p+=NTFS_SB_SIZE) {
+				bsz = blocks[i].size - p;
+				if (bsz > NTFS_SB_SIZE)
+					bsz = NTFS_SB_SIZE;
+				ref_compress_block((char*)&data[i][p], bsz,
+						ref_out);
+			}
+		*ref_time += now() - start;
+		start = now();
+		for (i=0; i<block_count; i++)
+			for (p=0; p<blocks[i].size; p+=NTFS_SB_SIZE) {
+				bsz = blocks[i].size - p;
+				if (bsz > NTFS_SB_SIZE)
+					bsz = NTFS_SB_SIZE;
+				ntfs_compress_block((char*)&data[i][p], bsz,
+						cur_out);
+			}
+		*cur_time += now() - start;
+	}
+	for (i=0; i<block_count; i++)
+		for (p=0; p<blocks[i].size; p+=NTFS_SB_SIZE) {
+			bsz = blocks[i].size - p;
+			if (bsz > NTFS_SB_SIZE)
+				bsz = NTFS_SB_SIZE;
+			ref_sz = ref_compress_block((char*)&data[i][p], bsz,
+					ref_out);
+			cur_sz = ntfs_compress_block((char*)&data[i][p], bsz,
+					cur_out);
+			if ((ref_sz != cur_sz)
+			    || memcmp(ref_out, cur_out, ref_sz)) {
+				ntfs_log_error("Compressed data differ, inode "
+					"%lld vcn %lld offset %u\n",
+					(long long)blocks[i].inum,
+					(long long)blocks[i].vcn, p);
+				differ++;
+			}
+		}
+	return (differ);
+}
+
+static void print_times(const char *what, double ref_time, double cur_time,
+			s64 bytes, int differ)
+{
+	double mb = bytes*(double)opts.repeat/1048576.0;
+
+	ntfs_log_quiet("%-12s reference %7.2fs %8.1f MB/s, current %7.2fs "
+		"%8.1f MB/s, %s\n", what, ref_time,
+		(ref_time > 0 ? mb/ref_time : 0.0), cur_time,
+		(cur_time > 0 ? mb/cur_time : 0.0),
+		(differ ? "DIFFERENT" : "identical"));
+}
+
+int main(int argc, char *argv[])
+{
+	ntfs_volume *vol;
+	double ref_time, cur_time;
+	int differ, cdiffer;
+	u8 **data;
+	int i;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	if (!parse_options(argc, argv))
+		return 1;
+
+	utils_set_locale();
+
+	vol = utils_mount_volume(opts.device, NTFS_MNT_RDONLY
+				| (opts.force ? NTFS_MNT_RECOVER : 0));
+	if (!vol) {
+		ntfs_log_perror("ERROR: couldn't mount volume %s",
+				opts.device);
+		return 1;
+	}
+	load_volume(vol);
+	ntfs_umount(vol, FALSE);
+
+	ntfs_log_quiet("%lld compressed streams, %d compression blocks, "
+		"%.1f MB compressed to %.1f MB\n", files, block_count,
+		data_bytes/1048576.0, loaded/1048576.0);
+	if (!block_count) {
+		ntfs_log_error("No compressed data found on %s.\n",
+				opts.device);
+		return 1;
+	}
+
+	data = (u8**)ntfs_malloc(block_count*sizeof(u8*));
+	if (!data)
+		return 1;
+	for (i=0; i<block_count; i++) {
+		data[i] = (u8*)ntfs_calloc(blocks[i].dest_size);
+		if (!data[i])
+			return 1;
+	}
+	differ = check_decompress(data, &ref_time, &cur_time);
+	print_times("decompress", ref_time, cur_time, data_bytes, differ);
+	cdiffer = check_compress(data, &ref_time, &cur_time);
+	print_times("compress", ref_time, cur_time, data_bytes, cdiffer);
+
+	for (i=0; i<block_count; i++) {
+		free(data[i]);
+		free(blocks[i].comp);
+	}
+	free(data);
+	free(blocks);
+	return ((differ || cdiffer) ? 2 : 0);
+}
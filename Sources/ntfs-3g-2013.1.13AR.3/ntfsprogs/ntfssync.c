@@ -0,0 +1,1842 @@
+/**
+ * ntfssync - Part of the Linux-NTFS project.
+ *
+ * This utility makes an NTFS volume a copy of another one, typically an
+ * image, without mounting any of them. Only the files which differ are
+ * written, and the NTFS specific attributes (security descriptors, file
+ * attributes, DOS names, reparse points, named data streams and times)
+ * are copied along, as well as hard links.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <signal.h>
+#include <fnmatch.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "types.h"
+#include "attrib.h"
+#include "utils.h"
+#include "volume.h"
+#include "dir.h"
+#include "security.h"
+#include "reparse.h"
+#include "misc.h"
+#include "debug.h"
+#include "logging.h"
+
+struct options {
+	char		*source;	/* Device/File to copy from */
+	char		*device;	/* Device/File to update */
+	char		**dirs;		/* Directories to sync, all if none */
+	int		 dircount;
+	int		 delete_excluded; /* Delete excluded files */
+	int		 checksum;	/* Compare all contents */
+	int		 force;		/* Override common sense */
+	int		 remove_hiberfile; /* Drop a hibernated session */
+	int		 quiet;		/* Less output */
+	int		 verbose;	/* Extra output */
+	int		 noaction;	/* Do not write to disk */
+};
+
+struct exclude {
+	struct exclude	*next;
+	int		 flags;
+	char		 pattern[1];	/* variable length */
+};
+
+enum {
+	EXCL_ANCHORED = 1,	/* matched against the full path */
+	EXCL_PATH = 2,		/* matched against the tails of the path */
+	EXCL_DIR = 4		/* only matches directories */
+};
+
+struct entry {
+	ntfschar	*name;
+	int		 len;
+	u64		 inum;
+	BOOL		 isdir;
+	char		*mbsname;
+};
+
+struct dirlist {
+	struct entry	*entries;
+	int		 count;
+	int		 size;
+	const char	*path;		/* of the directory, for exclusions */
+	BOOL		 excluding;	/* drop the excluded entries */
+};
+
+struct subdir {
+	u64		 src_inum;
+	u64		 dst_inum;
+	char		*path;
+};
+
+struct link {
+	struct link	*next;
+	u64		 key;
+	u64		 value;
+};
+
+struct stats {
+	long long	 entries;	/* entries in the source */
+	long long	 created;
+	long long	 updated;	/* data written */
+	long long	 fixed;		/* only attributes changed */
+	long long	 deleted;
+	long long	 errors;
+	s64		 written;	/* bytes */
+};
+
+	/* the data is copied and compared by BUFSZ, and rewritten by BLKSZ */
+#define BUFSZ 1048576
+#define BLKSZ 65536
+#define SDSZ 65536		/* largest security descriptor */
+#define LINKHASH 65536		/* buckets of the hard link tables */
+#define DOSNAMESZ 64		/* an 8.3 name, multibyte */
+
+	/* file attributes which can be copied, as in libntfs-3g/security.c */
+#define SYNC_ATTRIBUTES (FILE_ATTR_READONLY | FILE_ATTR_HIDDEN	\
+			| FILE_ATTR_SYSTEM | FILE_ATTR_ARCHIVE		\
+			| FILE_ATTR_TEMPORARY | FILE_ATTR_OFFLINE	\
+			| FILE_ATTR_NOT_CONTENT_INDEXED)
+
+static const char *EXEC_NAME = "ntfssync";
+static struct options opts;
+static struct stats stats;
+static struct exclude *excludes;
+static volatile sig_atomic_t caught_terminate = 0;
+
+#ifdef HAVE_SETXATTR	/* the attribute copying functions are required */
+
+static ntfs_volume *src_vol;
+static ntfs_volume *dst_vol;
+static struct SECURITY_CONTEXT src_scx;
+static struct SECURITY_CONTEXT dst_scx;
+static struct PERMISSIONS_CACHE *src_seccache;
+static struct PERMISSIONS_CACHE *dst_seccache;
+static BOOL secure;		/* security descriptors are copied */
+static char *src_buf;
+static char *dst_buf;
+	/* source inode -> destination inode, for hard links */
+static struct link *links[LINKHASH];
+	/* destination inode -> source inode, when shared by hard links */
+static struct link *claimed[LINKHASH];
+
+#endif /* HAVE_SETXATTR */
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Make an NTFS volume a copy "
+		"of another one.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] source device [directory...]\n\n"
+		"    -c, --checksum          Compare the contents of all files\n"
+		"    -x, --exclude PATTERN   Ignore the files matching PATTERN\n"
+		"    -X, --exclude-from FILE Read the patterns from FILE\n"
+		"    -d, --delete-excluded   Delete the excluded files from "
+						"device\n"
+		"    -f, --force             Use less caution\n"
+		"    -r, --remove-hiberfile  Remove the hibernation file of "
+						"device\n"
+		"    -h, --help              Print this help\n"
+		"    -n, --no-action         Do not write to disk\n"
+		"    -q, --quiet             Less output\n"
+		"    -V, --version           Version information\n"
+		"    -v, --verbose           More output\n\n",
+		EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * add_exclude - Record an exclusion pattern
+ *
+ * The patterns follow the rsync rules : a leading '/' anchors the pattern
+ * at the root of the volume, a trailing '/' only matches directories, a
+ * pattern with another '/' is matched against the trailing part of the
+ * path, and one without is matched against the file name.
+ *
+ * Return:  1 Success
+ *	    0 Error
+ */
+static int add_exclude(const char *pattern)
+{
+	struct exclude *excl;
+	size_t len;
+
+	len = strlen(pattern);
+	if (!len)
+		return (1);
+	excl = (struct exclude*)malloc(sizeof(struct exclude) + len);
+	if (!excl) {
+		ntfs_log_perror("Failed to record the pattern %s", pattern);
+		return (0);
+	}
+	strcpy(excl->pattern, pattern);
+	excl->flags = 0;
+	if ((len > 1) && (excl->pattern[len - 1] == '/')) {
+		excl->pattern[--len] = 0;
+		excl->flags |= EXCL_DIR;
+	}
+	if (excl->pattern[0] == '/')
+		excl->flags |= EXCL_ANCHORED;
+	else
+		if (strchr(excl->pattern, '/'))
+			excl->flags |= EXCL_PATH;
+	excl->next = excludes;
+	excludes = excl;
+	return (1);
+}
+
+/**
+ * read_excludes - Record the exclusion patterns from a file
+ *
+ * One pattern per line, empty lines and lines beginning with '#' or ';'
+ * are ignored.
+ *
+ * Return:  1 Success
+ *	    0 Error
+ */
+static int read_excludes(const char *filename)
+{
+	FILE *f;
+	char line[1024];
+	char *p;
+	int ok;
+
+	f = (strcmp(filename, "-") ? fopen(filename, "r") : stdin);
+	if (!f) {
+		ntfs_log_perror("Failed to open %s", filename);
+		return (0);
+	}
+	ok = 1;
+	while (ok && fgets(line, sizeof(line), f)) {
+		p = strchr(line, '\n');
+		if (p)
+			*p = 0;
+		p = strchr(line, '\r');
+		if (p)
+			*p = 0;
+		if ((line[0] != '#') && (line[0] != ';'))
+			ok = add_exclude(line);
+	}
+	if (f != stdin)
+		fclose(f);
+	return (ok);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:  1 Success
+ *	    0 Error, one or more problems
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-cdfh?nqrVvx:X:";
+	static const struct option lopt[] = {
+		{ "checksum",	     no_argument,	NULL, 'c' },
+		{ "delete-excluded", no_argument,	NULL, 'd' },
+		{ "exclude",	     required_argument,	NULL, 'x' },
+		{ "exclude-from",    required_argument,	NULL, 'X' },
+		{ "force",	     no_argument,	NULL, 'f' },
+		{ "help",	     no_argument,	NULL, 'h' },
+		{ "no-action",	     no_argument,	NULL, 'n' },
+		{ "quiet",	     no_argument,	NULL, 'q' },
+		{ "remove-hiberfile", no_argument,	NULL, 'r' },
+		{ "version",	     no_argument,	NULL, 'V' },
+		{ "verbose",	     no_argument,	NULL, 'v' },
+		{ NULL,		     0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+	int levels = 0;
+
+	opts.source = NULL;
+	opts.device = NULL;
+	opts.dirs = NULL;
+	opts.dircount = 0;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.source) {
+				opts.source = argv[optind - 1];
+			} else if (!opts.device) {
+				opts.device = argv[optind - 1];
+			} else {
+				if (!opts.dirs)
+					opts.dirs = &argv[optind - 1];
+				if (opts.dirs + opts.dircount
+				    == &argv[optind - 1])
+					opts.dircount++;
+				else {
+					ntfs_log_error("The directories must "
+						"be the last arguments.\n");
+					err++;
+				}
+			}
+			break;
+		case 'c':
+			opts.checksum++;
+			break;
+		case 'd':
+			opts.delete_excluded++;
+			break;
+		case 'x':
+			if (!add_exclude(optarg))
+				err++;
+			break;
+		case 'X':
+			if (!read_excludes(optarg))
+				err++;
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'h':
+		case '?':
+			if (strncmp(argv[optind - 1], "--log-", 6) == 0) {
+				if (!ntfs_log_parse_option(argv[optind - 1]))
+					err++;
+				break;
+			}
+			help++;
+			break;
+		case 'n':
+			opts.noaction++;
+			break;
+		case 'q':
+			opts.quiet++;
+			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
+			break;
+		case 'r':
+			opts.remove_hiberfile++;
+			break;
+		case 'V':
+			ver++;
+			break;
+		case 'v':
+			opts.verbose++;
+			ntfs_log_set_levels(NTFS_LOG_LEVEL_VERBOSE);
+			break;
+		default:
+			ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind - 1]);
+			err++;
+			break;
+		}
+	}
+
+	/* Make sure we're in sync with the log levels */
+	levels = ntfs_log_get_levels();
+	if (levels & NTFS_LOG_LEVEL_VERBOSE)
+		opts.verbose++;
+	if (!(levels & NTFS_LOG_LEVEL_QUIET))
+		opts.quiet++;
+
+	if (help || ver) {
+		opts.quiet = 0;
+	} else {
+		if (!opts.source) {
+			ntfs_log_error("You must specify a source.\n");
+			err++;
+		} else if (!opts.device) {
+			ntfs_log_error("You must specify a device.\n");
+			err++;
+		}
+
+		if (opts.quiet && opts.verbose) {
+			ntfs_log_error("You may not use --quiet and --verbose "
+					"at the same time.\n");
+			err++;
+		}
+	}
+
+	if (ver)
+		version();
+	if (help || err)
+		usage();
+
+	return (!err && !help && !ver);
+}
+
+/**
+ * signal_handler - Handle SIGINT and SIGTERM: stop and unmount cleanly.
+ */
+static void signal_handler(int arg __attribute__((unused)))
+{
+	caught_terminate++;
+}
+
+#ifdef HAVE_SETXATTR
+
+/**
+ * is_excluded - Check a path against the exclusion patterns
+ *
+ * @path is relative to the root of the volume and begins with '/'.
+ */
+static BOOL is_excluded(const char *path, BOOL isdir)
+{
+	const struct exclude *excl;
+	const char *p;
+	BOOL found;
+
+	found = FALSE;
+	for (excl=excludes; excl && !found; excl=excl->next) {
+		if ((excl->flags & EXCL_DIR) && !isdir)
+			continue;
+		if (excl->flags & EXCL_ANCHORED)
+			found = !fnmatch(excl->pattern, path, FNM_PATHNAME);
+		else {
+			if (excl->flags & EXCL_PATH)
+				p = path;
+			else
+				p = strrchr(path, '/');
+			while (p && !found) {
+				found = !fnmatch(excl->pattern, p + 1,
+						FNM_PATHNAME);
+				if (excl->flags & EXCL_PATH)
+					p = strchr(p + 1, '/');
+				else
+					p = (char*)NULL;
+			}
+		}
+	}
+	return (found);
+}
+
+/**
+ * child_path - Build the path of a directory entry
+ *
+ * Return:  the allocated path, or NULL if there is no memory
+ */
+static char *child_path(const char *path, const char *name)
+{
+	char *child;
+
+	child = (char*)malloc(strlen(path) + strlen(name) + 2);
+	if (child)
+		sprintf(child, "%s/%s", path, name);
+	else
+		ntfs_log_perror("Failed to allocate a path");
+	return (child);
+}
+
+static struct link **link_bucket(struct link **table, u64 key)
+{
+	return (&table[(key ^ (key >> 16)) & (LINKHASH - 1)]);
+}
+
+static u64 link_get(struct link **table, u64 key)
+{
+	struct link *link;
+
+	for (link=*link_bucket(table, key); link && (link->key != key);
+			link=link->next)
+		;
+	return (link ? link->value : 0);
+}
+
+static void link_put(struct link **table, u64 key, u64 value)
+{
+	struct link **bucket;
+	struct link *link;
+
+	bucket = link_bucket(table, key);
+	for (link=*bucket; link && (link->key != key); link=link->next)
+		;
+	if (!link) {
+		link = (struct link*)malloc(sizeof(struct link));
+		if (!link)
+			return;	/* the links will just not be shared */
+		link->key = key;
+		link->next = *bucket;
+		*bucket = link;
+	}
+	link->value = value;
+}
+
+static void link_free(struct link **table)
+{
+	struct link *link;
+	int i;
+
+	for (i=0; i<LINKHASH; i++)
+		while (table[i]) {
+			link = table[i];
+			table[i] = link->next;
+			free(link);
+		}
+}
+
+/**
+ * list_filler - Record a directory entry
+ *
+ * The DOS names (which come along with a long name), the dot entries and
+ * the metadata files are not listed.
+ */
+static int list_filler(struct dirlist *list, const ntfschar *name,
+		const int name_len, const int name_type,
+		const s64 pos __attribute__((unused)), const MFT_REF mref,
+		const unsigned dt_type)
+{
+	struct entry *entries;
+	struct entry *e;
+	char *path;
+	BOOL excluded;
+
+	if ((name_type == FILE_NAME_DOS)
+	    || (MREF(mref) < FILE_first_user)
+	    || ((name_len <= 2)
+		&& (name[0] == const_cpu_to_le16('.'))
+		&& ((name_len == 1)
+		    || (name[1] == const_cpu_to_le16('.')))))
+		return (0);
+	if (list->count >= list->size) {
+		entries = (struct entry*)realloc(list->entries,
+				(list->size + 256)*sizeof(struct entry));
+		if (!entries)
+			return (-1);
+		list->entries = entries;
+		list->size += 256;
+	}
+	e = &list->entries[list->count];
+	e->mbsname = (char*)NULL;
+	if (ntfs_ucstombs(name, name_len, &e->mbsname, 0) < 0) {
+		ntfs_log_perror("Cannot represent a name from %s/ (inode "
+			"%lld)", list->path, (long long)MREF(mref));
+		stats.errors++;
+		return (0);
+	}
+	e->isdir = (dt_type == NTFS_DT_DIR);
+	if (list->excluding && excludes) {
+		path = child_path(list->path, e->mbsname);
+		if (!path)
+			return (-1);
+		excluded = is_excluded(path, e->isdir);
+		free(path);
+		if (excluded) {
+			free(e->mbsname);
+			return (0);
+		}
+	}
+	e->name = (ntfschar*)ntfs_malloc(name_len*sizeof(ntfschar));
+	if (!e->name) {
+		free(e->mbsname);
+		return (-1);
+	}
+	memcpy(e->name, name, name_len*sizeof(ntfschar));
+	e->len = name_len;
+	e->inum = MREF(mref);
+	list->count++;
+	return (0);
+}
+
+/**
+ * compare_entries - Order the names as their 16-bit values
+ *
+ * Only the order matters, to merge the source and destination lists.
+ */
+static int compare_entries(const void *p1, const void *p2)
+{
+	const struct entry *e1 = (const struct entry*)p1;
+	const struct entry *e2 = (const struct entry*)p2;
+	int len;
+	int i;
+
+	len = (e1->len < e2->len ? e1->len : e2->len);
+	for (i=0; (i<len) && (e1->name[i] == e2->name[i]); i++)
+		;
+	if (i < len)
+		return (le16_to_cpu(e1->name[i]) < le16_to_cpu(e2->name[i])
+			? -1 : 1);
+	return (e1->len - e2->len);
+}
+
+static void free_list(struct dirlist *list)
+{
+	int i;
+
+	for (i=0; i<list->count; i++) {
+		free(list->entries[i].name);
+		free(list->entries[i].mbsname);
+	}
+	free(list->entries);
+	list->entries = (struct entry*)NULL;
+	list->count = list->size = 0;
+}
+
+/**
+ * read_dir - List a directory, sorted
+ *
+ * Return:  0 Success
+ *	   -1 Error
+ */
+static int read_dir(ntfs_volume *vol, u64 inum, struct dirlist *list,
+		const char *path, BOOL excluding)
+{
+	ntfs_inode *ni;
+	s64 pos;
+	int res;
+
+	list->entries = (struct entry*)NULL;
+	list->count = list->size = 0;
+	list->path = path;
+	list->excluding = excluding;
+	res = -1;
+	ni = ntfs_inode_open(vol, inum);
+	if (ni) {
+		pos = 0;
+		res = ntfs_readdir(ni, &pos, list,
+				(ntfs_filldir_t)list_filler);
+		ntfs_inode_close(ni);
+	}
+	if (res) {
+		ntfs_log_perror("Failed to read the directory %s/", path);
+		free_list(list);
+	} else
+		qsort(list->entries, list->count, sizeof(struct entry),
+				compare_entries);
+	return (res);
+}
+
+/**
+ * delete_entry - Delete a file or a directory tree from the destination
+ *
+ * The directory must not be open, ntfs_delete() closes it.
+ *
+ * Return:  0 Success
+ *	   -1 Error
+ */
+static int delete_entry(u64 dir_inum, const struct entry *e,
+		const char *path)
+{
+	struct dirlist list;
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	char *child;
+	int res;
+	int i;
+
+	res = 0;
+	if (e->isdir && !read_dir(dst_vol, e->inum, &list, path, FALSE)) {
+		for (i=0; (i<list.count) && !res && !caught_terminate; i++) {
+			child = child_path(path, list.entries[i].mbsname);
+			if (child) {
+				res = delete_entry(e->inum,
+						&list.entries[i], child);
+				free(child);
+			} else
+				res = -1;
+		}
+		free_list(&list);
+	}
+	if (res || caught_terminate)
+		return (-1);
+	ntfs_log_verbose("deleting %s\n", path);
+	stats.deleted++;
+	if (opts.noaction)
+		return (0);
+	ni = ntfs_inode_open(dst_vol, e->inum);
+	dir_ni = ntfs_inode_open(dst_vol, dir_inum);
+	if (ni && dir_ni) {
+		/* ntfs_delete() always closes ni and dir_ni */
+		res = ntfs_delete(dst_vol, (const char*)NULL, ni, dir_ni,
+				e->name, e->len);
+	} else {
+		if (ni)
+			ntfs_inode_close(ni);
+		if (dir_ni)
+			ntfs_inode_close(dir_ni);
+		res = -1;
+	}
+	if (res) {
+		ntfs_log_perror("Failed to delete %s", path);
+		stats.errors++;
+	}
+	return (res);
+}
+
+/**
+ * remove_hiberfile - Delete the hibernation file of the destination
+ *
+ * As the remove_hiberfile option of ntfs-3g does, the hibernated Windows
+ * session is lost, the sync replaces the files it had open anyway.
+ *
+ * Return:  0 Success, or the volume was not hibernated
+ *	   -1 Error
+ */
+static int remove_hiberfile(void)
+{
+	ntfschar *uname = NULL;
+	ntfs_inode *ni;
+	ntfs_inode *dir_ni;
+	int len;
+	int res;
+
+	if (!ntfs_volume_check_hiberfile(dst_vol, 0))
+		return (0);
+	if (errno != EPERM)
+		return (-1);
+	ntfs_log_info("Removing the hibernation file of %s\n", opts.device);
+	len = ntfs_mbstoucs("hiberfil.sys", &uname);
+	if (len < 0)
+		return (-1);
+	ni = ntfs_pathname_to_inode(dst_vol, NULL, "/hiberfil.sys");
+	dir_ni = ntfs_inode_open(dst_vol, FILE_root);
+	if (ni && dir_ni) {
+		/* ntfs_delete() always closes ni and dir_ni */
+		res = ntfs_delete(dst_vol, "/hiberfil.sys", ni, dir_ni,
+				uname, len);
+	} else {
+		if (ni)
+			ntfs_inode_close(ni);
+		if (dir_ni)
+			ntfs_inode_close(dir_ni);
+		res = -1;
+	}
+	if (res)
+		ntfs_log_perror("Failed to remove the hibernation file");
+	free(uname);
+	return (res);
+}
+
+/**
+ * read_full - Read from an attribute until the count or the end
+ *
+ * Return:  the count of bytes read, or -1 if there was an error
+ */
+static s64 read_full(ntfs_attr *na, s64 pos, s64 count, char *buf)
+{
+	s64 done;
+	s64 ret;
+
+	done = 0;
+	while (done < count) {
+		ret = ntfs_attr_pread(na, pos + done, count - done,
+				buf + done);
+		if (ret <= 0)
+			return (ret < 0 ? -1 : done);
+		done += ret;
+	}
+	return (done);
+}
+
+static s64 write_full(ntfs_attr *na, s64 pos, s64 count, const char *buf)
+{
+	s64 done;
+	s64 ret;
+
+	done = 0;
+	while (done < count) {
+		ret = ntfs_attr_pwrite(na, pos + done, count - done,
+				buf + done);
+		if (ret <= 0)
+			return (-1);
+		done += ret;
+	}
+	return (done);
+}
+
+static BOOL is_zero(const char *buf, s64 count)
+{
+	s64 i;
+
+	for (i=0; (i<count) && !buf[i]; i++)
+		;
+	return (i >= count);
+}
+
+/**
+ * copy_stream - Make a destination data stream a copy of a source one
+ *
+ * The destination is first set to its final size, with a single
+ * allocation unless the source is sparse or compressed, then each
+ * block which differs is written, so unchanged parts of updated files
+ * are not rewritten.
+ *
+ * Return:  1 The stream was changed (or would be)
+ *	    0 The stream was already the same
+ *	   -1 Error
+ */
+static int copy_stream(ntfs_attr *src_na, ntfs_inode *dst_ni,
+		ntfschar *name, int len, const char *path)
+{
+	ntfs_attr *dst_na;
+	s64 size;
+	s64 old_size;
+	s64 pos;
+	s64 count;
+	s64 got;
+	s64 start;
+	s64 off;
+	s64 n;
+	int changed;
+
+	dst_na = ntfs_attr_open(dst_ni, AT_DATA, name, len);
+	if (!dst_na) {
+		if (errno != ENOENT)
+			goto err;
+		if (opts.noaction)
+			return (1);
+		if (ntfs_attr_add(dst_ni, AT_DATA, name, len, NULL, 0))
+			goto err;
+		dst_na = ntfs_attr_open(dst_ni, AT_DATA, name, len);
+		if (!dst_na)
+			goto err;
+	}
+	size = src_na->data_size;
+	old_size = dst_na->data_size;
+	changed = (size != old_size);
+	if (changed && !opts.noaction) {
+		if ((size > old_size)
+		    && !NAttrSparse(src_na)
+		    && !NAttrCompressed(src_na)
+		    && !NAttrCompressed(dst_na)) {
+			if (ntfs_attr_truncate_solid(dst_na, size))
+				goto err_close;
+		} else
+			if (ntfs_attr_truncate(dst_na, size))
+				goto err_close;
+		if (old_size > size)
+			old_size = size;
+	}
+	for (pos=0; (pos<size) && !caught_terminate; pos+=count) {
+		count = (size - pos < BUFSZ ? size - pos : BUFSZ);
+		if (read_full(src_na, pos, count, src_buf) != count) {
+			ntfs_log_perror("Failed to read %s from the source",
+					path);
+			goto err_close;
+		}
+			/* compare with the previous contents, by blocks */
+		got = 0;
+		if (pos < old_size) {
+			got = (old_size - pos < count ? old_size - pos : count);
+			if (read_full(dst_na, pos, got, dst_buf) != got)
+				goto err_close;
+		}
+			/* write the runs of differing blocks */
+		start = -1;
+		for (off=0; (off<count) || (start>=0); off+=n) {
+			n = (count - off < BLKSZ ? count - off : BLKSZ);
+				/* zeroes beyond the old size are already there */
+			if ((n > 0)
+			    && ((off + n > got)
+				? ((pos + off < old_size)
+				    || !is_zero(src_buf + off, n))
+				: memcmp(src_buf + off, dst_buf + off, n))) {
+				if (start < 0)
+					start = off;
+			} else
+				if (start >= 0) {
+					changed = 1;
+					stats.written += off - start;
+					if (!opts.noaction
+					    && (write_full(dst_na, pos + start,
+						off - start, src_buf + start)
+							!= off - start))
+						goto err_close;
+					start = -1;
+				}
+		}
+	}
+	ntfs_attr_close(dst_na);
+	return (caught_terminate ? -1 : changed);
+err_close:
+	ntfs_attr_close(dst_na);
+err:
+	ntfs_log_perror("Failed to copy the data of %s", path);
+	return (-1);
+}
+
+static void free_streams(struct entry *streams, int count)
+{
+	int i;
+
+	for (i=0; i<count; i++)
+		free(streams[i].name);
+	free(streams);
+}
+
+/**
+ * list_streams - Get the names of the named data streams of an inode
+ *
+ * The names are copied, as the records they are in change when the
+ * streams are updated.
+ *
+ * Return:  the count of streams, or -1 if there was an error
+ */
+static int list_streams(ntfs_inode *ni, struct entry **pstreams)
+{
+	ntfs_attr_search_ctx *ctx;
+	struct entry *streams;
+	struct entry *grown;
+	ntfschar *name;
+	ATTR_RECORD *a;
+	int count;
+	BOOL ok;
+
+	streams = (struct entry*)NULL;
+	count = 0;
+	ok = TRUE;
+	ctx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (!ctx)
+		return (-1);
+	while (ok && !ntfs_attr_lookup(AT_DATA, NULL, 0, CASE_SENSITIVE, 0,
+			NULL, 0, ctx)) {
+		a = ctx->attr;
+		if (!a->name_length
+		    || (a->non_resident && a->lowest_vcn))
+			continue;
+		grown = (struct entry*)realloc(streams,
+				(count + 1)*sizeof(struct entry));
+		name = (ntfschar*)ntfs_malloc(a->name_length*sizeof(ntfschar));
+		if (grown)
+			streams = grown;
+		if (grown && name) {
+			memcpy(name, (u8*)a + le16_to_cpu(a->name_offset),
+					a->name_length*sizeof(ntfschar));
+			streams[count].name = name;
+			streams[count].len = a->name_length;
+			count++;
+		} else {
+			free(name);
+			ok = FALSE;
+		}
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	if (!ok) {
+		free_streams(streams, count);
+		streams = (struct entry*)NULL;
+		count = -1;
+	}
+	*pstreams = streams;
+	return (count);
+}
+
+/**
+ * sync_streams - Copy the data streams of a file
+ *
+ * Unless --checksum is used, the unnamed stream is not compared when the
+ * sizes and the modification times are the same. The named streams
+ * (usually small) are always compared.
+ *
+ * Return:  1 Some data was changed
+ *	    0 No change
+ *	   -1 Error
+ */
+static int sync_streams(ntfs_inode *src_ni, ntfs_inode *dst_ni,
+		const char *path)
+{
+	struct entry *src_streams;
+	struct entry *dst_streams;
+	ntfs_attr *src_na;
+	ntfs_attr *dst_na;
+	int src_count, dst_count;
+	int changed;
+	int res;
+	int i, j;
+
+	changed = 0;
+	src_na = ntfs_attr_open(src_ni, AT_DATA, AT_UNNAMED, 0);
+	if (src_na) {
+		dst_na = ntfs_attr_open(dst_ni, AT_DATA, AT_UNNAMED, 0);
+		if (opts.checksum
+		    || !dst_na
+		    || (dst_na->data_size != src_na->data_size)
+		    || (dst_ni->last_data_change_time
+				!= src_ni->last_data_change_time))
+			changed = 1;
+		if (dst_na)
+			ntfs_attr_close(dst_na);
+		if (changed)
+			changed = copy_stream(src_na, dst_ni, AT_UNNAMED, 0,
+					path);
+		ntfs_attr_close(src_na);
+		if (changed < 0)
+			return (-1);
+	}
+	src_count = list_streams(src_ni, &src_streams);
+	dst_count = list_streams(dst_ni, &dst_streams);
+	if ((src_count < 0) || (dst_count < 0)) {
+		ntfs_log_perror("Failed to list the streams of %s", path);
+		if (src_count >= 0)
+			free_streams(src_streams, src_count);
+		if (dst_count >= 0)
+			free_streams(dst_streams, dst_count);
+		return (-1);
+	}
+	res = 0;
+	for (j=0; (j<dst_count) && !res; j++) {
+		for (i=0; (i<src_count)
+			&& ((src_streams[i].len != dst_streams[j].len)
+			    || memcmp(src_streams[i].name, dst_streams[j].name,
+				src_streams[i].len*sizeof(ntfschar))); i++)
+			;
+		if (i >= src_count) {
+			changed = 1;
+			if (!opts.noaction
+			    && ntfs_attr_remove(dst_ni, AT_DATA,
+					dst_streams[j].name,
+					dst_streams[j].len)) {
+				ntfs_log_perror("Failed to remove a stream "
+						"of %s", path);
+				res = -1;
+			}
+		}
+	}
+	for (i=0; (i<src_count) && !res; i++) {
+		src_na = ntfs_attr_open(src_ni, AT_DATA, src_streams[i].name,
+				src_streams[i].len);
+		if (src_na) {
+			switch (copy_stream(src_na, dst_ni,
+					src_streams[i].name,
+					src_streams[i].len, path)) {
+			case 0 :
+				break;
+			case 1 :
+				changed = 1;
+				break;
+			default :
+				res = -1;
+				break;
+			}
+			ntfs_attr_close(src_na);
+		} else {
+			ntfs_log_perror("Failed to open a stream of %s", path);
+			res = -1;
+		}
+	}
+	free_streams(src_streams, src_count);
+	free_streams(dst_streams, dst_count);
+	return (res ? res : changed);
+}
+
+/**
+ * sync_security - Copy the security descriptor
+ *
+ * Return:  1 Changed
+ *	    0 No change
+ *	   -1 Error
+ */
+static int sync_security(ntfs_inode *src_ni, ntfs_inode *dst_ni,
+		const char *path)
+{
+	int src_size;
+	int dst_size;
+
+	if (!secure)
+		return (0);
+	src_size = ntfs_get_ntfs_acl(&src_scx, src_ni, src_buf, SDSZ);
+	if ((src_size <= 0) || (src_size > SDSZ)) {
+		ntfs_log_perror("Failed to get the security descriptor of %s",
+				path);
+		return (-1);
+	}
+	dst_size = ntfs_get_ntfs_acl(&dst_scx, dst_ni, dst_buf, SDSZ);
+	if ((dst_size == src_size) && !memcmp(src_buf, dst_buf, src_size))
+		return (0);
+	if (!opts.noaction
+	    && ntfs_set_ntfs_acl(&dst_scx, dst_ni, src_buf, src_size, 0)) {
+		ntfs_log_perror("Failed to set the security descriptor of %s",
+				path);
+		return (-1);
+	}
+	return (1);
+}
+
+/**
+ * sync_attrib - Copy the settable file attributes
+ *
+ * The compression flag can only be set on directories, files get it when
+ * created in a compressed directory.
+ *
+ * Return:  1 Changed
+ *	    0 No change
+ *	   -1 Error
+ */
+static int sync_attrib(ntfs_inode *src_ni, ntfs_inode *dst_ni,
+		const char *path)
+{
+	le32 mask;
+	u32 attrib;
+
+	mask = SYNC_ATTRIBUTES;
+	if (src_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+		mask |= FILE_ATTR_COMPRESSED;
+	if (!((src_ni->flags ^ dst_ni->flags) & mask))
+		return (0);
+	attrib = le32_to_cpu((src_ni->flags & mask)
+				| (dst_ni->flags & ~mask));
+	if (!opts.noaction
+	    && ntfs_set_ntfs_attrib(dst_ni, (const char*)&attrib,
+			sizeof(attrib), 0)) {
+		ntfs_log_perror("Failed to set the attributes of %s", path);
+		return (-1);
+	}
+	return (1);
+}
+
+/**
+ * sync_reparse - Copy the reparse data (symlinks, junctions, etc.)
+ *
+ * Return:  1 Changed
+ *	    0 No change
+ *	   -1 Error
+ */
+static int sync_reparse(ntfs_inode *src_ni, ntfs_inode *dst_ni,
+		const char *path)
+{
+	char *src_data;
+	char *dst_data;
+	s64 src_size;
+	s64 dst_size;
+	int res;
+
+	src_data = dst_data = (char*)NULL;
+	src_size = dst_size = 0;
+	if (src_ni->flags & FILE_ATTR_REPARSE_POINT) {
+		src_data = (char*)ntfs_attr_readall(src_ni, AT_REPARSE_POINT,
+				(ntfschar*)NULL, 0, &src_size);
+		if (!src_data) {
+			ntfs_log_perror("Failed to read the reparse data of "
+					"%s", path);
+			return (-1);
+		}
+	}
+	if (dst_ni->flags & FILE_ATTR_REPARSE_POINT)
+		dst_data = (char*)ntfs_attr_readall(dst_ni, AT_REPARSE_POINT,
+				(ntfschar*)NULL, 0, &dst_size);
+	res = 0;
+	if ((src_size != dst_size)
+	    || (src_data && !dst_data)
+	    || (src_data && memcmp(src_data, dst_data, src_size))) {
+		res = 1;
+		if (!opts.noaction
+		    && (src_data
+			? ntfs_set_ntfs_reparse_data(dst_ni, src_data,
+				src_size, 0)
+			: ntfs_remove_ntfs_reparse_data(dst_ni))) {
+			ntfs_log_perror("Failed to set the reparse data of %s",
+					path);
+			res = -1;
+		}
+	}
+	free(src_data);
+	free(dst_data);
+	return (res);
+}
+
+/**
+ * sync_times - Copy the creation, modification and access times
+ *
+ * This has to be done last, as any update changes the times.
+ *
+ * Return:  1 Changed
+ *	    0 No change
+ *	   -1 Error
+ */
+static int sync_times(ntfs_inode *src_ni, ntfs_inode *dst_ni,
+		const char *path)
+{
+	u64 times[3];
+
+	if ((src_ni->creation_time == dst_ni->creation_time)
+	    && (src_ni->last_data_change_time
+			== dst_ni->last_data_change_time)
+	    && (src_ni->last_access_time == dst_ni->last_access_time))
+		return (0);
+	times[0] = le64_to_cpu(src_ni->creation_time);
+	times[1] = le64_to_cpu(src_ni->last_data_change_time);
+	times[2] = le64_to_cpu(src_ni->last_access_time);
+	if (!opts.noaction
+	    && ntfs_inode_set_times(dst_ni, (const char*)times,
+			sizeof(times), 0)) {
+		ntfs_log_perror("Failed to set the times of %s", path);
+		return (-1);
+	}
+	return (1);
+}
+
+/**
+ * sync_dos_name - Copy the DOS name of an entry
+ *
+ * The libntfs-3g functions which change the DOS name close the inode and
+ * its directory, so they are opened again.
+ *
+ * Return:  1 Changed
+ *	    0 No change
+ *	   -1 Error
+ */
+static int sync_dos_name(ntfs_inode *src_ni, ntfs_inode *src_dir,
+		ntfs_inode **pdst_ni, ntfs_inode **pdst_dir, const char *path)
+{
+	char src_name[DOSNAMESZ];
+	char dst_name[DOSNAMESZ];
+	u64 inum;
+	u64 dir_inum;
+	int src_len;
+	int dst_len;
+	int res;
+
+	src_len = ntfs_get_ntfs_dos_name(src_ni, src_dir, src_name,
+					sizeof(src_name));
+	dst_len = ntfs_get_ntfs_dos_name(*pdst_ni, *pdst_dir, dst_name,
+					sizeof(dst_name));
+	if (src_len < 0)
+		src_len = 0;
+	if (dst_len < 0)
+		dst_len = 0;
+	if ((src_len == dst_len) && !memcmp(src_name, dst_name, src_len))
+		return (0);
+	if (opts.noaction)
+		return (1);
+	inum = (*pdst_ni)->mft_no;
+	dir_inum = (*pdst_dir)->mft_no;
+	if (src_len)
+		res = ntfs_set_ntfs_dos_name(*pdst_ni, *pdst_dir,
+				src_name, src_len, 0);
+	else
+		res = ntfs_remove_ntfs_dos_name(*pdst_ni, *pdst_dir);
+	if (res)
+		ntfs_log_perror("Failed to set the DOS name of %s", path);
+	*pdst_dir = ntfs_inode_open(dst_vol, dir_inum);
+	*pdst_ni = ntfs_inode_open(dst_vol, inum);
+	if (!*pdst_dir || !*pdst_ni) {
+		ntfs_log_perror("Failed to reopen %s", path);
+		res = -1;
+	}
+	return (res ? -1 : 1);
+}
+
+/**
+ * close_in_dir - Close a destination inode while its directory is open
+ *
+ * The directory index is updated through the open directory, as the
+ * version on disk may not have the entry yet. When the inode has several
+ * names, they may be in other directories which are opened from disk, so
+ * the directory is closed first.
+ *
+ * Return:  0 Success
+ *	   -1 Error, the directory may have been left closed
+ */
+static int close_in_dir(ntfs_inode *ni, ntfs_inode **pdir)
+{
+	u64 dir_inum;
+	int res;
+
+	if (le16_to_cpu(ni->mrec->link_count) > 1) {
+		dir_inum = (*pdir)->mft_no;
+		res = ntfs_inode_close(*pdir);
+		if (ntfs_inode_close(ni))
+			res = -1;
+		*pdir = ntfs_inode_open(dst_vol, dir_inum);
+		if (!*pdir)
+			res = -1;
+	} else
+		res = ntfs_inode_close_in_dir(ni, *pdir);
+	return (res);
+}
+
+static int add_subdir(struct subdir **psubdirs, int *pcount,
+		u64 src_inum, u64 dst_inum, const char *path)
+{
+	struct subdir *subdirs;
+
+	subdirs = (struct subdir*)realloc(*psubdirs,
+				(*pcount + 1)*sizeof(struct subdir));
+	if (!subdirs)
+		return (-1);
+	subdirs[*pcount].src_inum = src_inum;
+	subdirs[*pcount].dst_inum = dst_inum;
+	subdirs[*pcount].path = strdup(path);
+	if (!subdirs[*pcount].path)
+		return (-1);
+	*psubdirs = subdirs;
+	(*pcount)++;
+	return (0);
+}
+
+/**
+ * count_tree - Count the entries which would be created by a dry run
+ */
+static void count_tree(u64 src_inum, const char *path)
+{
+	struct dirlist list;
+	ntfs_inode *ni;
+	char *child;
+	int i;
+
+	if (read_dir(src_vol, src_inum, &list, path, TRUE))
+		return;
+	for (i=0; (i<list.count) && !caught_terminate; i++) {
+		child = child_path(path, list.entries[i].mbsname);
+		if (child) {
+			ntfs_log_verbose("creating %s\n", child);
+			stats.entries++;
+			stats.created++;
+			if (list.entries[i].isdir)
+				count_tree(list.entries[i].inum, child);
+			else {
+				ni = ntfs_inode_open(src_vol,
+						list.entries[i].inum);
+				if (ni) {
+					stats.written += ni->data_size;
+					ntfs_inode_close(ni);
+				}
+			}
+			free(child);
+		}
+	}
+	free_list(&list);
+}
+
+/**
+ * sync_entry - Make a destination entry a copy of a source one
+ *
+ * @dst_inum is the inode of the existing entry with the same name, or 0.
+ * The subdirectories are recorded for being synced after the directory.
+ *
+ * Return:  0 Success
+ *	   -1 Error (the error count has been updated)
+ */
+static int sync_entry(ntfs_inode *src_dir, ntfs_inode **pdst_dir,
+		const struct entry *e, u64 dst_inum, const char *path,
+		struct subdir **psubdirs, int *psubdir_count)
+{
+	ntfs_inode *src_ni;
+	ntfs_inode *dst_ni;
+	ntfs_inode *target_ni;
+	struct entry old;
+	u64 dir_inum;
+	u64 target;
+	BOOL isdir;
+	BOOL linked;
+	BOOL created;
+	BOOL replace;
+	int changed;
+	int fixed;
+	int res;
+
+	src_ni = ntfs_inode_open(src_vol, e->inum);
+	if (!src_ni) {
+		ntfs_log_perror("Failed to open %s in the source", path);
+		stats.errors++;
+		return (-1);
+	}
+	isdir = (src_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) != 0;
+	if (src_ni->flags & FILE_ATTR_ENCRYPTED) {
+		ntfs_log_error("Skipping the encrypted file %s\n", path);
+		ntfs_inode_close(src_ni);
+		stats.errors++;
+		return (-1);
+	}
+	linked = !isdir && (le16_to_cpu(src_ni->mrec->link_count) > 1);
+	target = (linked ? link_get(links, e->inum) : 0);
+	dir_inum = (*pdst_dir)->mft_no;
+	dst_ni = (ntfs_inode*)NULL;
+	res = 0;
+	if (dst_inum) {
+		dst_ni = ntfs_inode_open(dst_vol, dst_inum);
+		if (!dst_ni) {
+			ntfs_log_perror("Failed to open %s", path);
+			ntfs_inode_close(src_ni);
+			stats.errors++;
+			return (-1);
+		}
+			/*
+			 * Replace the entry if the type differs, or if the
+			 * inode is not the one expected for a hard link, or
+			 * if it is shared by hard links which are not in
+			 * the source.
+			 */
+		if (isdir)
+			replace = !(dst_ni->mrec->flags
+					& MFT_RECORD_IS_DIRECTORY);
+		else
+			replace = (dst_ni->mrec->flags
+					& MFT_RECORD_IS_DIRECTORY)
+			    || (target && (target != dst_inum))
+			    || (!target
+				&& (link_get(claimed, dst_inum)
+				    || (!linked
+					&& (le16_to_cpu(dst_ni->mrec->link_count)
+						> 1))));
+		if (replace) {
+			old.name = e->name;
+			old.len = e->len;
+			old.inum = dst_inum;
+			old.isdir = (dst_ni->mrec->flags
+					& MFT_RECORD_IS_DIRECTORY) != 0;
+			ntfs_inode_close(dst_ni);
+			dst_ni = (ntfs_inode*)NULL;
+				/* ntfs_delete() closes the directory */
+			if (!opts.noaction) {
+				ntfs_inode_close(*pdst_dir);
+				*pdst_dir = (ntfs_inode*)NULL;
+			}
+			if (delete_entry(dir_inum, &old, path))
+				res = -1;
+			if (!*pdst_dir) {
+				*pdst_dir = ntfs_inode_open(dst_vol, dir_inum);
+				if (!*pdst_dir) {
+					ntfs_log_perror("Failed to reopen the "
+						"directory of %s", path);
+					res = -1;
+				}
+			}
+		}
+	}
+	if (!res && !dst_ni) {
+		ntfs_log_verbose("creating %s\n", path);
+		stats.created++;
+		if (opts.noaction) {
+			if (isdir)
+				count_tree(e->inum, path);
+			else
+				stats.written += src_ni->data_size;
+			ntfs_inode_close(src_ni);
+			return (0);
+		}
+		if (target) {
+			target_ni = ntfs_inode_open(dst_vol, target);
+			if (!target_ni
+			    || ntfs_link(target_ni, *pdst_dir, e->name,
+					e->len)) {
+				ntfs_log_perror("Failed to link %s", path);
+				res = -1;
+			}
+			if (target_ni
+			    && close_in_dir(target_ni, pdst_dir)) {
+				ntfs_log_perror("Failed to update %s", path);
+				res = -1;
+			}
+			ntfs_inode_close(src_ni);
+			if (res)
+				stats.errors++;
+			return (res);
+		}
+		dst_ni = ntfs_create(*pdst_dir, const_cpu_to_le32(0),
+				e->name, e->len, (isdir ? S_IFDIR : S_IFREG));
+		if (!dst_ni) {
+			ntfs_log_perror("Failed to create %s", path);
+			res = -1;
+		}
+		created = TRUE;
+	} else
+		created = FALSE;
+	if (res) {
+		ntfs_inode_close(src_ni);
+		stats.errors++;
+		return (-1);
+	}
+	if (linked || (le16_to_cpu(dst_ni->mrec->link_count) > 1)) {
+		link_put(links, e->inum, dst_ni->mft_no);
+		link_put(claimed, dst_ni->mft_no, e->inum);
+	}
+	changed = fixed = 0;
+	if (target) {
+		/* another name of a file already synced */
+	} else {
+		fixed |= sync_security(src_ni, dst_ni, path);
+		fixed |= sync_attrib(src_ni, dst_ni, path);
+		if (!isdir) {
+			changed = sync_streams(src_ni, dst_ni, path);
+			fixed |= sync_reparse(src_ni, dst_ni, path);
+		}
+	}
+	fixed |= sync_dos_name(src_ni, src_dir, &dst_ni, pdst_dir, path);
+	if (dst_ni) {
+		if (isdir) {
+			if (add_subdir(psubdirs, psubdir_count, e->inum,
+					dst_ni->mft_no, path))
+				fixed = -1;
+		} else
+			if (!target)
+				fixed |= sync_times(src_ni, dst_ni, path);
+		if (close_in_dir(dst_ni, pdst_dir)) {
+			ntfs_log_perror("Failed to update %s", path);
+			fixed = -1;
+		}
+	}
+	ntfs_inode_close(src_ni);
+	if ((changed < 0) || (fixed < 0)) {
+		stats.errors++;
+		return (-1);
+	}
+	if (!created) {
+		if (changed) {
+			ntfs_log_verbose("updating %s\n", path);
+			stats.updated++;
+		} else
+			if (fixed) {
+				ntfs_log_verbose("fixing %s\n", path);
+				stats.fixed++;
+			}
+	}
+	return (0);
+}
+
+/**
+ * sync_dir - Make a destination directory a copy of a source one
+ *
+ * First the entries which are not in the source are deleted, then the
+ * entries of the source are created or updated, and the subdirectories
+ * are synced. The reparse data and the times of the directory itself are
+ * copied last.
+ *
+ * Return:  0 Success
+ *	   -1 Error
+ */
+static int sync_dir(u64 src_inum, u64 dst_inum, const char *path)
+{
+	struct dirlist src_list;
+	struct dirlist dst_list;
+	struct subdir *subdirs;
+	ntfs_inode *src_dir;
+	ntfs_inode *dst_dir;
+	char *child;
+	int subdir_count;
+	int cmp;
+	int res;
+	int i, j;
+
+	if (read_dir(src_vol, src_inum, &src_list, path, TRUE)) {
+		stats.errors++;
+		return (-1);
+	}
+	if (read_dir(dst_vol, dst_inum, &dst_list, path,
+			!opts.delete_excluded)) {
+		free_list(&src_list);
+		stats.errors++;
+		return (-1);
+	}
+	res = 0;
+		/* delete what is not in the source */
+	for (i=0, j=0; (j<dst_list.count) && !caught_terminate; j++) {
+		cmp = 1;
+		while ((i < src_list.count)
+		    && ((cmp = compare_entries(&src_list.entries[i],
+					&dst_list.entries[j])) < 0))
+			i++;
+		if (cmp) {
+			child = child_path(path, dst_list.entries[j].mbsname);
+			if (!child || delete_entry(dst_inum,
+					&dst_list.entries[j], child))
+				res = -1;
+			free(child);
+		}
+	}
+		/* create or update the source entries */
+	subdirs = (struct subdir*)NULL;
+	subdir_count = 0;
+	src_dir = ntfs_inode_open(src_vol, src_inum);
+	dst_dir = ntfs_inode_open(dst_vol, dst_inum);
+	if (!src_dir || !dst_dir) {
+		ntfs_log_perror("Failed to open the directory %s/", path);
+		res = -1;
+	}
+	for (i=0, j=0; (i<src_list.count) && src_dir && dst_dir
+				&& !caught_terminate; i++) {
+		cmp = 1;
+		while ((j < dst_list.count)
+		    && ((cmp = compare_entries(&dst_list.entries[j],
+					&src_list.entries[i])) < 0))
+			j++;
+		stats.entries++;
+		child = child_path(path, src_list.entries[i].mbsname);
+		if (!child
+		    || sync_entry(src_dir, &dst_dir, &src_list.entries[i],
+				(cmp ? 0 : dst_list.entries[j].inum), child,
+				&subdirs, &subdir_count))
+			res = -1;
+		free(child);
+	}
+	if (src_dir)
+		ntfs_inode_close(src_dir);
+	if (dst_dir && ntfs_inode_close(dst_dir)) {
+		ntfs_log_perror("Failed to update the directory %s/", path);
+		res = -1;
+	}
+	free_list(&src_list);
+	free_list(&dst_list);
+	for (i=0; i<subdir_count; i++) {
+		if (!caught_terminate) {
+			if (opts.noaction && !subdirs[i].dst_inum)
+				count_tree(subdirs[i].src_inum,
+						subdirs[i].path);
+			else
+				if (sync_dir(subdirs[i].src_inum,
+						subdirs[i].dst_inum,
+						subdirs[i].path))
+					res = -1;
+		}
+		free(subdirs[i].path);
+	}
+	free(subdirs);
+	if (caught_terminate)
+		return (-1);
+		/* now the directory will not change any more */
+	src_dir = ntfs_inode_open(src_vol, src_inum);
+	dst_dir = ntfs_inode_open(dst_vol, dst_inum);
+	if (src_dir && dst_dir) {
+		if ((sync_reparse(src_dir, dst_dir, path) < 0)
+		    || (sync_times(src_dir, dst_dir, path) < 0))
+			res = -1;
+	} else
+		res = -1;
+	if (src_dir)
+		ntfs_inode_close(src_dir);
+	if (dst_dir && ntfs_inode_close(dst_dir))
+		res = -1;
+	if (res)
+		stats.errors++;
+	return (res);
+}
+
+/**
+ * sync_tree - Sync a directory given by its path in both volumes
+ *
+ * Return:  0 Success
+ *	   -1 Error
+ */
+static int sync_tree(const char *dir)
+{
+	ntfs_inode *src_ni;
+	ntfs_inode *dst_ni;
+	char *path;
+	u64 src_inum, dst_inum;
+	int res;
+
+	res = -1;
+		/* a leading '/', no trailing one, the root is an empty path */
+	path = (char*)malloc(strlen(dir) + 2);
+	if (!path)
+		return (-1);
+	sprintf(path, "%s%s", (dir[0] == '/' ? "" : "/"), dir);
+	while (path[0] && (path[strlen(path) - 1] == '/'))
+		path[strlen(path) - 1] = 0;
+	src_ni = ntfs_pathname_to_inode(src_vol, NULL, (path[0] ? path : "/"));
+	dst_ni = ntfs_pathname_to_inode(dst_vol, NULL, (path[0] ? path : "/"));
+	if (!src_ni || !(src_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY))
+		ntfs_log_error("%s/ is not a directory in %s\n", path,
+				opts.source);
+	else
+		if (!dst_ni || !(dst_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY))
+			ntfs_log_error("%s/ is not a directory in %s\n", path,
+					opts.device);
+		else {
+			res = 0;
+			if ((sync_security(src_ni, dst_ni, path) < 0)
+			    || (sync_attrib(src_ni, dst_ni, path) < 0))
+				res = -1;
+			src_inum = src_ni->mft_no;
+			dst_inum = dst_ni->mft_no;
+		}
+	if (src_ni)
+		ntfs_inode_close(src_ni);
+	if (dst_ni && ntfs_inode_close(dst_ni))
+		res = -1;
+	if (!res && sync_dir(src_inum, dst_inum, path))
+		res = -1;
+	free(path);
+	return (res);
+}
+
+/**
+ * open_secure - Prepare for copying the security descriptors
+ */
+static void open_secure(ntfs_volume *vol, struct SECURITY_CONTEXT *scx,
+		struct PERMISSIONS_CACHE **pseccache)
+{
+	memset(scx, 0, sizeof(struct SECURITY_CONTEXT));
+	scx->vol = vol;
+	*pseccache = (struct PERMISSIONS_CACHE*)NULL;
+	scx->pseccache = pseccache;
+	if (ntfs_open_secure(vol))
+		secure = FALSE;
+}
+
+/**
+ * main - Begin here
+ *
+ * Start from here.
+ *
+ * Return:  0  Success, the program worked
+ *	    1  Error, nothing or only part of the volume was synced
+ *	    2  Some files could not be synced
+ */
+int main(int argc, char *argv[])
+{
+	int flags;
+	int result = 1;
+	int i;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	if (!parse_options(argc, argv))
+		return 1;
+
+	utils_set_locale();
+
+	/* Set SIGINT handler. */
+	if (signal(SIGINT, signal_handler) == SIG_ERR) {
+		ntfs_log_perror("Failed to set SIGINT handler");
+		return 1;
+	}
+	/* Set SIGTERM handler. */
+	if (signal(SIGTERM, signal_handler) == SIG_ERR) {
+		ntfs_log_perror("Failed to set SIGTERM handler");
+		return 1;
+	}
+
+	flags = (opts.force ? NTFS_MNT_RECOVER : 0);
+	src_vol = utils_mount_volume(opts.source, flags | NTFS_MNT_RDONLY);
+	if (!src_vol) {
+		ntfs_log_perror("ERROR: couldn't mount volume %s",
+				opts.source);
+		return 1;
+	}
+	if (opts.noaction)
+		flags |= NTFS_MNT_RDONLY;
+	else if (opts.remove_hiberfile)
+		flags |= NTFS_MNT_IGNORE_HIBERFILE;
+	dst_vol = utils_mount_volume(opts.device, flags);
+	if (!dst_vol) {
+		ntfs_log_perror("ERROR: couldn't mount volume %s",
+				opts.device);
+		goto umount_src;
+	}
+	if ((dst_vol->flags & VOLUME_IS_DIRTY) && !opts.force) {
+		ntfs_log_error("%s is marked dirty, use --force to sync it "
+				"anyway.\n", opts.device);
+		goto umount;
+	}
+	if ((flags & NTFS_MNT_IGNORE_HIBERFILE) && remove_hiberfile())
+		goto umount;
+	NVolSetCompression(dst_vol); /* allow compression */
+	if (ntfs_volume_get_free_space(dst_vol)) {
+		ntfs_log_perror("ERROR: couldn't get free space");
+		goto umount;
+	}
+	secure = TRUE;
+	open_secure(src_vol, &src_scx, &src_seccache);
+	open_secure(dst_vol, &dst_scx, &dst_seccache);
+	if (!secure)
+		ntfs_log_error("Warning : the security descriptors are not "
+				"copied (old NTFS version ?)\n");
+
+	src_buf = (char*)ntfs_malloc(BUFSZ);
+	dst_buf = (char*)ntfs_malloc(BUFSZ);
+	if (src_buf && dst_buf) {
+		result = 0;
+		if (!opts.dircount)
+			result = sync_tree("/") ? 1 : 0;
+		for (i=0; (i<opts.dircount) && !caught_terminate; i++)
+			if (sync_tree(opts.dirs[i]))
+				result = 1;
+		if (caught_terminate) {
+			ntfs_log_error("Interrupted, the volume is only "
+					"partially synced.\n");
+			result = 1;
+		} else
+			if (stats.errors)
+				result = 2;
+	}
+	free(src_buf);
+	free(dst_buf);
+	link_free(links);
+	link_free(claimed);
+
+	ntfs_log_quiet("%lld entries, %lld created, %lld updated, "
+		"%lld fixed, %lld deleted, %.1f MB %s, %lld errors\n",
+		stats.entries, stats.created, stats.updated, stats.fixed,
+		stats.deleted, stats.written/1048576.0,
+		(opts.noaction ? "to write" : "written"), stats.errors);
+
+	ntfs_close_secure(&dst_scx);
+	ntfs_close_secure(&src_scx);
+umount:
+	if (ntfs_umount(dst_vol, FALSE)) {
+		ntfs_log_perror("Failed to close volume %s", opts.device);
+		result = 1;
+	}
+umount_src:
+	ntfs_umount(src_vol, FALSE);
+	return (result);
+}
+
+#else /* HAVE_SETXATTR */
+
+int main(int argc, char *argv[])
+{
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	if (parse_options(argc, argv))
+		ntfs_log_error("%s needs libntfs-3g with extended "
+			"attributes support\n", EXEC_NAME);
+	return (1);
+}
+
+#endif /* HAVE_SETXATTR */
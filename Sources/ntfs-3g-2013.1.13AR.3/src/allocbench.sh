@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# allocbench.sh - Fragmentation of files written in parallel
+#
+# Creates an empty NTFS image file per set of mount options, writes JOBS
+# files of SIZE MB in parallel into it (as an image restore unpacking
+# several big files does), checks them, and prints the time taken and
+# the number of runs in the files, as listed by ntfsinfo. Without
+# delay_alloc the writers take clusters in turn and the files end up
+# interleaved.
+#
+# Must be run as root.  The programs are taken from $PATH unless NTFS3G,
+# MKNTFS and NTFSINFO name them, e.g. for a build tree :
+#
+#   LD_LIBRARY_PATH=libntfs-3g/.libs NTFS3G=src/.libs/ntfs-3g \
+#   MKNTFS=ntfsprogs/mkntfs NTFSINFO=ntfsprogs/ntfsinfo src/allocbench.sh
+#
+# This program/include file is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as published
+# by the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+NTFS3G="${NTFS3G:-ntfs-3g}"
+MKNTFS="${MKNTFS:-mkntfs}"
+NTFSINFO="${NTFSINFO:-ntfsinfo}"
+
+dir="${TMPDIR:-/tmp}/allocbench.$$"
+jobs=4
+mb=64
+bs=128
+sets="default delay_alloc"
+opts="noatime,big_writes"
+
+usage() {
+	cat <<EOF
+usage: $0 [options]
+  -j N       parallel writers (default $jobs)
+  -m MB      size of each file (default $mb)
+  -b KB      size of the writes (default $bs)
+  -O LIST    mount option sets to compare, "default" for none
+             (default "$sets")
+  -o OPTS    extra mount options (default "$opts")
+EOF
+	exit 1
+}
+
+while getopts "j:m:b:O:o:h" opt; do
+	case "$opt" in
+	j) jobs="$OPTARG" ;;
+	m) mb="$OPTARG" ;;
+	b) bs="$OPTARG" ;;
+	O) sets="$OPTARG" ;;
+	o) opts="$OPTARG" ;;
+	*) usage ;;
+	esac
+done
+
+mnt="$dir/mnt"
+image="$dir/ntfs.img"
+data="$dir/data"
+
+cleanup() {
+	mountpoint -q "$mnt" 2>/dev/null && umount "$mnt"
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+die() {
+	echo "$0: $*" >&2
+	exit 1
+}
+
+now() {
+	date +%s.%N
+}
+
+mkdir -p "$mnt" || die "cannot create $mnt"
+dd if=/dev/urandom of="$data" bs=1M count=$mb 2>/dev/null ||
+	die "cannot create $data"
+
+printf "%d writers, %d MB each, %d KB writes\n" $jobs $mb $bs
+printf "%-24s %10s %10s\n" options seconds runs
+for s in $sets; do
+	[ "$s" = "default" ] && o="$opts" || o="$opts,$s"
+	rm -f "$image"
+	truncate -s "$((jobs * mb * 2 + 64))M" "$image" ||
+		die "cannot create $image"
+	"$MKNTFS" -F -f -q "$image" > /dev/null 2>&1 || die "mkntfs failed"
+	"$NTFS3G" -o "$o" "$image" "$mnt" || die "cannot mount $image"
+	start=$(now)
+	j=0
+	while [ $j -lt $jobs ]; do
+		dd if="$data" of="$mnt/f$j" bs=${bs}k 2>/dev/null &
+		j=$((j + 1))
+	done
+	wait
+	end=$(now)
+	umount "$mnt" || die "cannot unmount $mnt"
+	"$NTFS3G" -o ro "$image" "$mnt" || die "cannot mount $image"
+	j=0
+	while [ $j -lt $jobs ]; do
+		cmp -s "$data" "$mnt/f$j" || die "bad contents of f$j with $s"
+		j=$((j + 1))
+	done
+	umount "$mnt"
+	runs=0
+	j=0
+	while [ $j -lt $jobs ]; do
+		r=$("$NTFSINFO" -F "/f$j" -v "$image" |
+			sed -n 's/^Total runs: \([0-9]*\).*/\1/p')
+		runs=$((runs + ${r:-0}))
+		j=$((j + 1))
+	done
+	awk -v o="$s" -v s=$start -v e=$end -v r=$runs 'BEGIN {
+		printf "%-24s %10.2f %10d\n", o, e - s, r }'
+done
@@ -0,0 +1,142 @@
+#!/bin/sh
+#
+# cachebench.sh - Stat walks over a big tree with several cache sizes
+#
+# Creates an NTFS image file holding a WinSxS-like tree, many directories
+# with long names sharing a prefix and a few files each, 500k files by
+# default. Then for each set of cache options it mounts the image, walks
+# the tree twice with find, stating every entry (as rsync and the stats
+# preload do), and prints the times along with the cache statistics which
+# ntfs-3g logs at unmount.
+#
+# Must be run as root.  The programs are taken from $PATH unless NTFS3G
+# and MKNTFS name them, e.g. for a build tree :
+#
+#   LD_LIBRARY_PATH=libntfs-3g/.libs NTFS3G=src/.libs/ntfs-3g \
+#   MKNTFS=ntfsprogs/mkntfs src/cachebench.sh -i /tmp/500k.img
+#
+# This program/include file is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as published
+# by the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+NTFS3G="${NTFS3G:-ntfs-3g}"
+MKNTFS="${MKNTFS:-mkntfs}"
+
+image=""
+dir="${TMPDIR:-/tmp}/cachebench.$$"
+size=2048
+dirs=20000
+files=25
+caches="default inode_cache=1048576,nidata_cache=65536"
+opts="noatime"
+
+usage() {
+	cat <<EOF
+usage: $0 [options]
+  -i IMAGE   use (and keep) this image file instead of a temporary one;
+             an existing image is not filled again
+  -s MB      image size (default $size)
+  -d N       number of directories (default $dirs)
+  -f N       files per directory (default $files)
+  -C LIST    cache option sets to compare, "default" for the built-in
+             sizes (default "$caches")
+  -o OPTS    extra mount options (default "$opts")
+EOF
+	exit 1
+}
+
+while getopts "i:s:d:f:C:o:h" opt; do
+	case "$opt" in
+	i) image="$OPTARG" ;;
+	s) size="$OPTARG" ;;
+	d) dirs="$OPTARG" ;;
+	f) files="$OPTARG" ;;
+	C) caches="$OPTARG" ;;
+	o) opts="$OPTARG" ;;
+	*) usage ;;
+	esac
+done
+
+mnt="$dir/mnt"
+log="$dir/log"
+sxs="Windows/winsxs"
+keep="$image"
+[ -n "$image" ] || image="$dir/ntfs.img"
+
+cleanup() {
+	mountpoint -q "$mnt" 2>/dev/null && umount "$mnt"
+	[ -n "$keep" ] || rm -f "$image"
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+die() {
+	echo "$0: $*" >&2
+	exit 1
+}
+
+now() {
+	date +%s.%N
+}
+
+# Mount in the foreground so that the unmount statistics go to $log
+mount_image() {
+	: > "$log"
+	"$NTFS3G" -o "no_detach,$1" "$image" "$mnt" 2>> "$log" &
+	pid=$!
+	t=0
+	while ! mountpoint -q "$mnt"; do
+		kill -0 $pid 2>/dev/null || die "cannot mount $image"
+		t=$((t + 1))
+		[ $t -lt 100 ] || die "timeout mounting $image"
+		sleep 0.1
+	done
+}
+
+umount_image() {
+	umount "$mnt" || die "cannot unmount $mnt"
+	wait $pid
+}
+
+fill_image() {
+	echo "Filling $image with $dirs x $files files..."
+	mount_image "$opts"
+	mkdir -p "$mnt/$sxs" || die "cannot create $sxs"
+	d=0
+	while [ $d -lt $dirs ]; do
+		p=$(printf "%s/%s/amd64_microsoft-windows-component%d_31bf3856ad364e35_6.1.7601.17514_none_%08x" \
+			"$mnt" "$sxs" $d $((d * 2654435761 % 4294967296)))
+		mkdir "$p" || die "cannot create $p (image too small?)"
+		(cd "$p" && seq -f "file%g.dll" 1 $files | xargs touch) ||
+			die "cannot fill $p (image too small?)"
+		d=$((d + 1))
+	done
+	umount_image
+}
+
+# Prints the number of entries and the seconds taken
+walk() {
+	start=$(now)
+	n=$(find "$mnt" -printf '%s\n' | wc -l)
+	end=$(now)
+	awk -v n=$n -v s=$start -v e=$end 'BEGIN { printf "%d %.2f", n, e - s }'
+}
+
+mkdir -p "$mnt" || die "cannot create $mnt"
+if [ ! -f "$image" ]; then
+	truncate -s "${size}M" "$image" || die "cannot create $image"
+	"$MKNTFS" -F -f -q "$image" > /dev/null || die "mkntfs failed"
+	fill_image
+fi
+
+for c in $caches; do
+	[ "$c" = "default" ] && o="$opts" || o="$opts,$c"
+	sync && echo 3 > /proc/sys/vm/drop_caches 2>/dev/null
+	mount_image "$o"
+	set -- $(walk) $(walk)
+	umount_image
+	echo "$c: $1 entries, first walk $2s, second walk $4s"
+	sed -n 's/^/    /; /cache :/p' "$log"
+done
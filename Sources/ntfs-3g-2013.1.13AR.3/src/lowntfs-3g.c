@@ -97,6 +97,7 @@
 #include "logging.h"
 #include "xattrs.h"
 #include "misc.h"
+#include "cache.h"
 
 #include "ntfs-3g_common.h"
 
@@ -3666,6 +3667,7 @@ static void ntfs_close(void)
 			}
 		}
 		ntfs_close_secure(&security);
+		ntfs_log_cache_stats(ctx->vol);
 	}
         
 	if (ntfs_umount(ctx->vol, FALSE))
@@ -3740,7 +3742,10 @@ static int ntfs_fuse_init(void)
 #endif		        
 		.atime	 = ATIME_RELATIVE,
 		.silent  = TRUE,
-		.recover = TRUE
+		.recover = TRUE,
+		.inode_cache = CACHE_INODE_SIZE,
+		.nidata_cache = CACHE_NIDATA_SIZE,
+		.lookup_cache = CACHE_LOOKUP_SIZE
 	};
 	return 0;
 }
@@ -3764,6 +3769,9 @@ static int ntfs_open(const char *device)
 		ntfs_log_perror("Failed to mount '%s'", device);
 		goto err_out;
 	}
+	if (ntfs_resize_lru_caches(ctx->vol, ctx->inode_cache,
+			ctx->nidata_cache, ctx->lookup_cache))
+		ntfs_log_perror("Failed to size the inode caches");
 	if (ctx->sync && ctx->vol->dev)
 		NDevSetSync(ctx->vol->dev);
 	if (ctx->compression)
@@ -4265,6 +4273,11 @@ int main(int argc, char *argv[])
 	if (permissions_mode)
 		ntfs_log_info("%s, configuration type %d\n",permissions_mode,
 			5 + POSIXACLS*6 - KERNELPERMS*3 + CACHEING);
+	if (ctx->threads > 1)
+		ntfs_log_info("Option 'threads' is ignored by %s\n", EXEC_NAME);
+	if (ctx->delay_alloc)
+		ntfs_log_info("Option 'delay_alloc' is ignored by %s\n",
+				EXEC_NAME);
         
 	fuse_session_loop(se);
 	fuse_remove_signal_handlers(se);
@@ -0,0 +1,163 @@
+#!/bin/sh
+#
+# mtbench.sh - Parallel find+cat against a loop-mounted NTFS image
+#
+# Creates an NTFS image file, fills it with a tree of files, then mounts
+# it once per thread count and times JOBS parallel find+cat workers,
+# each of them walking its own part of the tree.  Threads 1 is the
+# classic single-threaded loop, any other count mounts with -o threads=N.
+# After each timed run the file contents are checked with md5sum.
+#
+# Must be run as root.  The programs are taken from $PATH unless NTFS3G
+# and MKNTFS name them, e.g. for a build tree :
+#
+#   LD_LIBRARY_PATH=libntfs-3g/.libs NTFS3G=src/.libs/ntfs-3g \
+#   MKNTFS=ntfsprogs/mkntfs src/mtbench.sh -t "1 2 4 8"
+#
+# This program/include file is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as published
+# by the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+NTFS3G="${NTFS3G:-ntfs-3g}"
+MKNTFS="${MKNTFS:-mkntfs}"
+
+image=""
+dir="${TMPDIR:-/tmp}/mtbench.$$"
+size=1024
+jobs=8
+threads="1 4"
+dirs=32
+files=64
+opts="noatime"
+drop=""
+
+usage() {
+	cat <<EOF
+usage: $0 [options]
+  -i IMAGE   use (and keep) this image file instead of a temporary one;
+             an existing image is not filled again
+  -s MB      image size (default $size)
+  -d N       number of top directories (default $dirs)
+  -f N       files per directory (default $files)
+  -j N       parallel find+cat workers (default $jobs)
+  -t LIST    thread counts to compare (default "$threads")
+  -o OPTS    extra mount options (default "$opts")
+  -c         drop the page cache before each run (cold image reads)
+EOF
+	exit 1
+}
+
+while getopts "i:s:d:f:j:t:o:ch" opt; do
+	case "$opt" in
+	i) image="$OPTARG" ;;
+	s) size="$OPTARG" ;;
+	d) dirs="$OPTARG" ;;
+	f) files="$OPTARG" ;;
+	j) jobs="$OPTARG" ;;
+	t) threads="$OPTARG" ;;
+	o) opts="$OPTARG" ;;
+	c) drop=1 ;;
+	*) usage ;;
+	esac
+done
+
+mnt="$dir/mnt"
+sums="$dir/md5sums"
+keep="$image"
+[ -n "$image" ] || image="$dir/ntfs.img"
+
+cleanup() {
+	mountpoint -q "$mnt" 2>/dev/null && umount "$mnt"
+	[ -n "$keep" ] || rm -f "$image"
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+die() {
+	echo "$0: $*" >&2
+	exit 1
+}
+
+now() {
+	date +%s.%N
+}
+
+mount_image() {
+	if [ "$1" -gt 1 ]; then
+		"$NTFS3G" -o "$opts,threads=$1" "$image" "$mnt"
+	else
+		"$NTFS3G" -o "$opts" "$image" "$mnt"
+	fi || die "cannot mount $image"
+}
+
+# Sizes from 1KB to 1MB, mostly small as in a Windows system tree
+fill_image() {
+	echo "Filling $image with $dirs x $files files..."
+	mount_image 1
+	d=0
+	while [ $d -lt $dirs ]; do
+		mkdir -p "$mnt/d$d/sub"
+		f=0
+		while [ $f -lt $files ]; do
+			case $((f % 8)) in
+			0) kb=1024 ;;
+			1|2) kb=64 ;;
+			*) kb=$((f % 16 + 1)) ;;
+			esac
+			[ $((f % 2)) = 0 ] && p="$mnt/d$d/f$f" || p="$mnt/d$d/sub/f$f"
+			dd if=/dev/urandom of="$p" bs=1024 count=$kb 2>/dev/null ||
+				die "cannot write $p (image too small?)"
+			f=$((f + 1))
+		done
+		d=$((d + 1))
+	done
+	(cd "$mnt" && find . -type f -exec md5sum {} + > "$sums")
+	umount "$mnt"
+}
+
+# Worker $1 of $jobs walks every jobs-th top directory
+worker() {
+	d=$1
+	set --
+	while [ $d -lt $dirs ]; do
+		set -- "$@" "$mnt/d$d"
+		d=$((d + jobs))
+	done
+	[ $# -gt 0 ] && find "$@" -type f -exec cat {} + > /dev/null
+}
+
+mkdir -p "$mnt" || die "cannot create $mnt"
+if [ ! -f "$image" ]; then
+	truncate -s "${size}M" "$image" || die "cannot create $image"
+	"$MKNTFS" -F -f -q "$image" > /dev/null || die "mkntfs failed"
+	fill_image
+else
+	mount_image 1
+	(cd "$mnt" && find . -type f -exec md5sum {} + > "$sums")
+	umount "$mnt"
+fi
+
+nfiles=$(wc -l < "$sums")
+mb=$(mount_image 1; du -sm "$mnt" | cut -f1; umount "$mnt")
+
+printf "%d files, %d MB, %d workers\n" "$nfiles" "$mb" "$jobs"
+printf "%8s %10s %10s %10s\n" threads seconds "MB/s" "files/s"
+for t in $threads; do
+	[ -n "$drop" ] && sync && echo 3 > /proc/sys/vm/drop_caches
+	mount_image $t
+	start=$(now)
+	j=0
+	while [ $j -lt $jobs ]; do
+		worker $j &
+		j=$((j + 1))
+	done
+	wait
+	end=$(now)
+	(cd "$mnt" && md5sum -c --quiet "$sums") || die "bad contents with $t threads"
+	umount "$mnt"
+	awk -v t=$t -v s=$start -v e=$end -v mb=$mb -v n=$nfiles 'BEGIN {
+		d = e - s; if (d <= 0) d = 0.001;
+		printf "%8d %10.2f %10.1f %10.0f\n", t, d, mb / d, n / d }'
+done
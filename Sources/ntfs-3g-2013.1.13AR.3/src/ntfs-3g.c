@@ -96,6 +96,7 @@
 #include "logging.h"
 #include "xattrs.h"
 #include "misc.h"
+#include "cache.h"
 
 #include "ntfs-3g_common.h"
 
@@ -141,15 +142,31 @@ typedef struct {
 enum {
 	CLOSE_COMPRESSED = 1,
 	CLOSE_ENCRYPTED = 2,
-	CLOSE_DMTIME = 4
+	CLOSE_DMTIME = 4,
+	CLOSE_DELAYED = 8
 };
 
+	/* sequential writes gathered for an inode (delay_alloc option) */
+struct DELAYED_WRITE {
+	struct DELAYED_WRITE *next;
+	u64 inum;
+	s64 pos;	/* file offset of the buffer */
+	u32 count;	/* bytes in the buffer */
+	char *buf;	/* ctx->delay_alloc bytes */
+} ;
+
 static struct ntfs_options opts;
 
 const char *EXEC_NAME = "ntfs-3g";
 
 static ntfs_fuse_context_t *ctx;
 static u32 ntfs_sequence;
+static struct DELAYED_WRITE *delayed_writes; /* most recent first */
+static int delayed_count;
+
+	/* per thread state of the multi-threaded loop (threads option) */
+static __thread BOOL ntfs_fuse_shared; /* the volume lock is shared */
+static __thread BOOL ntfs_fuse_atime_pending; /* atime update deferred */
 
 static const char *usage_msg = 
 "\n"
@@ -234,6 +251,12 @@ static void ntfs_fuse_update_times(ntfs_inode *ni, ntfs_time_update_flags mask)
 			(le64_to_cpu(ni->last_access_time)
 				>= le64_to_cpu(ni->last_mft_change_time)))
 		return;
+	if (ntfs_fuse_shared && (mask == NTFS_UPDATE_ATIME)
+	    && !NVolReadOnly(ni->vol)) {
+		/* inodes must stay clean, see ntfs_fuse_mt_atime() */
+		ntfs_fuse_atime_pending = TRUE;
+		return;
+	}
 	ntfs_inode_update_times(ni, mask);
 }
 
@@ -1191,6 +1214,13 @@ static int ntfs_fuse_open(const char *org_path,
 			/* mark a future need to update the mtime */
 				if (ctx->dmtime)
 					fi->fh |= CLOSE_DMTIME;
+			/* writes to the unnamed stream may be delayed */
+				if (ctx->delay_alloc
+				    && !stream_name_len
+				    && !(fi->flags & O_SYNC)
+				    && !(na->data_flags & (ATTR_COMPRESSION_MASK
+						| ATTR_IS_ENCRYPTED)))
+					fi->fh |= CLOSE_DELAYED;
 			/* deny opening metadata files for writing */
 				if (ni->mft_no < FILE_first_user)
 					res = -EPERM;
@@ -1278,8 +1308,181 @@ exit:
 	return res;
 }
 
+/*
+ *		Delayed allocation (delay_alloc option)
+ *
+ *	Sequential writes which extend the unnamed data stream of a file
+ *	are gathered in a buffer for the inode. When the buffer is full,
+ *	or when the file is flushed or closed, the clusters for the whole
+ *	buffer are allocated at once, for the final size when the whole
+ *	file fitted, and the data is written by big pwrites. The resulting
+ *	runlists have a few big extents instead of many small ones.
+ *
+ *	Any operation other than on an open file first writes out all
+ *	the buffers (see ntfs_fuse_lock_exclusive()), so that the files
+ *	are seen as if the writes had not been delayed.
+ */
+
+static struct DELAYED_WRITE *ntfs_fuse_find_delayed(u64 inum)
+{
+	struct DELAYED_WRITE *dw;
+
+	for (dw=delayed_writes; dw && (dw->inum != inum); dw=dw->next)
+		;
+	return (dw);
+}
+
+/*
+ *		Write out a delayed buffer and free it
+ *
+ *	@ni is the inode if already open, otherwise NULL
+ *	Returns 0 or a negative error code
+ */
+
+static int ntfs_fuse_write_delayed(struct DELAYED_WRITE *dw,
+			ntfs_inode *ni)
+{
+	struct DELAYED_WRITE **pdw;
+	ntfs_inode *dw_ni;
+	ntfs_attr *na;
+	s64 end;
+	s64 ret;
+	u32 done;
+	int res;
+
+	for (pdw=&delayed_writes; *pdw != dw; pdw=&(*pdw)->next)
+		;
+	*pdw = dw->next;
+	delayed_count--;
+	res = 0;
+	done = 0;
+	dw_ni = (ni ? ni : ntfs_inode_open(ctx->vol, dw->inum));
+	na = (dw_ni ? ntfs_attr_open(dw_ni, AT_DATA, AT_UNNAMED, 0) : NULL);
+	if (na) {
+		end = dw->pos + dw->count;
+			/* allocate for the whole buffer in one go */
+		if ((end > na->allocated_size)
+		    && (dw->pos == na->data_size))
+			ntfs_attr_truncate_solid(na, end);
+		while (done < dw->count) {
+			ret = ntfs_attr_pwrite(na, dw->pos + done,
+					dw->count - done, dw->buf + done);
+			if (ret <= 0) {
+				res = (errno ? -errno : -EIO);
+				break;
+			}
+			done += ret;
+		}
+			/* do not leave unwritten clusters on errors */
+		if (res && (na->data_size > dw->pos + done))
+			ntfs_attr_truncate(na, dw->pos + done);
+		if (done
+		    && (!ctx->dmtime
+			|| (le64_to_cpu(ntfs_current_time())
+			     - le64_to_cpu(dw_ni->last_data_change_time))
+				> ctx->dmtime))
+			ntfs_fuse_update_times(dw_ni, NTFS_UPDATE_MCTIME);
+		ntfs_attr_close(na);
+	} else
+		res = -errno;
+	if (done)
+		set_archive(dw_ni);
+	if (dw_ni && !ni && ntfs_inode_close(dw_ni))
+		set_fuse_error(&res);
+	if (res)
+		ntfs_log_perror("Failed to write delayed data to inode %lld",
+				(long long)dw->inum);
+	free(dw->buf);
+	free(dw);
+	return (res);
+}
+
+/*
+ *		Write out all the delayed buffers
+ */
+
+static void ntfs_fuse_flush_delayed(void)
+{
+	while (delayed_writes)
+		ntfs_fuse_write_delayed(delayed_writes, (ntfs_inode*)NULL);
+}
+
+/*
+ *		Gather a write into the delayed buffer of the inode
+ *
+ *	Returns the size if the data was buffered, 0 if it has to be
+ *	written directly, or a negative error code
+ */
+
+static int ntfs_fuse_delay_write(ntfs_inode *ni, const char *buf,
+			size_t size, off_t offset)
+{
+	struct DELAYED_WRITE *dw;
+	struct DELAYED_WRITE *oldest;
+	ntfs_volume *vol;
+	ntfs_attr *na;
+	s64 reserved;
+	BOOL append;
+	int res;
+
+	dw = ntfs_fuse_find_delayed(ni->mft_no);
+	if (dw
+	    && (offset == dw->pos + dw->count)
+	    && (dw->count + size <= ctx->delay_alloc)) {
+		memcpy(dw->buf + dw->count, buf, size);
+		dw->count += size;
+		return (size);
+	}
+		/* not sequential or buffer full */
+	if (dw) {
+		res = ntfs_fuse_write_delayed(dw, ni);
+		if (res)
+			return (res);
+	}
+	if (size >= ctx->delay_alloc)
+		return (0);
+		/* make room, the oldest buffer is probably complete */
+	if (delayed_count >= DELAY_ALLOC_FILES) {
+		for (oldest=delayed_writes; oldest->next; oldest=oldest->next)
+			;
+		ntfs_fuse_write_delayed(oldest, (ntfs_inode*)NULL);
+	}
+		/* only appending to a plain file, when space is available */
+	vol = ni->vol;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		return (-errno);
+	reserved = ((s64)(delayed_count + 1)*ctx->delay_alloc)
+				>> vol->cluster_size_bits;
+	append = (offset == na->data_size)
+		&& !(na->data_flags & (ATTR_COMPRESSION_MASK
+				| ATTR_IS_ENCRYPTED))
+		&& (reserved < vol->free_clusters);
+	ntfs_attr_close(na);
+	if (!append)
+		return (0);
+	dw = (struct DELAYED_WRITE*)ntfs_malloc(sizeof(struct DELAYED_WRITE));
+	if (dw) {
+		dw->buf = (char*)ntfs_malloc(ctx->delay_alloc);
+		if (!dw->buf) {
+			free(dw);
+			dw = (struct DELAYED_WRITE*)NULL;
+		}
+	}
+	if (!dw)
+		return (0);
+	dw->inum = ni->mft_no;
+	dw->pos = offset;
+	dw->count = size;
+	memcpy(dw->buf, buf, size);
+	dw->next = delayed_writes;
+	delayed_writes = dw;
+	delayed_count++;
+	return (size);
+}
+
 static int ntfs_fuse_write(const char *org_path, const char *buf, size_t size,
-		off_t offset, struct fuse_file_info *fi __attribute__((unused)))
+		off_t offset, struct fuse_file_info *fi)
 {
 	ntfs_inode *ni = NULL;
 	ntfs_attr *na = NULL;
@@ -1297,6 +1500,11 @@ static int ntfs_fuse_write(const char *org_path, const char *buf, size_t size,
 		res = -errno;
 		goto exit;
 	}
+	if (fi->fh & CLOSE_DELAYED) {
+		res = ntfs_fuse_delay_write(ni, buf, size, offset);
+		if (res)
+			goto exit;
+	}
 	na = ntfs_attr_open(ni, AT_DATA, stream_name, stream_name_len);
 	if (!na) {
 		res = -errno;
@@ -1332,17 +1540,44 @@ out:
 	return res;
 }
 
+/*
+ *		Write out the delayed buffer when a descriptor is closed,
+ *	so that close(2) can report the errors
+ */
+
+static int ntfs_fuse_flush(const char *org_path, struct fuse_file_info *fi)
+{
+	struct DELAYED_WRITE *dw;
+	ntfs_inode *ni;
+	int res;
+
+	if (!(fi->fh & CLOSE_DELAYED) || !delayed_writes)
+		return (0);
+	ni = ntfs_pathname_to_inode(ctx->vol, NULL, org_path);
+	if (!ni)
+		return (-errno);
+	res = 0;
+	dw = ntfs_fuse_find_delayed(ni->mft_no);
+	if (dw)
+		res = ntfs_fuse_write_delayed(dw, ni);
+	if (ntfs_inode_close(ni))
+		set_fuse_error(&res);
+	return (res);
+}
+
 static int ntfs_fuse_release(const char *org_path,
 		struct fuse_file_info *fi)
 {
 	ntfs_inode *ni = NULL;
 	ntfs_attr *na = NULL;
+	struct DELAYED_WRITE *dw;
 	char *path = NULL;
 	ntfschar *stream_name;
 	int stream_name_len, res;
 
 	/* Only for marked descriptors there is something to do */
-	if (!(fi->fh & (CLOSE_COMPRESSED | CLOSE_ENCRYPTED | CLOSE_DMTIME))) {
+	if (!(fi->fh & (CLOSE_COMPRESSED | CLOSE_ENCRYPTED | CLOSE_DMTIME
+			| CLOSE_DELAYED))) {
 		res = 0;
 		goto out;
 	}
@@ -1356,6 +1591,14 @@ static int ntfs_fuse_release(const char *org_path,
 		res = -errno;
 		goto exit;
 	}
+	if (fi->fh & CLOSE_DELAYED) {
+		dw = ntfs_fuse_find_delayed(ni->mft_no);
+		if (dw) {
+			res = ntfs_fuse_write_delayed(dw, ni);
+			if (res)
+				goto exit;
+		}
+	}
 	na = ntfs_attr_open(ni, AT_DATA, stream_name, stream_name_len);
 	if (!na) {
 		res = -errno;
@@ -1748,6 +1991,12 @@ static int ntfs_fuse_create(const char *org_path, mode_t typemode, dev_t dev,
 			/* mark a need to update the mtime */
 			if (fi && ctx->dmtime)
 				fi->fh |= CLOSE_DMTIME;
+			/* writes may be delayed */
+			if (fi && ctx->delay_alloc
+			    && !(fi->flags & O_SYNC)
+			    && !(ni->flags & (FILE_ATTR_COMPRESSED
+					| FILE_ATTR_ENCRYPTED)))
+				fi->fh |= CLOSE_DELAYED;
 			NInoSetDirty(ni);
 			/*
 			 * closing ni requires access to dir_ni to
@@ -3279,6 +3528,7 @@ static void ntfs_close(void)
 	if (ctx->mounted) {
 		ntfs_log_info("Unmounting %s (%s)\n", opts.device, 
 			      ctx->vol->vol_name);
+		ntfs_fuse_flush_delayed();
 		if (ntfs_fuse_fill_security_context(&security)) {
 			if (ctx->seccache && ctx->seccache->head.p_reads) {
 				ntfs_log_info("Permissions cache : %lu writes, "
@@ -3292,6 +3542,7 @@ static void ntfs_close(void)
 			}
 		}
 		ntfs_close_secure(&security);
+		ntfs_log_cache_stats(ctx->vol);
 	}
 	
 	if (ntfs_umount(ctx->vol, FALSE))
@@ -3358,6 +3609,252 @@ static struct fuse_operations ntfs_3g_ops = {
 #endif
 };
 
+/*
+ *		Locking for the multi-threaded loop (threads option)
+ *
+ *	Lookups and reads run in parallel under the shared volume lock,
+ *	any other operation has the volume to itself (see the locking
+ *	rules in libntfs-3g/volume.c). With a user mapping, permissions
+ *	are checked through the shared security caches, so all operations
+ *	are then exclusive.
+ *
+ *	These wrappers are also used by the single-threaded loop when
+ *	writes are delayed (delay_alloc option), the locks are then
+ *	no-ops. Operations on an open file keep the delayed buffers, any
+ *	other one first writes them out, which needs the exclusive lock.
+ */
+
+static void ntfs_fuse_lock_exclusive(void)
+{
+	ntfs_volume_lock_exclusive(ctx->vol);
+	if (delayed_writes)
+		ntfs_fuse_flush_delayed();
+}
+
+static void ntfs_fuse_lock_shared(void)
+{
+	if (ctx->security.mapping[MAPUSERS])
+		ntfs_fuse_lock_exclusive();
+	else {
+		ntfs_volume_lock_shared(ctx->vol);
+			/* delayed buffers only change under exclusive lock */
+		if (delayed_writes) {
+			ntfs_volume_unlock(ctx->vol);
+			ntfs_fuse_lock_exclusive();
+		} else
+			ntfs_fuse_shared = TRUE;
+	}
+}
+
+static void ntfs_fuse_lock_file(void)
+{
+	ntfs_volume_lock_exclusive(ctx->vol);
+}
+
+static void ntfs_fuse_unlock(void)
+{
+	ntfs_fuse_shared = FALSE;
+	ntfs_volume_unlock(ctx->vol);
+}
+
+/*
+ *		Update the access time which a shared read or readdir
+ *	had to leave to an exclusive holder of the volume
+ */
+
+static void ntfs_fuse_mt_atime(const char *org_path)
+{
+	ntfs_inode *ni;
+	char *path = NULL;
+	ntfschar *stream_name;
+	int stream_name_len;
+
+	ntfs_fuse_atime_pending = FALSE;
+	stream_name_len = ntfs_fuse_parse_path(org_path, &path, &stream_name);
+	if (stream_name_len < 0)
+		return;
+	ntfs_fuse_lock_exclusive();
+	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	if (ni) {
+		ntfs_fuse_update_times(ni, NTFS_UPDATE_ATIME);
+		ntfs_inode_close(ni);
+	}
+	ntfs_fuse_unlock();
+	free(path);
+	if (stream_name_len)
+		free(stream_name);
+}
+
+static int ntfs_fuse_mt_read(const char *path, char *buf, size_t size,
+		off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+
+	ntfs_fuse_lock_shared();
+	res = ntfs_fuse_read(path, buf, size, offset, fi);
+	ntfs_fuse_unlock();
+	if (ntfs_fuse_atime_pending)
+		ntfs_fuse_mt_atime(path);
+	return res;
+}
+
+static int ntfs_fuse_mt_readdir(const char *path, void *buf,
+		fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+
+	ntfs_fuse_lock_shared();
+	res = ntfs_fuse_readdir(path, buf, filler, offset, fi);
+	ntfs_fuse_unlock();
+	if (ntfs_fuse_atime_pending)
+		ntfs_fuse_mt_atime(path);
+	return res;
+}
+
+static int ntfs_fuse_mt_release(const char *path, struct fuse_file_info *fi)
+{
+	int res;
+
+	/* Only marked descriptors update the file */
+	if (fi->fh & CLOSE_DELAYED)
+		ntfs_fuse_lock_file();
+	else if (fi->fh & (CLOSE_COMPRESSED | CLOSE_ENCRYPTED | CLOSE_DMTIME))
+		ntfs_fuse_lock_exclusive();
+	else
+		ntfs_fuse_lock_shared();
+	res = ntfs_fuse_release(path, fi);
+	ntfs_fuse_unlock();
+	return res;
+}
+
+	/* define ntfs_fuse_mt_OP() to run ntfs_fuse_OP() under a lock */
+#define NTFS_FUSE_MT_OP(op, lock, proto, args)	\
+static int ntfs_fuse_mt_##op proto		\
+{						\
+	int res;				\
+						\
+	ntfs_fuse_lock_##lock();		\
+	res = ntfs_fuse_##op args;		\
+	ntfs_fuse_unlock();			\
+	return res;				\
+}
+
+NTFS_FUSE_MT_OP(getattr, shared, (const char *path, struct stat *stbuf),
+		(path, stbuf))
+NTFS_FUSE_MT_OP(readlink, shared, (const char *path, char *buf, size_t size),
+		(path, buf, size))
+NTFS_FUSE_MT_OP(open, shared, (const char *path, struct fuse_file_info *fi),
+		(path, fi))
+NTFS_FUSE_MT_OP(statfs, shared, (const char *path, struct statvfs *sfs),
+		(path, sfs))
+NTFS_FUSE_MT_OP(write, file, (const char *path, const char *buf,
+		size_t size, off_t offset, struct fuse_file_info *fi),
+		(path, buf, size, offset, fi))
+NTFS_FUSE_MT_OP(truncate, exclusive, (const char *path, off_t size),
+		(path, size))
+NTFS_FUSE_MT_OP(ftruncate, exclusive, (const char *path, off_t size,
+		struct fuse_file_info *fi), (path, size, fi))
+NTFS_FUSE_MT_OP(chmod, exclusive, (const char *path, mode_t mode),
+		(path, mode))
+NTFS_FUSE_MT_OP(chown, exclusive, (const char *path, uid_t uid, gid_t gid),
+		(path, uid, gid))
+NTFS_FUSE_MT_OP(flush, file, (const char *path,
+		struct fuse_file_info *fi), (path, fi))
+NTFS_FUSE_MT_OP(create_file, file, (const char *path, mode_t mode,
+		struct fuse_file_info *fi), (path, mode, fi))
+NTFS_FUSE_MT_OP(mknod, exclusive, (const char *path, mode_t mode, dev_t dev),
+		(path, mode, dev))
+NTFS_FUSE_MT_OP(symlink, exclusive, (const char *to, const char *from),
+		(to, from))
+NTFS_FUSE_MT_OP(link, exclusive, (const char *old_path,
+		const char *new_path), (old_path, new_path))
+NTFS_FUSE_MT_OP(unlink, exclusive, (const char *path), (path))
+NTFS_FUSE_MT_OP(rename, exclusive, (const char *old_path,
+		const char *new_path), (old_path, new_path))
+NTFS_FUSE_MT_OP(mkdir, exclusive, (const char *path, mode_t mode),
+		(path, mode))
+NTFS_FUSE_MT_OP(rmdir, exclusive, (const char *path), (path))
+#ifdef HAVE_UTIMENSAT
+NTFS_FUSE_MT_OP(utimens, exclusive, (const char *path,
+		const struct timespec tv[2]), (path, tv))
+#else
+NTFS_FUSE_MT_OP(utime, exclusive, (const char *path, struct utimbuf *buf),
+		(path, buf))
+#endif
+NTFS_FUSE_MT_OP(fsync, exclusive, (const char *path, int type,
+		struct fuse_file_info *fi), (path, type, fi))
+NTFS_FUSE_MT_OP(bmap, exclusive, (const char *path, size_t blocksize,
+		uint64_t *idx), (path, blocksize, idx))
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+NTFS_FUSE_MT_OP(access, shared, (const char *path, int type), (path, type))
+NTFS_FUSE_MT_OP(opendir, shared, (const char *path,
+		struct fuse_file_info *fi), (path, fi))
+#endif
+#ifdef HAVE_SETXATTR
+	/*
+	 * the system and security namespaces use the security functions,
+	 * and do not depend on delayed data (the kernel asks for
+	 * security.capability before each write)
+	 */
+NTFS_FUSE_MT_OP(getxattr, file, (const char *path, const char *name,
+		char *value, size_t size), (path, name, value, size))
+NTFS_FUSE_MT_OP(setxattr, exclusive, (const char *path, const char *name,
+		const char *value, size_t size, int flags),
+		(path, name, value, size, flags))
+NTFS_FUSE_MT_OP(removexattr, exclusive, (const char *path,
+		const char *name), (path, name))
+NTFS_FUSE_MT_OP(listxattr, shared, (const char *path, char *list,
+		size_t size), (path, list, size))
+#endif /* HAVE_SETXATTR */
+
+static struct fuse_operations ntfs_3g_mt_ops = {
+	.getattr	= ntfs_fuse_mt_getattr,
+	.readlink	= ntfs_fuse_mt_readlink,
+	.readdir	= ntfs_fuse_mt_readdir,
+	.open		= ntfs_fuse_mt_open,
+	.release	= ntfs_fuse_mt_release,
+	.flush		= ntfs_fuse_mt_flush,
+	.read		= ntfs_fuse_mt_read,
+	.write		= ntfs_fuse_mt_write,
+	.truncate	= ntfs_fuse_mt_truncate,
+	.ftruncate	= ntfs_fuse_mt_ftruncate,
+	.statfs		= ntfs_fuse_mt_statfs,
+	.chmod		= ntfs_fuse_mt_chmod,
+	.chown		= ntfs_fuse_mt_chown,
+	.create		= ntfs_fuse_mt_create_file,
+	.mknod		= ntfs_fuse_mt_mknod,
+	.symlink	= ntfs_fuse_mt_symlink,
+	.link		= ntfs_fuse_mt_link,
+	.unlink		= ntfs_fuse_mt_unlink,
+	.rename		= ntfs_fuse_mt_rename,
+	.mkdir		= ntfs_fuse_mt_mkdir,
+	.rmdir		= ntfs_fuse_mt_rmdir,
+#ifdef HAVE_UTIMENSAT
+	.utimens	= ntfs_fuse_mt_utimens,
+#else
+	.utime		= ntfs_fuse_mt_utime,
+#endif
+	.fsync		= ntfs_fuse_mt_fsync,
+	.fsyncdir	= ntfs_fuse_mt_fsync,
+	.bmap		= ntfs_fuse_mt_bmap,
+	.destroy        = ntfs_fuse_destroy2,
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+	.access		= ntfs_fuse_mt_access,
+	.opendir	= ntfs_fuse_mt_opendir,
+#endif
+#ifdef HAVE_SETXATTR
+	.getxattr	= ntfs_fuse_mt_getxattr,
+	.setxattr	= ntfs_fuse_mt_setxattr,
+	.removexattr	= ntfs_fuse_mt_removexattr,
+	.listxattr	= ntfs_fuse_mt_listxattr,
+#endif /* HAVE_SETXATTR */
+	/* no MacFUSE extensions, the threads option is for Linux only */
+#if defined(FUSE_CAP_DONT_MASK) || defined(FUSE_CAP_BIG_WRITES) \
+		|| (defined(__APPLE__) || defined(__DARWIN__))
+	.init		= ntfs_init
+#endif
+};
+
 static int ntfs_fuse_init(void)
 {
 	ctx = ntfs_calloc(sizeof(ntfs_fuse_context_t));
@@ -3374,7 +3871,10 @@ static int ntfs_fuse_init(void)
 #endif			
 		.atime   = ATIME_RELATIVE,
 		.silent  = TRUE,
-		.recover = TRUE
+		.recover = TRUE,
+		.inode_cache = CACHE_INODE_SIZE,
+		.nidata_cache = CACHE_NIDATA_SIZE,
+		.lookup_cache = CACHE_LOOKUP_SIZE
 	};
 	return 0;
 }
@@ -3397,6 +3897,9 @@ static int ntfs_open(const char *device)
 		ntfs_log_perror("Failed to mount '%s'", device);
 		goto err_out;
 	}
+	if (ntfs_resize_lru_caches(ctx->vol, ctx->inode_cache,
+			ctx->nidata_cache, ctx->lookup_cache))
+		ntfs_log_perror("Failed to size the inode caches");
 	if (ctx->sync && ctx->vol->dev)
 		NDevSetSync(ctx->vol->dev);
 	if (ctx->compression)
@@ -3616,7 +4119,12 @@ static struct fuse *mount_fuse(char *parsed_options)
 		if (fuse_opt_add_arg(&args, "-odebug") == -1)
 			goto err;
 	
-	fh = fuse_new(ctx->fc, &args , &ntfs_3g_ops, sizeof(ntfs_3g_ops), NULL);
+	if ((ctx->threads > 1) || ctx->delay_alloc)
+		fh = fuse_new(ctx->fc, &args , &ntfs_3g_mt_ops,
+				sizeof(ntfs_3g_mt_ops), NULL);
+	else
+		fh = fuse_new(ctx->fc, &args , &ntfs_3g_ops,
+				sizeof(ntfs_3g_ops), NULL);
 	if (!fh)
 		goto err;
 	
@@ -3796,6 +4304,9 @@ int main(int argc, char *argv[])
 		if (ntfs_strinsert(&parsed_options, ",ro")) 
                 	goto err_out;
 	}
+	/* Without locks, fall back to the single-threaded loop */
+	if ((ctx->threads > 1) && ntfs_volume_set_locking(ctx->vol))
+		ctx->threads = 1;
 	/* We must do this after ntfs_open() to be able to set the blksize */
 	if (ctx->blkdev && set_fuseblk_options(&parsed_options))
 		goto err_out;
@@ -3902,7 +4413,10 @@ int main(int argc, char *argv[])
 	    && !ctx->uid && ctx->gid)
 		ntfs_log_error("Warning : using problematic uid==0 and gid!=0\n");
 	
-	fuse_loop(fh);
+	if (ctx->threads > 1)
+		fuse_loop_mt(fh, ctx->threads);
+	else
+		fuse_loop(fh);
 	
 	err = 0;
 
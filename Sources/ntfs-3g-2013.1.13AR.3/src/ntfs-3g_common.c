@@ -49,6 +49,7 @@
 #include "ntfs-3g_common.h"
 #include "realpath.h"
 #include "misc.h"
+#include "cache.h"
 
 const char xattr_ntfs_3g[] = "ntfs-3g.";
 
@@ -117,6 +118,11 @@ const struct DEFOPTION optionlist[] = {
 	{ "usermapping", OPT_USERMAPPING, FLGOPT_STRING },
 	{ "xattrmapping", OPT_XATTRMAPPING, FLGOPT_STRING },
 	{ "efs_raw", OPT_EFS_RAW, FLGOPT_BOGUS },
+	{ "threads", OPT_THREADS, FLGOPT_DECIMAL },
+	{ "inode_cache", OPT_INODE_CACHE, FLGOPT_DECIMAL },
+	{ "nidata_cache", OPT_NIDATA_CACHE, FLGOPT_DECIMAL },
+	{ "lookup_cache", OPT_LOOKUP_CACHE, FLGOPT_DECIMAL },
+	{ "delay_alloc", OPT_DELAY_ALLOC, FLGOPT_DECIMAL | FLGOPT_OPTIONAL },
 	{ (const char*)NULL, 0, 0 } /* end marker */
 } ;
 
@@ -480,6 +486,53 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 				ctx->efs_raw = TRUE;
 				break;
 #endif /* HAVE_SETXATTR */
+			case OPT_THREADS :
+#if defined(__APPLE__) || defined(__DARWIN__)
+				ntfs_log_error("'threads' option is not "
+					"supported on this system\n");
+				goto err_exit;
+#endif
+				if ((intarg < 1) || (intarg > MAX_FUSE_THREADS)) {
+					ntfs_log_error("'threads' option needs "
+						"a value from 1 to %d\n",
+						MAX_FUSE_THREADS);
+					goto err_exit;
+				}
+				ctx->threads = intarg;
+				break;
+			case OPT_INODE_CACHE :
+			case OPT_NIDATA_CACHE :
+			case OPT_LOOKUP_CACHE :
+				if ((intarg < 0) || (intarg > CACHE_MAX_SIZE)
+				    || ((intarg > 0) && (intarg < 3))) {
+					ntfs_log_error("'%s' option needs 0 "
+						"or a value from 3 to %d\n",
+						poptl->name, CACHE_MAX_SIZE);
+					goto err_exit;
+				}
+				if (poptl->type == OPT_INODE_CACHE)
+					ctx->inode_cache = intarg;
+				else if (poptl->type == OPT_NIDATA_CACHE)
+					ctx->nidata_cache = intarg;
+				else
+					ctx->lookup_cache = intarg;
+				break;
+			case OPT_DELAY_ALLOC :
+#if defined(__APPLE__) || defined(__DARWIN__)
+				ntfs_log_error("'delay_alloc' option is not "
+					"supported on this system\n");
+				goto err_exit;
+#endif
+				if (!intarg)
+					intarg = DEFAULT_DELAY_ALLOC;
+				if ((intarg < 1) || (intarg > MAX_DELAY_ALLOC)) {
+					ntfs_log_error("'delay_alloc' option needs "
+						"a value from 1 to %d\n",
+						MAX_DELAY_ALLOC);
+					goto err_exit;
+				}
+				ctx->delay_alloc = intarg << 20;
+				break;
 			case OPT_FSNAME : /* Filesystem name. */
 			/*
 			 * We need this to be able to check whether filesystem
@@ -636,6 +689,34 @@ int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 	return 0;
 }
 
+/*
+ *		Log the usage of the inode and lookup caches
+ */
+
+static void log_cache_stats(const char *name,
+			const struct CACHE_HEADER *cache)
+{
+	if (cache && cache->reads)
+		ntfs_log_info("%s cache : %d entries, %lu writes, "
+			"%lu reads, %lu.%1lu%% hits\n",
+			name, cache->item_count, cache->writes, cache->reads,
+			100 * cache->hits / cache->reads,
+			1000 * cache->hits / cache->reads % 10);
+}
+
+void ntfs_log_cache_stats(ntfs_volume *vol)
+{
+#if CACHE_INODE_SIZE
+	log_cache_stats("Inode", vol->xinode_cache);
+#endif
+#if CACHE_NIDATA_SIZE
+	log_cache_stats("Nidata", vol->nidata_cache);
+#endif
+#if CACHE_LOOKUP_SIZE
+	log_cache_stats("Lookup", vol->lookup_cache);
+#endif
+}
+
 #ifdef HAVE_SETXATTR
 
 int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
@@ -91,6 +91,11 @@ enum {
 	OPT_USERMAPPING,
 	OPT_XATTRMAPPING,
 	OPT_EFS_RAW,
+	OPT_THREADS,
+	OPT_INODE_CACHE,
+	OPT_NIDATA_CACHE,
+	OPT_LOOKUP_CACHE,
+	OPT_DELAY_ALLOC,
 } ;
 
 			/* Option flags */
@@ -136,6 +141,11 @@ typedef struct {
 	BOOL no_detach;
 	BOOL blkdev;
 	BOOL mounted;
+	int threads;
+	int inode_cache;
+	int nidata_cache;
+	int lookup_cache;
+	u32 delay_alloc;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 	BOOL efs_raw;
 #ifdef XATTR_MAPPINGS
@@ -179,6 +189,8 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 			int argc, char *argv[]);
 
+void ntfs_log_cache_stats(ntfs_volume *vol);
+
 int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
  			char *list, size_t size, BOOL prefixing);
 
@@ -90,6 +90,9 @@ static const rsync_acl empty_rsync_acl = {
 static item_list access_acl_list = EMPTY_ITEM_LIST;
 static item_list default_acl_list = EMPTY_ITEM_LIST;
 
+static struct hashchains access_acl_h;
+static struct hashchains default_acl_h;
+
 static size_t prior_access_count = (size_t)-1;
 static size_t prior_default_count = (size_t)-1;
 
@@ -450,28 +453,41 @@ static BOOL pack_smb_acl(SMB_ACL_T *smb_acl, const rsync_acl *racl)
 	return False;
 }
 
+/* Hashes what rsync_acl_equal() compares. */
+static uint32 rsync_acl_key(const rsync_acl *racl)
+{
+	uint32 h = hash_bytes(HASH_BYTES_INIT, &racl->user_obj, 4 * sizeof (uchar));
+	id_access *ida = racl->names.idas;
+	int count;
+
+	h = hash_bytes(h, &racl->names.count, sizeof racl->names.count);
+	for (count = racl->names.count; count--; ida++) {
+		h = hash_bytes(h, &ida->id, sizeof ida->id);
+		h = hash_bytes(h, &ida->access, sizeof ida->access);
+	}
+
+	return h;
+}
+
+/* Returns the first ACL in racl_list equal to racl, or -1.  The list holds
+ * rsync_acl items on the sender and acl_duo items on the receiver, hence
+ * the item_size.  New items are added to the list's hashchains here. */
 static int find_matching_rsync_acl(const rsync_acl *racl, SMB_ACL_TYPE_T type,
-				   const item_list *racl_list)
+				   const item_list *racl_list, size_t item_size)
 {
-	static int access_match = -1, default_match = -1;
-	int *match = type == SMB_ACL_TYPE_ACCESS ? &access_match : &default_match;
-	size_t count = racl_list->count;
-
-	/* If this is the first time through or we didn't match the last
-	 * time, then start at the end of the list, which should be the
-	 * best place to start hunting. */
-	if (*match == -1)
-		*match = racl_list->count - 1;
-	while (count--) {
-		rsync_acl *base = racl_list->items;
-		if (rsync_acl_equal(base + *match, racl))
-			return *match;
-		if (!(*match)--)
-			*match = racl_list->count - 1;
+	struct hashchains *hc = type == SMB_ACL_TYPE_ACCESS ? &access_acl_h : &default_acl_h;
+	char *base = racl_list->items;
+	int32 i, ndx = -1;
+
+	while ((size_t)hc->count < racl_list->count)
+		hashchains_add(hc, rsync_acl_key((rsync_acl *)(base + hc->count * item_size)));
+
+	for (i = hashchains_first(hc, rsync_acl_key(racl)); i >= 0; i = hc->next[i]) {
+		if (rsync_acl_equal((rsync_acl *)(base + i * item_size), racl))
+			ndx = i;
 	}
 
-	*match = -1;
-	return *match;
+	return ndx;
 }
 
 static int get_rsync_acl(const char *fname, rsync_acl *racl,
@@ -612,7 +628,7 @@ static void send_ida_entries(int f, const ida_entries *idal)
 static void send_rsync_acl(int f, rsync_acl *racl, SMB_ACL_TYPE_T type,
 			   item_list *racl_list)
 {
-	int ndx = find_matching_rsync_acl(racl, type, racl_list);
+	int ndx = find_matching_rsync_acl(racl, type, racl_list, sizeof (rsync_acl));
 
 	/* Send 0 (-1 + 1) to indicate that literal ACL data follows. */
 	write_varint(f, ndx + 1);
@@ -755,7 +771,10 @@ static int recv_rsync_acl(int f, item_list *racl_list, SMB_ACL_TYPE_T type, mode
 		return ndx - 1;
 
 	ndx = racl_list->count;
+	/* Growing the list can move it under a --writers thread. */
+	lock_attr_lists(1);
 	duo_item = EXPAND_ITEM_LIST(racl_list, acl_duo, 1000);
+	unlock_attr_lists();
 	duo_item->racl = empty_rsync_acl;
 
 	flags = read_byte(f);
@@ -805,7 +824,7 @@ static int cache_rsync_acl(rsync_acl *racl, SMB_ACL_TYPE_T type, item_list *racl
 
 	if (!racl)
 		ndx = -1;
-	else if ((ndx = find_matching_rsync_acl(racl, type, racl_list)) == -1) {
+	else if ((ndx = find_matching_rsync_acl(racl, type, racl_list, sizeof (acl_duo))) == -1) {
 		acl_duo *new_duo;
 		ndx = racl_list->count;
 		new_duo = EXPAND_ITEM_LIST(racl_list, acl_duo, 1000);
@@ -835,11 +854,13 @@ void cache_tmp_acl(struct file_struct *file, stat_x *sxp)
 	}
 }
 
-static void uncache_duo_acls(item_list *duo_list, size_t start)
+static void uncache_duo_acls(item_list *duo_list, struct hashchains *hc, size_t start)
 {
 	acl_duo *duo_item = duo_list->items;
 	acl_duo *duo_start = duo_item + start;
 
+	while ((size_t)hc->count > start)
+		hashchains_pop(hc);
 	duo_item += duo_list->count;
 	duo_list->count = start;
 
@@ -853,12 +874,12 @@ static void uncache_duo_acls(item_list *duo_list, size_t start)
 void uncache_tmp_acls(void)
 {
 	if (prior_access_count != (size_t)-1) {
-		uncache_duo_acls(&access_acl_list, prior_access_count);
+		uncache_duo_acls(&access_acl_list, &access_acl_h, prior_access_count);
 		prior_access_count = (size_t)-1;
 	}
 
 	if (prior_default_count != (size_t)-1) {
-		uncache_duo_acls(&default_acl_list, prior_default_count);
+		uncache_duo_acls(&default_acl_list, &default_acl_h, prior_default_count);
 		prior_default_count = (size_t)-1;
 	}
 }
@@ -24,6 +24,18 @@
 extern int checksum_seed;
 extern int protocol_version;
 
+#ifdef USE_SIMD_CHECKSUM
+/* 0 = plain C, 1 = SSE2, 2 = AVX2; -1 until the CPU has been checked. */
+static int simd_level = -1;
+
+static inline int checksum_simd(void)
+{
+	if (simd_level < 0)
+		simd_level = simd_checksum_level();
+	return simd_level;
+}
+#endif
+
 /*
   a simple 32 bit checksum that can be upadted from either end
   (inspired by Mark Adler's Adler-32 checksum)
@@ -34,6 +46,14 @@ uint32 get_checksum1(char *buf1, int32 len)
     uint32 s1, s2;
     schar *buf = (schar *)buf1;
 
+#ifdef USE_SIMD_CHECKSUM
+    if (len >= 32) {
+	if (checksum_simd() == 2)
+	    return get_checksum1_avx2(buf, len);
+	return get_checksum1_sse2(buf, len);
+    }
+#endif
+
     s1 = s2 = 0;
     for (i = 0; i < (len-4); i+=4) {
 	s2 += 4*(s1 + buf[i]) + 3*buf[i+1] + 2*buf[i+2] + buf[i+3] +
@@ -46,6 +66,28 @@ uint32 get_checksum1(char *buf1, int32 len)
     return (s1 & 0xffff) + (s2 << 16);
 }
 
+/* Roll the checksum sum of the k bytes at map forward by one byte
+ * ROLL_BATCH times, storing the checksum of the block at map+1+j in
+ * sums[j].  The caller must have mapped k+ROLL_BATCH bytes at map. */
+void roll_checksum1(schar *map, int32 k, uint32 sum, uint32 *sums)
+{
+#ifdef USE_SIMD_CHECKSUM
+    if (checksum_simd() == 2)
+	roll_checksum1_avx2(map, k, sum, sums);
+    else
+	roll_checksum1_sse2(map, k, sum, sums);
+#else
+    int32 j;
+    uint32 s1 = sum & 0xFFFF, s2 = sum >> 16;
+
+    for (j = 0; j < ROLL_BATCH; j++) {
+	s1 += map[j+k] - map[j];
+	s2 += s1 - k * (map[j]+CHAR_OFFSET);
+	sums[j] = (s1 & 0xffff) | (s2 << 16);
+    }
+#endif
+}
+
 
 void get_checksum2(char *buf, int32 len, char *sum)
 {
@@ -150,8 +192,8 @@ void file_checksum(char *fname, char *sum, OFF_T size)
 	unmap_file(buf);
 }
 
-static int32 sumresidue;
-static md_context md;
+static THREAD_LOCAL int32 sumresidue;
+static THREAD_LOCAL md_context md;
 
 void sum_init(int seed)
 {
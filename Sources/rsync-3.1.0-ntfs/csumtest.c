@@ -0,0 +1,270 @@
+/*
+ * Test and micro-benchmark for the SSE2/AVX2 rolling checksum code.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, visit the http://fsf.org website.
+ */
+
+/* Without options every kernel the CPU supports is checked against the
+ * plain C code.  With --bench the kernels are timed on SIZE MB of random
+ * (i.e. cloop-like, incompressible) data: the block sums the generator
+ * computes and the rolling update that the sender's hash_search() does
+ * at every byte offset. */
+
+#include "simd-checksum-x86_64.c"
+
+#include <popt.h>
+
+int do_bench = 0;
+int bench_mb = 256;
+int block_len = MAX_BLOCK_SIZE;
+int csum_errors = 0;
+
+static struct poptOption long_options[] = {
+  /* longName, shortName, argInfo, argPtr, value, descrip, argDesc */
+  {"bench",          'b', POPT_ARG_NONE,   &do_bench, 0, 0, 0},
+  {"size",           's', POPT_ARG_INT,    &bench_mb, 0, 0, 0},
+  {"block-size",     'B', POPT_ARG_INT,    &block_len, 0, 0, 0},
+  {0,0,0,0, 0, 0, 0}
+};
+
+/* The reference code: get_checksum1() and the rolling update from
+ * hash_search() as they were before the SIMD versions. */
+static uint32 plain_checksum1(schar *buf, int32 len)
+{
+    int32 i;
+    uint32 s1, s2;
+
+    s1 = s2 = 0;
+    for (i = 0; i < (len-4); i+=4) {
+	s2 += 4*(s1 + buf[i]) + 3*buf[i+1] + 2*buf[i+2] + buf[i+3] +
+	  10*CHAR_OFFSET;
+	s1 += (buf[i+0] + buf[i+1] + buf[i+2] + buf[i+3] + 4*CHAR_OFFSET);
+    }
+    for (; i < len; i++) {
+	s1 += (buf[i]+CHAR_OFFSET); s2 += s1;
+    }
+    return (s1 & 0xffff) + (s2 << 16);
+}
+
+static void plain_roll_checksum1(schar *map, int32 k, uint32 sum, uint32 *sums)
+{
+    uint32 s1 = sum & 0xFFFF, s2 = sum >> 16;
+    int32 j;
+
+    for (j = 0; j < ROLL_BATCH; j++) {
+	s1 -= map[j] + CHAR_OFFSET;
+	s2 -= k * (map[j]+CHAR_OFFSET);
+	s1 += map[j+k] + CHAR_OFFSET;
+	s2 += s1;
+	sums[j] = (s1 & 0xffff) | (s2 << 16);
+    }
+}
+
+struct kernel {
+    const char *name;
+    int level;
+    uint32 (*sum)(schar *buf, int32 len);
+    void (*roll)(schar *map, int32 k, uint32 sum, uint32 *sums);
+};
+
+static struct kernel kernels[] = {
+    { "plain", 0, plain_checksum1, plain_roll_checksum1 },
+#ifdef USE_SIMD_CHECKSUM
+    { "sse2", 1, get_checksum1_sse2, roll_checksum1_sse2 },
+    { "avx2", 2, get_checksum1_avx2, roll_checksum1_avx2 },
+#endif
+    { NULL, 0, NULL, NULL }
+};
+
+static uint32 rand_state = 12345;
+
+static uint32 next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+static schar *random_buffer(size_t len)
+{
+    schar *buf = malloc(len);
+    size_t i;
+
+    if (!buf) {
+	fprintf(stderr, "Unable to allocate %lu bytes\n", (unsigned long)len);
+	exit(1);
+    }
+    for (i = 0; i < len; i++)
+	buf[i] = (schar)next_rand();
+    return buf;
+}
+
+static void check_sum(struct kernel *kp, schar *buf, int32 len)
+{
+    uint32 want = plain_checksum1(buf, len), got = kp->sum(buf, len);
+
+    if (got != want) {
+	printf("%s: checksum of %ld bytes is %08x, expected %08x\n",
+	       kp->name, (long)len, got, want);
+	csum_errors++;
+    }
+}
+
+static void check_roll(struct kernel *kp, schar *map, int32 k)
+{
+    uint32 want[ROLL_BATCH], got[ROLL_BATCH];
+    uint32 sum = plain_checksum1(map, k);
+    int32 j;
+
+    plain_roll_checksum1(map, k, sum, want);
+    kp->roll(map, k, sum, got);
+    for (j = 0; j < ROLL_BATCH; j++) {
+	if (got[j] != want[j] || want[j] != plain_checksum1(map + j + 1, k)) {
+	    printf("%s: rolled checksum of %ld bytes at +%ld is %08x, expected %08x\n",
+		   kp->name, (long)k, (long)j + 1, got[j], want[j]);
+	    csum_errors++;
+	    break;
+	}
+    }
+}
+
+static void run_checks(int level)
+{
+    static const int32 roll_lens[] = {
+	1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 700, 4096, 65535, 65536,
+	MAX_BLOCK_SIZE, 0
+    };
+    int32 buf_len = 3 * MAX_BLOCK_SIZE, len, i;
+    schar *buf = random_buffer(buf_len);
+    struct kernel *kp;
+
+    /* Sign extension matters, so include runs of the extreme values. */
+    memset(buf + MAX_BLOCK_SIZE, 0x80, 4096);
+    memset(buf + MAX_BLOCK_SIZE + 4096, 0x7F, 4096);
+    memset(buf + MAX_BLOCK_SIZE + 8192, 0xFF, 4096);
+
+    for (kp = kernels; kp->name; kp++) {
+	if (kp->level > level)
+	    continue;
+	for (len = 0; len <= 300; len++)
+	    check_sum(kp, buf + len % 61, len);
+	for (i = 0; i < 500; i++) {
+	    len = next_rand() % (2 * MAX_BLOCK_SIZE);
+	    check_sum(kp, buf + next_rand() % (buf_len - len), len);
+	}
+	for (i = 0; roll_lens[i]; i++) {
+	    int32 k = roll_lens[i];
+	    check_roll(kp, buf, k);
+	    check_roll(kp, buf + MAX_BLOCK_SIZE - k / 2, k);
+	    check_roll(kp, buf + next_rand() % (buf_len - k - ROLL_BATCH), k);
+	}
+    }
+
+    free(buf);
+}
+
+static double elapsed(struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+static void run_bench(int level)
+{
+    size_t len = (size_t)bench_mb << 20;
+    schar *buf = random_buffer(len + ROLL_BATCH);
+    uint32 want_blocks = 0, want_roll = 0;
+    struct kernel *kp;
+
+    printf("%d MB of random data, block size %d\n", bench_mb, block_len);
+    printf("%-6s %12s %12s\n", "", "blocks MB/s", "rolling MB/s");
+
+    for (kp = kernels; kp->name; kp++) {
+	uint32 sums[ROLL_BATCH], blocks = 0, roll = 0, sum;
+	struct timeval start;
+	double t_blocks, t_roll;
+	size_t off;
+
+	if (kp->level > level)
+	    continue;
+
+	/* What the generator does for every block of the basis file. */
+	gettimeofday(&start, NULL);
+	for (off = 0; off + block_len <= len; off += block_len)
+	    blocks ^= kp->sum(buf + off, block_len);
+	t_blocks = elapsed(&start);
+
+	/* What the sender does at every offset that has no match. */
+	gettimeofday(&start, NULL);
+	sum = kp->sum(buf, block_len);
+	for (off = 0; off + block_len + ROLL_BATCH <= len; off += ROLL_BATCH) {
+	    kp->roll(buf + off, block_len, sum, sums);
+	    sum = sums[ROLL_BATCH-1];
+	    roll += sum;
+	}
+	t_roll = elapsed(&start);
+
+	if (kp == kernels) {
+	    want_blocks = blocks;
+	    want_roll = roll;
+	} else if (blocks != want_blocks || roll != want_roll) {
+	    printf("%s: results differ from the plain code!\n", kp->name);
+	    csum_errors++;
+	}
+
+	printf("%-6s %12.1f %12.1f\n", kp->name,
+	       t_blocks > 0 ? bench_mb / t_blocks : 0.0,
+	       t_roll > 0 ? bench_mb / t_roll : 0.0);
+    }
+
+    free(buf);
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt, level;
+    poptContext pc = poptGetContext("csumtest", argc, (const char**)argv,
+				    long_options, 0);
+
+    while ((opt = poptGetNextOpt(pc)) != -1) {
+	fprintf(stderr, "%s: %s\n",
+		poptBadOption(pc, POPT_BADOPTION_NOALIAS),
+		poptStrerror(opt));
+	exit(1);
+    }
+    if (poptGetArgs(pc) || bench_mb <= 0 || block_len <= 0 || block_len > MAX_BLOCK_SIZE) {
+	fprintf(stderr, "Usage: csumtest [--bench [--size=MB] [--block-size=LEN]]\n");
+	exit(1);
+    }
+
+#ifdef USE_SIMD_CHECKSUM
+    level = simd_checksum_level();
+#else
+    level = 0;
+#endif
+
+    if (do_bench)
+	run_bench(level);
+    else
+	run_checks(level);
+
+    if (csum_errors)
+	printf("-> %d checksum errors found.\n", csum_errors);
+    else if (!do_bench)
+	printf("No checksum errors found.\n");
+
+    return csum_errors ? 1 : 0;
+}
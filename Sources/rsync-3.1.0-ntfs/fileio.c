@@ -241,6 +241,27 @@ char *map_ptr(struct map_struct *map, OFF_T offset, int32 len)
 		exit_cleanup(RERR_FILEIO);
 	}
 
+#ifdef SUPPORT_DELTA_THREADS
+	if (map->shared) {
+		/* Other threads read the same fd, so leave its offset alone. */
+		map->p_offset = window_start;
+		map->p_len = window_size;
+		while (read_size > 0) {
+			ssize_t nread = pread(map->fd, map->p + read_offset, read_size, read_start);
+			if (nread <= 0) {
+				if (!map->status)
+					map->status = nread ? errno : ENODATA;
+				memset(map->p + read_offset, 0, read_size);
+				break;
+			}
+			read_start += nread;
+			read_offset += nread;
+			read_size -= nread;
+		}
+		return map->p + align_fudge;
+	}
+#endif
+
 	if (map->p_fd_offset != read_start) {
 		OFF_T ret = do_lseek(map->fd, read_start, SEEK_SET);
 		if (ret != read_start) {
@@ -80,6 +80,7 @@ extern struct chmod_mode_struct *chmod_modes;
 
 extern filter_rule_list filter_list;
 extern filter_rule_list daemon_filter_list;
+extern char *manifest_name;
 
 #ifdef ICONV_OPTION
 extern int filesfrom_convert;
@@ -196,8 +197,11 @@ static int readlink_stat(const char *path, STRUCT_STAT *stp, char *linkbuf)
 	if (link_stat(path, stp, copy_dirlinks) < 0)
 		return -1;
 	if (S_ISLNK(stp->st_mode)) {
-		int llen = do_readlink(path, linkbuf, MAXPATHLEN - 1);
-		if (llen < 0)
+		STRUCT_STAT mst;
+		int llen;
+		if (manifest_stat(path, &mst, linkbuf) > 0)
+			llen = strlen(linkbuf);
+		else if ((llen = do_readlink(path, linkbuf, MAXPATHLEN - 1)) < 0)
 			return -1;
 		linkbuf[llen] = '\0';
 		if (copy_unsafe_links && unsafe_symlink(linkbuf, path)) {
@@ -222,9 +226,11 @@ static int readlink_stat(const char *path, STRUCT_STAT *stp, char *linkbuf)
 int link_stat(const char *path, STRUCT_STAT *stp, int follow_dirlinks)
 {
 #ifdef SUPPORT_LINKS
+	int ret;
 	if (copy_links)
 		return x_stat(path, stp, NULL);
-	if (x_lstat(path, stp, NULL) < 0)
+	if ((ret = manifest_stat(path, stp, NULL)) < 0
+	 || (!ret && x_lstat(path, stp, NULL) < 0))
 		return -1;
 	if (follow_dirlinks && S_ISLNK(stp->st_mode)) {
 		STRUCT_STAT st;
@@ -1697,15 +1703,16 @@ static void send_directory(int f, struct file_list *flist, char *fbuf, int len,
 {
 	struct dirent *di;
 	unsigned remainder;
-	char *p;
-	DIR *d;
+	char *p, *dname;
+	DIR *d = NULL;
+	int32 mpos;
 	int divert_dirs = (flags & FLAG_DIVERT_DIRS) != 0;
 	int start = flist->used;
 	int filter_level = f == -2 ? SERVER_FILTERS : ALL_FILTERS;
 
 	assert(flist != NULL);
 
-	if (!(d = opendir(fbuf))) {
+	if (!manifest_opendir(fbuf, &mpos) && !(d = opendir(fbuf))) {
 		if (errno == ENOENT) {
 			if (am_sender) /* Can abuse this for vanished error w/ENOENT: */
 				interpret_stat_error(fbuf, True);
@@ -1726,9 +1733,17 @@ static void send_directory(int f, struct file_list *flist, char *fbuf, int len,
 	} else
 		remainder = 0;
 
-	for (errno = 0, di = readdir(d); di; errno = 0, di = readdir(d)) {
+	while (1) {
 		unsigned name_len;
-		char *dname = d_name(di);
+		errno = 0;
+		if (!d)
+			dname = (char *)manifest_readdir(&mpos);
+		else if ((di = readdir(d)) != NULL)
+			dname = d_name(di);
+		else
+			dname = NULL;
+		if (!dname)
+			break;
 		if (dname[0] == '.' && (dname[1] == '\0'
 		    || (dname[1] == '.' && dname[2] == '\0')))
 			continue;
@@ -1761,7 +1776,8 @@ static void send_directory(int f, struct file_list *flist, char *fbuf, int len,
 		rsyserr(FERROR_XFER, errno, "readdir(%s)", full_fname(fbuf));
 	}
 
-	closedir(d);
+	if (d)
+		closedir(d);
 
 	if (f >= 0 && recurse && !divert_dirs) {
 		int i, end = flist->used - 1;
@@ -2077,6 +2093,8 @@ struct file_list *send_file_list(int f, int argc, char *argv[])
 	int implied_dot_dir = 0;
 
 	rprintf(FLOG, "building file list\n");
+	if (manifest_name)
+		read_manifest(manifest_name);
 	if (show_filelist_p())
 		start_filelist_progress("building file list");
 	else if (inc_recurse && INFO_GTE(FLIST, 1) && !am_server)
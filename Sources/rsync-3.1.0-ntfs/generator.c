@@ -23,6 +23,9 @@
 #include "rsync.h"
 #include "inums.h"
 #include "ifuncs.h"
+#ifdef SUPPORT_DELTA_THREADS
+#include <pthread.h>
+#endif
 
 extern int dry_run;
 extern int do_xfers;
@@ -74,6 +77,7 @@ extern int file_total;
 extern int fuzzy_basis;
 extern int always_checksum;
 extern int checksum_len;
+extern int delta_threads;
 extern char *partial_dir;
 extern int compare_dest;
 extern int copy_dest;
@@ -673,6 +677,155 @@ static void sum_sizes_sqroot(struct sum_struct *sum, int64 len)
 }
 
 
+#ifdef SUPPORT_DELTA_THREADS
+/* The block sums of a big file are computed by delta_threads threads, each
+ * of which reads a piece of the file (DELTA_PIECE_SIZE bytes' worth of
+ * blocks) through its own pread() map and sums it into a slot.  The main
+ * thread sends the slots in order, and the threads stay at most two
+ * pieces each ahead of it. */
+struct sum_piece {
+	uint32 *sum1;
+	char *sum2;		/* SUM_LENGTH bytes per block */
+	int32 done;		/* piece number + 1 once it is summed */
+};
+
+struct sum_pieces {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct sum_struct *sum;
+	int fd;
+	int32 piece_blocks, npieces, nslots, next, sent;
+	struct sum_piece *slots;
+};
+
+static void *sum_thread(void *arg)
+{
+	struct sum_pieces *sp = arg;
+	struct sum_struct *sum = sp->sum;
+	struct map_struct *mapbuf = map_file(sp->fd, sum->flength, MAX_MAP_SIZE, sum->blength);
+
+	mapbuf->shared = 1;
+
+	pthread_mutex_lock(&sp->lock);
+	while (1) {
+		struct sum_piece *slot;
+		int32 piece, first, j;
+		OFF_T offset;
+
+		while (sp->next < sp->npieces && sp->next >= sp->sent + sp->nslots)
+			pthread_cond_wait(&sp->cond, &sp->lock);
+		if (sp->next >= sp->npieces)
+			break;
+		piece = sp->next++;
+		pthread_mutex_unlock(&sp->lock);
+
+		slot = &sp->slots[piece % sp->nslots];
+		first = piece * sp->piece_blocks;
+		offset = (OFF_T)first * sum->blength;
+		for (j = 0; j < sp->piece_blocks && first + j < sum->count; j++) {
+			int32 n1 = (int32)MIN(sum->flength - offset, (OFF_T)sum->blength);
+			char *map = map_ptr(mapbuf, offset, n1);
+			slot->sum1[j] = get_checksum1(map, n1);
+			get_checksum2(map, n1, slot->sum2 + j * SUM_LENGTH);
+			offset += n1;
+		}
+
+		pthread_mutex_lock(&sp->lock);
+		slot->done = piece + 1;
+		pthread_cond_broadcast(&sp->cond);
+	}
+	pthread_mutex_unlock(&sp->lock);
+
+	/* Like the unthreaded code we ignore read errors: the sums of a
+	 * changed basis file just won't match. */
+	unmap_file(mapbuf);
+
+	return NULL;
+}
+
+/* Writes the sums of all blocks to f_out.  Returns -1 if no thread could
+ * be started (and nothing was written). */
+static int send_sums_threaded(int fd, struct sum_struct *sum, int f_out)
+{
+	pthread_t tids[MAX_DELTA_THREADS];
+	sigset_t all_sigs, old_sigs;
+	struct sum_pieces sp;
+	int32 i, j;
+	int cnt, ret = 0;
+
+	memset(&sp, 0, sizeof sp);
+	pthread_mutex_init(&sp.lock, NULL);
+	pthread_cond_init(&sp.cond, NULL);
+	sp.sum = sum;
+	sp.fd = fd;
+	sp.piece_blocks = MAX(DELTA_PIECE_SIZE / sum->blength, 1);
+	sp.npieces = (sum->count + sp.piece_blocks - 1) / sp.piece_blocks;
+	sp.nslots = 2 * delta_threads;
+	if (!(sp.slots = new_array0(struct sum_piece, sp.nslots)))
+		out_of_memory("send_sums_threaded");
+	for (i = 0; i < sp.nslots; i++) {
+		if (!(sp.slots[i].sum1 = new_array(uint32, sp.piece_blocks))
+		 || !(sp.slots[i].sum2 = new_array(char, sp.piece_blocks * SUM_LENGTH)))
+			out_of_memory("send_sums_threaded");
+	}
+
+	/* Leave all signal handling to the main thread. */
+	sigfillset(&all_sigs);
+	pthread_sigmask(SIG_BLOCK, &all_sigs, &old_sigs);
+	for (cnt = 0; cnt < delta_threads; cnt++) {
+		if (pthread_create(&tids[cnt], NULL, sum_thread, &sp) != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+
+	if (cnt == 0) {
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (DEBUG_GTE(DELTASUM, 2))
+		rprintf(FINFO, "summing %s pieces with %d threads\n", big_num(sp.npieces), cnt);
+
+	for (i = 0; i < sp.npieces; i++) {
+		struct sum_piece *slot = &sp.slots[i % sp.nslots];
+		int32 first = i * sp.piece_blocks;
+
+		pthread_mutex_lock(&sp.lock);
+		while (slot->done != i + 1)
+			pthread_cond_wait(&sp.cond, &sp.lock);
+		pthread_mutex_unlock(&sp.lock);
+
+		for (j = 0; j < sp.piece_blocks && first + j < sum->count; j++) {
+			if (DEBUG_GTE(DELTASUM, 3)) {
+				rprintf(FINFO, "chunk[%s] sum1=%08lx\n",
+					big_num(first + j), (unsigned long)slot->sum1[j]);
+			}
+			write_int(f_out, slot->sum1[j]);
+			write_buf(f_out, slot->sum2 + j * SUM_LENGTH, sum->s2length);
+		}
+
+		pthread_mutex_lock(&sp.lock);
+		sp.sent++;
+		pthread_cond_broadcast(&sp.cond);
+		pthread_mutex_unlock(&sp.lock);
+	}
+
+	while (cnt--)
+		pthread_join(tids[cnt], NULL);
+
+  cleanup:
+	for (i = 0; i < sp.nslots; i++) {
+		free(sp.slots[i].sum1);
+		free(sp.slots[i].sum2);
+	}
+	free(sp.slots);
+	pthread_cond_destroy(&sp.cond);
+	pthread_mutex_destroy(&sp.lock);
+
+	return ret;
+}
+#endif
+
 /*
  * Generate and send a stream of signatures/checksums that describe a buffer
  *
@@ -693,6 +846,15 @@ static int generate_and_send_sums(int fd, OFF_T len, int f_out, int f_copy)
 	if (append_mode > 0 && f_copy < 0)
 		return 0;
 
+#ifdef SUPPORT_DELTA_THREADS
+	/* get_checksum2() is only thread-safe for MD5 sums. */
+	if (delta_threads > 1 && f_copy < 0 && protocol_version >= 30
+	 && len >= DELTA_THREADS_MIN_LEN) {
+		if (send_sums_threaded(fd, &sum, f_out) == 0)
+			return 0;
+	}
+#endif
+
 	if (len > 0)
 		mapbuf = map_file(fd, len, MAX_MAP_SIZE, sum.blength);
 	else
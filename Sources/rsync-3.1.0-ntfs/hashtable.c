@@ -170,3 +170,61 @@ void *hashtable_find(struct hashtable *tbl, int64 key, int allocate_if_missing)
 	tbl->entries++;
 	return node;
 }
+
+/* Add len bytes to a running hash (FNV-1a), which starts as HASH_BYTES_INIT. */
+uint32 hash_bytes(uint32 h, const void *buf, size_t len)
+{
+	const uchar *p = buf;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+/* A hashchains finds the items of an item_list that have a given key
+ * without scanning the whole list.  The hashtable holds the newest index
+ * with each key (plus one) and next[] links each index to the previous one
+ * with the same key.  The keys are passed to the hashtable as int32s,
+ * the way it stores them.  Indices are added in increasing order, starting at
+ * 0, and popped from the newest one down. */
+void hashchains_add(struct hashchains *hc, uint32 key)
+{
+	struct ht_int32_node *node;
+
+	if (!hc->tbl)
+		hc->tbl = hashtable_create(1024, 0);
+	if (hc->count == hc->size) {
+		hc->size = hc->size ? hc->size * 2 : 1024;
+		if (!(hc->next = realloc_array(hc->next, int32, hc->size))
+		 || !(hc->keys = realloc_array(hc->keys, uint32, hc->size)))
+			out_of_memory("hashchains_add");
+	}
+	if (!key)
+		key = 1;
+	node = hashtable_find(hc->tbl, (int32)key, 1);
+	hc->keys[hc->count] = key;
+	hc->next[hc->count] = node->data ? (int32)(long)node->data - 1 : -1;
+	node->data = (void*)(long)++hc->count;
+}
+
+/* Returns the newest index with this key, or -1. */
+int32 hashchains_first(struct hashchains *hc, uint32 key)
+{
+	struct ht_int32_node *node;
+
+	if (!hc->tbl || !(node = hashtable_find(hc->tbl, key ? (int32)key : 1, 0))
+	 || !node->data)
+		return -1;
+	return (int32)(long)node->data - 1;
+}
+
+/* Removes the newest index. */
+void hashchains_pop(struct hashchains *hc)
+{
+	int32 prev = hc->next[--hc->count];
+	struct ht_int32_node *node = hashtable_find(hc->tbl, (int32)hc->keys[hc->count], 0);
+
+	node->data = prev < 0 ? NULL : (void*)(long)(prev + 1);
+}
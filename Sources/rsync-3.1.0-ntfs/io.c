@@ -100,6 +100,9 @@ static int write_batch_monitor_in = -1;
 static int write_batch_monitor_out = -1;
 
 static int ff_forward_fd = -1;
+#ifdef SUPPORT_WRITERS
+static int writer_wakeup_fd = -1;
+#endif
 static int ff_reenable_multiplex = -1;
 static char ff_lastchar = '\0';
 static xbuf ff_xb = EMPTY_XBUF;
@@ -670,6 +673,16 @@ static char *perform_io(size_t needed, int flags)
 				max_fd = ff_forward_fd;
 		}
 
+#ifdef SUPPORT_WRITERS
+		/* Let the receiver report the files that its --writers threads
+		 * finish while it sits here waiting for more input. */
+		if (writer_wakeup_fd >= 0 && iobuf.in_fd >= 0 && flags & PIO_NEED_INPUT) {
+			FD_SET(writer_wakeup_fd, &r_fds);
+			if (writer_wakeup_fd > max_fd)
+				max_fd = writer_wakeup_fd;
+		}
+#endif
+
 		FD_ZERO(&w_fds);
 		if (iobuf.out_fd >= 0) {
 			if (iobuf.raw_flushing_ends_before
@@ -864,6 +877,11 @@ static char *perform_io(size_t needed, int flags)
 			}
 		}
 
+#ifdef SUPPORT_WRITERS
+		if (writer_wakeup_fd >= 0 && FD_ISSET(writer_wakeup_fd, &r_fds))
+			reap_file_writers();
+#endif
+
 		if (got_kill_signal > 0)
 			handle_kill_signal(True);
 
@@ -1091,6 +1109,14 @@ void io_set_sock_fds(int f_in, int f_out)
 	sock_f_out = f_out;
 }
 
+#ifdef SUPPORT_WRITERS
+/* The receiver's --writers threads poke this fd when a file is done. */
+void io_set_writer_wakeup_fd(int fd)
+{
+	writer_wakeup_fd = fd;
+}
+#endif
+
 void set_io_timeout(int secs)
 {
 	io_timeout = secs;
@@ -262,6 +262,13 @@ void rwrite(enum logcode code, const char *buf, int len, int is_utf8)
 	if (len < 0)
 		exit_cleanup(RERR_MESSAGEIO);
 
+#ifdef SUPPORT_WRITERS
+	/* A --writers thread can't touch the I/O buffers, so its messages
+	 * are held until the receiver reaps the finished file. */
+	if (defer_writer_msg(code, buf, len, is_utf8))
+		return;
+#endif
+
 	if (msgs2stderr) {
 		if (!am_daemon) {
 			if (code == FLOG)
@@ -92,6 +92,7 @@ extern char curr_dir[MAXPATHLEN];
 extern char backup_dir_buf[MAXPATHLEN];
 extern char *basis_dir[MAX_BASIS_DIRS+1];
 extern struct file_list *first_flist;
+extern char *write_manifest_name;
 extern filter_rule_list daemon_filter_list;
 
 uid_t our_uid;
@@ -1622,6 +1623,14 @@ int main(int argc,char *argv[])
 		exit_cleanup(RERR_SYNTAX);
 	}
 
+	if (write_manifest_name && !am_server) {
+		if (argc != 1) {
+			rprintf(FERROR, "--write-manifest takes just one SRC dir\n");
+			exit_cleanup(RERR_SYNTAX);
+		}
+		exit_cleanup(write_manifest(write_manifest_name, argv[0]));
+	}
+
 	if (am_server) {
 		set_nonblocking(STDIN_FILENO);
 		set_nonblocking(STDOUT_FILENO);
@@ -0,0 +1,620 @@
+/*
+ * A manifest is a precomputed file list of a source tree: the lstat()
+ * data, symlink targets and xattrs of every file, written once with
+ * --write-manifest (e.g. when a cloop image is made from a partition)
+ * and read with --manifest, so that the sender builds its file list
+ * without walking the tree (e.g. the mounted image, where every stat
+ * costs a block inflate).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, visit the http://fsf.org website.
+ */
+
+/* The file starts with MANIFEST_MAGIC and a varint of MF_* flags, the
+ * string given to --manifest-id (MF_ID), then has one record per file,
+ * each directory before its contents:
+ *
+ *   varint  this index minus the parent's index (0 for the root)
+ *   string  the name (empty for the root)
+ *   byte    MFE_* flags
+ *   varint  mode, uid, gid; varlong size, mtime, ino
+ *   varint  mtime nsecs (MFE_NSEC), nlink (MFE_NLINK)
+ *   varlong dev (MFE_DEV: when it is not the parent's), rdev (devices)
+ *   string  symlink target (symlinks)
+ *   varint  xattr count (MF_XATTRS), then for each xattr:
+ *           string name, varint value length, the value or (for more
+ *           than 32 bytes) the MD5 digest that the sender sends
+ *
+ * A varint is 7 bits per byte, low bits first, and a string is a varint
+ * length followed by the bytes and a '\0'. */
+
+#include "rsync.h"
+#include "ifuncs.h"
+
+extern int am_root;
+extern int preserve_xattrs;
+extern char *manifest_root;
+extern char *manifest_id;
+extern char curr_dir[MAXPATHLEN];
+extern unsigned int curr_dir_len;
+
+#define MANIFEST_MAGIC "rsync-mf"
+#define MANIFEST_MAGIC_LEN 8
+
+#define MF_XATTRS (1<<0)
+#define MF_ID (1<<1)
+
+#define MFE_NSEC (1<<0)
+#define MFE_NLINK (1<<1)
+#define MFE_DEV (1<<2)
+
+struct manifest_entry {
+	const char *path, *name; /* path is relative to the root */
+	const char *link;
+	struct manifest_xattr *xattrs;
+	int64 size, mtime, dev, ino, rdev;
+	int32 parent, first_child, last_child, next_sibling;
+	int32 xattr_count;
+	uint32 mtime_nsec, nlink;
+	uint32 mode, uid, gid;
+};
+
+static struct manifest_entry *entries;
+static int32 entry_count;
+static struct hashchains entry_h;
+static int manifest_flags;
+static char *root_dir;
+static unsigned int root_len;
+
+/* === Reading === */
+
+static const uchar *rbuf, *rend;
+static const char *rname;
+
+static NORETURN void bad_manifest(void)
+{
+	rprintf(FERROR, "manifest %s is corrupt\n", full_fname(rname));
+	exit_cleanup(RERR_FILEIO);
+}
+
+static uint64_t get_varlong(void)
+{
+	uint64_t x = 0;
+	int shift;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (rbuf == rend)
+			bad_manifest();
+		x |= (uint64_t)(*rbuf & 0x7F) << shift;
+		if (!(*rbuf++ & 0x80))
+			return x;
+	}
+	bad_manifest();
+}
+
+static uint32 get_varint(void)
+{
+	uint64_t x = get_varlong();
+
+	if (x > 0xFFFFFFFFu)
+		bad_manifest();
+	return (uint32)x;
+}
+
+static const char *get_string(size_t *len_ptr)
+{
+	size_t len = get_varint();
+	const char *s = (const char *)rbuf;
+
+	if ((size_t)(rend - rbuf) <= len || s[len] != '\0')
+		bad_manifest();
+	rbuf += len + 1;
+	if (len_ptr)
+		*len_ptr = len;
+	return s;
+}
+
+static void get_xattrs(struct manifest_entry *e)
+{
+	int32 j;
+
+	e->xattr_count = get_varint();
+	if (!e->xattr_count)
+		return;
+	if (!(e->xattrs = new_array(struct manifest_xattr, e->xattr_count)))
+		out_of_memory("read_manifest");
+	for (j = 0; j < e->xattr_count; j++) {
+		struct manifest_xattr *mx = e->xattrs + j;
+		mx->name = get_string(&mx->name_len);
+		mx->name_len++; /* rsync_xa counts the '\0' */
+		mx->datum_len = get_varint();
+		mx->stored_len = mx->datum_len > MAX_FULL_DATUM
+			       ? MAX_DIGEST_LEN : mx->datum_len;
+		if ((size_t)(rend - rbuf) < mx->stored_len)
+			bad_manifest();
+		mx->datum = (const char *)rbuf;
+		rbuf += mx->stored_len;
+	}
+}
+
+/* Loads the manifest file, which stays in memory for the whole run.  With
+ * --manifest-id, a manifest that was written with another id (or none)
+ * is not used, the tree is read from the disk instead. */
+void read_manifest(const char *fname)
+{
+	static alloc_pool_t path_pool;
+	STRUCT_STAT st;
+	const char *id = NULL;
+	char *buf;
+	int32 size = 0;
+	int fd, len;
+
+	rname = fname;
+	if ((fd = do_open(fname, O_RDONLY, 0)) < 0 || do_fstat(fd, &st) < 0) {
+		rsyserr(FERROR, errno, "cannot open manifest %s", full_fname(fname));
+		exit_cleanup(RERR_FILEIO);
+	}
+	if (!(buf = new_array(char, st.st_size + 1)))
+		out_of_memory("read_manifest");
+	if (read(fd, buf, st.st_size) != st.st_size) {
+		rsyserr(FERROR, errno, "cannot read manifest %s", full_fname(fname));
+		exit_cleanup(RERR_FILEIO);
+	}
+	close(fd);
+
+	rbuf = (const uchar *)buf;
+	rend = rbuf + st.st_size;
+	if (st.st_size < MANIFEST_MAGIC_LEN
+	 || memcmp(buf, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN) != 0) {
+		rprintf(FERROR, "%s is not a manifest\n", full_fname(fname));
+		exit_cleanup(RERR_FILEIO);
+	}
+	rbuf += MANIFEST_MAGIC_LEN;
+	manifest_flags = get_varint();
+	if (manifest_flags & MF_ID)
+		id = get_string(NULL);
+	if (manifest_id && (!id || strcmp(id, manifest_id) != 0)) {
+		rprintf(FWARNING, "manifest %s was not written for %s, not using it\n",
+			full_fname(fname), manifest_id);
+		manifest_flags = 0;
+		free(buf);
+		return;
+	}
+
+	if (!(path_pool = pool_create(64 * 1024, 0, out_of_memory, POOL_INTERN)))
+		out_of_memory("read_manifest");
+
+	while (rbuf < rend) {
+		struct manifest_entry *e;
+		uint32 delta = get_varint();
+		size_t name_len, dir_len;
+		char *path;
+		uchar flags;
+
+		if (entry_count == size) {
+			size = size ? size * 2 : 4096;
+			if (!(entries = realloc_array(entries, struct manifest_entry, size)))
+				out_of_memory("read_manifest");
+		}
+		e = entries + entry_count;
+		memset(e, 0, sizeof e[0]);
+		e->first_child = e->last_child = e->next_sibling = -1;
+
+		if (!entry_count != !delta || (uint32)entry_count < delta)
+			bad_manifest();
+		e->parent = entry_count - delta;
+		e->name = get_string(&name_len);
+
+		/* The path is the parent's path, a slash and the name. */
+		if (delta) {
+			struct manifest_entry *p = entries + e->parent;
+			if (!S_ISDIR(p->mode) || !name_len)
+				bad_manifest();
+			dir_len = strlen(p->path);
+			path = pool_alloc(path_pool, dir_len + name_len + 2, "read_manifest");
+			if (dir_len) {
+				memcpy(path, p->path, dir_len);
+				path[dir_len++] = '/';
+			}
+			memcpy(path + dir_len, e->name, name_len + 1);
+			e->path = path;
+			e->name = path + dir_len;
+			/* Keep the order of readdir() when it was written,
+			 * which is the order the sender sends them in. */
+			if (p->last_child < 0)
+				p->first_child = entry_count;
+			else
+				entries[p->last_child].next_sibling = entry_count;
+			p->last_child = entry_count;
+		} else
+			e->path = "";
+
+		if (rbuf == rend)
+			bad_manifest();
+		flags = *rbuf++;
+		e->mode = get_varint();
+		e->uid = get_varint();
+		e->gid = get_varint();
+		e->size = get_varlong();
+		e->mtime = get_varlong();
+		e->ino = get_varlong();
+		e->mtime_nsec = flags & MFE_NSEC ? get_varint() : 0;
+		e->nlink = flags & MFE_NLINK ? get_varint() : 1;
+		if (flags & MFE_DEV)
+			e->dev = get_varlong();
+		else if (delta)
+			e->dev = entries[e->parent].dev;
+		if (IS_DEVICE(e->mode))
+			e->rdev = get_varlong();
+		if (S_ISLNK(e->mode))
+			e->link = get_string(NULL);
+		if (manifest_flags & MF_XATTRS)
+			get_xattrs(e);
+
+		hashchains_add(&entry_h, hash_bytes(HASH_BYTES_INIT, e->path, strlen(e->path)));
+		entry_count++;
+	}
+
+	if (!entry_count || !S_ISDIR(entries[0].mode))
+		bad_manifest();
+
+	/* A relative root is taken from the dir we started in. */
+	if (manifest_root) {
+		if (*manifest_root == '/' || curr_dir_len == 1)
+			len = asprintf(&root_dir, "%s%s", *manifest_root == '/' ? "" : "/", manifest_root);
+		else
+			len = asprintf(&root_dir, "%s/%s", curr_dir, manifest_root);
+		if (len < 0)
+			out_of_memory("read_manifest");
+		root_len = clean_fname(root_dir, CFN_DROP_TRAILING_DOT_DIR);
+		if (root_len > 1 && root_dir[root_len-1] == '/')
+			root_dir[--root_len] = '\0';
+	}
+}
+
+/* Returns the manifest's entry for fname, which is relative to curr_dir,
+ * or -1 if there is none.  If fname is outside of the manifest's root,
+ * *covered is set to 0. */
+static int32 find_entry(const char *fname, int *covered)
+{
+	char path[MAXPATHLEN];
+	unsigned int len;
+	int32 i;
+
+	*covered = 0;
+	if (!entries)
+		return -1;
+
+	/* The root defaults to the first dir the sender looks at. */
+	if (!root_dir) {
+		if (!(root_dir = strdup(curr_dir)))
+			out_of_memory("find_entry");
+		root_len = curr_dir_len;
+	}
+
+	if (*fname == '/')
+		len = strlcpy(path, fname, sizeof path);
+	else if (curr_dir_len == 1)
+		len = snprintf(path, sizeof path, "/%s", fname);
+	else
+		len = snprintf(path, sizeof path, "%s/%s", curr_dir, fname);
+	if (len >= sizeof path)
+		return -1;
+	len = clean_fname(path, CFN_DROP_TRAILING_DOT_DIR);
+	if (len > 1 && path[len-1] == '/')
+		path[--len] = '\0';
+
+	if (root_len == 1)
+		fname = path + 1;
+	else if (strncmp(path, root_dir, root_len) == 0
+	      && (path[root_len] == '/' || path[root_len] == '\0'))
+		fname = path[root_len] ? path + root_len + 1 : "";
+	else
+		return -1;
+	*covered = 1;
+
+	for (i = hashchains_first(&entry_h, hash_bytes(HASH_BYTES_INIT, fname, strlen(fname)));
+	     i >= 0; i = entry_h.next[i]) {
+		if (strcmp(entries[i].path, fname) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Fills *stp for fname, as lstat() would, and linkbuf (if not NULL) with
+ * a symlink's target.  Returns 0 if fname is not under the manifest's
+ * root (the caller should look at the file itself), 1 if it was found,
+ * and -1 with errno ENOENT if the manifest does not have it. */
+int manifest_stat(const char *fname, STRUCT_STAT *stp, char *linkbuf)
+{
+	struct manifest_entry *e;
+	int32 i;
+	int covered;
+
+	if ((i = find_entry(fname, &covered)) < 0) {
+		if (!covered)
+			return 0;
+		errno = ENOENT;
+		return -1;
+	}
+	e = entries + i;
+
+	memset(stp, 0, sizeof stp[0]);
+	stp->st_mode = e->mode;
+	stp->st_uid = e->uid;
+	stp->st_gid = e->gid;
+	stp->st_size = e->size;
+	stp->st_mtime = e->mtime;
+#ifdef ST_MTIME_NSEC
+	stp->ST_MTIME_NSEC = e->mtime_nsec;
+#endif
+	stp->st_nlink = e->nlink;
+	stp->st_dev = e->dev;
+	stp->st_ino = e->ino;
+#ifdef HAVE_STRUCT_STAT_ST_RDEV
+	stp->st_rdev = e->rdev;
+#endif
+	if (linkbuf && e->link)
+		strlcpy(linkbuf, e->link, MAXPATHLEN);
+
+	return 1;
+}
+
+/* If fname is a directory in the manifest, returns 1 and sets *pos for
+ * manifest_readdir(). */
+int manifest_opendir(const char *fname, int32 *pos)
+{
+	int covered;
+	int32 i = find_entry(fname, &covered);
+
+	if (i < 0 || !S_ISDIR(entries[i].mode))
+		return 0;
+	*pos = entries[i].first_child;
+	return 1;
+}
+
+/* Returns the next name in a directory opened by manifest_opendir(), or
+ * NULL at the end. */
+const char *manifest_readdir(int32 *pos)
+{
+	const char *name;
+
+	if (*pos < 0)
+		return NULL;
+	name = entries[*pos].name;
+	*pos = entries[*pos].next_sibling;
+	return name;
+}
+
+/* Returns the number of xattrs of fname and sets *xattrs, or returns -1
+ * if the manifest has no xattrs for fname. */
+int manifest_xattrs(const char *fname, struct manifest_xattr **xattrs)
+{
+	int covered;
+	int32 i;
+
+	if (!(manifest_flags & MF_XATTRS) || (i = find_entry(fname, &covered)) < 0)
+		return -1;
+	*xattrs = entries[i].xattrs;
+	return entries[i].xattr_count;
+}
+
+/* === Writing === */
+
+static FILE *wfp;
+static int32 write_count;
+
+static void put_varlong(uint64_t x)
+{
+	while (x >= 0x80) {
+		putc((x & 0x7F) | 0x80, wfp);
+		x >>= 7;
+	}
+	putc((int)x, wfp);
+}
+
+static void put_string(const char *s, size_t len)
+{
+	put_varlong(len);
+	fwrite(s, 1, len, wfp);
+	putc('\0', wfp);
+}
+
+/* Writes the entry for path, a child of entry parent (-1 for the root).
+ * Returns its index, or -1 if it could not be read. */
+static int32 put_entry(const char *path, const char *name, int32 parent,
+		       STRUCT_STAT *stp, int64 parent_dev)
+{
+	uchar flags = 0;
+	uint32 nsec = 0;
+
+#ifdef ST_MTIME_NSEC
+	nsec = stp->ST_MTIME_NSEC;
+#endif
+	if (nsec)
+		flags |= MFE_NSEC;
+	if (!S_ISDIR(stp->st_mode) && stp->st_nlink > 1)
+		flags |= MFE_NLINK;
+	if (parent < 0 || (int64)stp->st_dev != parent_dev)
+		flags |= MFE_DEV;
+
+	put_varlong(parent < 0 ? 0 : write_count - parent);
+	put_string(name, strlen(name));
+	putc(flags, wfp);
+	put_varlong(stp->st_mode);
+	put_varlong(stp->st_uid);
+	put_varlong(stp->st_gid);
+	put_varlong(stp->st_size);
+	put_varlong(stp->st_mtime);
+	put_varlong(stp->st_ino);
+	if (flags & MFE_NSEC)
+		put_varlong(nsec);
+	if (flags & MFE_NLINK)
+		put_varlong(stp->st_nlink);
+	if (flags & MFE_DEV)
+		put_varlong(stp->st_dev);
+#ifdef HAVE_STRUCT_STAT_ST_RDEV
+	if (IS_DEVICE(stp->st_mode))
+		put_varlong(stp->st_rdev);
+#else
+	if (IS_DEVICE(stp->st_mode))
+		put_varlong(0);
+#endif
+
+	if (S_ISLNK(stp->st_mode)) {
+		char linkbuf[MAXPATHLEN];
+		int len = do_readlink(path, linkbuf, sizeof linkbuf - 1);
+		if (len < 0) {
+			rsyserr(FERROR_XFER, errno, "readlink %s failed", full_fname(path));
+			return -1;
+		}
+		put_string(linkbuf, len);
+	}
+
+	if (manifest_flags & MF_XATTRS) {
+#ifdef SUPPORT_XATTRS
+		item_list mxl = EMPTY_ITEM_LIST;
+		struct manifest_xattr *mx;
+		stat_x sx;
+		size_t j;
+
+		memset(&sx, 0, sizeof sx);
+		sx.st = *stp;
+		if (get_xattr(path, &sx) < 0)
+			return -1;
+		get_manifest_xattrs(&sx, &mxl);
+		put_varlong(mxl.count);
+		for (j = 0, mx = mxl.items; j < mxl.count; j++, mx++) {
+			put_string(mx->name, mx->name_len - 1);
+			put_varlong(mx->datum_len);
+			fwrite(mx->datum, 1, mx->stored_len, wfp);
+		}
+		free(mxl.items);
+		free_xattr(&sx);
+#else
+		put_varlong(0);
+#endif
+	}
+
+	return write_count++;
+}
+
+/* Writes the entries below the directory path (of len bytes, in a buffer
+ * of MAXPATHLEN), which is entry ndx.  Returns 0 if something could not
+ * be read. */
+static int put_dir(char *path, int len, int32 ndx, int64 dev)
+{
+	item_list names = EMPTY_ITEM_LIST;
+	struct dirent *di;
+	size_t j;
+	int ok = 1;
+	DIR *d;
+
+	if (!(d = opendir(path))) {
+		rsyserr(FERROR_XFER, errno, "opendir %s failed", full_fname(path));
+		return 0;
+	}
+	/* Read the whole directory first, so that we don't keep one open
+	 * per level of the tree. */
+	while ((di = readdir(d)) != NULL) {
+		char *dname = d_name(di), **np;
+		if (dname[0] == '.' && (dname[1] == '\0'
+		    || (dname[1] == '.' && dname[2] == '\0')))
+			continue;
+		np = EXPAND_ITEM_LIST(&names, char *, 256);
+		if (!(*np = strdup(dname)))
+			out_of_memory("put_dir");
+	}
+	closedir(d);
+
+	path[len] = '/';
+	for (j = 0; j < names.count; j++) {
+		char *name = ((char **)names.items)[j];
+		STRUCT_STAT st;
+		int32 i;
+
+		if (ok && strlcpy(path + len + 1, name, MAXPATHLEN - len - 1) >= (size_t)(MAXPATHLEN - len - 1)) {
+			rprintf(FERROR_XFER, "filename overflows max-path len: %s\n", name);
+			ok = 0;
+		} else if (ok && do_lstat(path, &st) < 0) {
+			rsyserr(FERROR_XFER, errno, "lstat %s failed", full_fname(path));
+			ok = 0;
+		} else if (ok) {
+			if ((i = put_entry(path, name, ndx, &st, dev)) < 0
+			 || (S_ISDIR(st.st_mode)
+			  && !put_dir(path, len + 1 + strlen(name), i, st.st_dev)))
+				ok = 0;
+		}
+		free(name);
+	}
+	path[len] = '\0';
+	free(names.items);
+
+	return ok;
+}
+
+/* Writes a manifest of the tree below dir into fname.  The manifest is
+ * first written to a temporary file, which only replaces fname when the
+ * whole tree could be read. */
+int write_manifest(const char *fname, const char *dir)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN];
+	STRUCT_STAT st;
+	int len, ok;
+
+	len = strlcpy(path, dir, sizeof path);
+	if (len >= (int)sizeof path)
+		overflow_exit("write_manifest");
+	len = clean_fname(path, CFN_DROP_TRAILING_DOT_DIR);
+	if (len > 1 && path[len-1] == '/')
+		path[--len] = '\0';
+	if (do_stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		rprintf(FERROR, "%s is not a directory\n", full_fname(path));
+		return RERR_FILESELECT;
+	}
+
+	if (snprintf(tmp, sizeof tmp, "%s.tmp", fname) >= (int)sizeof tmp)
+		overflow_exit("write_manifest");
+	if (!(wfp = fopen(tmp, "wb"))) {
+		rsyserr(FERROR, errno, "cannot create %s", full_fname(tmp));
+		return RERR_FILEIO;
+	}
+
+	if (preserve_xattrs)
+		manifest_flags |= MF_XATTRS;
+	if (manifest_id)
+		manifest_flags |= MF_ID;
+	fwrite(MANIFEST_MAGIC, 1, MANIFEST_MAGIC_LEN, wfp);
+	put_varlong(manifest_flags);
+	if (manifest_id)
+		put_string(manifest_id, strlen(manifest_id));
+
+	ok = put_entry(path, "", -1, &st, 0) == 0 && put_dir(path, len, 0, st.st_dev);
+
+	if (ferror(wfp) | fclose(wfp)) {
+		rsyserr(FERROR, errno, "cannot write %s", full_fname(tmp));
+		ok = 0;
+	}
+	if (!ok || rename(tmp, fname) < 0) {
+		if (ok)
+			rsyserr(FERROR, errno, "cannot rename %s", full_fname(tmp));
+		unlink(tmp);
+		return ok ? RERR_FILEIO : RERR_PARTIAL;
+	}
+
+	if (INFO_GTE(STATS, 1))
+		rprintf(FINFO, "%d files in manifest %s\n", write_count, fname);
+
+	return 0;
+}
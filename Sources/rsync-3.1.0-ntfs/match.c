@@ -21,10 +21,15 @@
 
 #include "rsync.h"
 #include "inums.h"
+#ifdef SUPPORT_DELTA_THREADS
+#include <pthread.h>
+#endif
 
 extern int checksum_seed;
 extern int append_mode;
 extern int checksum_len;
+extern int protocol_version;
+extern int delta_threads;
 
 int updating_basis_file;
 char sender_file_sum[MAX_DIGEST_LEN];
@@ -145,7 +150,8 @@ static void hash_search(int f,struct sum_struct *s,
 	int32 k, want_i, aligned_i, backup;
 	char sum2[SUM_LENGTH];
 	uint32 s1, s2, sum;
-	int more;
+	uint32 roll_sums[ROLL_BATCH];
+	int more, roll_next = ROLL_BATCH;
 	schar *map;
 
 	/* want_i is used to encourage adjacent matches, allowing the RLL
@@ -305,6 +311,7 @@ static void hash_search(int f,struct sum_struct *s,
 			sum = get_checksum1((char *)map, k);
 			s1 = sum & 0xFFFF;
 			s2 = sum >> 16;
+			roll_next = ROLL_BATCH;
 			matches++;
 			break;
 		} while ((i = s->sums[i].chain) >= 0);
@@ -315,19 +322,35 @@ static void hash_search(int f,struct sum_struct *s,
 		if (backup < 0)
 			backup = 0;
 
-		/* Trim off the first byte from the checksum */
-		more = offset + k < len;
-		map = (schar *)map_ptr(buf, offset - backup, k + more + backup)
-		    + backup;
-		s1 -= map[0] + CHAR_OFFSET;
-		s2 -= k * (map[0]+CHAR_OFFSET);
+		/* While there is enough data left, roll the checksum over the
+		 * next ROLL_BATCH offsets at once and use up those sums until
+		 * a match moves the offset. */
+		if (roll_next == ROLL_BATCH && offset + k + ROLL_BATCH <= len) {
+			map = (schar *)map_ptr(buf, offset - backup, k + ROLL_BATCH + backup)
+			    + backup;
+			roll_checksum1(map, k, (s1 & 0xFFFF) | (s2 << 16), roll_sums);
+			roll_next = 0;
+		}
 
-		/* Add on the next byte (if there is one) to the checksum */
-		if (more) {
-			s1 += map[k] + CHAR_OFFSET;
-			s2 += s1;
-		} else
-			--k;
+		if (roll_next < ROLL_BATCH) {
+			sum = roll_sums[roll_next++];
+			s1 = sum & 0xFFFF;
+			s2 = sum >> 16;
+		} else {
+			/* Trim off the first byte from the checksum */
+			more = offset + k < len;
+			map = (schar *)map_ptr(buf, offset - backup, k + more + backup)
+			    + backup;
+			s1 -= map[0] + CHAR_OFFSET;
+			s2 -= k * (map[0]+CHAR_OFFSET);
+
+			/* Add on the next byte (if there is one) to the checksum */
+			if (more) {
+				s1 += map[k] + CHAR_OFFSET;
+				s2 += s1;
+			} else
+				--k;
+		}
 
 		/* By matching early we avoid re-reading the
 		   data 3 times in the case where a token
@@ -344,6 +367,278 @@ static void hash_search(int f,struct sum_struct *s,
 }
 
 
+#ifdef SUPPORT_DELTA_THREADS
+/* For big files the search is split into pieces of about DELTA_PIECE_SIZE
+ * bytes (a multiple of the block length, so that unchanged data stays in
+ * step with the basis blocks).  Each of delta_threads threads searches a
+ * piece on its own, reading it through its own pread() map, and collects
+ * the matches it finds.  The main thread then sends the pieces in order,
+ * dropping any match that overlaps the end of the previous one.  Since the
+ * pieces only depend on the file and block length, the token stream is the
+ * same for any number of threads.  Reading ahead in the threads also means
+ * that the main thread finds the data in the page cache when it sends it. */
+struct match_hit {
+	OFF_T offset;
+	int32 i;
+};
+
+struct match_piece {
+	struct match_hit *hits;
+	int32 count, size;
+	int false_alarms, hash_hits, matches;
+	int32 done;		/* piece number + 1 once it is searched */
+};
+
+struct match_pieces {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct sum_struct *s;
+	int fd;
+	OFF_T len, end, piece_size;
+	int32 npieces, nslots, next, sent;
+	struct match_piece *slots;
+};
+
+/* Like hash_search() without the --inplace and debugging bits, and with
+ * the matches saved in mp instead of sent. */
+static void search_piece(struct sum_struct *s, struct map_struct *mapbuf,
+			 OFF_T offset, OFF_T stop, OFF_T len, struct match_piece *mp)
+{
+	char sum2[SUM_LENGTH];
+	uint32 s1, s2, sum;
+	uint32 roll_sums[ROLL_BATCH];
+	int32 k, want_i = (int32)(offset / s->blength);
+	int more, roll_next = ROLL_BATCH;
+	schar *map;
+
+	k = (int32)MIN(len - offset, (OFF_T)s->blength);
+	map = (schar *)map_ptr(mapbuf, offset, k);
+	sum = get_checksum1((char *)map, k);
+	s1 = sum & 0xFFFF;
+	s2 = sum >> 16;
+
+	while (offset < stop) {
+		int done_csum2 = 0;
+		int32 i;
+
+		sum = (s1 & 0xffff) | (s2 << 16);
+		if (tablesize == TRADITIONAL_TABLESIZE)
+			i = hash_table[SUM2HASH2(s1,s2)];
+		else
+			i = hash_table[BIG_SUM2HASH(sum)];
+
+		if (i >= 0) {
+			mp->hash_hits++;
+			do {
+				int32 l;
+
+				if (sum != s->sums[i].sum1)
+					continue;
+
+				l = (int32)MIN((OFF_T)s->blength, len-offset);
+				if (l != s->sums[i].len)
+					continue;
+
+				if (!done_csum2) {
+					map = (schar *)map_ptr(mapbuf, offset, l);
+					get_checksum2((char *)map, l, sum2);
+					done_csum2 = 1;
+				}
+
+				if (memcmp(sum2, s->sums[i].sum2, s->s2length) != 0) {
+					mp->false_alarms++;
+					continue;
+				}
+
+				if (i != want_i && want_i < s->count
+				    && sum == s->sums[want_i].sum1
+				    && memcmp(sum2, s->sums[want_i].sum2, s->s2length) == 0)
+					i = want_i;
+				break;
+			} while ((i = s->sums[i].chain) >= 0);
+		}
+
+		if (i >= 0) {
+			if (mp->count == mp->size) {
+				mp->size = mp->size ? mp->size * 2 : 1024;
+				mp->hits = realloc_array(mp->hits, struct match_hit, mp->size);
+				if (!mp->hits)
+					out_of_memory("search_piece");
+			}
+			mp->hits[mp->count].offset = offset;
+			mp->hits[mp->count++].i = i;
+			mp->matches++;
+			want_i = i + 1;
+
+			offset += s->sums[i].len;
+			if (offset >= stop)
+				break;
+			k = (int32)MIN((OFF_T)s->blength, len-offset);
+			map = (schar *)map_ptr(mapbuf, offset, k);
+			sum = get_checksum1((char *)map, k);
+			s1 = sum & 0xFFFF;
+			s2 = sum >> 16;
+			roll_next = ROLL_BATCH;
+			continue;
+		}
+
+		if (roll_next == ROLL_BATCH && offset + k + ROLL_BATCH <= len) {
+			map = (schar *)map_ptr(mapbuf, offset, k + ROLL_BATCH);
+			roll_checksum1(map, k, sum, roll_sums);
+			roll_next = 0;
+		}
+
+		if (roll_next < ROLL_BATCH) {
+			sum = roll_sums[roll_next++];
+			s1 = sum & 0xFFFF;
+			s2 = sum >> 16;
+		} else {
+			more = offset + k < len;
+			map = (schar *)map_ptr(mapbuf, offset, k + more);
+			s1 -= map[0] + CHAR_OFFSET;
+			s2 -= k * (map[0]+CHAR_OFFSET);
+			if (more) {
+				s1 += map[k] + CHAR_OFFSET;
+				s2 += s1;
+			} else
+				--k;
+		}
+		offset++;
+	}
+}
+
+static void *match_thread(void *arg)
+{
+	struct match_pieces *mps = arg;
+	struct sum_struct *s = mps->s;
+	struct map_struct *mapbuf;
+
+	mapbuf = map_file(mps->fd, mps->len, MAX(s->blength * 3, MAX_MAP_SIZE), s->blength);
+	mapbuf->shared = 1;
+
+	pthread_mutex_lock(&mps->lock);
+	while (1) {
+		struct match_piece *mp;
+		OFF_T start, stop;
+		int32 piece;
+
+		while (mps->next < mps->npieces && mps->next >= mps->sent + mps->nslots)
+			pthread_cond_wait(&mps->cond, &mps->lock);
+		if (mps->next >= mps->npieces)
+			break;
+		piece = mps->next++;
+		pthread_mutex_unlock(&mps->lock);
+
+		mp = &mps->slots[piece % mps->nslots];
+		mp->count = mp->false_alarms = mp->hash_hits = mp->matches = 0;
+		start = piece * mps->piece_size;
+		stop = MIN(start + mps->piece_size, mps->end);
+		search_piece(s, mapbuf, start, stop, mps->len, mp);
+
+		pthread_mutex_lock(&mps->lock);
+		mp->done = piece + 1;
+		pthread_cond_broadcast(&mps->cond);
+	}
+	pthread_mutex_unlock(&mps->lock);
+
+	/* The main thread reads all the data again to send it, so it will
+	 * notice any read error, too. */
+	unmap_file(mapbuf);
+
+	return NULL;
+}
+
+/* Returns -1 (having sent nothing) if no thread could be started. */
+static int hash_search_threaded(int f, struct sum_struct *s,
+				struct map_struct *buf, OFF_T len)
+{
+	pthread_t tids[MAX_DELTA_THREADS];
+	sigset_t all_sigs, old_sigs;
+	struct match_pieces mps;
+	OFF_T next_ok = 0;
+	int32 i, j;
+	int cnt;
+
+	memset(&mps, 0, sizeof mps);
+	pthread_mutex_init(&mps.lock, NULL);
+	pthread_cond_init(&mps.cond, NULL);
+	mps.s = s;
+	mps.fd = buf->fd;
+	mps.len = len;
+	mps.end = len + 1 - s->sums[s->count-1].len;
+	mps.piece_size = (OFF_T)s->blength * MAX(DELTA_PIECE_SIZE / s->blength, 1);
+	mps.npieces = (int32)((mps.end + mps.piece_size - 1) / mps.piece_size);
+	mps.nslots = 2 * delta_threads;
+	if (!(mps.slots = new_array0(struct match_piece, mps.nslots)))
+		out_of_memory("hash_search_threaded");
+
+	/* Leave all signal handling to the main thread. */
+	sigfillset(&all_sigs);
+	pthread_sigmask(SIG_BLOCK, &all_sigs, &old_sigs);
+	for (cnt = 0; cnt < delta_threads; cnt++) {
+		if (pthread_create(&tids[cnt], NULL, match_thread, &mps) != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+
+	if (cnt == 0) {
+		free(mps.slots);
+		return -1;
+	}
+
+	if (DEBUG_GTE(DELTASUM, 2)) {
+		rprintf(FINFO, "hash search in %s pieces with %d threads\n",
+			big_num(mps.npieces), cnt);
+	}
+
+	for (i = 0; i < mps.npieces; i++) {
+		struct match_piece *mp = &mps.slots[i % mps.nslots];
+		OFF_T piece_end;
+
+		pthread_mutex_lock(&mps.lock);
+		while (mp->done != i + 1)
+			pthread_cond_wait(&mps.cond, &mps.lock);
+		pthread_mutex_unlock(&mps.lock);
+
+		for (j = 0; j < mp->count; j++) {
+			struct match_hit *hit = &mp->hits[j];
+			if (hit->offset < next_ok)
+				continue;
+			matched(f, s, buf, hit->offset, hit->i);
+			next_ok = last_match;
+		}
+		false_alarms += mp->false_alarms;
+		hash_hits += mp->hash_hits;
+		matches += mp->matches;
+
+		/* Send the literal data of the piece now, while it is still
+		 * cached. */
+		piece_end = MIN((i + 1) * mps.piece_size, len);
+		if (last_match < piece_end)
+			matched(f, s, buf, piece_end, -2);
+
+		pthread_mutex_lock(&mps.lock);
+		mps.sent++;
+		pthread_cond_broadcast(&mps.cond);
+		pthread_mutex_unlock(&mps.lock);
+	}
+
+	while (cnt--)
+		pthread_join(tids[cnt], NULL);
+
+	for (i = 0; i < mps.nslots; i++)
+		free(mps.slots[i].hits);
+	free(mps.slots);
+	pthread_cond_destroy(&mps.cond);
+	pthread_mutex_destroy(&mps.lock);
+
+	matched(f, s, buf, len, -1);
+	map_ptr(buf, len-1, 1);
+
+	return 0;
+}
+#endif
+
 /**
  * Scan through a origin file, looking for sections that match
  * checksums from the generator, and transmit either literal or token
@@ -395,6 +690,16 @@ void match_sums(int f, struct sum_struct *s, struct map_struct *buf, OFF_T len)
 		if (DEBUG_GTE(DELTASUM, 2))
 			rprintf(FINFO,"built hash table\n");
 
+#ifdef SUPPORT_DELTA_THREADS
+		/* The threads can't do the --inplace bookkeeping, and
+		 * get_checksum2() is only thread-safe for MD5 sums. */
+		if (delta_threads > 1 && len >= DELTA_THREADS_MIN_LEN
+		 && !updating_basis_file && protocol_version >= 30
+		 && !DEBUG_GTE(DELTASUM, 3)
+		 && hash_search_threaded(f, s, buf, len) == 0)
+			;
+		else
+#endif
 		hash_search(f, s, buf, len);
 
 		if (DEBUG_GTE(DELTASUM, 2))
@@ -74,6 +74,8 @@ int one_file_system = 0;
 int protocol_version = PROTOCOL_VERSION;
 int sparse_files = 0;
 int preallocate_files = 0;
+int file_writers = 0;
+int delta_threads = 0;
 int do_compression = 0;
 int def_compress_level = Z_DEFAULT_COMPRESSION;
 int am_root = 0; /* 0 = normal, 1 = root, 2 = --super, -1 = --fake-super */
@@ -91,6 +93,10 @@ int io_timeout = 0;
 int prune_empty_dirs = 0;
 int use_qsort = 0;
 char *files_from = NULL;
+char *manifest_name = NULL;
+char *manifest_root = NULL;
+char *manifest_id = NULL;
+char *write_manifest_name = NULL;
 int filesfrom_fd = -1;
 char *filesfrom_host = NULL;
 int eol_nulls = 0;
@@ -719,10 +725,12 @@ void usage(enum logcode F)
 #else
   rprintf(F,"     --preallocate           pre-allocate dest files on remote receiver\n");
 #endif
+  rprintf(F,"     --writers=NUM           receiver writes up to NUM files at once\n");
   rprintf(F," -n, --dry-run               perform a trial run with no changes made\n");
   rprintf(F," -W, --whole-file            copy files whole (without delta-xfer algorithm)\n");
   rprintf(F," -x, --one-file-system       don't cross filesystem boundaries\n");
   rprintf(F," -B, --block-size=SIZE       force a fixed checksum block-size\n");
+  rprintf(F,"     --delta-threads=NUM     checksum and match big files with NUM threads\n");
   rprintf(F," -e, --rsh=COMMAND           specify the remote shell to use\n");
   rprintf(F,"     --rsync-path=PROGRAM    specify the rsync to run on the remote machine\n");
   rprintf(F,"     --existing              skip creating new files on receiver\n");
@@ -773,6 +781,10 @@ void usage(enum logcode F)
   rprintf(F,"     --include=PATTERN       don't exclude files matching PATTERN\n");
   rprintf(F,"     --include-from=FILE     read include patterns from FILE\n");
   rprintf(F,"     --files-from=FILE       read list of source-file names from FILE\n");
+  rprintf(F,"     --manifest=FILE         build the sender's file list from a manifest\n");
+  rprintf(F,"     --manifest-root=DIR     the dir that the manifest describes\n");
+  rprintf(F,"     --manifest-id=ID        write ID into the manifest, only use one with ID\n");
+  rprintf(F,"     --write-manifest=FILE   write a manifest of the only SRC dir to FILE\n");
   rprintf(F," -0, --from0                 all *-from/filter files are delimited by 0s\n");
   rprintf(F," -s, --protect-args          no space-splitting; only wildcard special-chars\n");
   rprintf(F,"     --address=ADDRESS       bind address for outgoing socket to daemon\n");
@@ -923,6 +935,8 @@ static struct poptOption long_options[] = {
   {"no-sparse",        0,  POPT_ARG_VAL,    &sparse_files, 0, 0, 0 },
   {"no-S",             0,  POPT_ARG_VAL,    &sparse_files, 0, 0, 0 },
   {"preallocate",      0,  POPT_ARG_NONE,   &preallocate_files, 0, 0, 0},
+  {"writers",          0,  POPT_ARG_INT,    &file_writers, 0, 0, 0 },
+  {"delta-threads",    0,  POPT_ARG_INT,    &delta_threads, 0, 0, 0 },
   {"inplace",          0,  POPT_ARG_VAL,    &inplace, 1, 0, 0 },
   {"no-inplace",       0,  POPT_ARG_VAL,    &inplace, 0, 0, 0 },
   {"append",           0,  POPT_ARG_NONE,   0, OPT_APPEND, 0, 0 },
@@ -998,6 +1012,10 @@ static struct poptOption long_options[] = {
   {"write-batch",      0,  POPT_ARG_STRING, &batch_name, OPT_WRITE_BATCH, 0, 0 },
   {"only-write-batch", 0,  POPT_ARG_STRING, &batch_name, OPT_ONLY_WRITE_BATCH, 0, 0 },
   {"files-from",       0,  POPT_ARG_STRING, &files_from, 0, 0, 0 },
+  {"manifest",         0,  POPT_ARG_STRING, &manifest_name, 0, 0, 0 },
+  {"manifest-root",    0,  POPT_ARG_STRING, &manifest_root, 0, 0, 0 },
+  {"manifest-id",      0,  POPT_ARG_STRING, &manifest_id, 0, 0, 0 },
+  {"write-manifest",   0,  POPT_ARG_STRING, &write_manifest_name, 0, 0, 0 },
   {"from0",           '0', POPT_ARG_VAL,    &eol_nulls, 1, 0, 0},
   {"no-from0",         0,  POPT_ARG_VAL,    &eol_nulls, 0, 0, 0},
   {"protect-args",    's', POPT_ARG_VAL,    &protect_args, 1, 0, 0},
@@ -1923,6 +1941,21 @@ int parse_arguments(int *argc_p, const char ***argv_p)
 	}
 #endif
 
+	if (manifest_name) {
+		if (am_daemon) {
+			snprintf(err_buf, sizeof err_buf,
+				 "--manifest is not allowed for a daemon\n");
+			return 0;
+		}
+		if (copy_links || am_root < 0 || read_batch) {
+			snprintf(err_buf, sizeof err_buf,
+				 "--manifest cannot be used with %s\n",
+				 copy_links ? "--copy-links" : am_root < 0
+				 ? "--fake-super" : "--read-batch");
+			return 0;
+		}
+	}
+
 	if (block_size > MAX_BLOCK_SIZE) {
 		snprintf(err_buf, sizeof err_buf,
 			 "--block-size=%lu is too large (max: %u)\n", block_size, MAX_BLOCK_SIZE);
@@ -2207,6 +2240,31 @@ int parse_arguments(int *argc_p, const char ***argv_p)
 			bwlimit_writemax = 512;
 	}
 
+	if (file_writers < 0) {
+		snprintf(err_buf, sizeof err_buf,
+			 "--writers=%d is invalid\n", file_writers);
+		return 0;
+	}
+
+	if (delta_threads < 0) {
+		snprintf(err_buf, sizeof err_buf,
+			 "--delta-threads=%d is invalid\n", delta_threads);
+		return 0;
+	}
+#ifdef SUPPORT_DELTA_THREADS
+	if (!delta_threads) {
+#ifdef HAVE_SYSCONF
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		delta_threads = cpus > 0 ? (int)MIN(cpus, MAX_DELTA_THREADS) : 1;
+#else
+		delta_threads = 1;
+#endif
+	} else if (delta_threads > MAX_DELTA_THREADS)
+		delta_threads = MAX_DELTA_THREADS;
+#else
+	delta_threads = 1;
+#endif
+
 	if (sparse_files && inplace) {
 		/* Note: we don't check for this below, because --append is
 		 * OK with --sparse (as long as redos are handled right). */
@@ -2727,6 +2785,19 @@ void server_options(char **args, int *argc_p)
 		if (!relative_paths)
 			args[ac++] = "--no-relative";
 	}
+	if (manifest_name && !am_sender) {
+		args[ac++] = "--manifest";
+		args[ac++] = manifest_name;
+		if (manifest_root) {
+			args[ac++] = "--manifest-root";
+			args[ac++] = manifest_root;
+		}
+		if (manifest_id) {
+			args[ac++] = "--manifest-id";
+			args[ac++] = manifest_id;
+		}
+	}
+
 	/* It's OK that this checks the upper-bound of the protocol_version. */
 	if (relative_paths && !implied_dirs && (!am_sender || protocol_version >= 30))
 		args[ac++] = "--no-implied-dirs";
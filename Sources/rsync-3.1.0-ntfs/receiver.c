@@ -52,6 +52,8 @@ extern int checksum_seed;
 extern int inplace;
 extern int allowed_lull;
 extern int delay_updates;
+extern int whole_file;
+extern int file_writers;
 extern mode_t orig_umask;
 extern struct stats stats;
 extern char *tmpdir;
@@ -67,6 +69,51 @@ static flist_ndx_list batch_redo_list;
 /* We're either updating the basis file or an identical copy: */
 static int updating_basis_or_equiv;
 
+int writer_threads = 0; /* number of running --writers threads */
+
+/* A file whose data is held in memory until a --writers thread puts
+ * it on disk.  Messages from the thread are saved in msgs and output
+ * by the receiver when it reaps the job. */
+struct write_job {
+	struct write_job *next;
+	struct file_struct *file;
+	char *fname;
+	char *data;
+	size_t len, size;
+	char *msgs;
+	size_t msgs_len, msgs_size;
+	int ndx;
+	int result; /* a recv_ok value, or -2 for a fatal write error */
+};
+
+#ifdef SUPPORT_WRITERS
+#include <pthread.h>
+
+/* Only files up to MAX_WRITER_FILE bytes are passed to the writers, and
+ * at most MAX_WRITER_BYTES of their data may be waiting in memory. */
+#define MAX_WRITERS 32
+#define MAX_WRITER_FILE (4*1024*1024)
+#define MAX_WRITER_BYTES (64*1024*1024)
+
+struct writer_msg {
+	enum logcode code;
+	int is_utf8;
+	int len;
+};
+
+static pthread_t *writer_tids;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_todo_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_rwlock_t attr_lists_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct write_job *todo_head, *todo_tail, *done_head, *done_tail;
+static size_t writer_bytes; /* data queued but not yet written */
+static int writer_jobs; /* jobs queued but not yet reaped */
+static int writers_quit;
+static int writer_pipe[2] = { -1, -1 };
+static THREAD_LOCAL struct write_job *writing_job;
+#endif
+
 #define TMPNAME_SUFFIX ".XXXXXX"
 #define TMPNAME_SUFFIX_LEN ((int)sizeof TMPNAME_SUFFIX - 1)
 #define MAX_UNIQUE_NUMBER 999999
@@ -224,8 +271,23 @@ int open_tmpfile(char *fnametmp, const char *fname, struct file_struct *file)
 	return fd;
 }
 
+static void write_job_append(struct write_job *job, const char *data, int32 len)
+{
+	if (job->len + len > job->size) {
+		/* The sender's file grew after it was listed. */
+		job->size = job->len + len + MAX(job->size / 2, CHUNK_SIZE);
+		if (!(job->data = realloc_array(job->data, char, job->size)))
+			out_of_memory("write_job_append");
+	}
+	memcpy(job->data + job->len, data, len);
+	job->len += len;
+}
+
+/* When job is set, the file's data is appended to it instead of being
+ * written to fd.  This only works for a whole-file transfer. */
 static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
-			const char *fname, int fd, OFF_T total_size)
+			const char *fname, int fd, OFF_T total_size,
+			struct write_job *job)
 {
 	static char file_sum1[MAX_DIGEST_LEN];
 	struct map_struct *mapbuf;
@@ -315,10 +377,18 @@ static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
 
 			if (fd != -1 && write_file(fd,data,i) != i)
 				goto report_write_error;
+			if (job)
+				write_job_append(job, data, i);
 			offset += i;
 			continue;
 		}
 
+		if (job) {
+			rprintf(FERROR, "unexpected block match for %s [%s]\n",
+				fname, who_am_i());
+			exit_cleanup(RERR_PROTOCOL);
+		}
+
 		i = -(i+1);
 		offset2 = i * (OFF_T)sum.blength;
 		len = sum.blength;
@@ -398,7 +468,7 @@ static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
 	read_buf(f_in, sender_file_sum, checksum_len);
 	if (DEBUG_GTE(DELTASUM, 2))
 		rprintf(FINFO,"got file_sum\n");
-	if (fd != -1 && memcmp(file_sum1, sender_file_sum, checksum_len) != 0)
+	if ((fd != -1 || job) && memcmp(file_sum1, sender_file_sum, checksum_len) != 0)
 		return 0;
 	return 1;
 }
@@ -406,9 +476,341 @@ static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
 
 static void discard_receive_data(int f_in, OFF_T length)
 {
-	receive_data(f_in, NULL, -1, 0, NULL, -1, length);
+	receive_data(f_in, NULL, -1, 0, NULL, -1, length, NULL);
+}
+
+#ifdef SUPPORT_WRITERS
+/* The xattr and ACL lists grow while the file-list is received, and the
+ * ACL code keeps scratch state in statics, so while --writers threads
+ * are running these are guarded by a read/write lock. */
+void lock_attr_lists(int exclusive)
+{
+	if (!writer_threads)
+		return;
+	if (exclusive)
+		pthread_rwlock_wrlock(&attr_lists_lock);
+	else
+		pthread_rwlock_rdlock(&attr_lists_lock);
+}
+
+void unlock_attr_lists(void)
+{
+	if (writer_threads)
+		pthread_rwlock_unlock(&attr_lists_lock);
+}
+
+/* Called by rwrite(): save a message from a writer thread in its job. */
+int defer_writer_msg(enum logcode code, const char *buf, int len, int is_utf8)
+{
+	struct write_job *job = writing_job;
+	struct writer_msg hdr;
+	size_t need;
+
+	if (!job)
+		return 0;
+
+	need = job->msgs_len + sizeof hdr + len;
+	if (need > job->msgs_size) {
+		job->msgs_size = need + 1024;
+		if (!(job->msgs = realloc_array(job->msgs, char, job->msgs_size))) {
+			writing_job = NULL;
+			out_of_memory("defer_writer_msg");
+		}
+	}
+
+	hdr.code = code;
+	hdr.is_utf8 = is_utf8;
+	hdr.len = len;
+	memcpy(job->msgs + job->msgs_len, &hdr, sizeof hdr);
+	memcpy(job->msgs + job->msgs_len + sizeof hdr, buf, len);
+	job->msgs_len = need;
+
+	return 1;
+}
+
+/* Runs in a writer thread: create the file, write its data, and then
+ * set its attributes and rename it into place. */
+static int write_job_file(struct write_job *job)
+{
+	char fnametmp[MAXPATHLEN];
+	const char *fname = job->fname;
+	int fd;
+
+	if (inplace) {
+		if ((fd = do_open(fname, O_WRONLY|O_CREAT, 0600)) < 0) {
+			rsyserr(FERROR_XFER, errno, "open %s failed",
+				full_fname(fname));
+			return -1;
+		}
+	} else if ((fd = open_tmpfile(fnametmp, fname, job->file)) < 0)
+		return -1;
+
+#ifdef SUPPORT_PREALLOCATION
+	if (preallocate_files && job->len > 0
+	 && do_fallocate(fd, 0, job->len) != 0)
+		rsyserr(FWARNING, errno, "do_fallocate %s", full_fname(fname));
+#endif
+
+	if (full_write(fd, job->data, job->len) != (int)job->len) {
+		rsyserr(FERROR_XFER, errno, "write failed on %s",
+			full_fname(fname));
+		goto fatal;
+	}
+
+#ifdef HAVE_FTRUNCATE
+	if (inplace && do_ftruncate(fd, job->len) < 0) {
+		rsyserr(FERROR_XFER, errno, "ftruncate failed on %s",
+			full_fname(fname));
+	}
+#endif
+
+	if (close(fd) < 0) {
+		fd = -1;
+		rsyserr(FERROR, errno, "close failed on %s",
+			full_fname(inplace ? fname : fnametmp));
+		goto fatal;
+	}
+
+	if (!finish_transfer(fname, fnametmp, fname, NULL, job->file, 1, 1))
+		return -1;
+	return 1;
+
+  fatal:
+	if (fd != -1)
+		close(fd);
+	if (!inplace)
+		do_unlink(fnametmp);
+	return -2;
+}
+
+static void *file_writer(UNUSED(void *arg))
+{
+	struct write_job *job;
+
+	while (1) {
+		pthread_mutex_lock(&writer_mutex);
+		while (!todo_head && !writers_quit)
+			pthread_cond_wait(&writer_todo_cond, &writer_mutex);
+		if (!(job = todo_head)) {
+			pthread_mutex_unlock(&writer_mutex);
+			return NULL;
+		}
+		if (!(todo_head = job->next))
+			todo_tail = NULL;
+		pthread_mutex_unlock(&writer_mutex);
+
+		writing_job = job;
+		job->result = write_job_file(job);
+		writing_job = NULL;
+
+		free(job->data);
+		job->data = NULL;
+
+		pthread_mutex_lock(&writer_mutex);
+		writer_bytes -= job->size;
+		job->next = NULL;
+		if (done_tail)
+			done_tail->next = job;
+		else
+			done_head = job;
+		done_tail = job;
+		pthread_cond_signal(&writer_done_cond);
+		pthread_mutex_unlock(&writer_mutex);
+
+		/* Wake the receiver if it is waiting for input.  If the pipe
+		 * is full, a wakeup is already pending. */
+		if (write(writer_pipe[1], "", 1) < 0) {
+		}
+	}
 }
 
+/* Output a finished job's messages and tell the generator how it went,
+ * just as recv_files() does for the files it writes itself. */
+static void finish_write_job(struct write_job *job)
+{
+	struct writer_msg hdr;
+	char *bp = job->msgs, *end = bp + job->msgs_len;
+
+	while (bp < end) {
+		memcpy(&hdr, bp, sizeof hdr);
+		bp += sizeof hdr;
+		rwrite(hdr.code, bp, hdr.len, hdr.is_utf8);
+		bp += hdr.len;
+	}
+
+	if (job->result == -2)
+		exit_cleanup(RERR_FILEIO);
+
+	if (job->result == 1) {
+		if (remove_source_files || inc_recurse
+		 || (preserve_hard_links && F_IS_HLINKED(job->file)))
+			send_msg_int(MSG_SUCCESS, job->ndx);
+	} else if (inc_recurse)
+		send_msg_int(MSG_NO_SEND, job->ndx);
+
+	free(job->msgs);
+	free(job->fname);
+	free(job);
+	writer_jobs--;
+}
+
+/* Finish off any jobs that the writers are done with.  This is also
+ * called from perform_io() when the wakeup pipe becomes readable. */
+void reap_file_writers(void)
+{
+	struct write_job *job, *next;
+	char buf[256];
+
+	while (read(writer_pipe[0], buf, sizeof buf) > 0) {}
+
+	pthread_mutex_lock(&writer_mutex);
+	job = done_head;
+	done_head = done_tail = NULL;
+	pthread_mutex_unlock(&writer_mutex);
+
+	for ( ; job; job = next) {
+		next = job->next;
+		finish_write_job(job);
+	}
+}
+
+/* Wait until "need" more bytes of data fit in the memory budget, or
+ * (when need is -1) until every queued job has been reaped. */
+static void wait_for_writers(OFF_T need)
+{
+	while (writer_jobs) {
+		pthread_mutex_lock(&writer_mutex);
+		if (need >= 0 && writer_bytes + need <= MAX_WRITER_BYTES) {
+			pthread_mutex_unlock(&writer_mutex);
+			break;
+		}
+		while (!done_head)
+			pthread_cond_wait(&writer_done_cond, &writer_mutex);
+		pthread_mutex_unlock(&writer_mutex);
+		reap_file_writers();
+	}
+}
+
+static struct write_job *new_write_job(struct file_struct *file, int ndx,
+				       const char *fname)
+{
+	struct write_job *job;
+
+	wait_for_writers(F_LENGTH(file));
+
+	if (!(job = new0(struct write_job))
+	 || !(job->fname = strdup(fname)))
+		out_of_memory("new_write_job");
+	job->file = file;
+	job->ndx = ndx;
+	job->size = F_LENGTH(file) ? F_LENGTH(file) : 1;
+	if (!(job->data = new_array(char, job->size)))
+		out_of_memory("new_write_job");
+
+	return job;
+}
+
+static void free_write_job(struct write_job *job)
+{
+	free(job->data);
+	free(job->fname);
+	free(job);
+}
+
+static void queue_write_job(struct write_job *job)
+{
+	writer_jobs++;
+
+	pthread_mutex_lock(&writer_mutex);
+	writer_bytes += job->size;
+	if (todo_tail)
+		todo_tail->next = job;
+	else
+		todo_head = job;
+	todo_tail = job;
+	pthread_cond_signal(&writer_todo_cond);
+	pthread_mutex_unlock(&writer_mutex);
+}
+
+/* The writers handle plain whole-file updates of the destination file;
+ * anything that stages the data elsewhere stays in recv_files(). */
+static int want_file_writers(void)
+{
+	return file_writers > 1 && do_xfers && whole_file > 0 && preserve_perms
+	    && !read_batch && !write_batch && !sparse_files && !make_backups
+	    && !keep_partial && !partial_dir && !delay_updates;
+}
+
+static void start_file_writers(void)
+{
+	sigset_t all_sigs, old_sigs;
+	int cnt = MIN(file_writers, MAX_WRITERS);
+	int i;
+
+	if (pipe(writer_pipe) < 0) {
+		rsyserr(FWARNING, errno, "unable to start --writers threads");
+		return;
+	}
+	set_nonblocking(writer_pipe[0]);
+	set_nonblocking(writer_pipe[1]);
+
+	if (!(writer_tids = new_array(pthread_t, cnt)))
+		out_of_memory("start_file_writers");
+	writers_quit = 0;
+
+	/* Leave all signal handling to the main thread. */
+	sigfillset(&all_sigs);
+	pthread_sigmask(SIG_BLOCK, &all_sigs, &old_sigs);
+	for (i = 0; i < cnt; i++) {
+		if ((errno = pthread_create(&writer_tids[i], NULL, file_writer, NULL)) != 0) {
+			rsyserr(FWARNING, errno, "unable to start --writers thread");
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+
+	if (!(writer_threads = i)) {
+		free(writer_tids);
+		close(writer_pipe[0]);
+		close(writer_pipe[1]);
+		return;
+	}
+	io_set_writer_wakeup_fd(writer_pipe[0]);
+
+	if (DEBUG_GTE(RECV, 1))
+		rprintf(FINFO, "recv_files: %d writer threads\n", writer_threads);
+}
+
+static void stop_file_writers(void)
+{
+	int i;
+
+	wait_for_writers(-1);
+
+	pthread_mutex_lock(&writer_mutex);
+	writers_quit = 1;
+	pthread_cond_broadcast(&writer_todo_cond);
+	pthread_mutex_unlock(&writer_mutex);
+
+	for (i = 0; i < writer_threads; i++)
+		pthread_join(writer_tids[i], NULL);
+	writer_threads = 0;
+
+	io_set_writer_wakeup_fd(-1);
+	close(writer_pipe[0]);
+	close(writer_pipe[1]);
+	free(writer_tids);
+}
+#else
+void lock_attr_lists(UNUSED(int exclusive))
+{
+}
+
+void unlock_attr_lists(void)
+{
+}
+#endif
+
 static void handle_delayed_updates(char *local_name)
 {
 	char *fname, *partialptr;
@@ -537,13 +939,29 @@ int recv_files(int f_in, int f_out, char *local_name)
 	if (delay_updates)
 		delayed_bits = bitbag_create(cur_flist->used + 1);
 
+#ifdef SUPPORT_WRITERS
+	if (want_file_writers())
+		start_file_writers();
+#endif
+
 	while (1) {
 		cleanup_disable();
 
+#ifdef SUPPORT_WRITERS
+		if (writer_threads)
+			reap_file_writers();
+#endif
+
 		/* This call also sets cur_flist. */
 		ndx = read_ndx_and_attrs(f_in, f_out, &iflags, &fnamecmp_type,
 					 xname, &xlen);
 		if (ndx == NDX_DONE) {
+#ifdef SUPPORT_WRITERS
+			/* All the files of this phase (and of any flist that
+			 * is about to be freed) must be on disk first. */
+			if (writer_threads)
+				wait_for_writers(-1);
+#endif
 			if (!am_server && INFO_GTE(PROGRESS, 2) && cur_flist) {
 				set_current_file_index(NULL, 0);
 				end_progress(0);
@@ -743,6 +1161,32 @@ int recv_files(int f_in, int f_out, char *local_name)
 				fnamecmp = fname;
 		}
 
+#ifdef SUPPORT_WRITERS
+		if (writer_threads && fnamecmp == fname && !redoing
+		 && F_LENGTH(file) <= MAX_WRITER_FILE) {
+			struct write_job *job = new_write_job(file, ndx, fname);
+
+			if (log_before_transfer)
+				log_item(FCLIENT, file, iflags, NULL);
+			else if (!am_server && INFO_GTE(NAME, 1) && INFO_EQ(PROGRESS, 1))
+				rprintf(FINFO, "%s\n", fname);
+
+			recv_ok = receive_data(f_in, NULL, -1, 0, fname, -1,
+					       F_LENGTH(file), job);
+
+			log_item(log_code, file, iflags, NULL);
+
+			if (recv_ok) {
+				queue_write_job(job);
+				continue;
+			}
+			/* Nothing was written, so just report the failed
+			 * verification and ask for a redo. */
+			free_write_job(job);
+			goto report_recv;
+		}
+#endif
+
 		/* open the file */
 		fd1 = do_open(fnamecmp, O_RDONLY, 0);
 
@@ -844,7 +1288,7 @@ int recv_files(int f_in, int f_out, char *local_name)
 
 		/* recv file data */
 		recv_ok = receive_data(f_in, fnamecmp, fd1, st.st_size,
-				       fname, fd2, F_LENGTH(file));
+				       fname, fd2, F_LENGTH(file), NULL);
 
 		log_item(log_code, file, iflags, NULL);
 
@@ -885,6 +1329,9 @@ int recv_files(int f_in, int f_out, char *local_name)
 		} else
 			do_unlink(fnametmp);
 
+#ifdef SUPPORT_WRITERS
+	  report_recv:
+#endif
 		cleanup_disable();
 
 		if (read_batch)
@@ -936,6 +1383,11 @@ int recv_files(int f_in, int f_out, char *local_name)
 			break;
 		}
 	}
+#ifdef SUPPORT_WRITERS
+	if (writer_threads)
+		stop_file_writers();
+#endif
+
 	if (make_backups < 0)
 		make_backups = -make_backups;
 
@@ -485,8 +485,11 @@ int set_file_attrs(const char *fname, struct file_struct *file, stat_x *sxp,
 		new_mode = tweak_mode(new_mode, daemon_chmod_modes);
 
 #ifdef SUPPORT_ACLS
-	if (preserve_acls && !S_ISLNK(file->mode) && !ACL_READY(*sxp))
+	if (preserve_acls && !S_ISLNK(file->mode) && !ACL_READY(*sxp)) {
+		lock_attr_lists(1);
 		get_acl(fname, sxp);
+		unlock_attr_lists();
+	}
 #endif
 
 #ifdef SUPPORT_XATTRS
@@ -569,7 +572,13 @@ int set_file_attrs(const char *fname, struct file_struct *file, stat_x *sxp,
 	 * an access ACL, it changes sxp->st.st_mode so we know whether we
 	 * need to chmod(). */
 	if (preserve_acls && !S_ISLNK(new_mode)) {
-		if (set_acl(fname, file, sxp, new_mode) > 0)
+		int ret;
+		/* The ACL code caches state in statics and in the shared
+		 * lists, so a --writers thread must hold the lock alone. */
+		lock_attr_lists(1);
+		ret = set_acl(fname, file, sxp, new_mode);
+		unlock_attr_lists();
+		if (ret > 0)
 			updated = 1;
 	}
 #endif
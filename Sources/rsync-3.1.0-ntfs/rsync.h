@@ -41,6 +41,9 @@
    incompatible with older versions :-( */
 #define CHAR_OFFSET 0
 
+/* How many offsets hash_search() rolls the checksum forward at once. */
+#define ROLL_BATCH 16
+
 /* These flags are only used during the flist transfer. */
 
 #define XMIT_TOP_DIR (1<<0)
@@ -141,6 +144,13 @@
 /* For compatibility with older rsyncs */
 #define OLD_MAX_BLOCK_SIZE ((int32)1 << 29)
 
+/* --delta-threads: files of at least DELTA_THREADS_MIN_LEN bytes have
+ * their block sums and matches computed by up to MAX_DELTA_THREADS threads,
+ * working on pieces of about DELTA_PIECE_SIZE bytes. */
+#define MAX_DELTA_THREADS 8
+#define DELTA_THREADS_MIN_LEN ((OFF_T)64 * 1024 * 1024)
+#define DELTA_PIECE_SIZE (8*1024*1024)
+
 #define ROUND_UP_1024(siz) ((siz) & (1024-1) ? ((siz) | (1024-1)) + 1 : (siz))
 
 #define IOERR_GENERAL	(1<<0) /* For backward compatibility, this must == 1 */
@@ -625,6 +635,26 @@ struct ht_int64_node {
 	int64 key;
 };
 
+/* Longer xattr values are sent as a digest first, see xattrs.c. */
+#define MAX_FULL_DATUM 32
+
+/* An xattr in a manifest, see manifest.c.  A value longer than
+ * MAX_FULL_DATUM is stored as its digest, of stored_len bytes. */
+struct manifest_xattr {
+	const char *name, *datum;
+	size_t name_len, datum_len, stored_len;
+};
+
+/* Chains of item_list indices by a 32-bit key, see hashtable.c. */
+struct hashchains {
+	struct hashtable *tbl;
+	int32 *next;
+	uint32 *keys;
+	int32 count, size;
+};
+
+#define HASH_BYTES_INIT 2166136261U
+
 #define HT_NODE(tbl, bkts, i) ((void*)((char*)(bkts) + (i)*(tbl)->node_size))
 #define HT_KEY(node, k64) ((k64)? ((struct ht_int64_node*)(node))->key \
 			 : (int64)((struct ht_int32_node*)(node))->key)
@@ -851,6 +881,7 @@ struct map_struct {
 	int32 def_window_size;	/* Default window size			*/
 	int fd;			/* File Descriptor			*/
 	int status;		/* first errno from read errors		*/
+	int shared;		/* fd is used by threads, so use pread() */
 };
 
 #define FILTRULE_WILD		(1<<0) /* pattern has '*', '[', and/or '?' */
@@ -986,6 +1017,13 @@ typedef struct {
 #define NORETURN __attribute__((__noreturn__))
 #endif
 
+/* Scratch state that the --writers threads must not share. */
+#ifdef SUPPORT_WRITERS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
 typedef struct {
     STRUCT_STAT st;
 #ifdef SUPPORT_ACLS
@@ -44,6 +44,7 @@ extern int batch_fd;
 extern int write_batch;
 extern int file_old_total;
 extern struct stats stats;
+extern char *manifest_name;
 extern struct file_list *cur_flist, *first_flist, *dir_flist;
 
 BOOL extra_flist_sending_enabled;
@@ -364,6 +365,20 @@ void send_files(int f_in, int f_out)
 			exit_cleanup(RERR_FILEIO);
 		}
 
+		/* The file list came from the manifest, which must be the
+		 * one of these files. */
+		if (manifest_name && (st.st_size != F_LENGTH(file)
+		 || st.st_mtime != file->modtime)) {
+			io_error |= IOERR_GENERAL;
+			rprintf(FERROR_XFER, "%s does not match the manifest\n",
+				full_fname(fname));
+			free_sums(s);
+			close(fd);
+			if (protocol_version >= 30)
+				send_msg_int(MSG_NO_SEND, ndx);
+			continue;
+		}
+
 		if (st.st_size) {
 			int32 read_size = MAX(s->blength * 3, MAX_MAP_SIZE);
 			mbuf = map_file(fd, st.st_size, read_size, s->blength);
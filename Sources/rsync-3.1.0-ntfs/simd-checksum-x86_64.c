@@ -0,0 +1,235 @@
+/*
+ * SSE2 and AVX2 versions of the rolling checksum (get_checksum1) and of
+ * its one-byte-at-a-time update in hash_search().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, visit the http://fsf.org website.
+ */
+
+/*
+ * For a block x[0..n-1] get_checksum1() computes
+ *
+ *	s1 = sum(x[i]),  s2 = sum((n-i) * x[i])
+ *
+ * and only the low 16 bits of each end up in the result.  The block sums
+ * are done N bytes at a time (N = 16 or 32): per chunk s1 grows by the
+ * sum of its bytes and s2 by N times the old s1 plus the chunk's bytes
+ * weighted N..1.  The lanes are summed up once at the end, and the
+ * 32-bit lanes may wrap since only 16 bits are used.
+ *
+ * The rolling update for offsets o+1..o+N is a prefix sum:
+ *
+ *	s1[j+1] = s1[j] + x[o+k+j] - x[o+j]
+ *	s2[j+1] = s2[j] + s1[j+1] - k * x[o+j]
+ *
+ * which is computed in 16-bit lanes, so the sums come out already reduced.
+ */
+
+#include "rsync.h"
+
+#ifdef USE_SIMD_CHECKSUM
+
+#include <immintrin.h>
+
+/* Horizontal sum of four 32-bit lanes. */
+static inline uint32 hsum_epi32(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32)_mm_cvtsi128_si32(v);
+}
+
+/* Sign-extend the low 8 bytes of v to 16-bit lanes. */
+static inline __m128i sext_lo_epi8(__m128i v)
+{
+	return _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+}
+
+/* Sign-extend the high 8 bytes of v to 16-bit lanes. */
+static inline __m128i sext_hi_epi8(__m128i v)
+{
+	return _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+}
+
+/* Inclusive prefix sum of eight 16-bit lanes. */
+static inline __m128i prefix_epi16(__m128i v)
+{
+	v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+	v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+	v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+	return v;
+}
+
+/* Copy 16-bit lane 7 of v to all lanes. */
+static inline __m128i bcast7_epi16(__m128i v)
+{
+	return _mm_shuffle_epi32(_mm_shufflehi_epi16(v, 0xFF), 0xFF);
+}
+
+/* Returns 2 if the CPU can run the AVX2 code, otherwise 1 (SSE2 is part of
+ * x86_64). */
+int simd_checksum_level(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? 2 : 1;
+}
+
+uint32 get_checksum1_sse2(schar *buf, int32 len)
+{
+	const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+	const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i vs1 = _mm_setzero_si128();
+	__m128i vs2 = _mm_setzero_si128();
+	__m128i vps = _mm_setzero_si128();
+	uint32 s1, s2;
+	int32 i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i lo = sext_lo_epi8(in), hi = sext_hi_epi8(in);
+
+		vps = _mm_add_epi32(vps, vs1);
+		vs1 = _mm_add_epi32(vs1, _mm_madd_epi16(_mm_add_epi16(lo, hi), one));
+		vs2 = _mm_add_epi32(vs2, _mm_add_epi32(_mm_madd_epi16(lo, w_lo),
+						       _mm_madd_epi16(hi, w_hi)));
+	}
+
+	s1 = hsum_epi32(vs1);
+	s2 = hsum_epi32(vs2) + 16 * hsum_epi32(vps);
+#if CHAR_OFFSET != 0
+	s1 += i * CHAR_OFFSET;
+	s2 += (uint32)((int64)i * (i + 1) / 2) * CHAR_OFFSET;
+#endif
+
+	for (; i < len; i++) {
+		s1 += (buf[i]+CHAR_OFFSET); s2 += s1;
+	}
+	return (s1 & 0xffff) + (s2 << 16);
+}
+
+/* Fills sums[0..ROLL_BATCH-1] with the checksums of the k-byte blocks that
+ * start at map+1 .. map+ROLL_BATCH, given the checksum sum of the block at
+ * map.  map[0 .. k+ROLL_BATCH-1] must be readable. */
+void roll_checksum1_sse2(schar *map, int32 k, uint32 sum, uint32 *sums)
+{
+	const __m128i vk = _mm_set1_epi16((short)k);
+	__m128i s1 = _mm_set1_epi16((short)(sum & 0xFFFF));
+	__m128i s2 = _mm_set1_epi16((short)(sum >> 16));
+	int32 j;
+
+	for (j = 0; j < ROLL_BATCH; j += 8) {
+		__m128i out = sext_lo_epi8(_mm_loadl_epi64((const __m128i *)(map + j)));
+		__m128i in = sext_lo_epi8(_mm_loadl_epi64((const __m128i *)(map + j + k)));
+		__m128i v1, v2;
+
+#if CHAR_OFFSET != 0
+		out = _mm_add_epi16(out, _mm_set1_epi16(CHAR_OFFSET));
+#endif
+		v1 = _mm_add_epi16(prefix_epi16(_mm_sub_epi16(in, out)), s1);
+		v2 = _mm_sub_epi16(v1, _mm_mullo_epi16(out, vk));
+		v2 = _mm_add_epi16(prefix_epi16(v2), s2);
+
+		_mm_storeu_si128((__m128i *)(sums + j), _mm_unpacklo_epi16(v1, v2));
+		_mm_storeu_si128((__m128i *)(sums + j + 4), _mm_unpackhi_epi16(v1, v2));
+
+		s1 = bcast7_epi16(v1);
+		s2 = bcast7_epi16(v2);
+	}
+}
+
+__attribute__((target("avx2")))
+uint32 get_checksum1_avx2(schar *buf, int32 len)
+{
+	const __m256i w = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+					   24, 23, 22, 21, 20, 19, 18, 17,
+					   16, 15, 14, 13, 12, 11, 10, 9,
+					   8, 7, 6, 5, 4, 3, 2, 1);
+	const __m256i one8 = _mm256_set1_epi8(1);
+	const __m256i one16 = _mm256_set1_epi16(1);
+	__m256i vs1 = _mm256_setzero_si256();
+	__m256i vs2 = _mm256_setzero_si256();
+	__m256i vps = _mm256_setzero_si256();
+	uint32 s1, s2;
+	int32 i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)(buf + i));
+
+		/* maddubs multiplies unsigned (first) by signed (second) bytes. */
+		vps = _mm256_add_epi32(vps, vs1);
+		vs1 = _mm256_add_epi32(vs1, _mm256_madd_epi16(_mm256_maddubs_epi16(one8, in), one16));
+		vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(w, in), one16));
+	}
+
+	s1 = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(vs1),
+				      _mm256_extracti128_si256(vs1, 1)));
+	s2 = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(vs2),
+				      _mm256_extracti128_si256(vs2, 1)))
+	   + 32 * hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(vps),
+					   _mm256_extracti128_si256(vps, 1)));
+#if CHAR_OFFSET != 0
+	s1 += i * CHAR_OFFSET;
+	s2 += (uint32)((int64)i * (i + 1) / 2) * CHAR_OFFSET;
+#endif
+
+	for (; i < len; i++) {
+		s1 += (buf[i]+CHAR_OFFSET); s2 += s1;
+	}
+	return (s1 & 0xffff) + (s2 << 16);
+}
+
+/* Inclusive prefix sum of sixteen 16-bit lanes. */
+__attribute__((target("avx2")))
+static inline __m256i prefix256_epi16(__m256i v)
+{
+	__m256i carry;
+
+	v = _mm256_add_epi16(v, _mm256_slli_si256(v, 2));
+	v = _mm256_add_epi16(v, _mm256_slli_si256(v, 4));
+	v = _mm256_add_epi16(v, _mm256_slli_si256(v, 8));
+	/* The shifts stay within each 128-bit lane, so add the low lane's
+	 * total (its lane 7) to the high lane. */
+	carry = _mm256_shuffle_epi32(_mm256_shufflehi_epi16(v, 0xFF), 0xFF);
+	return _mm256_add_epi16(v, _mm256_permute2x128_si256(carry, carry, 0x08));
+}
+
+__attribute__((target("avx2")))
+void roll_checksum1_avx2(schar *map, int32 k, uint32 sum, uint32 *sums)
+{
+	const __m256i vk = _mm256_set1_epi16((short)k);
+	__m256i out, in, v1, v2, lo, hi;
+
+#if ROLL_BATCH != 16
+#error roll_checksum1_avx2() assumes ROLL_BATCH == 16
+#endif
+	out = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)map));
+	in = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(map + k)));
+#if CHAR_OFFSET != 0
+	out = _mm256_add_epi16(out, _mm256_set1_epi16(CHAR_OFFSET));
+#endif
+
+	v1 = _mm256_add_epi16(prefix256_epi16(_mm256_sub_epi16(in, out)),
+			      _mm256_set1_epi16((short)(sum & 0xFFFF)));
+	v2 = _mm256_sub_epi16(v1, _mm256_mullo_epi16(out, vk));
+	v2 = _mm256_add_epi16(prefix256_epi16(v2), _mm256_set1_epi16((short)(sum >> 16)));
+
+	/* The unpacks also work per 128-bit lane: lo holds offsets 0-3 and
+	 * 8-11, hi holds 4-7 and 12-15. */
+	lo = _mm256_unpacklo_epi16(v1, v2);
+	hi = _mm256_unpackhi_epi16(v1, v2);
+	_mm256_storeu_si256((__m256i *)sums, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *)(sums + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+#endif /* USE_SIMD_CHECKSUM */
@@ -1114,11 +1114,11 @@ char *normalize_path(char *path, BOOL force_newbuf, unsigned int *len_ptr)
 /**
  * Return a quoted string with the full pathname of the indicated filename.
  * The string " (in MODNAME)" may also be appended.  The returned pointer
- * remains valid until the next time full_fname() is called.
+ * remains valid until the next time this thread calls full_fname().
  **/
 char *full_fname(const char *fn)
 {
-	static char *result = NULL;
+	static THREAD_LOCAL char *result = NULL;
 	char *m1, *m2, *m3;
 	char *p1, *p2;
 
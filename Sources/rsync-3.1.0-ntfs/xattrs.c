@@ -37,12 +37,12 @@ extern int preserve_links;
 extern int preserve_devices;
 extern int preserve_specials;
 extern int checksum_seed;
+extern int protocol_version;
+extern int writer_threads;
 
 #define RSYNC_XAL_INITIAL 5
 #define RSYNC_XAL_LIST_INITIAL 100
 
-#define MAX_FULL_DATUM 32
-
 #define HAS_PREFIX(str, prfx) (*(str) == *(prfx) \
 			    && strncmp(str, prfx, sizeof (prfx) - 1) == 0)
 
@@ -79,11 +79,12 @@ typedef struct {
 	int num;
 } rsync_xa;
 
-static size_t namebuf_len = 0;
-static char *namebuf = NULL;
+static THREAD_LOCAL size_t namebuf_len = 0;
+static THREAD_LOCAL char *namebuf = NULL;
 
 static item_list empty_xattr = EMPTY_ITEM_LIST;
 static item_list rsync_xal_l = EMPTY_ITEM_LIST;
+static struct hashchains rsync_xal_h;
 
 static size_t prior_xattr_count = (size_t)-1;
 
@@ -250,6 +251,67 @@ static char *get_xattr_data(const char *fname, const char *name, size_t *len_ptr
 	return ptr;
 }
 
+/* No rsync.%FOO attributes are copied w/o 2 -X options. */
+static int rsync_xal_skipped(const char *name, size_t name_len)
+{
+	if (name_len > RPRE_LEN && name[RPRE_LEN] == '%'
+	 && HAS_PREFIX(name, RSYNC_PREFIX)) {
+		if ((am_sender && preserve_xattrs < 2)
+		 || (am_root < 0
+		  && (strcmp(name+RPRE_LEN+1, XSTAT_SUFFIX) == 0
+		   || strcmp(name+RPRE_LEN+1, XACC_ACL_SUFFIX) == 0
+		   || strcmp(name+RPRE_LEN+1, XDEF_ACL_SUFFIX) == 0)))
+			return 1;
+	}
+	return 0;
+}
+
+static void rsync_xal_sort(item_list *xalp)
+{
+	int count = xalp->count;
+	rsync_xa *rxa = xalp->items;
+
+	if (count > 1)
+		qsort(rxa, count, sizeof (rsync_xa), rsync_xal_compare_names);
+	for (rxa += count-1; count; count--, rxa--)
+		rxa->num = count;
+}
+
+/* Fills *xalp from the xattrs that a manifest has for a file, which are
+ * already in the form that rsync_xal_get() gives them on the sender. */
+static void rsync_xal_get_manifest(struct manifest_xattr *mx, int count,
+				   item_list *xalp)
+{
+	size_t name_offset;
+	rsync_xa *rxa;
+	char *ptr;
+
+	for ( ; count--; mx++) {
+		if (rsync_xal_skipped(mx->name, mx->name_len))
+			continue;
+
+		if (mx->stored_len < mx->datum_len)
+			name_offset = 1 + MAX_DIGEST_LEN;
+		else
+			name_offset = mx->datum_len;
+		if (!(ptr = new_array(char, name_offset + mx->name_len)))
+			out_of_memory("rsync_xal_get_manifest");
+		if (mx->stored_len < mx->datum_len) {
+			*ptr = XSTATE_ABBREV;
+			memcpy(ptr + 1, mx->datum, MAX_DIGEST_LEN);
+		} else
+			memcpy(ptr, mx->datum, mx->datum_len);
+
+		rxa = EXPAND_ITEM_LIST(xalp, rsync_xa, RSYNC_XAL_INITIAL);
+		rxa->name = ptr + name_offset;
+		memcpy(rxa->name, mx->name, mx->name_len);
+		rxa->datum = ptr;
+		rxa->name_len = mx->name_len;
+		rxa->datum_len = mx->datum_len;
+	}
+	rsync_xal_sort(xalp);
+}
+
 static int rsync_xal_get(const char *fname, item_list *xalp)
 {
 	ssize_t list_len, name_len;
@@ -258,9 +320,17 @@ static int rsync_xal_get(const char *fname, item_list *xalp)
 #ifdef HAVE_LINUX_XATTRS
 	int user_only = am_sender ? 0 : !am_root;
 #endif
+	struct manifest_xattr *mx;
 	rsync_xa *rxa;
 	int count;
 
+	/* The digests in a manifest are MD5 sums, as of protocol 30. */
+	if (am_sender && protocol_version >= 30
+	 && (count = manifest_xattrs(fname, &mx)) >= 0) {
+		rsync_xal_get_manifest(mx, count, xalp);
+		return 0;
+	}
+
 	/* This puts the name list into the "namebuf" buffer. */
 	if ((list_len = get_xattr_names(fname)) < 0)
 		return -1;
@@ -280,16 +350,8 @@ static int rsync_xal_get(const char *fname, item_list *xalp)
 #endif
 #endif
 
-		/* No rsync.%FOO attributes are copied w/o 2 -X options. */
-		if (name_len > RPRE_LEN && name[RPRE_LEN] == '%'
-		 && HAS_PREFIX(name, RSYNC_PREFIX)) {
-			if ((am_sender && preserve_xattrs < 2)
-			 || (am_root < 0
-			  && (strcmp(name+RPRE_LEN+1, XSTAT_SUFFIX) == 0
-			   || strcmp(name+RPRE_LEN+1, XACC_ACL_SUFFIX) == 0
-			   || strcmp(name+RPRE_LEN+1, XDEF_ACL_SUFFIX) == 0)))
-				continue;
-		}
+		if (rsync_xal_skipped(name, name_len))
+			continue;
 
 		datum_len = name_len; /* Pass extra size to get_xattr_data() */
 		if (!(ptr = get_xattr_data(fname, name, &datum_len, 0)))
@@ -316,12 +378,7 @@ static int rsync_xal_get(const char *fname, item_list *xalp)
 		rxa->name_len = name_len;
 		rxa->datum_len = datum_len;
 	}
-	count = xalp->count;
-	rxa = xalp->items;
-	if (count > 1)
-		qsort(rxa, count, sizeof (rsync_xa), rsync_xal_compare_names);
-	for (rxa += count-1; count; count--, rxa--)
-		rxa->num = count;
+	rsync_xal_sort(xalp);
 	return 0;
 }
 
@@ -357,6 +414,29 @@ int get_xattr(const char *fname, stat_x *sxp)
 	return 0;
 }
 
+/* Lists the xattrs that get_xattr() read for a manifest.  The entries
+ * point into sxp's data. */
+void get_manifest_xattrs(stat_x *sxp, item_list *mxl)
+{
+	rsync_xa *rxa = sxp->xattr->items;
+	size_t j;
+
+	for (j = 0; j < sxp->xattr->count; j++, rxa++) {
+		struct manifest_xattr *mx;
+		mx = EXPAND_ITEM_LIST(mxl, struct manifest_xattr, RSYNC_XAL_INITIAL);
+		mx->name = rxa->name;
+		mx->name_len = rxa->name_len;
+		mx->datum_len = rxa->datum_len;
+		if (XATTR_ABBREV(*rxa)) {
+			mx->datum = rxa->datum + 1;
+			mx->stored_len = MAX_DIGEST_LEN;
+		} else {
+			mx->datum = rxa->datum;
+			mx->stored_len = rxa->datum_len;
+		}
+	}
+}
+
 int copy_xattrs(const char *source, const char *dest)
 {
 	ssize_t list_len, name_len;
@@ -398,53 +478,91 @@ int copy_xattrs(const char *source, const char *dest)
 	return 0;
 }
 
+static int rsync_xal_equal(item_list *xal1, item_list *xal2)
+{
+	rsync_xa *rxas1 = xal1->items;
+	rsync_xa *rxas2 = xal2->items;
+	size_t j;
+
+	/* Wrong number of elements? */
+	if (xal1->count != xal2->count)
+		return 0;
+	/* any elements different? */
+	for (j = 0; j < xal2->count; j++) {
+		if (rxas1[j].name_len != rxas2[j].name_len
+		 || rxas1[j].datum_len != rxas2[j].datum_len
+		 || strcmp(rxas1[j].name, rxas2[j].name))
+			return 0;
+		if (rxas1[j].datum_len > MAX_FULL_DATUM) {
+			if (memcmp(rxas1[j].datum + 1,
+				   rxas2[j].datum + 1,
+				   MAX_DIGEST_LEN) != 0)
+				return 0;
+		} else {
+			if (memcmp(rxas1[j].datum, rxas2[j].datum,
+				   rxas2[j].datum_len))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Hashes what rsync_xal_equal() compares. */
+static uint32 rsync_xal_key(item_list *xalp)
+{
+	rsync_xa *rxa = xalp->items;
+	uint32 h = hash_bytes(HASH_BYTES_INIT, &xalp->count, sizeof xalp->count);
+	size_t j;
+
+	for (j = 0; j < xalp->count; j++, rxa++) {
+		h = hash_bytes(h, rxa->name, strlen(rxa->name));
+		h = hash_bytes(h, &rxa->name_len, sizeof rxa->name_len);
+		h = hash_bytes(h, &rxa->datum_len, sizeof rxa->datum_len);
+		if (rxa->datum_len > MAX_FULL_DATUM)
+			h = hash_bytes(h, rxa->datum + 1, MAX_DIGEST_LEN);
+		else
+			h = hash_bytes(h, rxa->datum, rxa->datum_len);
+	}
+
+	return h;
+}
+
+/* Returns the first set in rsync_xal_l equal to *xalp, or -1.  The sets
+ * stored since the last call are added to rsync_xal_h first, so that a
+ * big transfer does not compare each new set with all the previous ones. */
 static int find_matching_xattr(item_list *xalp)
 {
-	size_t i, j;
 	item_list *lst = rsync_xal_l.items;
+	int32 i, ndx = -1;
 
-	for (i = 0; i < rsync_xal_l.count; i++) {
-		rsync_xa *rxas1 = lst[i].items;
-		rsync_xa *rxas2 = xalp->items;
+	while ((size_t)rsync_xal_h.count < rsync_xal_l.count)
+		hashchains_add(&rsync_xal_h, rsync_xal_key(&lst[rsync_xal_h.count]));
 
-		/* Wrong number of elements? */
-		if (lst[i].count != xalp->count)
-			continue;
-		/* any elements different? */
-		for (j = 0; j < xalp->count; j++) {
-			if (rxas1[j].name_len != rxas2[j].name_len
-			 || rxas1[j].datum_len != rxas2[j].datum_len
-			 || strcmp(rxas1[j].name, rxas2[j].name))
-				break;
-			if (rxas1[j].datum_len > MAX_FULL_DATUM) {
-				if (memcmp(rxas1[j].datum + 1,
-					   rxas2[j].datum + 1,
-					   MAX_DIGEST_LEN) != 0)
-					break;
-			} else {
-				if (memcmp(rxas1[j].datum, rxas2[j].datum,
-					   rxas2[j].datum_len))
-					break;
-			}
-		}
-		/* no differences found.  This is The One! */
-		if (j == xalp->count)
-			return i;
+	for (i = hashchains_first(&rsync_xal_h, rsync_xal_key(xalp));
+	     i >= 0; i = rsync_xal_h.next[i]) {
+		if (rsync_xal_equal(&lst[i], xalp))
+			ndx = i;
 	}
 
-	return -1;
+	return ndx;
 }
 
 /* Store *xalp on the end of rsync_xal_l */
 static void rsync_xal_store(item_list *xalp)
 {
-	item_list *new_lst = EXPAND_ITEM_LIST(&rsync_xal_l, item_list, RSYNC_XAL_LIST_INITIAL);
+	item_list *new_lst;
+
+	/* The expand can move rsync_xal_l while a writer is reading it. */
+	lock_attr_lists(1);
+	new_lst = EXPAND_ITEM_LIST(&rsync_xal_l, item_list, RSYNC_XAL_LIST_INITIAL);
 	/* Since the following call starts a new list, we know it will hold the
 	 * entire initial-count, not just enough space for one new item. */
 	*new_lst = empty_xattr;
 	(void)EXPAND_ITEM_LIST(new_lst, rsync_xa, xalp->count);
 	memcpy(new_lst->items, xalp->items, xalp->count * sizeof (rsync_xa));
 	new_lst->count = xalp->count;
+	unlock_attr_lists();
 	xalp->count = 0;
 }
 
@@ -638,7 +756,8 @@ void send_xattr_request(const char *fname, struct file_struct *file, int f_out)
 int recv_xattr_request(struct file_struct *file, int f_in)
 {
 	item_list *lst = rsync_xal_l.items;
-	char *old_datum, *name;
+	char *old_datum, *datum, *name;
+	size_t datum_len;
 	rsync_xa *rxa;
 	int rel_pos, cnt, num, got_xattr_data = 0;
 
@@ -673,19 +792,25 @@ int recv_xattr_request(struct file_struct *file, int f_in)
 			continue;
 		}
 
-		old_datum = rxa->datum;
-		rxa->datum_len = read_varint(f_in);
+		datum_len = read_varint(f_in);
 
-		if (rxa->name_len + rxa->datum_len < rxa->name_len)
+		if (rxa->name_len + datum_len < rxa->name_len)
 			overflow_exit("recv_xattr_request");
-		rxa->datum = new_array(char, rxa->datum_len + rxa->name_len);
-		if (!rxa->datum)
+		datum = new_array(char, datum_len + rxa->name_len);
+		if (!datum)
 			out_of_memory("recv_xattr_request");
-		name = rxa->datum + rxa->datum_len;
+		name = datum + datum_len;
 		memcpy(name, rxa->name, rxa->name_len);
+		read_buf(f_in, datum, datum_len);
+
+		/* A writer thread may be using this shared list. */
+		lock_attr_lists(1);
+		old_datum = rxa->datum;
+		rxa->datum = datum;
+		rxa->datum_len = datum_len;
 		rxa->name = name;
+		unlock_attr_lists();
 		free(old_datum);
-		read_buf(f_in, rxa->datum, rxa->datum_len);
 		got_xattr_data = 1;
 	}
 
@@ -820,6 +945,8 @@ void uncache_tmp_xattrs(void)
 		item_list *xattr_item = rsync_xal_l.items;
 		item_list *xattr_start = xattr_item + prior_xattr_count;
 		xattr_item += rsync_xal_l.count;
+		while ((size_t)rsync_xal_h.count > prior_xattr_count)
+			hashchains_pop(&rsync_xal_h);
 		rsync_xal_l.count = prior_xattr_count;
 		while (xattr_item-- > xattr_start)
 			rsync_xal_free(xattr_item);
@@ -882,7 +1009,9 @@ static int rsync_xal_set(const char *fname, item_list *xalp,
 			} else /* make sure caller sets mtime */
 				sxp->st.st_mtime = (time_t)-1;
 
-			if (am_generator) { /* generator items stay abbreviated */
+			/* Generator items stay abbreviated, as do items that
+			 * the writer threads might be reading concurrently. */
+			if (am_generator || writer_threads) {
 				free(ptr);
 				continue;
 			}
@@ -943,8 +1072,8 @@ static int rsync_xal_set(const char *fname, item_list *xalp,
 int set_xattr(const char *fname, const struct file_struct *file,
 	      const char *fnamecmp, stat_x *sxp)
 {
-	int ndx;
-	item_list *lst = rsync_xal_l.items;
+	item_list *lst;
+	int ret;
 
 	if (dry_run)
 		return 1; /* FIXME: --dry-run needs to compute this value */
@@ -973,8 +1102,12 @@ int set_xattr(const char *fname, const struct file_struct *file,
 	}
 #endif
 
-	ndx = F_XATTR(file);
-	return rsync_xal_set(fname, lst + ndx, fnamecmp, sxp);
+	lock_attr_lists(0);
+	lst = rsync_xal_l.items;
+	ret = rsync_xal_set(fname, lst + F_XATTR(file), fnamecmp, sxp);
+	unlock_attr_lists();
+
+	return ret;
 }
 
 #ifdef SUPPORT_ACLS